@@ -0,0 +1,1013 @@
+// Costs of the basic MmapManager operations: mapping more chunks, growing the reserved space, first touch
+// page faults, lazy mappings, reads over the mapping, flushing dirty pages, synchronous and asynchronous
+// checkpoints, parallel fills, the effect of appends on the cache, the scan functions, guarded reads and
+// record replay, and the mmap, pwrite and O_DIRECT engines of logs compared on the same appends and reads.
+//
+// Except for the scans, guarded reads and the replay, every benchmark runs once with the file on tmpfs
+// (/dev/shm) and once on a real file system, by default /var/tmp or the directory in MMAPEXT_BENCH_DISK_DIR.
+// Use --benchmark_format=json or --benchmark_out=<file> --benchmark_out_format=json to keep results for
+// comparison over time.
+
+#include <benchmark/benchmark.h>
+#include <mmapext/mmapext.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr uint64_t MB = uint64_t(1) << 20;
+
+// Size of the file for the read benchmarks.
+static constexpr uint64_t data_size = 256 * MB;
+
+static uint64_t chunks(uint64_t bytes) { return bytes / mmapext_chunk_size(); }
+
+static std::string bench_file(const std::string &dir, const char *name)
+{
+    return dir + "/mmapext_bench_" + name + ".bin";
+}
+
+static bool
+create_manager(benchmark::State &state, const std::string &path, uint64_t reserve, MmapManager *man)
+{
+    unlink(path.c_str());
+
+    auto opts = MmapManagerCreateOptions{
+        .backing_file = path.c_str(),
+        .initial_reserved_size = reserve,
+        .reserve_existing_file_size = true,
+    };
+
+    *man = mmapext_create_manager(opts);
+    if (man->error_code != MMAPEXT_ERR_NONE) {
+        state.SkipWithError(man->error_message);
+        return false;
+    }
+    return true;
+}
+
+static bool
+map_next(benchmark::State &state, MmapManager *man, uint64_t num_chunks, uint64_t extra_chunks = 0)
+{
+    auto opts = MmapManagerMapNextOptions{
+        .dont_grow_if_fully_mapped = false,
+        .extra_chunks_to_reserve_on_grow = extra_chunks,
+        .chunks_to_map_next = num_chunks,
+    };
+
+    auto res = mmapext_map_next_file_chunk(man, opts);
+    if (res.error.error_code != MMAPEXT_ERR_NONE) {
+        state.SkipWithError(res.error.error_message);
+        return false;
+    }
+    return true;
+}
+
+static void destroy_manager(MmapManager *man, const std::string &path)
+{
+    mmapext_delete_manager(man);
+    unlink(path.c_str());
+}
+
+// Touches one byte of every page so all of the range is faulted in.
+static void touch_pages(uint8_t *p, uint64_t size)
+{
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    for (uint64_t off = 0; off < size; off += page_size) {
+        p[off] = 1;
+    }
+}
+
+// Maps 256MB in steps of `chunks_to_map_next` chunks within already reserved space.
+static void map_next_throughput(benchmark::State &state, std::string dir)
+{
+    const uint64_t step = uint64_t(state.range(0));
+    const std::string path = bench_file(dir, "map_next");
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        MmapManager man;
+        if (!create_manager(state, path, data_size, &man)) {
+            return;
+        }
+        state.ResumeTiming();
+
+        for (uint64_t mapped = 0; mapped < chunks(data_size); mapped += step) {
+            if (!map_next(state, &man, step)) {
+                break;
+            }
+        }
+
+        state.PauseTiming();
+        destroy_manager(&man, path);
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+}
+
+// Cost of one map next call that has to grow the reserved space, moving a fully mapped file of the given
+// size. With touch set, all pages are faulted in before growing, so the old page tables must be torn down.
+static void grow_cost(benchmark::State &state, std::string dir)
+{
+    const uint64_t size = uint64_t(state.range(0)) * MB;
+    const bool touch = state.range(1) != 0;
+    const std::string path = bench_file(dir, "grow");
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        MmapManager man;
+        if (!create_manager(state, path, size, &man) || !map_next(state, &man, chunks(size))) {
+            return;
+        }
+        if (touch) {
+            touch_pages(man.address, size);
+        }
+        state.ResumeTiming();
+
+        map_next(state, &man, 1, chunks(size));
+
+        state.PauseTiming();
+        destroy_manager(&man, path);
+        state.ResumeTiming();
+    }
+}
+
+// Page fault cost of the first access to each page of freshly mapped 64MB.
+static void first_touch(benchmark::State &state, std::string dir)
+{
+    const uint64_t size = 64 * MB;
+    const bool write = state.range(0) != 0;
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const std::string path = bench_file(dir, "first_touch");
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        MmapManager man;
+        if (!create_manager(state, path, size, &man) || !map_next(state, &man, chunks(size))) {
+            return;
+        }
+        state.ResumeTiming();
+
+        uint64_t sum = 0;
+        for (uint64_t off = 0; off < size; off += page_size) {
+            if (write) {
+                man.address[off] = 1;
+            } else {
+                sum += man.address[off];
+            }
+        }
+        benchmark::DoNotOptimize(sum);
+
+        state.PauseTiming();
+        destroy_manager(&man, path);
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations() * (size / page_size)));
+    state.SetLabel("items are pages");
+}
+
+// Opens a 64MB file and reads one byte of every page, or of 1% of the pages at random, either through a
+// regular mapping or a lazy one filled with pread. The file is in the page cache, so this compares the
+// fault handling, not the I/O.
+static void lazy_open(benchmark::State &state, std::string dir)
+{
+    const uint64_t size = 64 * MB;
+    const bool lazy = state.range(0) != 0;
+    const bool sparse = state.range(1) != 0;
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t num_pages = size / page_size;
+    const uint64_t touched = sparse ? num_pages / 100 : num_pages;
+    const std::string path = bench_file(dir, "lazy_open");
+
+    MmapManager setup;
+    if (!create_manager(state, path, size, &setup) || !map_next(state, &setup, chunks(size))) {
+        return;
+    }
+    memset(setup.address, 7, size);
+    mmapext_delete_manager(&setup);
+
+    uint64_t faults = 0;
+    for (auto _ : state) {
+        MmapManager man;
+        if (lazy) {
+            man = mmapext_open_lazy(MmapManagerLazyOptions{ .backing_file = path.c_str() });
+        } else {
+            man = mmapext_create_manager(MmapManagerCreateOptions{
+                .backing_file = path.c_str(),
+                .initial_reserved_size = size,
+                .reserve_existing_file_size = true,
+            });
+            if (man.error_code == MMAPEXT_ERR_NONE) {
+                man.error_code = mmapext_map_full_file(&man).error.error_code;
+            }
+        }
+        if (man.error_code != MMAPEXT_ERR_NONE) {
+            state.SkipWithError("failed to open file");
+            break;
+        }
+
+        uint64_t sum = 0;
+        uint64_t x = 0x9e3779b97f4a7c15ull;
+        for (uint64_t i = 0; i < touched; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            sum += man.address[(sparse ? x % num_pages : i) * page_size];
+        }
+        benchmark::DoNotOptimize(sum);
+
+        MmapManagerLazyStats stats;
+        mmapext_get_lazy_stats(&man, &stats);
+        faults += stats.faults;
+        mmapext_delete_manager(&man);
+    }
+
+    state.counters["faults"] = double(faults) / double(std::max<int64_t>(state.iterations(), 1));
+    state.SetItemsProcessed(int64_t(state.iterations() * touched));
+    state.SetLabel("items are pages");
+    unlink(path.c_str());
+}
+
+// Maps and fills the read benchmark file. Pages are resident, so this measures memory and TLB, not I/O.
+static bool setup_read_file(benchmark::State &state, const std::string &path, MmapManager *man)
+{
+    if (!create_manager(state, path, data_size, man) || !map_next(state, man, chunks(data_size))) {
+        return false;
+    }
+
+    uint64_t *words = reinterpret_cast<uint64_t *>(man->address);
+    for (uint64_t i = 0; i < data_size / sizeof(uint64_t); ++i) {
+        words[i] = i;
+    }
+    return true;
+}
+
+static void sequential_read(benchmark::State &state, std::string dir)
+{
+    const std::string path = bench_file(dir, "seq_read");
+    MmapManager man;
+    if (!setup_read_file(state, path, &man)) {
+        return;
+    }
+
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(man.address);
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < data_size / sizeof(uint64_t); ++i) {
+            sum += words[i];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+    destroy_manager(&man, path);
+}
+
+static void random_read(benchmark::State &state, std::string dir)
+{
+    const std::string path = bench_file(dir, "random_read");
+    MmapManager man;
+    if (!setup_read_file(state, path, &man)) {
+        return;
+    }
+
+    constexpr uint64_t reads_per_iteration = 1 << 20;
+    const uint64_t num_words = data_size / sizeof(uint64_t);
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(man.address);
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < reads_per_iteration; ++i) {
+            // xorshift64
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            sum += words[x % num_words];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations() * reads_per_iteration));
+    destroy_manager(&man, path);
+}
+
+// msync(MS_SYNC) of the given number of dirty MB.
+static void flush_cost(benchmark::State &state, std::string dir)
+{
+    const uint64_t size = uint64_t(state.range(0)) * MB;
+    const std::string path = bench_file(dir, "flush");
+
+    MmapManager man;
+    if (!create_manager(state, path, size, &man) || !map_next(state, &man, chunks(size))) {
+        return;
+    }
+
+    uint8_t value = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        memset(man.address, ++value, size);
+        state.ResumeTiming();
+
+        if (msync(man.address, size, MS_SYNC) != 0) {
+            state.SkipWithError("msync failed");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * size));
+    destroy_manager(&man, path);
+}
+
+// mmapext_checkpoint of a 256MB mapping after writing the given number of random pages with mmapext_write,
+// untracked (mode 0) or with explicit (1) or userfaultfd (3) dirty tracking. Without tracking the whole
+// mapping is flushed.
+static void checkpoint_cost(benchmark::State &state, std::string dir)
+{
+    const int mode = int(state.range(0));
+    const uint64_t dirty_pages = uint64_t(state.range(1));
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const std::string path = bench_file(dir, "checkpoint");
+
+    MmapManager man;
+    if (!create_manager(state, path, data_size, &man) || !map_next(state, &man, chunks(data_size))) {
+        return;
+    }
+    memset(man.address, 1, data_size);
+
+    auto err = mmapext_track_dirty(&man, mode);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        state.SkipWithError(err.error_message);
+        destroy_manager(&man, path);
+        return;
+    }
+    mmapext_checkpoint(&man);
+
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    uint64_t flushed = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (uint64_t i = 0; i < dirty_pages; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            const uint64_t value = x;
+            mmapext_write(&man, (x % (data_size / page_size)) * page_size, &value, sizeof(value));
+        }
+        state.ResumeTiming();
+
+        auto res = mmapext_checkpoint(&man);
+        if (res.error.error_code != MMAPEXT_ERR_NONE) {
+            state.SkipWithError(res.error.error_message);
+            break;
+        }
+        flushed += res.flushed_bytes;
+    }
+
+    state.counters["flushed_kb"] =
+        benchmark::Counter(double(flushed >> 10), benchmark::Counter::kAvgIterations);
+    destroy_manager(&man, path);
+}
+
+// Writes the given number of random pages of a 256MB mapping with explicit dirty tracking, then flushes
+// them with mmapext_checkpoint (async 0) or mmapext_async_checkpoint (1). The time is what the writer
+// spends. An asynchronous checkpoint only starts once the previous one completed, pages written meanwhile
+// go with the next one like in a group commit. checkpoints is the share of iterations that started one.
+static void async_checkpoint(benchmark::State &state, std::string dir)
+{
+    const bool async = state.range(0) != 0;
+    const uint64_t dirty_pages = uint64_t(state.range(1));
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const std::string path = bench_file(dir, "async_checkpoint");
+
+    MmapManager man;
+    if (!create_manager(state, path, data_size, &man) || !map_next(state, &man, chunks(data_size))) {
+        return;
+    }
+    memset(man.address, 1, data_size);
+    mmapext_track_dirty(&man, MMAPEXT_DIRTY_EXPLICIT);
+    mmapext_checkpoint(&man);
+    mmapext_enable_async(&man, 0);
+
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    uint64_t checkpoints = 0;
+    MmapManagerAsyncCompletion completion;
+    for (auto _ : state) {
+        for (uint64_t i = 0; i < dirty_pages; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            const uint64_t value = x;
+            mmapext_write(&man, (x % (data_size / page_size)) * page_size, &value, sizeof(value));
+        }
+
+        ErrorResult err{};
+        if (!async) {
+            err = mmapext_checkpoint(&man).error;
+            ++checkpoints;
+        } else {
+            mmapext_async_reap(&man, &completion, 1, 0);
+            if (mmapext_async_pending(&man) == 0) {
+                err = mmapext_async_checkpoint(&man, 0);
+                ++checkpoints;
+            }
+        }
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            state.SkipWithError(err.error_message);
+            break;
+        }
+    }
+    mmapext_async_reap(&man, &completion, 1, 1);
+
+    state.counters["checkpoints"] =
+        benchmark::Counter(double(checkpoints), benchmark::Counter::kAvgIterations);
+    destroy_manager(&man, path);
+}
+
+// mmapext_parallel_fill of a freshly mapped 256MB with the given number of threads, page faults included.
+static void parallel_fill(benchmark::State &state, std::string dir)
+{
+    const int threads = int(state.range(0));
+    const std::string path = bench_file(dir, "parallel_fill");
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        MmapManager man;
+        if (!create_manager(state, path, data_size, &man) || !map_next(state, &man, chunks(data_size))) {
+            return;
+        }
+        state.ResumeTiming();
+
+        mmapext_parallel_fill(&man, 0, data_size, 0xaa, threads);
+
+        state.PauseTiming();
+        destroy_manager(&man, path);
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+}
+
+// Appends 1MB records with mmapext_append while another thread looks up random entries of a 1MB table,
+// which stands in for a hot index that fits in L2. With streaming stores the appended data doesn't evict
+// the table, which shows up in the lookups_per_second counter.
+static void append_with_lookups(benchmark::State &state, std::string dir)
+{
+    const bool streaming = state.range(0) != 0;
+    const uint64_t record_size = MB;
+    const uint64_t log_offset = 64;
+    const std::string path = bench_file(dir, "append");
+
+    MmapManager man;
+    if (!create_manager(state, path, data_size, &man) || !map_next(state, &man, chunks(data_size))) {
+        return;
+    }
+    // Fault the log in up front, the page faults would hide the cache effects.
+    memset(man.address, 0, data_size);
+    uint64_t *commit_length = reinterpret_cast<uint64_t *>(man.address + MMAPEXT_APPEND_COMMIT_OFFSET);
+    *commit_length = log_offset;
+
+    const std::vector<uint8_t> record(record_size, 0x5a);
+    std::vector<uint64_t> table(MB / sizeof(uint64_t), 1);
+
+    std::atomic<bool> stop{ false };
+    std::atomic<uint64_t> lookups{ 0 };
+    std::thread reader([&] {
+        uint64_t x = 0x9e3779b97f4a7c15ull;
+        uint64_t sum = 0;
+        uint64_t count = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            for (int i = 0; i < 1024; ++i) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                sum += table[x % table.size()];
+            }
+            count += 1024;
+        }
+        benchmark::DoNotOptimize(sum);
+        lookups.store(count);
+    });
+
+    const uint64_t saved_threshold = mmapext_streaming_threshold();
+    mmapext_set_streaming_threshold(streaming ? 0 : UINT64_MAX);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        if (*commit_length + record_size > data_size) {
+            *commit_length = log_offset;
+        }
+        auto err = mmapext_append(&man, MMAPEXT_APPEND_COMMIT_OFFSET, record.data(), record_size, nullptr);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            state.SkipWithError(err.error_message);
+            break;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    stop.store(true);
+    reader.join();
+    mmapext_set_streaming_threshold(saved_threshold);
+
+    state.SetBytesProcessed(int64_t(state.iterations() * record_size));
+    state.counters["lookups_per_second"] = benchmark::Counter(double(lookups.load()) / seconds);
+    destroy_manager(&man, path);
+}
+
+// Resident memory of the process in MB, file pages of its mappings included.
+static double resident_mb()
+{
+    uint64_t pages = 0;
+    uint64_t resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != nullptr) {
+        if (fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return double(resident * sysconf(_SC_PAGESIZE)) / double(MB);
+}
+
+// Latency percentiles of the operations of a log benchmark and the RSS it added, as counters.
+static void log_counters(benchmark::State &state, std::vector<uint64_t> &latencies_ns, double rss_before)
+{
+    if (latencies_ns.empty()) {
+        return;
+    }
+    const auto percentile = [&](double p) {
+        auto nth = latencies_ns.begin() + uint64_t(p * double(latencies_ns.size() - 1));
+        std::nth_element(latencies_ns.begin(), nth, latencies_ns.end());
+        return double(*nth);
+    };
+    state.counters["p50_ns"] = percentile(0.5);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["rss_mb"] = resident_mb() - rss_before;
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static bool open_log(benchmark::State &state, const std::string &path, int engine, MmapManagerLog *log)
+{
+    *log = mmapext_log_open(MmapManagerLogOptions{ .path = path.c_str(), .engine = engine });
+    if (log->error_code != MMAPEXT_ERR_NONE) {
+        state.SkipWithError(log->error_message);
+        return false;
+    }
+    return true;
+}
+
+// Appends 64MB to a new log in records of the given size with one MMAPEXT_ENGINE_*, syncing every 1MB
+// like a write ahead log with group commit. Latencies are of single appends, syncs included.
+static void log_append(benchmark::State &state, std::string dir)
+{
+    const int engine = int(state.range(0));
+    const uint64_t record_size = uint64_t(state.range(1));
+    const uint64_t log_size = 64 * MB;
+    const uint64_t sync_every = MB / record_size;
+    const std::string path = bench_file(dir, "log");
+    const std::vector<uint8_t> record(record_size, 0xab);
+
+    std::vector<uint64_t> latencies_ns;
+    latencies_ns.reserve(log_size / record_size);
+    double rss_before = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        unlink(path.c_str());
+        latencies_ns.clear();
+        rss_before = resident_mb();
+        MmapManagerLog log;
+        if (!open_log(state, path, engine, &log)) {
+            return;
+        }
+        state.ResumeTiming();
+
+        for (uint64_t i = 0; i < log_size / record_size; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            auto err = mmapext_log_append(&log, record.data(), record_size, nullptr);
+            if (err.error_code == MMAPEXT_ERR_NONE && (i + 1) % sync_every == 0) {
+                err = mmapext_log_sync(&log);
+            }
+            if (err.error_code != MMAPEXT_ERR_NONE) {
+                state.SkipWithError(err.error_message);
+                break;
+            }
+            latencies_ns.push_back(elapsed_ns(start));
+        }
+
+        state.PauseTiming();
+        log_counters(state, latencies_ns, rss_before);
+        mmapext_log_close(&log);
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * log_size));
+    unlink(path.c_str());
+}
+
+// 256 byte reads at random offsets of a 256MB log with one MMAPEXT_ENGINE_*. The file was just written, so
+// for mmap and pwrite it is in the page cache, while the direct engine only has its 16MB block cache.
+static void log_random_read(benchmark::State &state, std::string dir)
+{
+    const int engine = int(state.range(0));
+    const uint64_t read_size = 256;
+    const std::string path = bench_file(dir, "log");
+    unlink(path.c_str());
+
+    MmapManagerLog log;
+    if (!open_log(state, path, engine, &log)) {
+        return;
+    }
+    const std::vector<uint8_t> block(MB, 0xcd);
+    for (uint64_t written = 0; written < data_size; written += block.size()) {
+        mmapext_log_append(&log, block.data(), block.size(), nullptr);
+    }
+    mmapext_log_close(&log);
+
+    const double rss_before = resident_mb();
+    if (!open_log(state, path, engine, &log)) {
+        return;
+    }
+
+    constexpr uint64_t reads_per_iteration = 1 << 12;
+    std::vector<uint64_t> latencies_ns;
+    uint8_t buffer[read_size];
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (auto _ : state) {
+        for (uint64_t i = 0; i < reads_per_iteration; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            const auto start = std::chrono::steady_clock::now();
+            mmapext_log_read(&log, x % (data_size - read_size), buffer, read_size);
+            latencies_ns.push_back(elapsed_ns(start));
+            benchmark::DoNotOptimize(buffer);
+        }
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations() * reads_per_iteration));
+    log_counters(state, latencies_ns, rss_before);
+    mmapext_log_close(&log);
+    unlink(path.c_str());
+}
+
+// Fills the file with newline terminated records of 20 to 200 letters.
+static bool setup_records_file(benchmark::State &state, const std::string &path, MmapManager *man)
+{
+    if (!create_manager(state, path, data_size, man) || !map_next(state, man, chunks(data_size))) {
+        return false;
+    }
+
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    uint64_t record_end = 0;
+    for (uint64_t i = 0; i < data_size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if (i == record_end) {
+            man->address[i] = '\n';
+            record_end = i + 21 + x % 180;
+        } else {
+            man->address[i] = uint8_t('a' + x % 26);
+        }
+    }
+    return true;
+}
+
+enum ScanMethod { scan_mmapext, scan_libc, scan_naive, scan_mmapext_batch };
+
+static uint64_t naive_find_byte(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    uint64_t i = 0;
+    while (i < n && p[i] != byte) {
+        ++i;
+    }
+    return i;
+}
+
+// Splits the file into records by finding each newline.
+static void scan_records(benchmark::State &state)
+{
+    const auto method = ScanMethod(state.range(0));
+    const std::string path = bench_file("/dev/shm", "scan_records");
+    MmapManager man;
+    if (!setup_records_file(state, path, &man)) {
+        return;
+    }
+
+    uint64_t records = 0;
+    std::vector<uint64_t> newlines(4096);
+    for (auto _ : state) {
+        records = 0;
+        if (method == scan_mmapext_batch) {
+            for (uint64_t offset = 0; offset < data_size;) {
+                const uint64_t n = mmapext_find_all_bytes(
+                    &man, offset, data_size - offset, '\n', newlines.data(), newlines.size());
+                records += n;
+                offset = n == newlines.size() ? newlines.back() + 1 : data_size;
+            }
+            benchmark::DoNotOptimize(records);
+            continue;
+        }
+        for (uint64_t offset = 0; offset < data_size; ++records) {
+            uint64_t newline = data_size;
+            if (method == scan_mmapext) {
+                newline = std::min(data_size, mmapext_find_byte(&man, offset, data_size - offset, '\n'));
+            } else if (method == scan_libc) {
+                const void *found = memchr(man.address + offset, '\n', data_size - offset);
+                newline = found ? uint64_t(static_cast<const uint8_t *>(found) - man.address) : data_size;
+            } else {
+                newline = offset + naive_find_byte(man.address + offset, data_size - offset, '\n');
+            }
+            offset = newline + 1;
+        }
+        benchmark::DoNotOptimize(records);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+    state.counters["records"] = double(records);
+    destroy_manager(&man, path);
+}
+
+static void count_lines(benchmark::State &state)
+{
+    const auto method = ScanMethod(state.range(0));
+    const std::string path = bench_file("/dev/shm", "count_lines");
+    MmapManager man;
+    if (!setup_records_file(state, path, &man)) {
+        return;
+    }
+
+    for (auto _ : state) {
+        uint64_t lines = 0;
+        if (method == scan_mmapext) {
+            lines = mmapext_count_byte(&man, 0, data_size, '\n');
+        } else {
+            for (uint64_t i = 0; i < data_size; ++i) {
+                lines += man.address[i] == '\n';
+            }
+        }
+        benchmark::DoNotOptimize(lines);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+    destroy_manager(&man, path);
+}
+
+// Looks for a string that isn't in the file, so the whole file is scanned.
+static void find_substring(benchmark::State &state)
+{
+    const auto method = ScanMethod(state.range(0));
+    const std::string path = bench_file("/dev/shm", "find_substring");
+    MmapManager man;
+    if (!setup_records_file(state, path, &man)) {
+        return;
+    }
+
+    const char *needle = "request_id=";
+    const uint64_t needle_length = strlen(needle);
+
+    for (auto _ : state) {
+        uint64_t found = 0;
+        if (method == scan_mmapext) {
+            found = mmapext_find_substring(&man, 0, data_size, (const uint8_t *)needle, needle_length);
+        } else {
+            found = uint64_t(uintptr_t(memmem(man.address, data_size, needle, needle_length)));
+        }
+        benchmark::DoNotOptimize(found);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * data_size));
+    destroy_manager(&man, path);
+}
+
+// Replays a log of u32 length prefixed records of 20 to 200 bytes, reading the first byte of each.
+static void record_replay(benchmark::State &state)
+{
+    const uint64_t prefetch_distance = state.range(0);
+    const bool batch = state.range(1) != 0;
+    const std::string path = bench_file("/dev/shm", "record_replay");
+    MmapManager man;
+    if (!create_manager(state, path, data_size, &man) || !map_next(state, &man, chunks(data_size))) {
+        return;
+    }
+
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    uint64_t end = 0;
+    while (true) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        const uint32_t length = uint32_t(20 + x % 181);
+        if (end + sizeof(length) + length > data_size) {
+            break;
+        }
+        memcpy(man.address + end, &length, sizeof(length));
+        memset(man.address + end + sizeof(length), int(x >> 32), length);
+        end += sizeof(length) + length;
+    }
+
+    const auto opts = MmapManagerRecordIteratorOptions{
+        .format = MMAPEXT_RECORD_U32,
+        .begin = 0,
+        .end = end,
+        .prefetch_distance = prefetch_distance,
+    };
+
+    uint64_t records = 0;
+    std::vector<MmapManagerRecord> spans(256);
+    for (auto _ : state) {
+        auto it = mmapext_record_iterator(&man, opts);
+        uint64_t sum = 0;
+        records = 0;
+        if (batch) {
+            uint64_t n = 0;
+            while ((n = mmapext_record_next_batch(&it, spans.data(), spans.size())) != 0) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    sum += spans[i].data[0];
+                }
+                records += n;
+            }
+        } else {
+            MmapManagerRecord record;
+            while (mmapext_record_next(&it, &record)) {
+                sum += record.data[0];
+                ++records;
+            }
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * end));
+    state.counters["records"] = double(records);
+    destroy_manager(&man, path);
+}
+
+// 64 byte reads at random offsets of a resident 16MB file with memcpy (0), mmapext_read (1) or
+// mmapext_safe_read (2). The difference of the last two is the cost of the SIGBUS guard when nothing faults.
+static void guarded_read(benchmark::State &state)
+{
+    const uint64_t size = 16 * MB;
+    const int64_t method = state.range(0);
+    const std::string path = bench_file("/dev/shm", "guarded_read");
+    MmapManager man;
+    if (!create_manager(state, path, size, &man) || !map_next(state, &man, chunks(size))) {
+        return;
+    }
+    touch_pages(man.address, size);
+
+    constexpr uint64_t reads_per_iteration = 1 << 16;
+    uint8_t buffer[64];
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (auto _ : state) {
+        for (uint64_t i = 0; i < reads_per_iteration; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            const uint64_t offset = x % (size - sizeof(buffer));
+            if (method == 2) {
+                mmapext_safe_read(&man, offset, buffer, sizeof(buffer));
+            } else if (method == 1) {
+                mmapext_read(&man, offset, buffer, sizeof(buffer));
+            } else {
+                memcpy(buffer, man.address + offset, sizeof(buffer));
+            }
+            benchmark::DoNotOptimize(buffer);
+        }
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations() * reads_per_iteration));
+    destroy_manager(&man, path);
+}
+
+static void scan_methods(benchmark::internal::Benchmark *b, bool record_by_record)
+{
+    b->ArgName("method")->Arg(scan_mmapext)->Arg(scan_libc);
+    if (record_by_record) {
+        b->Arg(scan_naive)->Arg(scan_mmapext_batch);
+    }
+    b->Unit(benchmark::kMillisecond);
+}
+
+int main(int argc, char **argv)
+{
+    const char *disk_dir = getenv("MMAPEXT_BENCH_DISK_DIR");
+
+    const std::vector<std::pair<std::string, std::string>> dirs = {
+        { "tmpfs", "/dev/shm" },
+        { "disk", disk_dir ? disk_dir : "/var/tmp" },
+    };
+
+    for (const auto &[fs, dir] : dirs) {
+        benchmark::RegisterBenchmark(("map_next_throughput/" + fs).c_str(), map_next_throughput, dir)
+            ->ArgName("chunks_to_map_next")
+            ->RangeMultiplier(8)
+            ->Range(1, 4096)
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("grow_cost/" + fs).c_str(), grow_cost, dir)
+            ->ArgNames({ "file_mb", "touched" })
+            ->ArgsProduct({ { 16, 64, 256, 1024 }, { 0, 1 } })
+            ->Unit(benchmark::kMicrosecond);
+
+        benchmark::RegisterBenchmark(("first_touch/" + fs).c_str(), first_touch, dir)
+            ->ArgName("write")
+            ->Arg(0)
+            ->Arg(1)
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("lazy_open/" + fs).c_str(), lazy_open, dir)
+            ->ArgNames({ "lazy", "sparse" })
+            ->ArgsProduct({ { 0, 1 }, { 0, 1 } })
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("sequential_read/" + fs).c_str(), sequential_read, dir)
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("random_read/" + fs).c_str(), random_read, dir)
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("flush_cost/" + fs).c_str(), flush_cost, dir)
+            ->ArgName("dirty_mb")
+            ->Arg(1)
+            ->Arg(16)
+            ->Arg(64)
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("checkpoint_cost/" + fs).c_str(), checkpoint_cost, dir)
+            ->ArgNames({ "mode", "dirty_pages" })
+            ->ArgsProduct({ { MMAPEXT_DIRTY_NONE, MMAPEXT_DIRTY_EXPLICIT, MMAPEXT_DIRTY_UFFD_WP },
+                            { 16, 4096 } })
+            ->Unit(benchmark::kMicrosecond);
+
+        benchmark::RegisterBenchmark(("async_checkpoint/" + fs).c_str(), async_checkpoint, dir)
+            ->ArgNames({ "async", "dirty_pages" })
+            ->ArgsProduct({ { 0, 1 }, { 16, 4096 } })
+            ->UseRealTime()
+            ->Unit(benchmark::kMicrosecond);
+
+        benchmark::RegisterBenchmark(("parallel_fill/" + fs).c_str(), parallel_fill, dir)
+            ->ArgName("threads")
+            ->RangeMultiplier(2)
+            ->Range(1, 16)
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("append_with_lookups/" + fs).c_str(), append_with_lookups, dir)
+            ->ArgName("streaming")
+            ->Arg(0)
+            ->Arg(1)
+            ->UseRealTime()
+            ->Unit(benchmark::kMicrosecond);
+
+        benchmark::RegisterBenchmark(("log_append/" + fs).c_str(), log_append, dir)
+            ->ArgNames({ "engine", "record_size" })
+            ->ArgsProduct({ { MMAPEXT_ENGINE_MMAP, MMAPEXT_ENGINE_PWRITE, MMAPEXT_ENGINE_DIRECT },
+                            { 64, 4096 } })
+            ->UseRealTime()
+            ->Unit(benchmark::kMillisecond);
+
+        benchmark::RegisterBenchmark(("log_random_read/" + fs).c_str(), log_random_read, dir)
+            ->ArgName("engine")
+            ->DenseRange(MMAPEXT_ENGINE_MMAP, MMAPEXT_ENGINE_DIRECT)
+            ->UseRealTime()
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    // These only read memory, the file system doesn't matter. method is 0 for the mmapext functions, 1 for
+    // memchr or memmem, 2 for a plain loop and 3 for mmapext_find_all_bytes. count_lines 1 is a plain loop.
+    scan_methods(benchmark::RegisterBenchmark("scan_records", scan_records), true);
+    scan_methods(benchmark::RegisterBenchmark("count_lines", count_lines), false);
+    scan_methods(benchmark::RegisterBenchmark("find_substring", find_substring), false);
+
+    benchmark::RegisterBenchmark("guarded_read", guarded_read)->ArgName("method")->DenseRange(0, 2);
+
+    benchmark::RegisterBenchmark("record_replay", record_replay)
+        ->ArgNames({ "prefetch_distance", "batch" })
+        ->ArgsProduct({ { 64, 1024, 4096, 16384 }, { 0, 1 } })
+        ->Unit(benchmark::kMillisecond);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Scan throughput of a mapped file depending on which NUMA node its pages are on.
+//
+// The reading thread always runs on node 0. The pages are faulted in by a thread on the last node, so with
+// the default policy they are remote for the reader (on a single node host everything is local). With
+// MMAPEXT_NUMA_BIND they go to the node given as the second argument regardless of who faults them.
+//
+// The file is on /dev/shm since the kernel only applies mbind policies to the page cache of tmpfs files.
+
+#include <benchmark/benchmark.h>
+#include <mmapext/mmapext.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+static constexpr uint64_t file_size = uint64_t(256) << 20;
+static const char *file_path = "/dev/shm/mmapext_numa_bench.bin";
+
+static int num_nodes()
+{
+    // "0" or "0-1" and so on
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    int first = 0;
+    int last = 0;
+    if (f == nullptr) {
+        return 1;
+    }
+    const int n = fscanf(f, "%d-%d", &first, &last);
+    fclose(f);
+    return n == 2 ? last + 1 : first + 1;
+}
+
+static bool pin_to_node(int node)
+{
+    const std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    // Comma separated list of cpus and ranges of cpus.
+    int first = 0;
+    while (fscanf(f, "%d", &first) == 1) {
+        int last = first;
+        const int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            fgetc(f);
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    fclose(f);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void scan(benchmark::State &state)
+{
+    const int policy = int(state.range(0));
+    const int node = int(state.range(1));
+    const int fault_node = num_nodes() - 1;
+
+    if (!pin_to_node(0)) {
+        state.SkipWithError("failed to pin reader to node 0");
+        return;
+    }
+
+    unlink(file_path);
+
+    auto create_opts = MmapManagerCreateOptions{
+        .backing_file = file_path,
+        .initial_reserved_size = file_size,
+        .reserve_existing_file_size = true,
+        .preferred_address = nullptr,
+        .numa_policy = policy,
+        .numa_node_mask = policy == MMAPEXT_NUMA_DEFAULT ? 0 : uint64_t(1) << node,
+    };
+
+    MmapManager man = mmapext_create_manager(create_opts);
+    if (man.error_code != MMAPEXT_ERR_NONE) {
+        state.SkipWithError(man.error_message);
+        return;
+    }
+
+    auto map_opts = MmapManagerMapNextOptions{
+        .dont_grow_if_fully_mapped = false,
+        .extra_chunks_to_reserve_on_grow = 0,
+        .chunks_to_map_next = file_size / mmapext_chunk_size(),
+    };
+    auto map_res = mmapext_map_next_file_chunk(&man, map_opts);
+    if (map_res.error.error_code != MMAPEXT_ERR_NONE) {
+        mmapext_delete_manager(&man);
+        state.SkipWithError(map_res.error.error_message);
+        return;
+    }
+
+    std::thread faulter([&]() {
+        pin_to_node(fault_node);
+        memset(man.address, 1, file_size);
+    });
+    faulter.join();
+
+    const auto residency = mmapext_numa_residency(&man, 0, file_size);
+
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(man.address);
+    const uint64_t num_words = file_size / sizeof(uint64_t);
+
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < num_words; ++i) {
+            sum += words[i];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations() * file_size));
+    if (residency.num_pages != 0) {
+        state.counters["local_pages_pct"] = 100.0 * residency.num_pages_on_node[0] / residency.num_pages;
+    }
+
+    mmapext_delete_manager(&man);
+    unlink(file_path);
+}
+
+static void scan_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({ "policy", "node" });
+    b->Args({ MMAPEXT_NUMA_DEFAULT, 0 });
+    for (int node = 0; node < num_nodes(); ++node) {
+        b->Args({ MMAPEXT_NUMA_BIND, node });
+    }
+}
+
+BENCHMARK(scan)->Apply(scan_args)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
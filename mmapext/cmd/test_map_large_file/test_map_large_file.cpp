@@ -1,20 +1,62 @@
+// Stress tool that grows a mapped file the way our services do and reports the cost of each step.
+//
+// The file starts at --initial-size and is mapped in increments of --increment until --max-size, each
+// increment in map next calls of --chunk-size bytes. The new part of each increment can be touched, filled
+// and verified by several threads. One CSV row is written per increment.
+//
+// Example: test_map_large_file --max-size 8G --increment 512M --reserve 1G --populate write --threads 4
+
 #include "argparse.hpp"
 #include "util.hpp"
 
-#include <linenoise.h>
 #include <mmapext/mmapext.h>
-#include <optional>
 #include <plog/Appenders/ColorConsoleAppender.h>
 #include <plog/Formatters/TxtFormatter.h>
 #include <plog/Init.h>
 #include <plog/Log.h>
-#include <scaffold/const_log.h>
-#include <scaffold/scanner.h>
+#include <scaffold/memory.h>
+
+#include <fcntl.h>
 #include <sys/mman.h>
-#include <variant>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std::string_literals;
 
+constexpr uint64_t GB = uint64_t(1) << 30;
+constexpr uint64_t MB = uint64_t(1) << 20;
+constexpr uint64_t KB = uint64_t(1) << 10;
+
+// Pattern written by --populate write. Depends on the offset so that verification catches misplaced pages.
+static inline uint64_t pattern_at(uint64_t offset) { return offset * 0x9e3779b97f4a7c15ull; }
+
+enum class Populate { none, read, write };
+
+struct Config {
+    std::string filepath;
+    uint64_t initial_size;
+    uint64_t max_size;
+    uint64_t increment;
+    uint64_t reserve;
+    uint64_t chunk_size;
+    int threads;
+    Populate populate;
+    int advice;
+    bool verify;
+    bool sync_each;
+    bool keep_file;
+    std::string csv_path;
+};
+
 std::string _format_memory_size(uint64_t size)
 {
     auto quotients = std::array<uint64_t, 5>{ size, 0, 0, 0, 0 };
@@ -22,7 +64,7 @@ std::string _format_memory_size(uint64_t size)
     auto divisors = std::array<uint64_t, 5>{ 0, uint64_t(1) << 30, uint64_t(1) << 20, uint64_t(1) << 10, 1 };
     auto units = std::array<std::string, 5>{ "Total", "GB", "MB", "KB", "B" };
 
-    for (auto i = 1; i < quotients.size(); i++) {
+    for (size_t i = 1; i < quotients.size(); i++) {
         rems[i] = rems[i - 1] % divisors[i];
         quotients[i] = rems[i - 1] / divisors[i];
     }
@@ -30,7 +72,7 @@ std::string _format_memory_size(uint64_t size)
     std::string total;
     total.reserve(64);
 
-    for (auto i = 1; i < quotients.size(); i++) {
+    for (size_t i = 1; i < quotients.size(); i++) {
         if (quotients[i] != 0) {
             total += std::to_string(quotients[i]);
             total += units[i];
@@ -40,139 +82,384 @@ std::string _format_memory_size(uint64_t size)
     return total;
 }
 
-struct Config {
-    std::string filepath;
-};
+// Parses a byte count with an optional K, M or G suffix.
+static std::optional<uint64_t> parse_size(const std::string &s)
+{
+    char *end = nullptr;
+    const uint64_t value = strtoull(s.c_str(), &end, 10);
+    if (end == s.c_str()) {
+        return {};
+    }
 
-static Config config;
+    switch (*end) {
+    case '\0':
+        return value;
+    case 'k':
+    case 'K':
+        return value * KB;
+    case 'm':
+    case 'M':
+        return value * MB;
+    case 'g':
+    case 'G':
+        return value * GB;
+    }
+    return {};
+}
 
-std::aligned_storage_t<sizeof(MmapManager), alignof(MmapManager)> _mmap_manager_store[1];
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
 
-MmapManager *manager() { return reinterpret_cast<MmapManager *>(_mmap_manager_store); }
+static uint64_t rss_bytes()
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
 
-void must_create_file(std::string filepath, uint64_t initial_size)
+static uint64_t total_syscall_ns(const MmapManager *man)
 {
-    int fd = open(filepath.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd == -1) {
-        PLOGE.printf("failed to create file: %s", strerror(errno));
+    MmapManagerMetrics metrics;
+    mmapext_get_metrics(man, &metrics);
+
+    uint64_t total = 0;
+    for (const auto &h : metrics.latency) {
+        total += h.total_ns;
     }
+    return total;
+}
 
-    if (ftruncate(fd, initial_size) != 0) {
-        PLOGE.printf("failed to ftruncate file %s: %s", filepath.c_str(), strerror(errno));
-        exit(1);
+// Runs fn(begin, end) over page aligned stripes of [begin, end) on the configured number of threads.
+template <typename Fn> static void for_each_stripe(const Config &config, uint64_t begin, uint64_t end, Fn fn)
+{
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t stripe =
+        std::max<uint64_t>(page_size, (end - begin) / config.threads / page_size * page_size);
+
+    std::vector<std::thread> threads;
+    for (uint64_t stripe_begin = begin; stripe_begin < end; stripe_begin += stripe) {
+        const uint64_t stripe_end = std::min(end, stripe_begin + stripe);
+        if (config.threads == 1) {
+            fn(stripe_begin, stripe_end);
+        } else {
+            threads.emplace_back(fn, stripe_begin, stripe_end);
+        }
     }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
 
-    if (close(fd) != 0) {
-        PLOGE.printf("failed to close newly created backing file %s: %s", filepath.c_str(), strerror(errno));
-        exit(0);
+static void populate(const Config &config, uint8_t *base, uint64_t begin, uint64_t end)
+{
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (config.populate == Populate::read) {
+        std::atomic<uint64_t> sink{ 0 };
+        for_each_stripe(config, begin, end, [&](uint64_t b, uint64_t e) {
+            uint64_t sum = 0;
+            for (uint64_t off = b; off < e; off += page_size) {
+                sum += base[off];
+            }
+            sink += sum;
+        });
+    } else if (config.populate == Populate::write) {
+        for_each_stripe(config, begin, end, [&](uint64_t b, uint64_t e) {
+            uint64_t *words = reinterpret_cast<uint64_t *>(base + b);
+            for (uint64_t i = 0; i < (e - b) / sizeof(uint64_t); ++i) {
+                words[i] = pattern_at(b + i * sizeof(uint64_t));
+            }
+        });
     }
 }
 
-void reset_file_size(std::string filepath)
+// Returns the number of words of [begin, end) that don't hold the pattern.
+static uint64_t verify(const Config &config, const uint8_t *base, uint64_t begin, uint64_t end)
 {
-    int fd = open(filepath.c_str(), O_RDWR | O_CREAT, 0644);
+    std::atomic<uint64_t> mismatches{ 0 };
+    for_each_stripe(config, begin, end, [&](uint64_t b, uint64_t e) {
+        const uint64_t *words = reinterpret_cast<const uint64_t *>(base + b);
+        uint64_t bad = 0;
+        for (uint64_t i = 0; i < (e - b) / sizeof(uint64_t); ++i) {
+            bad += words[i] != pattern_at(b + i * sizeof(uint64_t));
+        }
+        mismatches += bad;
+    });
+    return mismatches.load();
+}
+
+static void must_create_file(const std::string &filepath, uint64_t initial_size)
+{
+    int fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
-        PLOGE.printf("failed to create file: %s", strerror(errno));
+        PLOGF.printf("failed to create file %s: %s", filepath.c_str(), strerror(errno));
         exit(1);
     }
 
-    if (ftruncate(fd, 0) != 0) {
-        PLOGE.printf("failed to ftruncate file to 0 bytes %s: %s", filepath.c_str(), strerror(errno));
+    if (ftruncate(fd, initial_size) != 0) {
+        PLOGF.printf("failed to ftruncate file %s: %s", filepath.c_str(), strerror(errno));
         exit(1);
     }
-}
-
-constexpr uint64_t GB = u64(1) << 30;
-constexpr uint64_t MB = u64(1) << 20;
-constexpr uint64_t KB = u64(1) << 10;
 
-constexpr const char *backing_file = "test_backing_file";
-constexpr auto initial_file_size = 4u * GB;
-constexpr auto max_file_size = 20u * GB;
-constexpr auto map_increment_size = 4u * GB;
-
-constexpr auto chunks_per_increment = map_increment_size / MMAPEXT_PAGE_SIZE;
-constexpr auto target_size = max_file_size;
-constexpr auto target_mapped_chunks = target_size / MMAPEXT_PAGE_SIZE;
-
-// Reserving full foreseeable file-size, so reserved address range doesn't need
-// to move, just extended.
-constexpr auto initial_reserved_size = max_file_size;
+    if (close(fd) != 0) {
+        PLOGF.printf("failed to close newly created backing file %s: %s", filepath.c_str(), strerror(errno));
+        exit(1);
+    }
+}
 
-void map_large_file()
+static int map_large_file(const Config &config)
 {
-    must_create_file(backing_file, initial_file_size);
-    // DEFERSTAT(reset_file_size(backing_file));
+    must_create_file(config.filepath, config.initial_size);
+    DEFERSTAT(if (!config.keep_file) { unlink(config.filepath.c_str()); });
 
     auto create_opts = MmapManagerCreateOptions{
-        .backing_file = backing_file,
-        .initial_reserved_size = initial_reserved_size,
-        .reserve_existing_file_size = false,
+        .backing_file = config.filepath.c_str(),
+        .initial_reserved_size = config.reserve,
+        .reserve_existing_file_size = true,
     };
 
     auto manager = mmapext_create_manager(create_opts);
     if (manager.error_code != MMAPEXT_ERR_NONE) {
         PLOGF.printf("failed to create manager: %s", manager.error_message);
+        return 1;
     }
     DEFERSTAT(mmapext_delete_manager(&manager));
 
-    PLOGI.printf("created manager with initial_file_size: %lu", initial_file_size);
-
-    auto opts = MmapManagerMapNextOptions{};
-    opts.dont_grow_if_fully_mapped = false; // We want the file to be grown.
-    opts.chunks_to_map_next = map_increment_size / MMAPEXT_PAGE_SIZE;
-
-    // const int64_t num_chunks_unmapped = int64_t(manager.num_chunks_reserved - manager.num_chunks_mapped);
-    const int64_t num_chunks_unmapped =
-        std::max(int64_t(0), int64_t(target_mapped_chunks - manager.num_chunks_mapped));
-    const int64_t increments_needed = ceil_div(num_chunks_unmapped, int64_t(chunks_per_increment));
+    FILE *csv = config.csv_path == "-" ? stdout : fopen(config.csv_path.c_str(), "w");
+    if (csv == nullptr) {
+        PLOGF.printf("failed to open csv output %s: %s", config.csv_path.c_str(), strerror(errno));
+        return 1;
+    }
+    DEFERSTAT(if (csv != stdout) { fclose(csv); });
+
+    fprintf(csv,
+            "iteration,mapped_bytes,map_ns,populate_ns,verify_ns,sync_ns,syscall_ns,grow_events,moved,"
+            "rss_bytes,minor_faults,major_faults,mismatches\n");
+
+    const uint64_t chunks_per_call = config.chunk_size / mmapext_chunk_size();
+    uint64_t total_mismatches = 0;
+
+    for (int iteration = 0; mmapext_mapped_size(&manager) < config.max_size; ++iteration) {
+        const uint64_t begin = mmapext_mapped_size(&manager);
+        const uint64_t end = std::min(config.max_size, begin + config.increment);
+
+        struct rusage usage_before;
+        getrusage(RUSAGE_SELF, &usage_before);
+        const uint64_t syscall_ns_before = total_syscall_ns(&manager);
+
+        const uint64_t map_start = now_ns();
+        bool moved = false;
+
+        while (mmapext_mapped_size(&manager) < end) {
+            const uint64_t remaining_chunks = (end - mmapext_mapped_size(&manager)) / mmapext_chunk_size();
+            auto opts = MmapManagerMapNextOptions{
+                .dont_grow_if_fully_mapped = false,
+                .extra_chunks_to_reserve_on_grow = config.increment / mmapext_chunk_size(),
+                .chunks_to_map_next = std::min(chunks_per_call, remaining_chunks),
+            };
+
+            auto res = mmapext_map_next_file_chunk(&manager, opts);
+            if (res.error.error_code != MMAPEXT_ERR_NONE) {
+                PLOGF.printf("failed to map next chunk: %s", res.error.error_message);
+                return 1;
+            }
+            moved = moved || res.mapping_was_moved;
+        }
 
-    PLOGI.printf("Will map %li chunks in %d increments, one increment = %li chunks",
-                 num_chunks_unmapped,
-                 increments_needed,
-                 chunks_per_increment);
+        const uint64_t map_ns = now_ns() - map_start;
 
-    PLOGI.printf("Pausing before mapping chunks...");
-    getchar();
+        if (config.advice >= 0 && madvise(manager.address + begin, end - begin, config.advice) != 0) {
+            PLOGW.printf("madvise failed: %s", strerror(errno));
+        }
 
-    for (int64_t remaining_chunks = num_chunks_unmapped; remaining_chunks > 0;
-         remaining_chunks -= opts.chunks_to_map_next) {
-        opts.chunks_to_map_next = std::min(remaining_chunks, int64_t(opts.chunks_to_map_next));
-        auto res = mmapext_map_next_file_chunk(&manager, opts);
-        if (res.error.error_code != MMAPEXT_ERR_NONE) {
-            PLOGF.printf("failed to map next chunk: %s", res.error.error_message);
+        // Only the new part of the mapping is touched, so the total work stays linear in the file size.
+        const uint64_t populate_start = now_ns();
+        populate(config, manager.address, begin, end);
+        const uint64_t populate_ns = now_ns() - populate_start;
+
+        uint64_t verify_ns = 0;
+        uint64_t mismatches = 0;
+        if (config.verify && config.populate == Populate::write) {
+            const uint64_t verify_start = now_ns();
+            mismatches = verify(config, manager.address, begin, end);
+            verify_ns = now_ns() - verify_start;
+            total_mismatches += mismatches;
         }
 
-        const auto cur_mapped_size = uint64_t(manager.num_chunks_mapped) * MMAPEXT_PAGE_SIZE;
-        const auto cur_mapped_size_str = _format_memory_size(cur_mapped_size);
+        uint64_t sync_ns = 0;
+        if (config.sync_each) {
+            const uint64_t sync_start = now_ns();
+            msync(manager.address + begin, end - begin, MS_SYNC);
+            sync_ns = now_ns() - sync_start;
+        }
 
-        PLOGI.printf(
-            "Remaining chunks = %li, current mapped size: %s", remaining_chunks, cur_mapped_size_str.c_str());
-        memset(manager.address, 170, cur_mapped_size); // 0b10101010
+        struct rusage usage_after;
+        getrusage(RUSAGE_SELF, &usage_after);
+
+        MmapManagerMetrics metrics;
+        mmapext_get_metrics(&manager, &metrics);
+
+        fprintf(csv,
+                "%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%d,%lu,%ld,%ld,%lu\n",
+                iteration,
+                mmapext_mapped_size(&manager),
+                map_ns,
+                populate_ns,
+                verify_ns,
+                sync_ns,
+                total_syscall_ns(&manager) - syscall_ns_before,
+                metrics.grow_events,
+                int(moved),
+                rss_bytes(),
+                usage_after.ru_minflt - usage_before.ru_minflt,
+                usage_after.ru_majflt - usage_before.ru_majflt,
+                mismatches);
+        fflush(csv);
     }
 
-    const auto cur_mapped_size = uint64_t(manager.num_chunks_mapped) * MMAPEXT_PAGE_SIZE;
-    const auto cur_mapped_size_str = _format_memory_size(cur_mapped_size);
-
-    PLOGI.printf("fully mapped targeted size: %s, filling with 1s", cur_mapped_size_str.c_str());
-    // memset(manager.address, 1, cur_mapped_size);
+    // The whole file once more, catching pages that were lost when the mapping moved.
+    if (config.verify && config.populate == Populate::write) {
+        const uint64_t mismatches = verify(config, manager.address, 0, config.max_size);
+        if (mismatches != 0 || total_mismatches != 0) {
+            PLOGE.printf("verification failed: %lu words differ in the final pass, %lu during the run",
+                         mismatches,
+                         total_mismatches);
+            return 2;
+        }
+        PLOGI.printf("verified %lu bytes", config.max_size);
+    }
 
-    PLOGI.printf("fully mapped targeted size: %s, syncing...", cur_mapped_size_str.c_str());
-    msync(manager.address, uint64_t(manager.num_chunks_mapped) * MMAPEXT_PAGE_SIZE, MS_SYNC);
+    PLOGI.printf("mapped %s", _format_memory_size(mmapext_mapped_size(&manager)).c_str());
 
-    PLOGI.printf(
-        "mapped all chunks: %lu, size: %lu bytes", manager.num_chunks_mapped, mmapext_mapped_size(&manager));
+    return 0;
 }
 
-int main()
+int main(int argc, char **argv)
 {
     fo::memory_globals::init();
     DEFERSTAT(fo::memory_globals::shutdown());
 
-    static plog::ColorConsoleAppender<plog::TxtFormatter> consoleAppender;
-    plog::init(plog::verbose, &consoleAppender);
+    argparse::ArgumentParser program("test_map_large_file");
+
+    program.add_argument("--file").default_value("test_backing_file"s).help("backing file to create");
+    program.add_argument("--initial-size").default_value("4G"s).help("size of the file before mapping");
+    program.add_argument("--max-size").default_value("20G"s).help("size to grow the mapping to");
+    program.add_argument("--increment").default_value("4G"s).help("bytes mapped per iteration");
+    program.add_argument("--reserve")
+        .default_value(""s)
+        .help("address space reserved up front, defaults to --max-size so the mapping never moves");
+    program.add_argument("--chunk-size")
+        .default_value(""s)
+        .help("bytes mapped per map next call, defaults to --increment");
+    program.add_argument("--threads")
+        .default_value(1)
+        .scan<'i', int>()
+        .help("threads populating and verifying");
+    program.add_argument("--populate")
+        .default_value("write"s)
+        .help("what to do with each new increment: none, read (one byte per page) or write (whole range)");
+    program.add_argument("--advise")
+        .default_value("none"s)
+        .help("madvise for each new increment: none, normal, sequential, random, willneed or hugepage");
+    program.add_argument("--verify")
+        .default_value(false)
+        .implicit_value(true)
+        .help("check the written pattern after each increment and over the whole file at the end");
+    program.add_argument("--sync-each").default_value(false).implicit_value(true).help(
+        "msync each increment");
+    program.add_argument("--keep-file").default_value(false).implicit_value(true).help(
+        "don't delete the file");
+    program.add_argument("--csv").default_value("-"s).help("per-iteration csv output, - for stdout");
+    program.add_argument("--verbose").default_value(false).implicit_value(true).help("log at info level");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error &err) {
+        fprintf(stderr, "%s\n", err.what());
+        return 1;
+    }
+
+    static plog::ColorConsoleAppender<plog::TxtFormatter> consoleAppender(plog::streamStdErr);
+    plog::init(program.get<bool>("--verbose") ? plog::info : plog::warning, &consoleAppender);
+
+    Config config{};
+    config.filepath = program.get<std::string>("--file");
+
+    const auto initial_size = parse_size(program.get<std::string>("--initial-size"));
+    const auto max_size = parse_size(program.get<std::string>("--max-size"));
+    const auto increment = parse_size(program.get<std::string>("--increment"));
+    const auto reserve = program.get<std::string>("--reserve").empty()
+                             ? max_size
+                             : parse_size(program.get<std::string>("--reserve"));
+    const auto chunk_size = program.get<std::string>("--chunk-size").empty()
+                                ? increment
+                                : parse_size(program.get<std::string>("--chunk-size"));
+
+    if (!initial_size || !max_size || !increment || !reserve || !chunk_size) {
+        fprintf(stderr, "sizes are numbers of bytes with an optional K, M or G suffix\n");
+        return 1;
+    }
+
+    config.initial_size = *initial_size / mmapext_chunk_size() * mmapext_chunk_size();
+    config.max_size = *max_size / mmapext_chunk_size() * mmapext_chunk_size();
+    config.increment = *increment;
+    config.reserve = *reserve;
+    config.chunk_size = *chunk_size;
+
+    if (config.increment % mmapext_chunk_size() != 0 || config.chunk_size % mmapext_chunk_size() != 0 ||
+        config.increment == 0 || config.chunk_size == 0) {
+        fprintf(stderr, "--increment and --chunk-size must be multiples of %lu\n", mmapext_chunk_size());
+        return 1;
+    }
+
+    config.threads = std::max(1, program.get<int>("--threads"));
+
+    const auto populate = program.get<std::string>("--populate");
+    if (populate == "none") {
+        config.populate = Populate::none;
+    } else if (populate == "read") {
+        config.populate = Populate::read;
+    } else if (populate == "write") {
+        config.populate = Populate::write;
+    } else {
+        fprintf(stderr, "unknown --populate mode %s\n", populate.c_str());
+        return 1;
+    }
+
+    const auto advise = program.get<std::string>("--advise");
+    if (advise == "none") {
+        config.advice = -1;
+    } else if (advise == "normal") {
+        config.advice = MADV_NORMAL;
+    } else if (advise == "sequential") {
+        config.advice = MADV_SEQUENTIAL;
+    } else if (advise == "random") {
+        config.advice = MADV_RANDOM;
+    } else if (advise == "willneed") {
+        config.advice = MADV_WILLNEED;
+    } else if (advise == "hugepage") {
+        config.advice = MADV_HUGEPAGE;
+    } else {
+        fprintf(stderr, "unknown --advise mode %s\n", advise.c_str());
+        return 1;
+    }
 
-    auto pid = getpid();
+    config.verify = program.get<bool>("--verify");
+    config.sync_each = program.get<bool>("--sync-each");
+    config.keep_file = program.get<bool>("--keep-file");
+    config.csv_path = program.get<std::string>("--csv");
 
-    map_large_file();
+    return map_large_file(config);
 }
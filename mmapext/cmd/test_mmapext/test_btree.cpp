@@ -0,0 +1,89 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/btree.h>
+
+#include <algorithm>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace mmapext;
+
+static BTree *open_tree(const char *path)
+{
+    BTreeOptions opts{};
+    opts.backing_file = path;
+    auto res = BTree::open(opts);
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    return res.tree;
+}
+
+// Every key of keys is in the tree with the value key + 1, and iteration visits them in order.
+static void check_keys(const BTree *tree, const std::vector<uint64_t> &keys)
+{
+    CHECK(tree->size() == keys.size());
+    uint64_t missing = 0;
+    for (uint64_t key : keys) {
+        uint64_t value = 0;
+        missing += !tree->get(key, &value) || value != key + 1;
+    }
+    CHECK(missing == 0);
+
+    std::vector<uint64_t> visited;
+    for (BTreeIterator it = tree->begin(); it.valid(); it.next()) {
+        visited.push_back(it.key());
+    }
+    std::vector<uint64_t> sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    CHECK(visited == sorted);
+}
+
+TEST_CASE("a split that can't grow the file leaves the tree as it was")
+{
+    TempFile file("btree.bin");
+
+    // A full root leaf, in a file with room for one more node. Splitting the leaf needs two, the new leaf
+    // and a new root.
+    std::vector<uint64_t> keys;
+    BTree *tree = open_tree(file.path());
+    for (uint64_t i = 0; i < BTree::NODE_CAPACITY; ++i) {
+        keys.push_back(2 * i);
+        REQUIRE(tree->put(2 * i, 2 * i + 1).error_code == MMAPEXT_ERR_NONE);
+    }
+    REQUIRE(tree->height() == 1);
+    const uint64_t num_nodes = tree->num_nodes();
+    REQUIRE(BTree::close(tree).error_code == MMAPEXT_ERR_NONE);
+
+    const uint64_t file_size = (num_nodes + 2) * MMAPEXT_PAGE_SIZE;
+    REQUIRE(truncate(file.path(), file_size) == 0);
+    tree = open_tree(file.path());
+
+    rlimit old_limit{};
+    REQUIRE(getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+    rlimit limit = old_limit;
+    limit.rlim_cur = file_size;
+    sighandler_t old_handler = signal(SIGXFSZ, SIG_IGN);
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+    const uint64_t key = BTree::NODE_CAPACITY + 1;
+    const ErrorResult err = tree->put(key, key + 1);
+
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+
+    CHECK(err.error_code == MMAPEXT_ERR_OUT_OF_MEMORY);
+    CHECK(tree->height() == 1);
+    CHECK(tree->num_nodes() == num_nodes);
+    check_keys(tree, keys);
+
+    // With room again the same insert splits.
+    REQUIRE(tree->put(key, key + 1).error_code == MMAPEXT_ERR_NONE);
+    keys.push_back(key);
+    CHECK(tree->height() == 2);
+    check_keys(tree, keys);
+
+    REQUIRE(BTree::close(tree).error_code == MMAPEXT_ERR_NONE);
+}
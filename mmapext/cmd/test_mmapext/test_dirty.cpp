@@ -0,0 +1,130 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/mmapext.h>
+
+#include <string.h>
+#include <unistd.h>
+
+static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+// Starts tracking with mode and takes the first checkpoint, which flushes the whole mapping. False if the
+// kernel doesn't support the mode.
+static bool start_tracking(MmapManager *man, int mode)
+{
+    auto err = mmapext_track_dirty(man, mode);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        WARN("dirty tracking mode " << mode << " is not supported: " << err.error_message);
+        return false;
+    }
+    auto cp = mmapext_checkpoint(man);
+    REQUIRE(cp.error.error_code == MMAPEXT_ERR_NONE);
+    CHECK(cp.flushed_bytes == mmapext_mapped_size(man));
+    return true;
+}
+
+static void check_flushed(MmapManager *man, uint64_t ranges, uint64_t bytes)
+{
+    auto cp = mmapext_checkpoint(man);
+    REQUIRE(cp.error.error_code == MMAPEXT_ERR_NONE);
+    CHECK(cp.ranges == ranges);
+    CHECK(cp.flushed_bytes == bytes);
+}
+
+TEST_CASE("explicit dirty tracking flushes the marked pages")
+{
+    TempFile file("dirty_explicit.bin");
+    MmapManager man = create_mapped_manager(file.path(), 8);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(start_tracking(&man, MMAPEXT_DIRTY_EXPLICIT));
+
+    man.address[3 * MMAPEXT_PAGE_SIZE] = 1;
+    mmapext_mark_dirty(&man, 3 * MMAPEXT_PAGE_SIZE, 1);
+    man.address[6 * MMAPEXT_PAGE_SIZE + 1] = 1;
+    mmapext_mark_dirty(&man, 6 * MMAPEXT_PAGE_SIZE + 1, page_size);
+    check_flushed(&man, 2, 3 * page_size);
+    check_flushed(&man, 0, 0);
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
+
+TEST_CASE("soft-dirty tracking finds written pages")
+{
+    TempFile file("dirty_soft.bin");
+    MmapManager man = create_mapped_manager(file.path(), 8);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    if (start_tracking(&man, MMAPEXT_DIRTY_SOFT_DIRTY)) {
+        man.address[2 * MMAPEXT_PAGE_SIZE] = 1;
+        auto cp = mmapext_checkpoint(&man);
+        REQUIRE(cp.error.error_code == MMAPEXT_ERR_NONE);
+        CHECK(cp.ranges >= 1);
+        CHECK(cp.flushed_bytes >= page_size);
+    }
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
+
+// userfaultfd write protection only works for files on tmpfs.
+TEST_CASE("userfaultfd tracking records writes to the current mapping only")
+{
+    TempFile file("dirty_uffd.bin", "/dev/shm");
+    MmapManager man = create_mapped_manager(file.path(), 4);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    if (start_tracking(&man, MMAPEXT_DIRTY_UFFD_WP)) {
+        man.address[MMAPEXT_PAGE_SIZE] = 1;
+        check_flushed(&man, 1, page_size);
+        check_flushed(&man, 0, 0);
+
+        // Writing through the reservation the mapping moved away from wakes the writer and records nothing
+        // outside the mapping.
+        MmapManagerReadSection section = mmapext_read_begin(&man);
+        MmapManagerMapNextOptions opts{};
+        opts.extra_chunks_to_reserve_on_grow = 64;
+        opts.chunks_to_map_next = 4;
+        auto res = mmapext_map_next_file_chunk(&man, opts);
+        REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+        REQUIRE(res.mapping_was_moved);
+        section.address[0] = 2;
+        mmapext_read_end();
+        CHECK(man.address[0] == 2);
+
+        auto cp = mmapext_checkpoint(&man);
+        REQUIRE(cp.error.error_code == MMAPEXT_ERR_NONE);
+        CHECK(cp.flushed_bytes <= mmapext_mapped_size(&man));
+
+        man.address[6 * MMAPEXT_PAGE_SIZE] = 1;
+        check_flushed(&man, 1, page_size);
+    }
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
+
+TEST_CASE("userfaultfd tracking protects pages again around unmapped chunks")
+{
+    TempFile file("dirty_uffd_holes.bin", "/dev/shm");
+    MmapManager man = create_mapped_manager(file.path(), 8);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    if (start_tracking(&man, MMAPEXT_DIRTY_UFFD_WP)) {
+        // One dirty run from the end of chunk 1 over chunk 2 to the start of chunk 3.
+        memset(man.address + 2 * MMAPEXT_PAGE_SIZE - page_size, 1, MMAPEXT_PAGE_SIZE + 2 * page_size);
+        REQUIRE(mmapext_unmap_range(&man, 2, 1).error_code == MMAPEXT_ERR_NONE);
+
+        // The dirty pages of the unmapped chunk are still flushed, from the file.
+        check_flushed(&man, 1, MMAPEXT_PAGE_SIZE + 2 * page_size);
+
+        // The mapped pages of the run are protected again.
+        man.address[3 * MMAPEXT_PAGE_SIZE] = 2;
+        check_flushed(&man, 1, page_size);
+
+        REQUIRE(mmapext_map_range(&man, 2, 1).error_code == MMAPEXT_ERR_NONE);
+        CHECK(man.address[2 * MMAPEXT_PAGE_SIZE] == 1);
+        man.address[2 * MMAPEXT_PAGE_SIZE] = 2;
+        check_flushed(&man, 1, page_size);
+    }
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
@@ -0,0 +1,59 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/mmap_allocator.h>
+
+#include <sys/mman.h>
+
+using namespace mmapext;
+
+static MmapAllocatorOpenResult open_heap(const char *path)
+{
+    MmapAllocatorOptions opts{};
+    opts.backing_file = path;
+    opts.max_heap_size = uint64_t(1) << 30;
+    opts.chunks_per_grow = 4;
+    return MmapAllocator::open(opts);
+}
+
+TEST_CASE("a heap opened at another address keeps reporting invalid pointers")
+{
+    TempFile file("heap.bin");
+
+    auto res = open_heap(file.path());
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(res.created);
+    CHECK(res.pointers_valid);
+    uint8_t *const created_at = res.allocator->manager().address;
+    MmapAllocator::close(res.allocator);
+
+    // Keep the heap from going back to the address it was created at.
+    void *blocker = mmap(created_at,
+                         MMAPEXT_PAGE_SIZE,
+                         PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                         -1,
+                         0);
+    REQUIRE(blocker == created_at);
+
+    res = open_heap(file.path());
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    CHECK(res.allocator->manager().address != created_at);
+    CHECK_FALSE(res.pointers_valid);
+    MmapAllocator::close(res.allocator);
+
+    // Landing at the address of the previous open doesn't make the pointers valid.
+    res = open_heap(file.path());
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    CHECK_FALSE(res.pointers_valid);
+    MmapAllocator::close(res.allocator);
+
+    munmap(blocker, MMAPEXT_PAGE_SIZE);
+
+    res = open_heap(file.path());
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    CHECK(res.allocator->manager().address == created_at);
+    CHECK(res.pointers_valid);
+    MmapAllocator::close(res.allocator);
+}
@@ -0,0 +1,73 @@
+// Lazily mapped managers are read only, the functions that write to the mapping must refuse them instead of
+// faulting on the private read only pages.
+
+#include <catch2/catch.hpp>
+
+#include <mmapext/mmapext.h>
+
+#include <string.h>
+
+static int fill_pattern(void *, uint64_t offset, void *dst, uint64_t length)
+{
+    memset(dst, static_cast<int>(offset / 4096), length);
+    return 0;
+}
+
+TEST_CASE("writes to a lazily mapped manager are rejected")
+{
+    MmapManagerLazyOptions opts{};
+    opts.file_size = 64 << 10;
+    opts.fill = fill_pattern;
+    MmapManager man = mmapext_open_lazy(opts);
+    if (man.error_code != 0) {
+        WARN("lazy mapping unavailable: " << man.error_message);
+        return;
+    }
+
+    const uint8_t data[64] = { 1 };
+    uint64_t commit_length = 0;
+
+    CHECK(mmapext_write(&man, 4096, data, sizeof(data)).error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+    CHECK(mmapext_append(&man, 0, data, sizeof(data), &commit_length).error_code ==
+          MMAPEXT_ERR_INVALID_ARGUMENT);
+    CHECK(mmapext_append_record(&man, 0, MMAPEXT_RECORD_U32, data, sizeof(data), &commit_length)
+              .error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+    CHECK(mmapext_parallel_fill(&man, 0, 8192, 0xff, 2).error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+    CHECK(mmapext_parallel_copy_in(&man, 0, data, sizeof(data), 2).error_code ==
+          MMAPEXT_ERR_INVALID_ARGUMENT);
+    CHECK(mmapext_safe_write(&man, 0, data, sizeof(data)).error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+
+    // Nothing was written, the pages still read what the fill function produced.
+    uint8_t page[4096];
+    CHECK(mmapext_read(&man, 4096, page, sizeof(page)).error_code == 0);
+    CHECK(page[0] == 1);
+    CHECK(page[4095] == 1);
+
+    CHECK(mmapext_delete_manager(&man).error_code == 0);
+}
+
+TEST_CASE("fill_pages is checked against the maximum that is used")
+{
+    MmapManagerLazyOptions opts{};
+    opts.file_size = 1 << 20;
+    opts.fill = fill_pattern;
+
+    // max_fill_pages 0 means 256.
+    opts.fill_pages = 32;
+    MmapManager man = mmapext_open_lazy(opts);
+    if (man.error_code != 0) {
+        WARN("lazy mapping unavailable: " << man.error_message);
+        return;
+    }
+    CHECK(man.address[5 * 4096] == 5);
+    CHECK(mmapext_delete_manager(&man).error_code == 0);
+
+    opts.fill_pages = 257;
+    man = mmapext_open_lazy(opts);
+    CHECK(man.error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+
+    opts.fill_pages = 8;
+    opts.max_fill_pages = 4;
+    man = mmapext_open_lazy(opts);
+    CHECK(man.error_code == MMAPEXT_ERR_INVALID_ARGUMENT);
+}
@@ -0,0 +1,99 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/mmapext.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// Bytes the process has locked, the VmLck line of /proc/self/status.
+static uint64_t locked_by_process()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    REQUIRE(f != nullptr);
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        if (sscanf(line, "VmLck: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb << 10;
+}
+
+static MmapManagerMapNextChunkResult grow_past_reservation(MmapManager *man)
+{
+    MmapManagerMapNextOptions opts{};
+    opts.extra_chunks_to_reserve_on_grow = 16;
+    opts.chunks_to_map_next = 4;
+    return mmapext_map_next_file_chunk(man, opts);
+}
+
+TEST_CASE("a moved mapping stays readable until the reader leaves")
+{
+    TempFile file("moves.bin");
+    MmapManager man = create_mapped_manager(file.path(), 4);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(mmapext_full(&man));
+    memset(man.address, 0x5a, mmapext_mapped_size(&man));
+
+    MmapManagerReadSection section = mmapext_read_begin(&man);
+    REQUIRE(section.address == man.address);
+
+    auto res = grow_past_reservation(&man);
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(res.mapping_was_moved);
+    CHECK(man.address != section.address);
+
+    // The reader still sees the data through the address it got, and writes through the new mapping show
+    // up in the old one, both map the same file.
+    CHECK(section.address[section.mapped_size - 1] == 0x5a);
+    man.address[0] = 0x11;
+    CHECK(section.address[0] == 0x11);
+
+    CHECK(mmapext_reclaim_mappings(&man, false) == 1);
+    uint64_t vmas = 0;
+    REQUIRE(mmapext_count_vmas(&man, &vmas).error_code == MMAPEXT_ERR_NONE);
+    CHECK(vmas == mmapext_vma_count(&man));
+
+    mmapext_read_end();
+    CHECK(mmapext_reclaim_mappings(&man, false) == 0);
+    REQUIRE(mmapext_count_vmas(&man, &vmas).error_code == MMAPEXT_ERR_NONE);
+    CHECK(vmas == mmapext_vma_count(&man));
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
+
+TEST_CASE("locked ranges are locked once after the mapping moved")
+{
+    TempFile file("moves_locked.bin");
+    MmapManager man = create_mapped_manager(file.path(), 4);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    const uint64_t locked_before = locked_by_process();
+    const uint64_t length = 2 * MMAPEXT_PAGE_SIZE;
+    REQUIRE(mmapext_lock_range(&man, MMAPEXT_PAGE_SIZE, length).error_code == MMAPEXT_ERR_NONE);
+    CHECK(locked_by_process() == locked_before + length);
+
+    // A reader keeps the old mapping alive across the move. Only the new one may be locked.
+    MmapManagerReadSection section = mmapext_read_begin(&man);
+    auto res = grow_past_reservation(&man);
+    REQUIRE(res.error.error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(res.mapping_was_moved);
+    CHECK(locked_by_process() == locked_before + length);
+    CHECK(mmapext_locked_bytes() == length);
+
+    uint64_t vmas = 0;
+    REQUIRE(mmapext_count_vmas(&man, &vmas).error_code == MMAPEXT_ERR_NONE);
+    CHECK(vmas == mmapext_vma_count(&man));
+    CHECK(section.address[MMAPEXT_PAGE_SIZE] == 0);
+
+    mmapext_read_end();
+    CHECK(mmapext_reclaim_mappings(&man, true) == 0);
+    CHECK(locked_by_process() == locked_before + length);
+
+    CHECK(mmapext_unlock_range(&man, MMAPEXT_PAGE_SIZE, length).error_code == MMAPEXT_ERR_NONE);
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
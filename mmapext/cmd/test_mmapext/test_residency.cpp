@@ -0,0 +1,64 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/mmapext.h>
+
+#include <fstream>
+#include <string.h>
+
+// Column of the path in the header lines of /proc/self/smaps, the kernel pads the fields before it.
+constexpr size_t smaps_path_column = 73;
+
+// Bytes mmapext_residency reads of a line at a time.
+constexpr size_t smaps_read_size = 511;
+
+// The header line of the mapping of path in /proc/self/smaps, empty if there is none.
+static std::string smaps_header(const std::string &path)
+{
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    while (std::getline(smaps, line)) {
+        if (line.size() > path.size() && line.compare(line.size() - path.size(), path.size(), path) == 0) {
+            return line;
+        }
+    }
+    return std::string();
+}
+
+TEST_CASE("residency ignores the parts of long paths in smaps")
+{
+    TempFile file("residency");
+    std::string path = std::filesystem::path(file.path()).parent_path().string() + "/";
+
+    // Pad the path so that the second read of its header line starts with something that looks like a field
+    // of the mapping.
+    const size_t fake_field_column = smaps_read_size - smaps_path_column;
+    while (path.size() < fake_field_column) {
+        path += std::string(std::min<size_t>(200, fake_field_column - path.size()), 'a');
+        if (path.size() < fake_field_column) {
+            path.back() = '/';
+        }
+    }
+    path.back() = '/';
+    path += "Rss: 1048576 kB";
+    std::filesystem::create_directories(path);
+    path += "/data.bin";
+
+    MmapManager man = create_mapped_manager(path.c_str(), 4);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+    memset(man.address, 1, mmapext_mapped_size(&man));
+
+    const std::string header = smaps_header(path);
+    REQUIRE(!header.empty());
+    if (header.size() - path.size() != smaps_path_column) {
+        WARN("smaps pads its header lines differently: " << header);
+    }
+
+    MmapManagerResidency res{};
+    REQUIRE(mmapext_residency(&man, 0, mmapext_mapped_size(&man), &res).error_code == MMAPEXT_ERR_NONE);
+    CHECK(res.resident_bytes == mmapext_mapped_size(&man));
+    CHECK(res.rss_bytes == mmapext_mapped_size(&man));
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
@@ -0,0 +1,100 @@
+#include <catch2/catch.hpp>
+
+#include "test_util.hpp"
+
+#include <mmapext/mmapext.h>
+
+#include <string.h>
+#include <vector>
+
+static uint64_t commit_length(const MmapManager &man)
+{
+    return __atomic_load_n(reinterpret_cast<const uint64_t *>(man.address + MMAPEXT_APPEND_COMMIT_OFFSET),
+                           __ATOMIC_ACQUIRE);
+}
+
+static std::vector<uint8_t> pattern(uint64_t length, uint8_t seed)
+{
+    std::vector<uint8_t> data(length);
+    for (uint64_t i = 0; i < length; ++i) {
+        data[i] = uint8_t(seed + i * 7 + i / 251);
+    }
+    return data;
+}
+
+TEST_CASE("appending after sealing continues at the commit length")
+{
+    TempFile file("sealed.bin");
+    MmapManager man = create_mapped_manager(file.path(), 64);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    MmapManagerSealOptions seal_opts{};
+    seal_opts.block_size = 4 * MMAPEXT_PAGE_SIZE;
+    REQUIRE(mmapext_enable_sealing(&man, seal_opts).error_code == MMAPEXT_ERR_NONE);
+
+    // The log starts right after its commit length, in the first chunk, like a file without a header would.
+    *reinterpret_cast<uint64_t *>(man.address + MMAPEXT_APPEND_COMMIT_OFFSET) = sizeof(uint64_t);
+    const auto first = pattern(10 * MMAPEXT_PAGE_SIZE, 1);
+    uint64_t length = 0;
+    REQUIRE(mmapext_append(&man, MMAPEXT_APPEND_COMMIT_OFFSET, first.data(), first.size(), &length)
+                .error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(length == sizeof(uint64_t) + first.size());
+
+    REQUIRE(mmapext_seal(&man, length).error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(mmapext_sealed_size(&man) == 8 * MMAPEXT_PAGE_SIZE);
+
+    // Punching the sealed range must not take the commit length with it.
+    CHECK(commit_length(man) == length);
+
+    const auto second = pattern(3 * MMAPEXT_PAGE_SIZE, 2);
+    uint64_t new_length = 0;
+    REQUIRE(mmapext_append(&man, MMAPEXT_APPEND_COMMIT_OFFSET, second.data(), second.size(), &new_length)
+                .error_code == MMAPEXT_ERR_NONE);
+    CHECK(new_length == length + second.size());
+
+    // The first chunk reads the current commit length, not the one sealed with it.
+    uint64_t read_length = 0;
+    REQUIRE(mmapext_read(&man, MMAPEXT_APPEND_COMMIT_OFFSET, &read_length, sizeof(read_length)).error_code ==
+            MMAPEXT_ERR_NONE);
+    CHECK(read_length == new_length);
+
+    std::vector<uint8_t> expected(first);
+    expected.insert(expected.end(), second.begin(), second.end());
+    std::vector<uint8_t> data(expected.size());
+    REQUIRE(mmapext_read(&man, sizeof(uint64_t), data.data(), data.size()).error_code == MMAPEXT_ERR_NONE);
+    CHECK(data == expected);
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
+
+TEST_CASE("sealing a superblock file keeps the superblock readable")
+{
+    TempFile file("sealed_superblock.bin");
+    MmapManager man = create_mapped_manager(file.path(), 64, true);
+    REQUIRE(man.error_code == MMAPEXT_ERR_NONE);
+
+    MmapManagerSealOptions seal_opts{};
+    seal_opts.block_size = 4 * MMAPEXT_PAGE_SIZE;
+    REQUIRE(mmapext_enable_sealing(&man, seal_opts).error_code == MMAPEXT_ERR_NONE);
+
+    const auto data = pattern(12 * MMAPEXT_PAGE_SIZE, 3);
+    uint64_t length = 0;
+    REQUIRE(mmapext_append(&man, MMAPEXT_SUPERBLOCK_COMMIT_OFFSET, data.data(), data.size(), &length)
+                .error_code == MMAPEXT_ERR_NONE);
+    REQUIRE(mmapext_seal(&man, length).error_code == MMAPEXT_ERR_NONE);
+
+    // The seal updated the superblock after taking the compressed copy of its chunk.
+    MmapManagerSuperblock sb{};
+    REQUIRE(mmapext_get_superblock(&man, &sb).error_code == MMAPEXT_ERR_NONE);
+    CHECK(sb.reclaim_watermark == mmapext_sealed_size(&man));
+
+    std::vector<uint8_t> first_chunk(MMAPEXT_PAGE_SIZE);
+    REQUIRE(mmapext_read(&man, 0, first_chunk.data(), first_chunk.size()).error_code == MMAPEXT_ERR_NONE);
+    CHECK(memcmp(first_chunk.data(), man.address, first_chunk.size()) == 0);
+
+    std::vector<uint8_t> read(data.size());
+    REQUIRE(mmapext_read(&man, MMAPEXT_PAGE_SIZE, read.data(), read.size()).error_code == MMAPEXT_ERR_NONE);
+    CHECK(read == data);
+
+    CHECK(mmapext_delete_manager(&man).error_code == MMAPEXT_ERR_NONE);
+}
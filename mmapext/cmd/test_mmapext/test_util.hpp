@@ -0,0 +1,52 @@
+#pragma once
+
+#include <mmapext/mmapext.h>
+
+#include <filesystem>
+#include <stdlib.h>
+#include <string>
+
+// A path in a fresh directory under parent, $TMPDIR by default, removed with everything in it at the end of
+// the test.
+class TempFile {
+  public:
+    explicit TempFile(const char *name, const char *parent = getenv("TMPDIR"))
+    {
+        _dir = std::string(parent != nullptr ? parent : "/var/tmp") + "/mmapext_test_XXXXXX";
+        if (mkdtemp(&_dir[0]) == nullptr) {
+            abort();
+        }
+        _path = _dir + "/" + name;
+    }
+
+    ~TempFile()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(_dir, ec);
+    }
+
+    const char *path() const { return _path.c_str(); }
+
+  private:
+    std::string _dir;
+    std::string _path;
+};
+
+// Creates a manager for path and maps num_chunks chunks of it.
+inline MmapManager create_mapped_manager(const char *path, uint64_t num_chunks, bool use_superblock = false)
+{
+    MmapManagerCreateOptions opts{};
+    opts.backing_file = path;
+    opts.initial_reserved_size = num_chunks * MMAPEXT_PAGE_SIZE;
+    opts.use_superblock = use_superblock;
+    MmapManager man = mmapext_create_manager(opts);
+    if (man.error_code == MMAPEXT_ERR_NONE && man.num_chunks_mapped < num_chunks) {
+        MmapManagerMapNextOptions map_opts{};
+        map_opts.extra_chunks_to_reserve_on_grow = num_chunks;
+        map_opts.chunks_to_map_next = num_chunks - man.num_chunks_mapped;
+        auto res = mmapext_map_next_file_chunk(&man, map_opts);
+        man.error_code = res.error.error_code;
+        man.error_message = res.error.error_message;
+    }
+    return man;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <mmapext/mmapext.h>
+
+namespace mmapext {
+
+struct BTreeHeader;
+struct BTreeNode;
+
+struct MMAPEXT_API BTreeOptions {
+    // Path to the tree file. Created if it doesn't exist.
+    const char *backing_file;
+
+    // Address space reserved up front. The tree grows beyond this by moving the mapping, which is fine since
+    // nodes refer to each other by file offset.
+    uint64_t initial_reserved_size = uint64_t(1) << 30;
+};
+
+class BTree;
+
+struct MMAPEXT_API BTreeOpenResult {
+    ErrorResult error;
+    BTree *tree;
+
+    // True if the file did not contain a tree and a new one was created.
+    bool created;
+};
+
+/// Position in the leaf level of a BTree. Invalidated by any modification of the tree.
+struct MMAPEXT_API BTreeIterator {
+    const BTree *tree;
+    uint64_t leaf;
+    uint32_t index;
+
+    bool valid() const { return leaf != 0; }
+    uint64_t key() const;
+    uint64_t value() const;
+
+    /// Moves to the next entry in key order. Prefetches the following leaf whenever it enters a new one.
+    void next();
+};
+
+/// A persistent B+tree from 64-bit keys to 64-bit values, whose nodes are MMAPEXT_PAGE_SIZE pages of its own
+/// MmapManager file. All state is in the file, so reopening needs no rebuild.
+///
+/// The keys of a node are a sorted array at the start of the node, searched with a short binary search
+/// followed by a SIMD scan. Leaves are linked for range iteration.
+///
+/// Removal doesn't merge underfull nodes, which suits the append-mostly indexes this is meant for. Not thread
+/// safe. Keys are unique; `put` overwrites.
+class MMAPEXT_API BTree {
+  public:
+    /// Number of keys in a node. Leaves hold as many values, inner nodes one more child.
+    static constexpr uint32_t NODE_CAPACITY = ((MMAPEXT_PAGE_SIZE - 72) / 16) & ~7u;
+
+    static BTreeOpenResult open(const BTreeOptions &opts);
+
+    /// Deletes the manager and the tree object. Does not sync the file.
+    static ErrorResult close(BTree *tree);
+
+    /// Looks up `key`. Returns true and sets `*value` if found.
+    bool get(uint64_t key, uint64_t *value) const;
+
+    /// Inserts or overwrites the value associated with `key`. If the file can't grow for the nodes a split
+    /// takes, fails without changing the tree.
+    ErrorResult put(uint64_t key, uint64_t value);
+
+    /// Removes `key`. Returns true if it was present.
+    bool remove(uint64_t key);
+
+    /// Builds the tree bottom up from `count` strictly increasing keys and their values. The tree must be
+    /// empty. Leaves are filled to `fill_factor` so a few later inserts don't split them right away.
+    ErrorResult
+    bulk_load(const uint64_t *keys, const uint64_t *values, uint64_t count, float fill_factor = 1.0f);
+
+    /// Returns an iterator at the first entry with key >= `key`.
+    BTreeIterator lower_bound(uint64_t key) const;
+
+    /// Returns an iterator at the smallest key.
+    BTreeIterator begin() const;
+
+    /// Number of keys in the tree.
+    uint64_t size() const;
+
+    /// Number of levels, 1 when the root is a leaf.
+    uint32_t height() const;
+
+    /// Number of pages used by nodes.
+    uint64_t num_nodes() const;
+
+    /// Flushes the tree to the file with msync.
+    ErrorResult sync();
+
+    const MmapManager &manager() const { return _man; }
+
+  private:
+    friend struct BTreeIterator;
+
+    BTree() = default;
+
+    BTreeHeader *header() const;
+    BTreeNode *node_at(uint64_t offset) const;
+
+    // Returns the offset of a new zeroed node, 0 on failure. Can move the mapping.
+    uint64_t allocate_node(bool is_leaf);
+
+    // Descends to the leaf that would contain `key`. If `path` is not null, fills it with the offsets of the
+    // inner nodes on the way and returns their number in `*path_length`.
+    uint64_t find_leaf(uint64_t key, uint64_t *path, uint32_t *path_length) const;
+
+    // Inserts a separator and the child to its right into the inner node `path[level]`, splitting upwards as
+    // needed. A level of -1 means the root was split and a new root is needed. put maps the nodes this
+    // allocates before splitting the leaf, so the allocations here don't fail.
+    ErrorResult insert_into_parent(const uint64_t *path, int level, uint64_t separator, uint64_t right);
+
+    MmapManager _man;
+};
+
+} // namespace mmapext
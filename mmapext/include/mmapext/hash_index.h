@@ -0,0 +1,104 @@
+#pragma once
+
+#include <mmapext/mmapext.h>
+
+namespace mmapext {
+
+struct HashIndexHeader;
+struct HashIndexBucket;
+
+struct MMAPEXT_API HashIndexOptions {
+    // Path to the index file. Created if it doesn't exist.
+    const char *backing_file;
+
+    // Number of buckets of a new index is 2^initial_buckets_log2. Ignored when opening an existing index.
+    uint32_t initial_buckets_log2 = 10;
+
+    // A bucket is split whenever the average number of entries per slot exceeds this. Ignored when opening
+    // an existing index.
+    float max_load_factor = 0.8f;
+
+    // Address space reserved up front. The index grows beyond this by moving the mapping, which is fine
+    // since the index only stores offsets.
+    uint64_t initial_reserved_size = uint64_t(1) << 30;
+};
+
+class HashIndex;
+
+struct MMAPEXT_API HashIndexOpenResult {
+    ErrorResult error;
+    HashIndex *index;
+
+    // True if the file did not contain an index and a new one was created.
+    bool created;
+};
+
+/// A persistent hash index from 64-bit keys to 64-bit values (typically offsets of records in a log), whose
+/// slot array lives in its own MmapManager file. All state is in the file, so reopening needs no rebuild.
+///
+/// Uses linear hashing: when the load factor goes above the limit, only the bucket at the split pointer is
+/// split, so growth never rehashes the whole table at once. Buckets are 128 bytes. The keys and the entry
+/// count are in the first cache line and the values in the second, so a lookup that doesn't overflow costs
+/// one cache miss, two on a hit. Buckets are stored in segments whose sizes double, so finding a bucket is a
+/// couple of shifts and one load from the header.
+///
+/// Not thread safe. Keys are unique; `put` overwrites.
+class MMAPEXT_API HashIndex {
+  public:
+    static constexpr uint32_t SLOTS_PER_BUCKET = 7;
+
+    static HashIndexOpenResult open(const HashIndexOptions &opts);
+
+    /// Deletes the manager and the index object. Does not sync the file.
+    static ErrorResult close(HashIndex *index);
+
+    /// Looks up `key`. Returns true and sets `*value` if found.
+    bool get(uint64_t key, uint64_t *value) const;
+
+    /// Inserts or overwrites the value associated with `key`.
+    ErrorResult put(uint64_t key, uint64_t value);
+
+    /// Removes `key`. Returns true if it was present.
+    bool remove(uint64_t key);
+
+    /// Issues a prefetch for the bucket that `key` maps to. Useful for batches of lookups.
+    void prefetch(uint64_t key) const;
+
+    /// Number of keys in the index.
+    uint64_t size() const;
+
+    /// Number of primary buckets.
+    uint64_t num_buckets() const;
+
+    /// Number of overflow buckets currently in use.
+    uint64_t num_overflow_buckets() const;
+
+    /// Flushes the index to the file with msync.
+    ErrorResult sync();
+
+    const MmapManager &manager() const { return _man; }
+
+  private:
+    HashIndex() = default;
+
+    HashIndexHeader *header() const;
+    HashIndexBucket *bucket_at(uint64_t offset) const;
+    uint64_t bucket_offset(uint64_t bucket_index) const;
+    uint64_t bucket_index_for(uint64_t hash) const;
+
+    // Allocates `size` bytes at the end of the file, growing it if needed. Returns the offset, 0 on failure.
+    // Can move the mapping.
+    uint64_t allocate(uint64_t size);
+
+    // Returns the offset of a zeroed overflow bucket, 0 on failure.
+    uint64_t allocate_overflow_bucket();
+
+    // Appends an entry to the chain starting at the given primary bucket. Can move the mapping.
+    ErrorResult append_to_chain(uint64_t bucket_index, uint64_t key, uint64_t value);
+
+    ErrorResult split_next_bucket();
+
+    MmapManager _man;
+};
+
+} // namespace mmapext
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <mmapext/mmapext.h>
+#include <scaffold/memory.h>
+
+#include <mutex>
+
+namespace mmapext {
+
+struct HeapHeader;
+
+struct MMAPEXT_API MmapAllocatorOptions {
+    // Path to the heap file. Created if it doesn't exist.
+    const char *backing_file;
+
+    // Address space reserved for the heap. The heap never moves its mapping (objects in the heap, including
+    // the allocator itself, are referred to by raw pointers), so allocations fail once this much of the file
+    // is in use.
+    uint64_t max_heap_size = uint64_t(64) << 30;
+
+    // Number of chunks by which the file and the mapping are extended when the heap runs out of mapped
+    // memory.
+    uint64_t chunks_per_grow = 128;
+};
+
+class MmapAllocator;
+
+struct MMAPEXT_API MmapAllocatorOpenResult {
+    ErrorResult error;
+    MmapAllocator *allocator;
+
+    // True if the file was mapped at the address the heap was created at, or if the heap was freshly
+    // created. Raw pointers stored inside the heap (the ones fo::Array, fo::PodHash etc. keep) are only valid
+    // if this is true. Opening the heap at another address doesn't make that address the valid one, so
+    // every later open elsewhere reports false too. The collections in persistent_types.h don't depend on
+    // this.
+    bool pointers_valid;
+
+    // True if the file did not contain a heap and a new one was created.
+    bool created;
+};
+
+/// An fo::Allocator whose buffer is the mapping of an MmapManager. All allocator metadata (free lists, top
+/// of heap, root object) is stored in the first chunk of the file as offsets, so opening the file again
+/// regains the heap.
+///
+/// The allocator object itself is constructed inside the first chunk of the mapping. Since the mapping is
+/// re-established at the address it was last mapped at whenever possible, the `_allocator` pointer that the
+/// scaffold containers keep points to the reopened allocator. This lets an fo::Array<T> allocated with
+/// `fo::make_new` from this allocator be found again through `root()`.
+///
+/// Allocations are served from power-of-2 size classes up to `MAX_CLASS_SIZE`, and page-multiple blocks
+/// above that. Freed blocks are kept on per-class free lists.
+class MMAPEXT_API MmapAllocator : public fo::Allocator {
+  public:
+    static constexpr uint64_t MIN_CLASS_SIZE = 32;
+    static constexpr uint64_t MAX_CLASS_SIZE = uint64_t(1) << 20;
+    static constexpr uint32_t NUM_SIZE_CLASSES = 16;
+
+    /// Opens (or creates) the heap stored in `opts.backing_file`. A missing or empty file, or one whose first
+    /// chunk is all zeros, gets a new heap. Any other file must start with the header of a heap of this
+    /// version, or opening fails with MMAPEXT_ERR_BAD_FILE_FORMAT.
+    static MmapAllocatorOpenResult open(const MmapAllocatorOptions &opts);
+
+    /// Destroys the allocator and deletes the manager. `a` must not be used after this. Does not sync the
+    /// file. Call `sync` first if that is needed.
+    static ErrorResult close(MmapAllocator *a);
+
+    void *allocate(fo::AddrUint size, fo::AddrUint align = DEFAULT_ALIGN) override;
+
+    void *reallocate(void *old_allocation,
+                     fo::AddrUint new_size,
+                     fo::AddrUint align = DEFAULT_ALIGN,
+                     fo::AddrUint old_size = DONT_CARE_OLD_SIZE) override;
+
+    void deallocate(void *p) override;
+
+    uint64_t allocated_size(void *p) override;
+
+    uint64_t total_allocated() override;
+
+    /// Returns the root object of the heap, or nullptr if none was set. The root is how objects in the heap
+    /// are found again after reopening the file.
+    void *root();
+
+    /// Sets the root object of the heap. `p` must be an allocation made from this allocator, or nullptr.
+    void set_root(void *p);
+
+    /// Flushes the mapped heap to the file with msync.
+    ErrorResult sync();
+
+    /// The manager mapping the heap file.
+    const MmapManager &manager() const { return _man; }
+
+  private:
+    MmapAllocator() = default;
+    ~MmapAllocator() = default;
+
+    void *allocate_no_lock(uint64_t size, uint64_t align);
+    void deallocate_no_lock(void *p);
+
+    // Returns the offset of a free block of the given size, extending the heap if needed. Returns 0 if out
+    // of memory.
+    uint64_t take_block(uint32_t size_class, uint64_t block_size);
+
+    // Makes sure the first `end_offset` bytes of the file are mapped.
+    bool ensure_mapped(uint64_t end_offset);
+
+    HeapHeader *header() const;
+
+    std::mutex _mutex;
+    MmapManager _man;
+    uint64_t _chunks_per_grow;
+};
+
+} // namespace mmapext
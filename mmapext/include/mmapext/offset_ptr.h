@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mmapext {
+
+/// A self-relative pointer. Stores the distance from itself to the pointee instead of an address, so a
+/// structure that lives in a mapping and only points to other locations inside the same mapping stays valid
+/// when the whole mapping moves (`mapping_was_moved`) or when the file is mapped at a different address in
+/// another process. An offset of 0 represents nullptr, so an OffsetPtr can't point to itself.
+///
+/// Copying an OffsetPtr recomputes the offset relative to the destination, so it's fine to copy one out of
+/// the mapping to the stack and back.
+template <typename T> class OffsetPtr {
+  public:
+    OffsetPtr() = default;
+    OffsetPtr(T *p) { set(p); }
+    OffsetPtr(const OffsetPtr &other) { set(other.get()); }
+
+    OffsetPtr &operator=(const OffsetPtr &other)
+    {
+        set(other.get());
+        return *this;
+    }
+
+    OffsetPtr &operator=(T *p)
+    {
+        set(p);
+        return *this;
+    }
+
+    T *get() const
+    {
+        if (_offset == 0) {
+            return nullptr;
+        }
+        return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + _offset);
+    }
+
+    void set(T *p)
+    {
+        _offset = p == nullptr ? 0 : reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(this);
+    }
+
+    T *operator->() const { return get(); }
+    T &operator*() const { return *get(); }
+    T &operator[](size_t i) const { return get()[i]; }
+
+    explicit operator bool() const { return _offset != 0; }
+
+    bool operator==(const OffsetPtr &other) const { return get() == other.get(); }
+    bool operator!=(const OffsetPtr &other) const { return get() != other.get(); }
+
+    /// The raw stored offset.
+    int64_t offset() const { return _offset; }
+
+  private:
+    int64_t _offset = 0;
+};
+
+static_assert(sizeof(OffsetPtr<int>) == sizeof(int64_t), "");
+
+/// A pointer relative to a base address known by the user, usually the `address` of the MmapManager. Half
+/// the size of a full pointer for mappings under 4GB, but needs the base for every dereference. An offset of
+/// 0 represents nullptr, which is fine since offset 0 of a mapping is normally a file header.
+template <typename T, typename OffsetType = uint32_t> struct BaseOffsetPtr {
+    OffsetType offset = 0;
+
+    BaseOffsetPtr() = default;
+    BaseOffsetPtr(const uint8_t *base, T *p) { set(base, p); }
+
+    T *get(const uint8_t *base) const
+    {
+        return offset == 0 ? nullptr : reinterpret_cast<T *>(const_cast<uint8_t *>(base) + offset);
+    }
+
+    void set(const uint8_t *base, T *p)
+    {
+        offset = p == nullptr ? 0 : OffsetType(reinterpret_cast<const uint8_t *>(p) - base);
+    }
+
+    explicit operator bool() const { return offset != 0; }
+};
+
+} // namespace mmapext
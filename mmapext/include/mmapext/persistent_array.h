@@ -0,0 +1,114 @@
+#pragma once
+
+#include <mmapext/persistent_types.h>
+#include <scaffold/const_log.h>
+
+#include <string.h>
+
+/// Functions operating on mmapext::PArray. Same semantics as the fo::Array functions.
+
+namespace mmapext {
+
+template <typename T> uint32_t size(const PArray<T> &a) { return a._size; }
+template <typename T> bool any(const PArray<T> &a) { return a._size != 0; }
+template <typename T> bool empty(const PArray<T> &a) { return a._size == 0; }
+
+template <typename T> T *data(PArray<T> &a) { return a._data.get(); }
+template <typename T> const T *data(const PArray<T> &a) { return a._data.get(); }
+
+template <typename T> T &front(PArray<T> &a) { return a[0]; }
+template <typename T> const T &front(const PArray<T> &a) { return a[0]; }
+template <typename T> T &back(PArray<T> &a) { return a[a._size - 1]; }
+template <typename T> const T &back(const PArray<T> &a) { return a[a._size - 1]; }
+
+template <typename T> void set_capacity(PArray<T> &a, uint32_t new_capacity)
+{
+    if (new_capacity == a._capacity) {
+        return;
+    }
+
+    if (new_capacity < a._size) {
+        a._size = new_capacity;
+    }
+
+    T *new_data = nullptr;
+    if (new_capacity > 0) {
+        new_data = (T *)a._allocator->reallocate(
+            a._data.get(), sizeof(T) * new_capacity, alignof(T), sizeof(T) * a._capacity);
+        log_assert(new_data != nullptr, "Failed to allocate capacity %u", new_capacity);
+    } else {
+        a._allocator->deallocate(a._data.get());
+    }
+    a._data = new_data;
+    a._capacity = new_capacity;
+}
+
+template <typename T> void grow(PArray<T> &a, uint32_t min_capacity = 0)
+{
+    uint32_t new_capacity = a._capacity ? a._capacity * 2 : 2;
+    if (new_capacity < min_capacity) {
+        new_capacity = clip_to_pow2(min_capacity);
+    }
+    set_capacity(a, new_capacity);
+}
+
+template <typename T> void reserve(PArray<T> &a, uint32_t new_capacity)
+{
+    if (new_capacity > a._capacity) {
+        set_capacity(a, new_capacity);
+    }
+}
+
+template <typename T> void resize(PArray<T> &a, uint32_t new_size)
+{
+    if (new_size > a._capacity) {
+        grow(a, new_size);
+    }
+    a._size = new_size;
+}
+
+template <typename T> void clear(PArray<T> &a) { a._size = 0; }
+
+/// Removes all items and frees the memory.
+template <typename T> void free(PArray<T> &a) { set_capacity(a, 0); }
+
+template <typename T> void trim(PArray<T> &a) { set_capacity(a, a._size); }
+
+template <typename T> void push_back(PArray<T> &a, const T &item)
+{
+    if (a._size + 1 > a._capacity) {
+        grow(a);
+    }
+    a[a._size++] = item;
+}
+
+template <typename T> void pop_back(PArray<T> &a) { --a._size; }
+
+/// Pushes n items to the back of the array.
+template <typename T> void push(PArray<T> &a, const T *items, uint32_t n)
+{
+    reserve(a, a._size + n);
+    memcpy(data(a) + a._size, items, sizeof(T) * n);
+    a._size += n;
+}
+
+template <typename T>
+PArray<T>::PArray(fo::Allocator &allocator, uint32_t initial_size)
+    : _allocator(&allocator)
+    , _size(0)
+    , _capacity(0)
+{
+    resize(*this, initial_size);
+}
+
+template <typename T> PArray<T>::~PArray()
+{
+    if (_data) {
+        _allocator->deallocate(_data.get());
+        _data = nullptr;
+        _size = 0;
+        _capacity = 0;
+    }
+}
+
+} // namespace mmapext
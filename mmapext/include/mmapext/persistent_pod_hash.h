@@ -0,0 +1,194 @@
+#pragma once
+
+#include <mmapext/persistent_array.h>
+
+/// Functions operating on mmapext::PPodHash. Same semantics as the fo::PodHash functions.
+
+namespace mmapext {
+
+#define TypeList typename K, typename V, typename HashFnType, typename EqualFnType
+#define PPodHashSig PPodHash<K, V, HashFnType, EqualFnType>
+
+// -- Iterators on PPodHash. Iterate over the entries, in no particular order.
+template <TypeList> auto begin(const PPodHashSig &h) { return h._entries.begin(); }
+template <TypeList> auto end(const PPodHashSig &h) { return h._entries.end(); }
+template <TypeList> auto begin(PPodHashSig &h) { return h._entries.begin(); }
+template <TypeList> auto end(PPodHashSig &h) { return h._entries.end(); }
+
+namespace ppod_hash_internal {
+
+const uint32_t END_OF_LIST = 0xffffffffu;
+
+struct FindResult {
+    uint32_t hash_i;
+    uint32_t entry_i;
+    uint32_t entry_prev;
+};
+
+template <TypeList> uint32_t hash_slot(const PPodHashSig &h, const K &key)
+{
+    return uint32_t(uint64_t(HashFnType{}(key)) % size(h._hashes));
+}
+
+template <TypeList> FindResult find(const PPodHashSig &h, const K &key)
+{
+    FindResult fr = { END_OF_LIST, END_OF_LIST, END_OF_LIST };
+
+    if (size(h._hashes) == 0) {
+        return fr;
+    }
+
+    fr.hash_i = hash_slot(h, key);
+    fr.entry_i = h._hashes[fr.hash_i];
+    while (fr.entry_i != END_OF_LIST) {
+        if (EqualFnType{}(h._entries[fr.entry_i].key, key)) {
+            return fr;
+        }
+        fr.entry_prev = fr.entry_i;
+        fr.entry_i = h._entries[fr.entry_prev].next;
+    }
+    return fr;
+}
+
+/// Makes a new entry and appends it to the appropriate chain. The key must not already be present.
+template <TypeList> uint32_t make(PPodHashSig &h, const K &key)
+{
+    const FindResult fr = find(h, key);
+
+    typename PPodHashSig::Entry e{};
+    e.key = key;
+    e.next = END_OF_LIST;
+    const uint32_t ei = size(h._entries);
+    push_back(h._entries, e);
+
+    if (fr.entry_prev == END_OF_LIST) {
+        h._hashes[fr.hash_i] = ei;
+    } else {
+        h._entries[fr.entry_prev].next = ei;
+    }
+    return ei;
+}
+
+/// Recomputes the chains for a new number of hash slots. The entries stay where they are, so unlike
+/// fo::PodHash this doesn't need a second table.
+template <TypeList> void rehash(PPodHashSig &h, uint32_t new_size)
+{
+    resize(h._hashes, new_size);
+    for (uint32_t &entry_i : h._hashes) {
+        entry_i = END_OF_LIST;
+    }
+
+    for (uint32_t ei = 0; ei < size(h._entries); ++ei) {
+        auto &e = h._entries[ei];
+        const uint32_t hash_i = hash_slot(h, e.key);
+        e.next = h._hashes[hash_i];
+        h._hashes[hash_i] = ei;
+    }
+}
+
+template <TypeList> void grow(PPodHashSig &h) { rehash(h, size(h._entries) * 2 + 10); }
+
+template <TypeList> bool full(const PPodHashSig &h)
+{
+    return size(h._entries) >= size(h._hashes) * h._load_factor;
+}
+
+template <TypeList> uint32_t find_or_make(PPodHashSig &h, const K &key)
+{
+    if (size(h._hashes) == 0 || full(h)) {
+        grow(h);
+    }
+
+    const FindResult fr = find(h, key);
+    if (fr.entry_i != END_OF_LIST) {
+        return fr.entry_i;
+    }
+    return make(h, key);
+}
+
+template <TypeList> void erase(PPodHashSig &h, const FindResult &fr)
+{
+    if (fr.entry_prev == END_OF_LIST) {
+        h._hashes[fr.hash_i] = h._entries[fr.entry_i].next;
+    } else {
+        h._entries[fr.entry_prev].next = h._entries[fr.entry_i].next;
+    }
+
+    if (fr.entry_i == size(h._entries) - 1) {
+        pop_back(h._entries);
+        return;
+    }
+
+    // Move the last entry into the hole and fix the link pointing to it.
+    h._entries[fr.entry_i] = back(h._entries);
+    pop_back(h._entries);
+    const FindResult last = find(h, h._entries[fr.entry_i].key);
+
+    if (last.entry_prev == END_OF_LIST) {
+        h._hashes[last.hash_i] = fr.entry_i;
+    } else {
+        h._entries[last.entry_prev].next = fr.entry_i;
+    }
+}
+
+} // namespace ppod_hash_internal
+
+/// Number of entries in the table.
+template <TypeList> uint32_t size(const PPodHashSig &h) { return size(h._entries); }
+
+/// Reserve space for `size` keys.
+template <TypeList> void reserve(PPodHashSig &h, uint32_t size)
+{
+    reserve(h._entries, size);
+    ppod_hash_internal::rehash(h, uint32_t(size / h._load_factor) + 1);
+}
+
+/// Sets the given key's value.
+template <TypeList> void set(PPodHashSig &h, const K &key, const V &value)
+{
+    const uint32_t ei = ppod_hash_internal::find_or_make(h, key);
+    h._entries[ei].value = value;
+}
+
+/// Returns true if an entry with the given key is present.
+template <TypeList> bool has(const PPodHashSig &h, const K &key)
+{
+    return ppod_hash_internal::find(h, key).entry_i != ppod_hash_internal::END_OF_LIST;
+}
+
+/// Returns an iterator to the entry containing given `key`, if present. Otherwise returns end(h).
+template <TypeList> auto get(const PPodHashSig &h, const K &key)
+{
+    const auto fr = ppod_hash_internal::find(h, key);
+    if (fr.entry_i == ppod_hash_internal::END_OF_LIST) {
+        return end(h);
+    }
+    return begin(h) + fr.entry_i;
+}
+
+/// Sets the given key's value to `deffault` if no entry is present with the given key. Returns reference to
+/// the value associated with the key.
+template <TypeList> V &set_default(PPodHashSig &h, const K &key, const V &deffault)
+{
+    auto fr = ppod_hash_internal::find(h, key);
+    if (fr.entry_i != ppod_hash_internal::END_OF_LIST) {
+        return h._entries[fr.entry_i].value;
+    }
+    const uint32_t ei = ppod_hash_internal::find_or_make(h, key);
+    h._entries[ei].value = deffault;
+    return h._entries[ei].value;
+}
+
+/// Removes the entry with the given key if it exists.
+template <TypeList> void remove(PPodHashSig &h, const K &key)
+{
+    const auto fr = ppod_hash_internal::find(h, key);
+    if (fr.entry_i != ppod_hash_internal::END_OF_LIST) {
+        ppod_hash_internal::erase(h, fr);
+    }
+}
+
+} // namespace mmapext
+
+#undef TypeList
+#undef PPodHashSig
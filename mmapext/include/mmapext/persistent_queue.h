@@ -0,0 +1,115 @@
+#pragma once
+
+#include <mmapext/persistent_array.h>
+
+/// Functions operating on mmapext::PQueue. Same semantics as the fo::Queue functions.
+
+namespace mmapext {
+
+namespace pqueue_internal {
+
+// Can only be used to increase the capacity.
+template <typename T> void increase_capacity(PQueue<T> &q, uint32_t new_capacity)
+{
+    uint32_t end = size(q._data);
+    resize(q._data, new_capacity);
+    if (q._offset + q._size > end) {
+        uint32_t end_items = end - q._offset;
+        memmove(data(q._data) + new_capacity - end_items, data(q._data) + q._offset, end_items * sizeof(T));
+        q._offset += new_capacity - end;
+    }
+}
+
+template <typename T> void grow(PQueue<T> &q, uint32_t min_capacity = 0)
+{
+    uint32_t new_capacity = size(q._data) * 2 + 8;
+    if (new_capacity < min_capacity) {
+        new_capacity = min_capacity;
+    }
+    increase_capacity(q, new_capacity);
+}
+
+} // namespace pqueue_internal
+
+/// Returns the number of items in the queue.
+template <typename T> uint32_t size(const PQueue<T> &q) { return q._size; }
+
+/// Returns the number of items we can push before the queue needs to grow.
+template <typename T> uint32_t space(const PQueue<T> &q) { return size(q._data) - q._size; }
+
+template <typename T> void reserve(PQueue<T> &q, uint32_t size)
+{
+    if (size > q._size) {
+        pqueue_internal::increase_capacity(q, size);
+    }
+}
+
+template <typename T> void push_back(PQueue<T> &q, const T &item)
+{
+    if (!space(q)) {
+        pqueue_internal::grow(q);
+    }
+    q[q._size++] = item;
+}
+
+template <typename T> void pop_back(PQueue<T> &q) { --q._size; }
+
+template <typename T> void push_front(PQueue<T> &q, const T &item)
+{
+    if (!space(q)) {
+        pqueue_internal::grow(q);
+    }
+    q._offset = (q._offset - 1 + size(q._data)) % size(q._data);
+    ++q._size;
+    q[0] = item;
+}
+
+template <typename T> void pop_front(PQueue<T> &q)
+{
+    q._offset = (q._offset + 1) % size(q._data);
+    --q._size;
+}
+
+/// Consumes n items from the front of the queue.
+template <typename T> void consume(PQueue<T> &q, uint32_t n)
+{
+    q._offset = (q._offset + n) % size(q._data);
+    q._size -= n;
+}
+
+/// Pushes n items to the back of the queue.
+template <typename T> void push(PQueue<T> &q, const T *items, uint32_t n)
+{
+    if (space(q) < n) {
+        pqueue_internal::grow(q, size(q) + n);
+    }
+    const uint32_t capacity = size(q._data);
+    const uint32_t insert = (q._offset + q._size) % capacity;
+    uint32_t to_insert = n;
+    if (insert + to_insert > capacity) {
+        to_insert = capacity - insert;
+    }
+    memcpy(data(q._data) + insert, items, to_insert * sizeof(T));
+    q._size += to_insert;
+    items += to_insert;
+    n -= to_insert;
+    memcpy(data(q._data), items, n * sizeof(T));
+    q._size += n;
+}
+
+template <typename T>
+PQueue<T>::PQueue(fo::Allocator &allocator)
+    : _data(allocator)
+    , _size(0)
+    , _offset(0)
+{
+}
+
+template <typename T> T &PQueue<T>::operator[](uint32_t i) { return _data[(i + _offset) % size(_data)]; }
+
+template <typename T> const T &PQueue<T>::operator[](uint32_t i) const
+{
+    return _data[(i + _offset) % size(_data)];
+}
+
+} // namespace mmapext
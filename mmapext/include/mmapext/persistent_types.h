@@ -0,0 +1,90 @@
+#pragma once
+
+#include <mmapext/offset_ptr.h>
+#include <scaffold/memory.h>
+#include <scaffold/pod_hash.h>
+
+#include <type_traits>
+
+/// Persistent counterparts of the scaffold collection types. They store no raw pointers, only OffsetPtrs, so
+/// they can live inside a mapped file and be used right after reopening it, at whatever address it's mapped
+/// at, and across `mapping_was_moved`.
+///
+/// The allocator given to a persistent collection must live in the same mapping as the collection and
+/// allocate from that mapping, which is what mmapext::MmapAllocator does. The collection itself must be
+/// allocated from that allocator too (see `MmapAllocator::root()`).
+///
+/// Like the scaffold collections these only store POD elements, and their functions are in the
+/// persistent_array.h, persistent_queue.h and persistent_pod_hash.h headers.
+namespace mmapext {
+
+/// Dynamically resizable array of POD objects. Counterpart of fo::Array.
+template <typename T> struct PArray {
+    static_assert(std::is_trivially_copyable<T>::value, "Only supports trivially copyable elements");
+
+    PArray(fo::Allocator &a, uint32_t initial_size = 0);
+    ~PArray();
+
+    PArray(const PArray &other) = delete;
+    PArray &operator=(const PArray &other) = delete;
+
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    T &operator[](uint32_t i) { return _data.get()[i]; }
+    const T &operator[](uint32_t i) const { return _data.get()[i]; }
+
+    iterator begin() { return _data.get(); }
+    iterator end() { return _data.get() + _size; }
+    const_iterator begin() const { return _data.get(); }
+    const_iterator end() const { return _data.get() + _size; }
+
+    OffsetPtr<fo::Allocator> _allocator;
+    uint32_t _size;
+    uint32_t _capacity;
+    OffsetPtr<T> _data;
+};
+
+/// A double-ended queue/ring buffer. Counterpart of fo::Queue.
+template <typename T> struct PQueue {
+    PQueue(fo::Allocator &a);
+
+    PQueue(const PQueue &other) = delete;
+    PQueue &operator=(const PQueue &other) = delete;
+
+    T &operator[](uint32_t i);
+    const T &operator[](uint32_t i) const;
+
+    PArray<T> _data;
+    uint32_t _size;
+    uint32_t _offset;
+};
+
+/// Hash table with POD keys and values. Counterpart of fo::PodHash. The hash and equal function types are
+/// default constructed on every use instead of being stored, since a stored functor could hold pointers.
+template <typename K,
+          typename V,
+          typename HashFnType = fo::ConvertToInt<K>,
+          typename EqualFnType = fo::CallEqualOperator<K>>
+struct PPodHash {
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "Only supports trivially copyable keys and values");
+
+    struct Entry {
+        K key;
+        V value;
+        uint32_t next;
+    };
+
+    PPodHash(fo::Allocator &a)
+        : _hashes(a)
+        , _entries(a)
+    {
+    }
+
+    PArray<uint32_t> _hashes; // Array mapping a hash to an entry index
+    PArray<Entry> _entries;   // Array of entries
+    float _load_factor = 0.7f;
+};
+
+} // namespace mmapext
@@ -0,0 +1,235 @@
+#include "lz4block.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+// The format requires the last 5 bytes to be literals and the last match to start at least 12 bytes
+// before the end.
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+static uint8_t *write_length(uint8_t *op, size_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Bytes needed by a sequence with the given literal and match lengths, at most.
+static size_t sequence_size(size_t literals, size_t match_length)
+{
+    return 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1;
+}
+
+int lz4block_compress_bound(int src_size)
+{
+    if (src_size < 0) {
+        return 0;
+    }
+    return src_size + src_size / 255 + 16;
+}
+
+int lz4block_compress(const void *src, int src_size, void *dst, int dst_capacity)
+{
+    const uint8_t *const base = (const uint8_t *)src;
+    const uint8_t *const end = base + src_size;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *const out = (uint8_t *)dst;
+    uint8_t *op = out;
+    uint8_t *const oend = out + dst_capacity;
+
+    if (src_size < 0 || dst_capacity < 0) {
+        return 0;
+    }
+
+    if (src_size > MATCH_FIND_LIMIT) {
+        // Positions of the last 4 byte sequence with each hash. Stale or colliding entries are caught by
+        // comparing the bytes.
+        uint32_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t *const find_limit = end - MATCH_FIND_LIMIT;
+        const uint8_t *const match_limit = end - LAST_LITERALS;
+
+        while (ip < find_limit) {
+            const uint32_t sequence = read32(ip);
+            const uint32_t h = hash4(sequence);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+                // Skip faster through data that doesn't compress.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+
+            const uint8_t *p = ip + MIN_MATCH;
+            const uint8_t *q = ref + MIN_MATCH;
+            while (p < match_limit && *p == *q) {
+                ++p;
+                ++q;
+            }
+
+            const size_t literals = (size_t)(ip - anchor);
+            const size_t match_length = (size_t)(p - ip) - MIN_MATCH;
+            if (sequence_size(literals, match_length) > (size_t)(oend - op)) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+            if (literals >= 15) {
+                op = write_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            const size_t offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            *token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+            if (match_length >= 15) {
+                op = write_length(op, match_length - 15);
+            }
+
+            ip = p;
+            anchor = p;
+            if (ip < find_limit) {
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    const size_t literals = (size_t)(end - anchor);
+    if (1 + literals / 255 + 1 + literals > (size_t)(oend - op)) {
+        return 0;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) {
+        op = write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return (int)(op - out);
+}
+
+// Reads the extension bytes of a length. Returns 0 if the input ends first.
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 1;
+}
+
+int lz4block_decompress(const void *src, int src_size, void *dst, int dst_capacity)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *const iend = ip + src_size;
+    uint8_t *const out = (uint8_t *)dst;
+    uint8_t *op = out;
+    uint8_t *const oend = out + dst_capacity;
+
+    if (src_size <= 0 || dst_capacity < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        if (ip >= iend) {
+            return -1;
+        }
+        const uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(&ip, iend, &literals)) {
+            return -1;
+        }
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) >= literals + 16 && (size_t)(oend - op) >= literals + 16) {
+            // Copying whole 16 byte blocks is faster than an exact memcpy of the short runs typical of
+            // literals. Overshooting is fine since the following bytes are written later.
+            for (size_t i = 0; i < literals; i += 16) {
+                memcpy(op + i, ip + i, 16);
+            }
+        } else {
+            memcpy(op, ip, literals);
+        }
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match.
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(&ip, iend, &match_length)) {
+            return -1;
+        }
+        match_length += MIN_MATCH;
+        if (match_length > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t *match = op - offset;
+        if (offset >= 16 && (size_t)(oend - op) >= match_length + 16) {
+            // Block copies may overlap the match with its output since each one only reads bytes that are
+            // already written, and may write past the match like the literal copy above.
+            for (size_t i = 0; i < match_length; i += 16) {
+                memcpy(op + i, match + i, 16);
+            }
+        } else if (offset >= 8 && (size_t)(oend - op) >= match_length + 8) {
+            for (size_t i = 0; i < match_length; i += 8) {
+                memcpy(op + i, match + i, 8);
+            }
+        } else {
+            for (size_t i = 0; i < match_length; ++i) {
+                op[i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+
+    return (int)(op - out);
+}
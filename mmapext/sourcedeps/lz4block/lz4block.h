@@ -0,0 +1,22 @@
+#pragma once
+
+// LZ4 block format compression, see README.md.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest compressed size of src_size bytes, for sizing the output buffer.
+int lz4block_compress_bound(int src_size);
+
+// Compresses src_size bytes of src to dst. Returns the compressed size, or 0 if it doesn't fit in
+// dst_capacity bytes.
+int lz4block_compress(const void *src, int src_size, void *dst, int dst_capacity);
+
+// Decompresses a block. Returns the decompressed size, or -1 if the block is malformed or decompresses to
+// more than dst_capacity bytes.
+int lz4block_decompress(const void *src, int src_size, void *dst, int dst_capacity);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,180 @@
+#include <mmapext/mmapext.h>
+
+#include "mmapext_internal.h"
+#include "records.h"
+#include "streaming.h"
+
+#include <algorithm>
+#include <atomic>
+#include <plog/Log.h>
+
+// Writes of at least this many bytes use non-temporal stores. About what fits in the L2 cache of one core,
+// beyond that a plain copy evicts more useful data than it saves in later reads of the written bytes.
+static std::atomic<uint64_t> g_streaming_threshold{ uint64_t(256) << 10 };
+
+void mmapext_set_streaming_threshold(uint64_t bytes) { g_streaming_threshold.store(bytes); }
+
+uint64_t mmapext_streaming_threshold() { return g_streaming_threshold.load(); }
+
+static bool _mmapext_valid_write(const MmapManager *man, uint64_t offset, uint64_t length)
+{
+    return offset <= mmapext_mapped_size(man) && length <= mmapext_mapped_size(man) - offset;
+}
+
+// Copies to the mapping with streaming stores if the copy is large enough. Returns whether it did, in which
+// case the caller has to fence before publishing the data.
+static bool _mmapext_copy_to_mapping(MmapManager *man, uint64_t offset, const void *src, uint64_t length)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(src);
+    mmapext_mark_dirty(man, offset, length);
+    if (length >= g_streaming_threshold.load(std::memory_order_relaxed)) {
+        stream_copy(man->address + offset, bytes, length);
+        return true;
+    }
+    memcpy(man->address + offset, bytes, length);
+    return false;
+}
+
+ErrorResult mmapext_write(struct MmapManager *man, uint64_t offset, const void *src, uint64_t length)
+{
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+    if (!_mmapext_valid_write(man, offset, length)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to write is not mapped",
+        };
+    }
+    auto err = mmapext_ensure_mapped(man, offset, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    if (_mmapext_copy_to_mapping(man, offset, src, length)) {
+        stream_fence();
+    }
+    return ErrorResult{};
+}
+
+// One of the pieces of an append, written back to back.
+struct AppendPart {
+    const void *data;
+    uint64_t length;
+};
+
+static ErrorResult _mmapext_append_parts(MmapManager *man,
+                                         uint64_t commit_offset,
+                                         const AppendPart *parts,
+                                         int num_parts,
+                                         uint64_t *new_commit_length)
+{
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+    if (commit_offset % sizeof(uint64_t) != 0 ||
+        !_mmapext_valid_write(man, commit_offset, sizeof(uint64_t))) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "commit length is not an aligned, mapped uint64_t",
+        };
+    }
+    auto err = mmapext_ensure_mapped(man, commit_offset, sizeof(uint64_t));
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    uint64_t length = 0;
+    for (int i = 0; i < num_parts; ++i) {
+        length += parts[i].length;
+    }
+
+    // Only the appending thread writes the commit length.
+    const uint64_t begin = __atomic_load_n((uint64_t *)(man->address + commit_offset), __ATOMIC_RELAXED);
+    const uint64_t end = begin + length;
+
+    if (end < begin || (begin < commit_offset + sizeof(uint64_t) && commit_offset < end)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "appended range overlaps the commit length",
+        };
+    }
+
+    if (end > mmapext_mapped_size(man)) {
+        // Doubles the reserved space when it runs out, so appends cost amortized O(1) remaps.
+        const uint64_t missing = end - mmapext_mapped_size(man);
+        const uint64_t needed_chunks = (missing + man->_chunk_size - 1) / man->_chunk_size;
+        auto opts = MmapManagerMapNextOptions{
+            .dont_grow_if_fully_mapped = false,
+            .extra_chunks_to_reserve_on_grow = std::max<uint64_t>(needed_chunks, man->num_chunks_reserved),
+            .chunks_to_map_next = needed_chunks,
+        };
+
+        auto res = mmapext_map_next_file_chunk(man, opts);
+        if (res.error.error_code != MMAPEXT_ERR_NONE) {
+            PLOGE.printf(
+                "failed to map %lu more chunks for append: %s", needed_chunks, res.error.error_message);
+            return res.error;
+        }
+    }
+    err = mmapext_ensure_mapped(man, begin, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    bool streamed = false;
+    uint64_t offset = begin;
+    for (int i = 0; i < num_parts; ++i) {
+        streamed |= _mmapext_copy_to_mapping(man, offset, parts[i].data, parts[i].length);
+        offset += parts[i].length;
+    }
+
+    if (streamed) {
+        // Streaming stores are weakly ordered and not covered by the release below. Without the fence a
+        // reader could see the new commit length before the data.
+        stream_fence();
+    }
+    __atomic_store_n((uint64_t *)(man->address + commit_offset), end, __ATOMIC_RELEASE);
+    mmapext_mark_dirty(man, commit_offset, sizeof(uint64_t));
+
+    if (new_commit_length != nullptr) {
+        *new_commit_length = end;
+    }
+    return ErrorResult{};
+}
+
+ErrorResult mmapext_append(struct MmapManager *man,
+                           uint64_t commit_offset,
+                           const void *src,
+                           uint64_t length,
+                           uint64_t *new_commit_length)
+{
+    const AppendPart part{ src, length };
+    return _mmapext_append_parts(man, commit_offset, &part, 1, new_commit_length);
+}
+
+ErrorResult mmapext_append_record(struct MmapManager *man,
+                                  uint64_t commit_offset,
+                                  int format,
+                                  const void *src,
+                                  uint64_t length,
+                                  uint64_t *new_commit_length)
+{
+    uint8_t prefix[max_record_prefix_size];
+    const int prefix_size = encode_record_length(format, length, prefix);
+    if (prefix_size == 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "unknown record format or record too long for it",
+        };
+    }
+
+    // The suffix of a framed record repeats its prefix.
+    const int suffix_size = format == MMAPEXT_RECORD_U32_FRAMED ? prefix_size : 0;
+    const AppendPart parts[3] = {
+        { prefix, uint64_t(prefix_size) },
+        { src, length },
+        { prefix, uint64_t(suffix_size) },
+    };
+    return _mmapext_append_parts(man, commit_offset, parts, 3, new_commit_length);
+}
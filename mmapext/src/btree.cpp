@@ -0,0 +1,597 @@
+#include <mmapext/btree.h>
+
+#include "mmapext_internal.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#    include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <plog/Log.h>
+#include <string.h>
+#include <vector>
+
+namespace mmapext {
+
+namespace {
+
+constexpr uint64_t tree_magic = 0x4545525454584d4dull; // "MMXTTREE"
+constexpr uint32_t tree_version = 1;
+
+// With 500 keys per node this is far more levels than any file can hold.
+constexpr uint32_t max_height = 16;
+
+} // namespace
+
+// Lives in the first page of the tree file.
+struct BTreeHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+
+    uint32_t height;
+    uint32_t _pad;
+
+    uint64_t root;
+    uint64_t num_entries;
+    uint64_t num_nodes;
+
+    // End of the allocated part of the file.
+    uint64_t top;
+};
+
+// One page. The keys start at the second cache line so SIMD loads are aligned.
+struct alignas(64) BTreeNode {
+    uint32_t is_leaf;
+    uint32_t count;
+
+    // Offset of the next leaf, 0 for the last one. Unused in inner nodes.
+    uint64_t next;
+
+    uint8_t _pad[48];
+
+    uint64_t keys[BTree::NODE_CAPACITY];
+    union {
+        uint64_t values[BTree::NODE_CAPACITY];
+
+        // children[i] holds the keys below keys[i], children[i + 1] the keys from keys[i] on.
+        uint64_t children[BTree::NODE_CAPACITY + 1];
+    };
+};
+
+static_assert(sizeof(BTreeNode) <= MMAPEXT_PAGE_SIZE, "");
+static_assert(sizeof(BTreeHeader) <= MMAPEXT_PAGE_SIZE, "");
+
+// Returns the number of keys in keys[0, n) less than k.
+static inline uint32_t count_less(const uint64_t *keys, uint32_t n, uint64_t k)
+{
+    uint32_t count = 0;
+    uint32_t i = 0;
+
+#if defined(__AVX512F__)
+    const __m512i kv = _mm512_set1_epi64(k);
+    for (; i + 8 <= n; i += 8) {
+        count += __builtin_popcount(_mm512_cmplt_epu64_mask(_mm512_loadu_si512(keys + i), kv));
+    }
+    if (i < n) {
+        const __mmask8 m = __mmask8((1u << (n - i)) - 1);
+        const __m512i v = _mm512_maskz_loadu_epi64(m, keys + i);
+        count += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(m, v, kv));
+    }
+    return count;
+#elif defined(__AVX2__)
+    // AVX2 only has signed 64-bit compares. Flipping the sign bit turns them into unsigned ones.
+    const __m256i bias = _mm256_set1_epi64x(int64_t(1) << 63);
+    const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(int64_t(k)), bias);
+    for (; i + 4 <= n; i += 4) {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), bias);
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, v))));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        count += keys[i] < k;
+    }
+    return count;
+}
+
+// Index of the first key >= k. Binary search narrows the range to a few cache lines which are then counted
+// with SIMD compares, avoiding the hard to predict branches at the end of the search.
+static inline uint32_t lower_bound_in(const uint64_t *keys, uint32_t n, uint64_t k)
+{
+    uint32_t lo = 0;
+    while (n > 32) {
+        const uint32_t half = n / 2;
+        if (keys[lo + half] < k) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo + count_less(keys + lo, n, k);
+}
+
+// Index of the child of an inner node that covers k.
+static inline uint32_t child_index(const BTreeNode *node, uint64_t k)
+{
+    if (k == UINT64_MAX) {
+        return node->count;
+    }
+    return lower_bound_in(node->keys, node->count, k + 1);
+}
+
+static inline void prefetch_leaf(const BTreeNode *node)
+{
+    __builtin_prefetch(node);
+    __builtin_prefetch(node->keys);
+    __builtin_prefetch(node->keys + 8);
+    __builtin_prefetch(node->values);
+    __builtin_prefetch(node->values + 8);
+}
+
+BTreeHeader *BTree::header() const { return reinterpret_cast<BTreeHeader *>(_man.address); }
+
+BTreeNode *BTree::node_at(uint64_t offset) const
+{
+    return reinterpret_cast<BTreeNode *>(_man.address + offset);
+}
+
+uint64_t BTree::allocate_node(bool is_leaf)
+{
+    const uint64_t offset = header()->top;
+    const uint64_t end = offset + MMAPEXT_PAGE_SIZE;
+    if (grow_structure_file(&_man, end, "b+tree").error_code != MMAPEXT_ERR_NONE) {
+        return 0;
+    }
+
+    BTreeHeader *h = header();
+    h->top = end;
+    ++h->num_nodes;
+
+    BTreeNode *node = node_at(offset);
+    node->is_leaf = is_leaf;
+    node->count = 0;
+    node->next = 0;
+    return offset;
+}
+
+BTreeOpenResult BTree::open(const BTreeOptions &opts)
+{
+    BTreeOpenResult res{};
+
+    MmapManager man = open_structure_file(opts.backing_file, opts.initial_reserved_size);
+    if (man.error_code != MMAPEXT_ERR_NONE) {
+        res.error = ErrorResult{ .error_code = man.error_code, .error_message = man.error_message };
+        return res;
+    }
+
+    auto tree = new BTree();
+    tree->_man = man;
+
+    BTreeHeader *h = tree->header();
+
+    if (h->magic == 0) {
+        h->magic = tree_magic;
+        h->version = tree_version;
+        h->page_size = MMAPEXT_PAGE_SIZE;
+        h->height = 1;
+        h->top = MMAPEXT_PAGE_SIZE;
+
+        const uint64_t root = tree->allocate_node(true);
+        if (root == 0) {
+            close(tree);
+            res.error = ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "failed to allocate root of b+tree",
+            };
+            return res;
+        }
+        tree->header()->root = root;
+        res.created = true;
+    } else if (h->magic != tree_magic || h->version != tree_version || h->page_size != MMAPEXT_PAGE_SIZE) {
+        close(tree);
+        res.error = ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "file is not a b+tree or was created by an incompatible version",
+        };
+        return res;
+    }
+
+    PLOGI.printf(
+        "opened b+tree %s with %lu entries, height %u", opts.backing_file, tree->size(), tree->height());
+
+    res.tree = tree;
+    return res;
+}
+
+ErrorResult BTree::close(BTree *tree)
+{
+    auto err = mmapext_delete_manager(&tree->_man);
+    delete tree;
+    return err;
+}
+
+uint64_t BTree::find_leaf(uint64_t key, uint64_t *path, uint32_t *path_length) const
+{
+    const BTreeHeader *h = header();
+    uint64_t offset = h->root;
+
+    for (uint32_t level = 0; level + 1 < h->height; ++level) {
+        if (path) {
+            path[level] = offset;
+        }
+        const BTreeNode *node = node_at(offset);
+        offset = node->children[child_index(node, key)];
+    }
+
+    if (path_length) {
+        *path_length = h->height - 1;
+    }
+    return offset;
+}
+
+bool BTree::get(uint64_t key, uint64_t *value) const
+{
+    const BTreeNode *leaf = node_at(find_leaf(key, nullptr, nullptr));
+    const uint32_t i = lower_bound_in(leaf->keys, leaf->count, key);
+    if (i < leaf->count && leaf->keys[i] == key) {
+        *value = leaf->values[i];
+        return true;
+    }
+    return false;
+}
+
+ErrorResult BTree::put(uint64_t key, uint64_t value)
+{
+    uint64_t path[max_height];
+    uint32_t path_length = 0;
+    const uint64_t leaf_offset = find_leaf(key, path, &path_length);
+
+    BTreeNode *leaf = node_at(leaf_offset);
+    const uint32_t pos = lower_bound_in(leaf->keys, leaf->count, key);
+
+    if (pos < leaf->count && leaf->keys[pos] == key) {
+        leaf->values[pos] = value;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    ++header()->num_entries;
+
+    if (leaf->count < NODE_CAPACITY) {
+        memmove(leaf->keys + pos + 1, leaf->keys + pos, (leaf->count - pos) * sizeof(uint64_t));
+        memmove(leaf->values + pos + 1, leaf->values + pos, (leaf->count - pos) * sizeof(uint64_t));
+        leaf->keys[pos] = key;
+        leaf->values[pos] = value;
+        ++leaf->count;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // The split goes up through every full inner node on the path, and past the root if they all are. Map
+    // the nodes it takes before changing anything, so running out of space leaves the tree as it was.
+    uint64_t new_nodes = 1;
+    int level = int(path_length) - 1;
+    for (; level >= 0 && node_at(path[level])->count == NODE_CAPACITY; --level) {
+        ++new_nodes;
+    }
+    if (level < 0) {
+        if (header()->height == max_height) {
+            --header()->num_entries;
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "b+tree reached the maximum height",
+            };
+        }
+        ++new_nodes;
+    }
+    if (grow_structure_file(&_man, header()->top + new_nodes * MMAPEXT_PAGE_SIZE, "b+tree").error_code !=
+        MMAPEXT_ERR_NONE) {
+        --header()->num_entries;
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+            .error_message = "failed to allocate b+tree nodes for a split",
+        };
+    }
+
+    const uint64_t right_offset = allocate_node(true);
+    if (right_offset == 0) {
+        --header()->num_entries;
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+            .error_message = "failed to allocate b+tree leaf",
+        };
+    }
+
+    // Allocation can move the mapping.
+    leaf = node_at(leaf_offset);
+    BTreeNode *right = node_at(right_offset);
+
+    right->next = leaf->next;
+    leaf->next = right_offset;
+
+    if (pos == NODE_CAPACITY && right->next == 0) {
+        // Appending past the last key. Leave the full leaf full, so that ascending inserts fill every leaf.
+        right->keys[0] = key;
+        right->values[0] = value;
+        right->count = 1;
+    } else {
+        const uint32_t mid = NODE_CAPACITY / 2;
+        right->count = NODE_CAPACITY - mid;
+        memcpy(right->keys, leaf->keys + mid, right->count * sizeof(uint64_t));
+        memcpy(right->values, leaf->values + mid, right->count * sizeof(uint64_t));
+        leaf->count = mid;
+
+        BTreeNode *target = pos <= mid ? leaf : right;
+        const uint32_t target_pos = pos <= mid ? pos : pos - mid;
+        memmove(target->keys + target_pos + 1,
+                target->keys + target_pos,
+                (target->count - target_pos) * sizeof(uint64_t));
+        memmove(target->values + target_pos + 1,
+                target->values + target_pos,
+                (target->count - target_pos) * sizeof(uint64_t));
+        target->keys[target_pos] = key;
+        target->values[target_pos] = value;
+        ++target->count;
+    }
+
+    return insert_into_parent(path, int(path_length) - 1, right->keys[0], right_offset);
+}
+
+ErrorResult BTree::insert_into_parent(const uint64_t *path, int level, uint64_t separator, uint64_t right)
+{
+    if (level < 0) {
+        if (header()->height == max_height) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "b+tree reached the maximum height",
+            };
+        }
+
+        const uint64_t old_root = header()->root;
+        const uint64_t root_offset = allocate_node(false);
+        if (root_offset == 0) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "failed to allocate b+tree root",
+            };
+        }
+
+        BTreeNode *root = node_at(root_offset);
+        root->keys[0] = separator;
+        root->children[0] = old_root;
+        root->children[1] = right;
+        root->count = 1;
+
+        BTreeHeader *h = header();
+        h->root = root_offset;
+        ++h->height;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    const uint64_t node_offset = path[level];
+    BTreeNode *node = node_at(node_offset);
+    const uint32_t pos = lower_bound_in(node->keys, node->count, separator);
+
+    if (node->count < NODE_CAPACITY) {
+        memmove(node->keys + pos + 1, node->keys + pos, (node->count - pos) * sizeof(uint64_t));
+        memmove(node->children + pos + 2, node->children + pos + 1, (node->count - pos) * sizeof(uint64_t));
+        node->keys[pos] = separator;
+        node->children[pos + 1] = right;
+        ++node->count;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    const uint64_t sibling_offset = allocate_node(false);
+    if (sibling_offset == 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+            .error_message = "failed to allocate b+tree inner node",
+        };
+    }
+
+    node = node_at(node_offset);
+    BTreeNode *sibling = node_at(sibling_offset);
+
+    // Lay out the overfull node in scratch arrays, then split it around the middle key which moves up.
+    uint64_t keys[NODE_CAPACITY + 1];
+    uint64_t children[NODE_CAPACITY + 2];
+
+    memcpy(keys, node->keys, pos * sizeof(uint64_t));
+    keys[pos] = separator;
+    memcpy(keys + pos + 1, node->keys + pos, (NODE_CAPACITY - pos) * sizeof(uint64_t));
+
+    memcpy(children, node->children, (pos + 1) * sizeof(uint64_t));
+    children[pos + 1] = right;
+    memcpy(children + pos + 2, node->children + pos + 1, (NODE_CAPACITY - pos) * sizeof(uint64_t));
+
+    const uint32_t mid = (NODE_CAPACITY + 1) / 2;
+
+    node->count = mid;
+    memcpy(node->keys, keys, mid * sizeof(uint64_t));
+    memcpy(node->children, children, (mid + 1) * sizeof(uint64_t));
+
+    sibling->count = NODE_CAPACITY - mid;
+    memcpy(sibling->keys, keys + mid + 1, sibling->count * sizeof(uint64_t));
+    memcpy(sibling->children, children + mid + 1, (sibling->count + 1) * sizeof(uint64_t));
+
+    return insert_into_parent(path, level - 1, keys[mid], sibling_offset);
+}
+
+bool BTree::remove(uint64_t key)
+{
+    BTreeNode *leaf = node_at(find_leaf(key, nullptr, nullptr));
+    const uint32_t pos = lower_bound_in(leaf->keys, leaf->count, key);
+
+    if (pos == leaf->count || leaf->keys[pos] != key) {
+        return false;
+    }
+
+    --leaf->count;
+    memmove(leaf->keys + pos, leaf->keys + pos + 1, (leaf->count - pos) * sizeof(uint64_t));
+    memmove(leaf->values + pos, leaf->values + pos + 1, (leaf->count - pos) * sizeof(uint64_t));
+    --header()->num_entries;
+    return true;
+}
+
+ErrorResult BTree::bulk_load(const uint64_t *keys, const uint64_t *values, uint64_t count, float fill_factor)
+{
+    if (size() != 0 || height() != 1) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "bulk_load needs an empty b+tree",
+        };
+    }
+
+    for (uint64_t i = 1; i < count; ++i) {
+        if (keys[i - 1] >= keys[i]) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+                .error_message = "bulk_load needs strictly increasing keys",
+            };
+        }
+    }
+
+    if (count == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    const auto oom = ErrorResult{
+        .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+        .error_message = "failed to allocate b+tree node during bulk load",
+    };
+
+    fill_factor = std::min(std::max(fill_factor, 0.0f), 1.0f);
+
+    // First key and offset of each node of the level being built.
+    std::vector<uint64_t> first_keys;
+    std::vector<uint64_t> offsets;
+
+    // Spread entries evenly instead of leaving a nearly empty node at the end.
+    const uint64_t per_leaf = std::max<uint64_t>(1, uint64_t(NODE_CAPACITY * fill_factor));
+    const uint64_t num_leaves = (count + per_leaf - 1) / per_leaf;
+
+    uint64_t prev_leaf = 0;
+    uint64_t consumed = 0;
+
+    for (uint64_t l = 0; l < num_leaves; ++l) {
+        const uint64_t leaf_offset = l == 0 ? header()->root : allocate_node(true);
+        if (leaf_offset == 0) {
+            return oom;
+        }
+
+        const uint64_t n = count * (l + 1) / num_leaves - consumed;
+        BTreeNode *leaf = node_at(leaf_offset);
+        memcpy(leaf->keys, keys + consumed, n * sizeof(uint64_t));
+        memcpy(leaf->values, values + consumed, n * sizeof(uint64_t));
+        leaf->count = uint32_t(n);
+
+        if (prev_leaf != 0) {
+            node_at(prev_leaf)->next = leaf_offset;
+        }
+        prev_leaf = leaf_offset;
+
+        first_keys.push_back(keys[consumed]);
+        offsets.push_back(leaf_offset);
+        consumed += n;
+    }
+
+    header()->num_entries = count;
+
+    const uint64_t per_inner = std::max<uint64_t>(2, uint64_t((NODE_CAPACITY + 1) * fill_factor));
+
+    while (offsets.size() > 1) {
+        if (height() == max_height) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "b+tree reached the maximum height",
+            };
+        }
+
+        const uint64_t num_children = offsets.size();
+        const uint64_t num_nodes = (num_children + per_inner - 1) / per_inner;
+
+        std::vector<uint64_t> parent_first_keys;
+        std::vector<uint64_t> parent_offsets;
+        consumed = 0;
+
+        for (uint64_t p = 0; p < num_nodes; ++p) {
+            const uint64_t node_offset = allocate_node(false);
+            if (node_offset == 0) {
+                return oom;
+            }
+
+            const uint64_t n = num_children * (p + 1) / num_nodes - consumed;
+            BTreeNode *node = node_at(node_offset);
+            memcpy(node->children, offsets.data() + consumed, n * sizeof(uint64_t));
+            memcpy(node->keys, first_keys.data() + consumed + 1, (n - 1) * sizeof(uint64_t));
+            node->count = uint32_t(n - 1);
+
+            parent_first_keys.push_back(first_keys[consumed]);
+            parent_offsets.push_back(node_offset);
+            consumed += n;
+        }
+
+        first_keys.swap(parent_first_keys);
+        offsets.swap(parent_offsets);
+
+        BTreeHeader *h = header();
+        h->root = offsets[0];
+        ++h->height;
+    }
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+BTreeIterator BTree::lower_bound(uint64_t key) const
+{
+    const uint64_t leaf_offset = find_leaf(key, nullptr, nullptr);
+    const BTreeNode *leaf = node_at(leaf_offset);
+
+    BTreeIterator it{ this, leaf_offset, lower_bound_in(leaf->keys, leaf->count, key) };
+    if (leaf->next != 0) {
+        prefetch_leaf(node_at(leaf->next));
+    }
+
+    if (it.index == leaf->count) {
+        // Key is past the end of this leaf. Step to the first entry of the next non-empty one.
+        it.index = leaf->count - 1;
+        it.next();
+    }
+    return it;
+}
+
+BTreeIterator BTree::begin() const { return lower_bound(0); }
+
+uint64_t BTree::size() const { return header()->num_entries; }
+
+uint32_t BTree::height() const { return header()->height; }
+
+uint64_t BTree::num_nodes() const { return header()->num_nodes; }
+
+ErrorResult BTree::sync() { return sync_structure_file(&_man, "msync failed on b+tree"); }
+
+uint64_t BTreeIterator::key() const { return tree->node_at(leaf)->keys[index]; }
+
+uint64_t BTreeIterator::value() const { return tree->node_at(leaf)->values[index]; }
+
+void BTreeIterator::next()
+{
+    const BTreeNode *node = tree->node_at(leaf);
+    ++index;
+
+    // Removal can leave empty leaves in the chain.
+    while (index >= node->count) {
+        leaf = node->next;
+        index = 0;
+        if (leaf == 0) {
+            return;
+        }
+
+        node = tree->node_at(leaf);
+        if (node->next != 0) {
+            prefetch_leaf(tree->node_at(node->next));
+        }
+    }
+}
+
+} // namespace mmapext
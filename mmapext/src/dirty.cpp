@@ -0,0 +1,574 @@
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <mmapext/mmapext.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <plog/Log.h>
+
+// Bit 55 of a /proc/self/pagemap entry.
+constexpr uint64_t pagemap_soft_dirty = uint64_t(1) << 55;
+
+// clear_refs resets the soft-dirty bits of the whole process, so only one manager can track with them.
+static std::atomic<const MmapManager *> g_soft_dirty_owner{ nullptr };
+
+struct DirtyTracker {
+    std::atomic<int> mode{ MMAPEXT_DIRTY_NONE };
+    uint64_t page_size = 0;
+
+    // Guards bits, base and mapped_size. The uffd handler holds it while recording a fault and removing the
+    // protection, and checkpoints hold it while protecting the pages again, so a write is either in the bits
+    // taken by a checkpoint or faults again after it.
+    std::mutex mutex;
+
+    // One bit per system page of the mapping.
+    std::vector<uint64_t> bits;
+
+    // Address and mapped size of the mapping, for the handler to turn fault addresses into offsets.
+    uint8_t *base = nullptr;
+    uint64_t mapped_size = 0;
+
+    int uffd = -1;
+    int stop_fd = -1;
+    std::thread handler;
+};
+
+static ErrorResult _mmapext_dirty_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+// Sets the bits of pages [first, end). Called with the mutex held.
+static void _mmapext_set_dirty_pages(DirtyTracker *t, uint64_t first, uint64_t end)
+{
+    if (first >= end) {
+        return;
+    }
+    if (t->bits.size() * 64 < end) {
+        t->bits.resize((end + 63) / 64, 0);
+    }
+
+    while (first < end && first % 64 != 0) {
+        t->bits[first / 64] |= uint64_t(1) << (first % 64);
+        ++first;
+    }
+    for (; first + 64 <= end; first += 64) {
+        t->bits[first / 64] = ~uint64_t(0);
+    }
+    for (; first < end; ++first) {
+        t->bits[first / 64] |= uint64_t(1) << (first % 64);
+    }
+}
+
+// Calls f(first, end) for every run of set bits, in pages.
+template <typename F> static void _mmapext_for_each_dirty_run(const std::vector<uint64_t> &bits, F &&f)
+{
+    const uint64_t num_pages = bits.size() * 64;
+    uint64_t page = 0;
+    while (page < num_pages) {
+        const uint64_t set = bits[page / 64] >> (page % 64);
+        if (set == 0) {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        page += __builtin_ctzll(set);
+
+        uint64_t end = page;
+        while (end < num_pages) {
+            const uint64_t clear = ~bits[end / 64] >> (end % 64);
+            if (clear != 0) {
+                end += __builtin_ctzll(clear);
+                break;
+            }
+            end = (end / 64 + 1) * 64;
+        }
+        end = std::min(end, num_pages);
+
+        f(page, end);
+        page = end;
+    }
+}
+
+static long _mmapext_uffd_writeprotect(int uffd, uint8_t *address, uint64_t length, bool protect)
+{
+    struct uffdio_writeprotect wp {};
+    wp.range.start = uint64_t(address);
+    wp.range.len = length;
+    wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+static void _mmapext_uffd_handler(DirtyTracker *t)
+{
+    std::array<uffd_msg, 64> msgs;
+
+    for (;;) {
+        pollfd fds[2] = { { t->uffd, POLLIN, 0 }, { t->stop_fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOGE.printf("poll on userfaultfd failed, stopping dirty tracking handler");
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+
+        const ssize_t n = read(t->uffd, msgs.data(), sizeof(msgs));
+        if (n <= 0) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(t->mutex);
+        for (ssize_t i = 0; i < n / ssize_t(sizeof(uffd_msg)); ++i) {
+            const uffd_msg &msg = msgs[i];
+            const bool wp_fault = (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) != 0;
+            if (msg.event != UFFD_EVENT_PAGEFAULT || !wp_fault) {
+                continue;
+            }
+
+            // Faults outside the mapping come from a reservation it moved away from, which only readers use
+            // until it is reclaimed. They are woken without being recorded.
+            uint8_t *page = reinterpret_cast<uint8_t *>(msg.arg.pagefault.address & ~(t->page_size - 1));
+            if (page >= t->base && page < t->base + t->mapped_size) {
+                const uint64_t index = uint64_t(page - t->base) / t->page_size;
+                _mmapext_set_dirty_pages(t, index, index + 1);
+            }
+            // Also wakes the faulting thread.
+            _mmapext_uffd_writeprotect(t->uffd, page, t->page_size, false);
+        }
+    }
+}
+
+static void _mmapext_stop_uffd(DirtyTracker *t)
+{
+    if (t->handler.joinable()) {
+        const uint64_t one = 1;
+        if (write(t->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            PLOGE.printf("failed to signal the dirty tracking handler to stop");
+        }
+        t->handler.join();
+    }
+    // Closing the userfaultfd unregisters the ranges and drops their write protection.
+    if (t->uffd != -1) {
+        close(t->uffd);
+        t->uffd = -1;
+    }
+    if (t->stop_fd != -1) {
+        close(t->stop_fd);
+        t->stop_fd = -1;
+    }
+}
+
+// Registers the mapped range [offset, offset + length) for write protection faults and protects it.
+static ErrorResult
+_mmapext_uffd_protect_range(MmapManager *man, DirtyTracker *t, uint64_t offset, uint64_t length)
+{
+    if (length == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    struct uffdio_register reg {};
+    reg.range.start = uint64_t(man->address + offset);
+    reg.range.len = length;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(t->uffd, UFFDIO_REGISTER, &reg) != 0) {
+        return _mmapext_dirty_error(MMAPEXT_ERR_INVALID_ARGUMENT,
+                                    "failed to register mapping with userfaultfd, is the file on tmpfs?");
+    }
+    if (_mmapext_uffd_writeprotect(t->uffd, man->address + offset, length, true) != 0) {
+        return _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "failed to write protect mapping with userfaultfd");
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Write protects the dirty range [offset, end) again. Chunks that an on-demand manager unmapped are reserved
+// address space, not registered with the userfaultfd, and protecting across them fails. They are skipped,
+// mapping them again protects them.
+static ErrorResult _mmapext_uffd_reprotect(MmapManager *man, DirtyTracker *t, uint64_t offset, uint64_t end)
+{
+    const MmapManagerInternal *internal = man->_internal;
+    const bool on_demand = internal->on_demand.load();
+    const auto chunk_is_mapped = [&](uint64_t chunk) {
+        const uint64_t word = __atomic_load_n(&internal->mapped_chunks.words[chunk / 64], __ATOMIC_ACQUIRE);
+        return ((word >> (chunk % 64)) & 1) != 0;
+    };
+
+    while (offset < end) {
+        uint64_t stop = end;
+        if (on_demand) {
+            uint64_t chunk = offset / man->_chunk_size;
+            const bool mapped = chunk_is_mapped(chunk);
+            while ((chunk + 1) * man->_chunk_size < end && chunk_is_mapped(chunk + 1) == mapped) {
+                ++chunk;
+            }
+            stop = std::min(end, (chunk + 1) * man->_chunk_size);
+            if (!mapped) {
+                offset = stop;
+                continue;
+            }
+        }
+
+        if (_mmapext_uffd_writeprotect(t->uffd, man->address + offset, stop - offset, true) != 0) {
+            return _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "failed to write protect dirty pages again");
+        }
+        offset = stop;
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult _mmapext_start_uffd(MmapManager *man, DirtyTracker *t)
+{
+    t->uffd = int(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+    if (t->uffd == -1) {
+        return _mmapext_dirty_error(MMAPEXT_ERR_INVALID_ARGUMENT, "userfaultfd is not available");
+    }
+
+    struct uffdio_api api {};
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+    if (ioctl(t->uffd, UFFDIO_API, &api) != 0) {
+        auto err = _mmapext_dirty_error(MMAPEXT_ERR_INVALID_ARGUMENT,
+                                        "userfaultfd doesn't support write protection of shared memory");
+        _mmapext_stop_uffd(t);
+        return err;
+    }
+
+    t->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (t->stop_fd == -1) {
+        auto err = _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "failed to create eventfd");
+        _mmapext_stop_uffd(t);
+        return err;
+    }
+
+    t->base = man->address;
+    t->mapped_size = mmapext_mapped_size(man);
+    auto err = _mmapext_uffd_protect_range(man, t, 0, t->mapped_size);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        _mmapext_stop_uffd(t);
+        return err;
+    }
+
+    t->handler = std::thread(_mmapext_uffd_handler, t);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static bool _mmapext_clear_soft_dirty()
+{
+    const int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = write(fd, "4", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+// Kernels without CONFIG_MEM_SOFT_DIRTY accept clear_refs but never set the bit, which would silently make
+// every checkpoint empty. Writes to a page after clearing and checks that it turned soft-dirty.
+static bool _mmapext_soft_dirty_works(uint64_t page_size)
+{
+    auto page = static_cast<volatile uint8_t *>(
+        mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (page == MAP_FAILED) {
+        return false;
+    }
+    page[0] = 1;
+
+    uint64_t entry = 0;
+    const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && _mmapext_clear_soft_dirty()) {
+        page[0] = 2;
+        if (pread(fd, &entry, sizeof(entry), uint64_t(page) / page_size * sizeof(entry)) != sizeof(entry)) {
+            entry = 0;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    munmap((void *)page, page_size);
+    return (entry & pagemap_soft_dirty) != 0;
+}
+
+// Adds the soft-dirty pages of the mapping to the bits and clears the soft-dirty bits. Called with the
+// mutex held. A page first written between reading its entry and the clearing loses its bit without being
+// reported. Clearing first would lose every page written since the last collection instead, so the window
+// stays, and checkpoints cover it with an fdatasync, which writes back the page with the rest of the file.
+static ErrorResult _mmapext_collect_soft_dirty(MmapManager *man, DirtyTracker *t)
+{
+    const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return _mmapext_dirty_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open /proc/self/pagemap");
+    }
+
+    const uint64_t first_page = uint64_t(man->address) / t->page_size;
+    const uint64_t num_pages = mmapext_mapped_size(man) / t->page_size;
+    constexpr uint64_t batch_pages = 4096;
+    std::array<uint64_t, batch_pages> entries;
+
+    for (uint64_t page = 0; page < num_pages; page += batch_pages) {
+        const uint64_t n = std::min(batch_pages, num_pages - page);
+        if (pread(fd, entries.data(), n * sizeof(uint64_t), (first_page + page) * sizeof(uint64_t)) !=
+            ssize_t(n * sizeof(uint64_t))) {
+            close(fd);
+            return _mmapext_dirty_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read /proc/self/pagemap");
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            if ((entries[i] & pagemap_soft_dirty) != 0) {
+                _mmapext_set_dirty_pages(t, page + i, page + i + 1);
+            }
+        }
+    }
+    close(fd);
+
+    if (!_mmapext_clear_soft_dirty()) {
+        return _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "failed to clear soft-dirty bits");
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static void _mmapext_stop_tracking(DirtyTracker *t)
+{
+    const int mode = t->mode.exchange(MMAPEXT_DIRTY_NONE);
+    if (mode == MMAPEXT_DIRTY_UFFD_WP) {
+        _mmapext_stop_uffd(t);
+    } else if (mode == MMAPEXT_DIRTY_SOFT_DIRTY) {
+        g_soft_dirty_owner.store(nullptr);
+    }
+}
+
+void dirty_tracker_delete(DirtyTracker *t)
+{
+    if (t == nullptr) {
+        return;
+    }
+    _mmapext_stop_tracking(t);
+    delete t;
+}
+
+ErrorResult mmapext_track_dirty(struct MmapManager *man, int mode)
+{
+    if (man->_internal == nullptr || mode < MMAPEXT_DIRTY_NONE || mode > MMAPEXT_DIRTY_UFFD_WP) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "manager is not alive or unknown dirty tracking mode",
+        };
+    }
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+
+    DirtyTracker *t = man->_internal->dirty;
+    if (t == nullptr) {
+        t = new DirtyTracker();
+        t->page_size = sysconf(_SC_PAGESIZE);
+        man->_internal->dirty = t;
+    }
+    _mmapext_stop_tracking(t);
+
+    if (mode == MMAPEXT_DIRTY_SOFT_DIRTY) {
+        const MmapManager *expected = nullptr;
+        if (!g_soft_dirty_owner.compare_exchange_strong(expected, man)) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+                .error_message = "another manager already tracks dirty pages with soft-dirty bits",
+            };
+        }
+        if (!_mmapext_soft_dirty_works(t->page_size)) {
+            g_soft_dirty_owner.store(nullptr);
+            PLOGE.printf("soft-dirty bits are not supported by the kernel");
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+                .error_message = "soft-dirty bits are not supported by the kernel",
+            };
+        }
+    } else if (mode == MMAPEXT_DIRTY_UFFD_WP) {
+        auto err = _mmapext_start_uffd(man, t);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+    }
+
+    // Whatever was written before is unknown.
+    {
+        std::lock_guard<std::mutex> lock(t->mutex);
+        t->bits.clear();
+        _mmapext_set_dirty_pages(t, 0, mmapext_mapped_size(man) / t->page_size);
+    }
+
+    t->mode.store(mode);
+    PLOGI.printf("tracking dirty pages of %s with mode %d", man->filepath, mode);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void mmapext_mark_dirty(struct MmapManager *man, uint64_t offset, uint64_t length)
+{
+    DirtyTracker *t = man->_internal != nullptr ? man->_internal->dirty : nullptr;
+    if (t == nullptr || length == 0 || t->mode.load(std::memory_order_relaxed) != MMAPEXT_DIRTY_EXPLICIT) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(t->mutex);
+    _mmapext_set_dirty_pages(t, offset / t->page_size, (offset + length + t->page_size - 1) / t->page_size);
+}
+
+bool dirty_tracker_survives_unmap(const MmapManager *man)
+{
+    DirtyTracker *t = man->_internal != nullptr ? man->_internal->dirty : nullptr;
+    const int mode = t != nullptr ? t->mode.load() : MMAPEXT_DIRTY_NONE;
+    return mode == MMAPEXT_DIRTY_EXPLICIT || mode == MMAPEXT_DIRTY_UFFD_WP;
+}
+
+ErrorResult dirty_tracker_on_map(MmapManager *man, uint64_t offset, uint64_t length)
+{
+    DirtyTracker *t = man->_internal != nullptr ? man->_internal->dirty : nullptr;
+    if (t == nullptr || t->mode.load() != MMAPEXT_DIRTY_UFFD_WP) {
+        // New mappings are all soft-dirty until the next clear, and explicit tracking only needs offsets.
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    std::lock_guard<std::mutex> lock(t->mutex);
+    t->base = man->address;
+    t->mapped_size = mmapext_mapped_size(man);
+    return _mmapext_uffd_protect_range(man, t, offset, length);
+}
+
+ErrorResult dirty_tracker_take(MmapManager *man, DirtyPages *out)
+{
+    DirtyTracker *t = man->_internal != nullptr ? man->_internal->dirty : nullptr;
+    const int mode = t != nullptr ? t->mode.load() : MMAPEXT_DIRTY_NONE;
+    out->tracked = mode != MMAPEXT_DIRTY_NONE;
+    out->sync_file = false;
+    out->bits.clear();
+    out->runs.clear();
+    if (!out->tracked) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    const uint64_t mapped_pages = mmapext_mapped_size(man) / t->page_size;
+    {
+        std::lock_guard<std::mutex> lock(t->mutex);
+
+        if (mode == MMAPEXT_DIRTY_SOFT_DIRTY) {
+            auto err = _mmapext_collect_soft_dirty(man, t);
+            if (err.error_code != MMAPEXT_ERR_NONE) {
+                return err;
+            }
+            out->sync_file = true;
+        } else if (mode == MMAPEXT_DIRTY_UFFD_WP) {
+            // Protect before taking the bits, so later writes fault and land in the next checkpoint. If that
+            // fails the bits stay for the next checkpoint.
+            ErrorResult err{ .error_code = MMAPEXT_ERR_NONE };
+            _mmapext_for_each_dirty_run(t->bits, [&](uint64_t first, uint64_t end) {
+                end = std::min(end, mapped_pages);
+                if (first < end && err.error_code == MMAPEXT_ERR_NONE) {
+                    err = _mmapext_uffd_reprotect(man, t, first * t->page_size, end * t->page_size);
+                }
+            });
+            if (err.error_code != MMAPEXT_ERR_NONE) {
+                return err;
+            }
+        }
+
+        out->bits.swap(t->bits);
+        t->bits.assign(out->bits.size(), 0);
+    }
+
+    _mmapext_for_each_dirty_run(out->bits, [&](uint64_t first, uint64_t end) {
+        end = std::min(end, mapped_pages);
+        if (first < end) {
+            out->runs.push_back(DirtyRun{ first * t->page_size, (end - first) * t->page_size });
+        }
+    });
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void dirty_tracker_restore(MmapManager *man, const DirtyPages &pages)
+{
+    DirtyTracker *t = man->_internal != nullptr ? man->_internal->dirty : nullptr;
+    if (t == nullptr || !pages.tracked) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(t->mutex);
+    t->bits.resize(std::max(t->bits.size(), pages.bits.size()), 0);
+    for (uint64_t i = 0; i < pages.bits.size(); ++i) {
+        t->bits[i] |= pages.bits[i];
+    }
+}
+
+struct MmapManagerCheckpoint mmapext_checkpoint(struct MmapManager *man)
+{
+    auto res = MmapManagerCheckpoint{};
+    const uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+
+    DirtyPages pages;
+    res.error = dirty_tracker_take(man, &pages);
+    if (res.error.error_code != MMAPEXT_ERR_NONE) {
+        return res;
+    }
+
+    if (!pages.tracked) {
+        if (mapped_size != 0) {
+            if (timed_syscall(man->_internal, MMAPEXT_OP_MSYNC, [&] {
+                    return msync(man->address, mapped_size, MS_SYNC);
+                }) != 0) {
+                res.error = _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "msync failed to flush the mapping");
+            } else {
+                res.ranges = 1;
+                res.flushed_bytes = mapped_size;
+            }
+        }
+        res.duration_ns = clock_ns(CLOCK_MONOTONIC) - start;
+        return res;
+    }
+
+    // An msync per run would commit the journal once per run. Starting writeback of each run and waiting
+    // for all of them with one fdatasync costs a single commit, the mapping is the file from offset 0.
+    bool failed = false;
+    for (const DirtyRun &run : pages.runs) {
+        failed = timed_syscall(man->_internal, MMAPEXT_OP_MSYNC, [&] {
+            return sync_file_range(man->_fd, run.offset, run.length, SYNC_FILE_RANGE_WRITE);
+        }) != 0;
+        if (failed) {
+            break;
+        }
+        ++res.ranges;
+        res.flushed_bytes += run.length;
+    }
+    if (!failed && (res.ranges != 0 || pages.sync_file)) {
+        failed = timed_syscall(man->_internal, MMAPEXT_OP_MSYNC, [&] { return fdatasync(man->_fd); }) != 0;
+    }
+
+    if (failed) {
+        res.error = _mmapext_dirty_error(MMAPEXT_ERR_UNKNOWN, "failed to flush dirty pages");
+
+        // Keep the pages for the next checkpoint.
+        dirty_tracker_restore(man, pages);
+    }
+
+    res.duration_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    return res;
+}
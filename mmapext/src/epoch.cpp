@@ -0,0 +1,90 @@
+#include <mmapext/mmapext.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Read-side critical sections of mmapext_read_begin. Each thread that enters one registers a record on its
+// first use, and publishes the epoch it entered in there. Replacing something readers may use, the old
+// mapping of a manager that moved, advances the epoch, and the old thing can go once no record shows the
+// ended epoch or an earlier one. Readers share nothing but the epoch counter, which they only load.
+struct ReaderRecord {
+    // Epoch the thread entered its outermost critical section in, 0 outside of one.
+    std::atomic<uint64_t> epoch{ 0 };
+    uint32_t depth = 0;
+};
+
+// Records of all threads that have entered a critical section and are still running.
+static std::mutex g_readers_mutex;
+static std::vector<ReaderRecord *> g_readers;
+
+static std::atomic<uint64_t> g_epoch{ 1 };
+
+// Registers the record of the thread for as long as it runs. Thread-local objects of the main thread are
+// destroyed before the statics above.
+struct ReaderRegistration {
+    ReaderRecord record;
+
+    ReaderRegistration()
+    {
+        std::lock_guard<std::mutex> lock(g_readers_mutex);
+        g_readers.push_back(&record);
+    }
+
+    ~ReaderRegistration()
+    {
+        std::lock_guard<std::mutex> lock(g_readers_mutex);
+        g_readers.erase(std::find(g_readers.begin(), g_readers.end(), &record));
+    }
+};
+
+static ReaderRecord &_mmapext_reader()
+{
+    static thread_local ReaderRegistration registration;
+    return registration.record;
+}
+
+uint64_t epoch_advance() { return g_epoch.fetch_add(1); }
+
+uint64_t epoch_oldest_reader()
+{
+    std::lock_guard<std::mutex> lock(g_readers_mutex);
+    uint64_t oldest = UINT64_MAX;
+    for (const ReaderRecord *r : g_readers) {
+        const uint64_t epoch = r->epoch.load();
+        if (epoch != 0) {
+            oldest = std::min(oldest, epoch);
+        }
+    }
+    return oldest;
+}
+
+// The store of the epoch and the loads after it are sequentially consistent, like the stores of a moving
+// mapping and the loads of epoch_oldest_reader. Either the mover sees the epoch, or the reader sees the new
+// mapping.
+MmapManagerReadSection mmapext_read_begin(const struct MmapManager *man)
+{
+    ReaderRecord &reader = _mmapext_reader();
+    if (reader.depth++ == 0) {
+        reader.epoch.store(g_epoch.load());
+    }
+
+    // The mapped size grows after the mapping moved, so loading it first never pairs it with an old
+    // mapping that is smaller.
+    const uint64_t num_chunks_mapped = __atomic_load_n(&man->num_chunks_mapped, __ATOMIC_SEQ_CST);
+    return MmapManagerReadSection{
+        .address = __atomic_load_n(&man->address, __ATOMIC_SEQ_CST),
+        .mapped_size = num_chunks_mapped * man->_chunk_size,
+    };
+}
+
+void mmapext_read_end()
+{
+    ReaderRecord &reader = _mmapext_reader();
+    if (reader.depth > 0 && --reader.depth == 0) {
+        reader.epoch.store(0, std::memory_order_release);
+    }
+}
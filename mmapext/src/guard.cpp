@@ -0,0 +1,309 @@
+#include <mmapext/mmapext.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/ucontext.h>
+#include <sys/stat.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+#include <plog/Log.h>
+
+struct SizeWatchdog {
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop = false;
+    std::thread thread;
+};
+
+#if defined(__x86_64__)
+// A copy routine of our own, so a SIGBUS with the instruction pointer inside of it can only come from a
+// guarded copy. The handler then resumes at the fault label, which returns false, like the exception
+// tables of the kernel's copy_from_user. Nothing has to be set up per copy, so the guard costs no more
+// than the call. Short copies move 16 bytes at a time and store the last 16 bytes unaligned, longer ones
+// use rep movsb, which is fast from a few hundred bytes on but slow below that at unaligned addresses.
+extern "C" bool _mmapext_guarded_memcpy(void *dst, const void *src, uint64_t length);
+extern "C" char _mmapext_guarded_memcpy_fault[];
+
+// The VEX encoding when the rest of the library uses AVX, mixing in legacy SSE instructions costs a state
+// transition on every copy.
+#    if defined(__AVX__)
+#        define MMAPEXT_MOVDQU "vmovdqu"
+#    else
+#        define MMAPEXT_MOVDQU "movdqu"
+#    endif
+
+asm("    .text\n"
+    "    .p2align 4\n"
+    "    .type _mmapext_guarded_memcpy, @function\n"
+    "_mmapext_guarded_memcpy:\n"
+    "    cmp $256, %rdx\n"
+    "    jae 4f\n"
+    "    cmp $16, %rdx\n"
+    "    jb 2f\n"
+    "    " MMAPEXT_MOVDQU " -16(%rsi,%rdx), %xmm1\n"
+    "    lea -16(%rdi,%rdx), %r8\n"
+    "1:\n"
+    "    " MMAPEXT_MOVDQU " (%rsi), %xmm0\n"
+    "    " MMAPEXT_MOVDQU " %xmm0, (%rdi)\n"
+    "    add $16, %rsi\n"
+    "    add $16, %rdi\n"
+    "    sub $16, %rdx\n"
+    "    cmp $16, %rdx\n"
+    "    jae 1b\n"
+    "    " MMAPEXT_MOVDQU " %xmm1, (%r8)\n"
+    "    mov $1, %eax\n"
+    "    ret\n"
+    "2:\n"
+    "    test %rdx, %rdx\n"
+    "    jz 3f\n"
+    "    movzbl (%rsi), %eax\n"
+    "    mov %al, (%rdi)\n"
+    "    inc %rsi\n"
+    "    inc %rdi\n"
+    "    dec %rdx\n"
+    "    jmp 2b\n"
+    "3:\n"
+    "    mov $1, %eax\n"
+    "    ret\n"
+    "4:\n"
+    "    mov %rdx, %rcx\n"
+    "    rep movsb\n"
+    "    mov $1, %eax\n"
+    "    ret\n"
+    "_mmapext_guarded_memcpy_fault:\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+    "    .size _mmapext_guarded_memcpy, .-_mmapext_guarded_memcpy\n");
+
+static bool _mmapext_recover_guarded_copy(void *ucontext)
+{
+    auto *uc = static_cast<ucontext_t *>(ucontext);
+    const greg_t ip = uc->uc_mcontext.gregs[REG_RIP];
+    if (ip < greg_t(_mmapext_guarded_memcpy) || ip >= greg_t(_mmapext_guarded_memcpy_fault)) {
+        return false;
+    }
+    uc->uc_mcontext.gregs[REG_RIP] = greg_t(_mmapext_guarded_memcpy_fault);
+    return true;
+}
+
+// Copies length bytes, returning false instead of crashing if the copy raised SIGBUS.
+static bool _mmapext_guarded_copy(void *dst, const void *src, uint64_t length)
+{
+    return _mmapext_guarded_memcpy(dst, src, length);
+}
+#else
+// Recovery point of the guarded copy running on this thread, null outside of one. Initial exec TLS, so the
+// signal handler reads it without calling into the dynamic linker.
+static thread_local sigjmp_buf *volatile t_recover __attribute__((tls_model("initial-exec"))) = nullptr;
+
+static bool _mmapext_recover_guarded_copy(void *)
+{
+    sigjmp_buf *recover = t_recover;
+    if (recover == nullptr) {
+        return false;
+    }
+    t_recover = nullptr;
+    siglongjmp(*recover, 1);
+}
+
+static bool _mmapext_guarded_copy(void *dst, const void *src, uint64_t length)
+{
+    sigjmp_buf recover;
+    if (sigsetjmp(recover, 0) != 0) {
+        return false;
+    }
+
+    // The fences keep the compiler from moving the copy out of the guarded section.
+    t_recover = &recover;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    memcpy(dst, src, length);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    t_recover = nullptr;
+    return true;
+}
+#endif
+
+static struct sigaction g_previous_sigbus;
+static std::atomic<bool> g_sigbus_handler_installed{ false };
+static std::mutex g_sigbus_handler_mutex;
+
+static void _mmapext_sigbus_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    if (_mmapext_recover_guarded_copy(ucontext)) {
+        return;
+    }
+
+    // Not raised by a guarded copy, hand it to whoever handled SIGBUS before.
+    if ((g_previous_sigbus.sa_flags & SA_SIGINFO) != 0) {
+        g_previous_sigbus.sa_sigaction(sig, info, ucontext);
+    } else if (g_previous_sigbus.sa_handler != SIG_DFL && g_previous_sigbus.sa_handler != SIG_IGN) {
+        g_previous_sigbus.sa_handler(sig);
+    } else {
+        // Returning retries the access, which now kills the process as it would have without us.
+        signal(SIGBUS, SIG_DFL);
+    }
+}
+
+// Installs the handler on the first guarded copy. std::call_once would cost a few TLS lookups and a
+// pthread_once call on every copy.
+static void _mmapext_install_sigbus_handler()
+{
+    if (g_sigbus_handler_installed.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_sigbus_handler_mutex);
+    if (g_sigbus_handler_installed.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    struct sigaction action {};
+    action.sa_sigaction = _mmapext_sigbus_handler;
+    // Without x86 the handler leaves with siglongjmp. SA_NODEFER keeps SIGBUS unblocked after that, so
+    // sigsetjmp doesn't have to save and restore the signal mask, which would cost two system calls per copy.
+    action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGBUS, &action, &g_previous_sigbus) != 0) {
+        PLOGE.printf("failed to install SIGBUS handler, guarded copies are not guarded");
+    }
+    g_sigbus_handler_installed.store(true, std::memory_order_release);
+}
+
+// Stats the backing file and updates the known file size. Returns it, UINT64_MAX if unknown.
+static uint64_t _mmapext_refresh_file_size(MmapManagerInternal *internal, int fd)
+{
+    struct stat statbuf;
+    if (fd == -1 || internal->lazy != nullptr ||
+        timed_syscall(internal, MMAPEXT_OP_STAT, [&] { return fstat(fd, &statbuf); }) != 0) {
+        // Lazy mappings are private copies and don't fault when the file shrinks.
+        return UINT64_MAX;
+    }
+    internal->known_file_size.store(uint64_t(statbuf.st_size), std::memory_order_relaxed);
+    return uint64_t(statbuf.st_size);
+}
+
+// Checks that [offset, offset + length) is mapped and, as far as we know, within the file.
+static ErrorResult _mmapext_check_guarded_range(const MmapManager *man, uint64_t offset, uint64_t length)
+{
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (man->_internal == nullptr || offset > mapped_size || length > mapped_size - offset) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range is not mapped",
+        };
+    }
+
+    // The known size only ever lags behind growth by this manager, so a range past it is checked again.
+    if (offset + length > man->_internal->known_file_size.load(std::memory_order_relaxed) &&
+        offset + length > _mmapext_refresh_file_size(man->_internal, man->_fd)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_BUS_ERROR,
+            .error_message = "range is past the end of the backing file",
+        };
+    }
+    return mmapext_ensure_mapped(man, offset, length);
+}
+
+static ErrorResult _mmapext_guarded_copy_failed(const MmapManager *man, uint64_t offset)
+{
+    PLOGW.printf("SIGBUS accessing %s at offset %lu, was the file truncated?", man->filepath, offset);
+    _mmapext_refresh_file_size(man->_internal, man->_fd);
+    return ErrorResult{
+        .error_code = MMAPEXT_ERR_BUS_ERROR,
+        .error_message = "SIGBUS while accessing the mapping",
+    };
+}
+
+ErrorResult mmapext_safe_read(const struct MmapManager *man, uint64_t offset, void *dst, uint64_t length)
+{
+    _mmapext_install_sigbus_handler();
+
+    auto err = _mmapext_check_guarded_range(man, offset, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    if (!_mmapext_guarded_copy(dst, man->address + offset, length)) {
+        return _mmapext_guarded_copy_failed(man, offset);
+    }
+    return ErrorResult{};
+}
+
+ErrorResult mmapext_safe_write(struct MmapManager *man, uint64_t offset, const void *src, uint64_t length)
+{
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+    _mmapext_install_sigbus_handler();
+
+    auto err = _mmapext_check_guarded_range(man, offset, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    mmapext_mark_dirty(man, offset, length);
+    if (!_mmapext_guarded_copy(man->address + offset, src, length)) {
+        return _mmapext_guarded_copy_failed(man, offset);
+    }
+    return ErrorResult{};
+}
+
+uint64_t mmapext_valid_size(const struct MmapManager *man)
+{
+    if (man->_internal == nullptr) {
+        return 0;
+    }
+    const uint64_t file_size = man->_internal->known_file_size.load(std::memory_order_relaxed);
+    return std::min(mmapext_mapped_size(man), file_size);
+}
+
+void size_watchdog_delete(SizeWatchdog *w)
+{
+    if (w == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        w->stop = true;
+    }
+    w->wake.notify_one();
+    w->thread.join();
+    delete w;
+}
+
+ErrorResult mmapext_watch_file_size(struct MmapManager *man, uint32_t interval_ms)
+{
+    if (man->_internal == nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "manager is not alive",
+        };
+    }
+
+    size_watchdog_delete(man->_internal->watchdog);
+    man->_internal->watchdog = nullptr;
+    _mmapext_refresh_file_size(man->_internal, man->_fd);
+    if (interval_ms == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // The thread only uses state that stays put when the MmapManager struct is copied.
+    auto *w = new SizeWatchdog();
+    MmapManagerInternal *internal = man->_internal;
+    const int fd = man->_fd;
+    w->thread = std::thread([w, internal, fd, interval_ms] {
+        std::unique_lock<std::mutex> lock(w->mutex);
+        while (!w->wake.wait_for(lock, std::chrono::milliseconds(interval_ms), [w] { return w->stop; })) {
+            _mmapext_refresh_file_size(internal, fd);
+        }
+    });
+    man->_internal->watchdog = w;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
@@ -0,0 +1,397 @@
+#include <mmapext/hash_index.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <plog/Log.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace mmapext {
+
+namespace {
+
+constexpr uint64_t index_magic = 0x5844494854584d4dull; // "MMXTHIDX"
+constexpr uint32_t index_version = 1;
+
+// Segment 0 holds the initial buckets, segment k >= 1 holds as many buckets as all the segments before it.
+constexpr uint32_t max_segments = 48;
+
+} // namespace
+
+// Lives at offset 0 of the index file.
+struct HashIndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t bucket_size;
+
+    uint32_t initial_buckets_log2;
+    float max_load_factor;
+
+    // Number of times the table has doubled. The table has 2^(initial_buckets_log2 + level) + split buckets.
+    uint32_t level;
+    uint32_t _pad;
+
+    // Index of the next bucket to split.
+    uint64_t split;
+
+    uint64_t num_entries;
+    uint64_t num_overflow_buckets;
+
+    // End of the allocated part of the file.
+    uint64_t top;
+
+    // Free list of overflow buckets, linked through their overflow field.
+    uint64_t free_overflow;
+
+    // File offsets of the bucket segments.
+    uint64_t segments[max_segments];
+};
+
+// Keys and count in the first cache line, values and link to the overflow bucket in the second.
+struct alignas(64) HashIndexBucket {
+    uint64_t keys[HashIndex::SLOTS_PER_BUCKET];
+    uint32_t count;
+    uint32_t _pad;
+    uint64_t values[HashIndex::SLOTS_PER_BUCKET];
+    uint64_t overflow;
+};
+
+static_assert(sizeof(HashIndexBucket) == 128, "");
+static_assert(sizeof(HashIndexHeader) <= MMAPEXT_PAGE_SIZE, "");
+
+// Finalizer of MurmurHash3. Keys are often offsets or already hashes with poor low bits.
+static inline uint64_t mix_key(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+template <typename T> static T align_up(T value, T divisor)
+{
+    return (value + divisor - 1) / divisor * divisor;
+}
+
+HashIndexHeader *HashIndex::header() const { return reinterpret_cast<HashIndexHeader *>(_man.address); }
+
+HashIndexBucket *HashIndex::bucket_at(uint64_t offset) const
+{
+    return reinterpret_cast<HashIndexBucket *>(_man.address + offset);
+}
+
+uint64_t HashIndex::bucket_offset(uint64_t bucket_index) const
+{
+    const HashIndexHeader *h = header();
+    const uint64_t q = bucket_index >> h->initial_buckets_log2;
+    const uint32_t segment = q == 0 ? 0 : 64 - __builtin_clzll(q);
+    const uint64_t segment_start = segment == 0 ? 0 : uint64_t(1) << (h->initial_buckets_log2 + segment - 1);
+    return h->segments[segment] + (bucket_index - segment_start) * sizeof(HashIndexBucket);
+}
+
+uint64_t HashIndex::bucket_index_for(uint64_t hash) const
+{
+    const HashIndexHeader *h = header();
+    const uint32_t bits = h->initial_buckets_log2 + h->level;
+    uint64_t index = hash & ((uint64_t(1) << bits) - 1);
+    if (index < h->split) {
+        index = hash & ((uint64_t(1) << (bits + 1)) - 1);
+    }
+    return index;
+}
+
+uint64_t HashIndex::allocate(uint64_t size)
+{
+    const uint64_t offset = align_up<uint64_t>(header()->top, sizeof(HashIndexBucket));
+    const uint64_t end = offset + size;
+    if (grow_structure_file(&_man, end, "hash index").error_code != MMAPEXT_ERR_NONE) {
+        return 0;
+    }
+
+    header()->top = end;
+    return offset;
+}
+
+uint64_t HashIndex::allocate_overflow_bucket()
+{
+    HashIndexHeader *h = header();
+    uint64_t offset = h->free_overflow;
+
+    if (offset != 0) {
+        h->free_overflow = bucket_at(offset)->overflow;
+        memset(bucket_at(offset), 0, sizeof(HashIndexBucket));
+    } else {
+        offset = allocate(sizeof(HashIndexBucket));
+        if (offset == 0) {
+            return 0;
+        }
+    }
+
+    ++header()->num_overflow_buckets;
+    return offset;
+}
+
+HashIndexOpenResult HashIndex::open(const HashIndexOptions &opts)
+{
+    HashIndexOpenResult res{};
+
+    MmapManager man = open_structure_file(opts.backing_file, opts.initial_reserved_size);
+    if (man.error_code != MMAPEXT_ERR_NONE) {
+        res.error = ErrorResult{ .error_code = man.error_code, .error_message = man.error_message };
+        return res;
+    }
+
+    auto index = new HashIndex();
+    index->_man = man;
+
+    HashIndexHeader *h = index->header();
+
+    if (h->magic == 0) {
+        h->magic = index_magic;
+        h->version = index_version;
+        h->bucket_size = sizeof(HashIndexBucket);
+        h->initial_buckets_log2 = opts.initial_buckets_log2;
+        h->max_load_factor = opts.max_load_factor;
+        h->top = MMAPEXT_PAGE_SIZE;
+
+        const uint64_t segment_offset =
+            index->allocate(sizeof(HashIndexBucket) << opts.initial_buckets_log2);
+        if (segment_offset == 0) {
+            close(index);
+            res.error = ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "failed to allocate initial buckets of hash index",
+            };
+            return res;
+        }
+        index->header()->segments[0] = segment_offset;
+        res.created = true;
+    } else if (h->magic != index_magic || h->version != index_version ||
+               h->bucket_size != sizeof(HashIndexBucket)) {
+        close(index);
+        res.error = ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "file is not a hash index or was created by an incompatible version",
+        };
+        return res;
+    }
+
+    PLOGI.printf("opened hash index %s with %lu entries in %lu buckets",
+                 opts.backing_file,
+                 index->size(),
+                 index->num_buckets());
+
+    res.index = index;
+    return res;
+}
+
+ErrorResult HashIndex::close(HashIndex *index)
+{
+    auto err = mmapext_delete_manager(&index->_man);
+    delete index;
+    return err;
+}
+
+bool HashIndex::get(uint64_t key, uint64_t *value) const
+{
+    uint64_t offset = bucket_offset(bucket_index_for(mix_key(key)));
+
+    while (offset != 0) {
+        const HashIndexBucket *b = bucket_at(offset);
+        for (uint32_t i = 0; i < b->count; ++i) {
+            if (b->keys[i] == key) {
+                *value = b->values[i];
+                return true;
+            }
+        }
+        offset = b->overflow;
+    }
+    return false;
+}
+
+void HashIndex::prefetch(uint64_t key) const
+{
+    __builtin_prefetch(bucket_at(bucket_offset(bucket_index_for(mix_key(key)))));
+}
+
+ErrorResult HashIndex::append_to_chain(uint64_t bucket_index, uint64_t key, uint64_t value)
+{
+    uint64_t offset = bucket_offset(bucket_index);
+    HashIndexBucket *b = bucket_at(offset);
+
+    while (b->count == SLOTS_PER_BUCKET && b->overflow != 0) {
+        offset = b->overflow;
+        b = bucket_at(offset);
+    }
+
+    if (b->count == SLOTS_PER_BUCKET) {
+        const uint64_t overflow = allocate_overflow_bucket();
+        if (overflow == 0) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "failed to allocate overflow bucket",
+            };
+        }
+        // Allocation can move the mapping.
+        bucket_at(offset)->overflow = overflow;
+        offset = overflow;
+        b = bucket_at(offset);
+    }
+
+    b->keys[b->count] = key;
+    b->values[b->count] = value;
+    ++b->count;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult HashIndex::put(uint64_t key, uint64_t value)
+{
+    const uint64_t bucket_index = bucket_index_for(mix_key(key));
+
+    for (uint64_t offset = bucket_offset(bucket_index); offset != 0;) {
+        HashIndexBucket *b = bucket_at(offset);
+        for (uint32_t i = 0; i < b->count; ++i) {
+            if (b->keys[i] == key) {
+                b->values[i] = value;
+                return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+            }
+        }
+        offset = b->overflow;
+    }
+
+    auto err = append_to_chain(bucket_index, key, value);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    HashIndexHeader *h = header();
+    ++h->num_entries;
+
+    if (h->num_entries > h->max_load_factor * SLOTS_PER_BUCKET * num_buckets()) {
+        return split_next_bucket();
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+bool HashIndex::remove(uint64_t key)
+{
+    uint64_t prev_offset = 0;
+    uint64_t offset = bucket_offset(bucket_index_for(mix_key(key)));
+
+    while (offset != 0) {
+        HashIndexBucket *b = bucket_at(offset);
+        for (uint32_t i = 0; i < b->count; ++i) {
+            if (b->keys[i] != key) {
+                continue;
+            }
+
+            --b->count;
+            b->keys[i] = b->keys[b->count];
+            b->values[i] = b->values[b->count];
+
+            HashIndexHeader *h = header();
+            --h->num_entries;
+
+            // Unlink and free emptied overflow buckets.
+            if (b->count == 0 && prev_offset != 0) {
+                bucket_at(prev_offset)->overflow = b->overflow;
+                b->overflow = h->free_overflow;
+                h->free_overflow = offset;
+                --h->num_overflow_buckets;
+            }
+            return true;
+        }
+        prev_offset = offset;
+        offset = b->overflow;
+    }
+    return false;
+}
+
+ErrorResult HashIndex::split_next_bucket()
+{
+    HashIndexHeader *h = header();
+
+    const uint32_t level = h->level;
+    const uint64_t split = h->split;
+    const uint64_t level_buckets = uint64_t(1) << (h->initial_buckets_log2 + level);
+
+    // First split of this level needs the next segment.
+    if (split == 0) {
+        if (level + 1 >= max_segments) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "hash index reached the maximum number of segments",
+            };
+        }
+
+        const uint64_t segment_offset = allocate(level_buckets * sizeof(HashIndexBucket));
+        if (segment_offset == 0) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_OUT_OF_MEMORY,
+                .error_message = "failed to allocate hash index segment",
+            };
+        }
+        h = header();
+        h->segments[level + 1] = segment_offset;
+    }
+
+    // Take all entries out of the chain, returning its overflow buckets to the free list.
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+
+    const uint64_t primary_offset = bucket_offset(split);
+    HashIndexBucket *primary = bucket_at(primary_offset);
+    uint64_t offset = primary_offset;
+
+    while (offset != 0) {
+        HashIndexBucket *b = bucket_at(offset);
+        for (uint32_t i = 0; i < b->count; ++i) {
+            entries.emplace_back(b->keys[i], b->values[i]);
+        }
+        const uint64_t next = b->overflow;
+        if (offset != primary_offset) {
+            b->count = 0;
+            b->overflow = h->free_overflow;
+            h->free_overflow = offset;
+            --h->num_overflow_buckets;
+        }
+        offset = next;
+    }
+
+    primary->count = 0;
+    primary->overflow = 0;
+
+    if (split + 1 == level_buckets) {
+        h->split = 0;
+        h->level = level + 1;
+    } else {
+        h->split = split + 1;
+    }
+
+    // Each entry goes either back to the split bucket or to its new image at split + level_buckets.
+    for (const auto &e : entries) {
+        auto err = append_to_chain(bucket_index_for(mix_key(e.first)), e.first, e.second);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+    }
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+uint64_t HashIndex::size() const { return header()->num_entries; }
+
+uint64_t HashIndex::num_buckets() const
+{
+    const HashIndexHeader *h = header();
+    return (uint64_t(1) << (h->initial_buckets_log2 + h->level)) + h->split;
+}
+
+uint64_t HashIndex::num_overflow_buckets() const { return header()->num_overflow_buckets; }
+
+ErrorResult HashIndex::sync() { return sync_structure_file(&_man, "msync failed on hash index"); }
+
+} // namespace mmapext
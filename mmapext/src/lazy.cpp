@@ -0,0 +1,449 @@
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <mmapext/mmapext.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include <plog/Log.h>
+
+// Older kernel headers lack poisoning, which arrived in Linux 6.6.
+#if !defined(UFFD_FEATURE_POISON)
+#    define UFFD_FEATURE_POISON (1 << 14)
+struct uffdio_poison {
+    struct uffdio_range range;
+    __u64 mode;
+    __s64 updated;
+};
+#    define UFFDIO_POISON _IOWR(UFFDIO, 0x08, struct uffdio_poison)
+#endif
+
+constexpr uint32_t default_fill_pages = 16;
+constexpr uint32_t default_max_fill_pages = 256;
+
+struct LazyState {
+    // Metrics of the manager, which stay put when the MmapManager struct is copied.
+    MmapManagerInternal *internal = nullptr;
+
+    uint8_t *base = nullptr;
+    uint64_t page_size = 0;
+    uint64_t num_pages = 0;
+    uint64_t file_size = 0;
+
+    mmapext_fill_fn fill = nullptr;
+    void *fill_ctx = nullptr;
+    int fd = -1;
+
+    uint32_t fill_pages = 0;
+    uint32_t max_fill_pages = 0;
+
+    // Only touched by the handler thread. One bit per system page that was filled.
+    std::vector<uint64_t> filled;
+    uint64_t window = 0;
+    uint64_t next_sequential = UINT64_MAX;
+
+    bool can_poison = false;
+    int uffd = -1;
+    int stop_fd = -1;
+    std::thread handler;
+
+    std::atomic<uint64_t> faults{ 0 };
+    std::atomic<uint64_t> bytes_filled{ 0 };
+    std::atomic<uint64_t> fill_errors{ 0 };
+};
+
+static ErrorResult _mmapext_lazy_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+static int _mmapext_pread_fill(void *ctx, uint64_t offset, void *dst, uint64_t length)
+{
+    const int fd = *static_cast<const int *>(ctx);
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    while (length > 0) {
+        const ssize_t n = pread(fd, out, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            // Shorter than when it was opened, the caller zeroes the rest.
+            memset(out, 0, length);
+            return 0;
+        }
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static bool _mmapext_lazy_filled(const LazyState *l, uint64_t page)
+{
+    return (l->filled[page / 64] >> (page % 64) & 1) != 0;
+}
+
+// Picks the pages filled for a fault at page. Faults right after the previous fill double the window, up
+// to max_fill_pages, any other fault starts over with fill_pages. The window stops at filled pages, which
+// UFFDIO_COPY would refuse.
+static uint64_t _mmapext_lazy_fill_end(LazyState *l, uint64_t page)
+{
+    l->window = page == l->next_sequential ? std::min<uint64_t>(l->window * 2, l->max_fill_pages)
+                                           : l->fill_pages;
+    const uint64_t end = std::min(page + l->window, l->num_pages);
+    for (uint64_t p = page + 1; p < end; ++p) {
+        if (_mmapext_lazy_filled(l, p)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static void _mmapext_lazy_mark_filled(LazyState *l, uint64_t first, uint64_t end)
+{
+    for (uint64_t p = first; p < end; ++p) {
+        l->filled[p / 64] |= uint64_t(1) << (p % 64);
+    }
+}
+
+// Resolves the fault at page without its data. The faulting thread gets SIGBUS, as if reading a mapped file
+// failed, or reads zeros on kernels that can't poison. If neither works it is still woken, and faults again.
+static void _mmapext_lazy_fail_page(LazyState *l, uint64_t page)
+{
+    const uint64_t start = uint64_t(l->base) + page * l->page_size;
+    int ret;
+    if (l->can_poison) {
+        struct uffdio_poison poison {};
+        poison.range.start = start;
+        poison.range.len = l->page_size;
+        do {
+            ret = ioctl(l->uffd, UFFDIO_POISON, &poison);
+        } while (ret != 0 && errno == EAGAIN);
+        if (ret == 0) {
+            _mmapext_lazy_mark_filled(l, page, page + 1);
+            return;
+        }
+    }
+
+    struct uffdio_zeropage zero {};
+    zero.range.start = start;
+    zero.range.len = l->page_size;
+    do {
+        ret = ioctl(l->uffd, UFFDIO_ZEROPAGE, &zero);
+    } while (ret != 0 && errno == EAGAIN);
+    if (ret == 0) {
+        _mmapext_lazy_mark_filled(l, page, page + 1);
+        return;
+    }
+
+    struct uffdio_range range {};
+    range.start = start;
+    range.len = l->page_size;
+    ioctl(l->uffd, UFFDIO_WAKE, &range);
+}
+
+static void _mmapext_lazy_fault(LazyState *l, uint8_t *buffer, uint64_t address)
+{
+    const uint64_t page = (address - uint64_t(l->base)) / l->page_size;
+    if (page >= l->num_pages || _mmapext_lazy_filled(l, page)) {
+        // Filled by an earlier fault of the same batch.
+        struct uffdio_range range {};
+        range.start = uint64_t(l->base) + page * l->page_size;
+        range.len = l->page_size;
+        ioctl(l->uffd, UFFDIO_WAKE, &range);
+        return;
+    }
+
+    const uint64_t end = _mmapext_lazy_fill_end(l, page);
+    const uint64_t offset = page * l->page_size;
+    const uint64_t length = (end - page) * l->page_size;
+
+    // The tail of the last page is past the end of the data.
+    const uint64_t data_length = offset < l->file_size ? std::min(length, l->file_size - offset) : 0;
+    int err = data_length > 0 ? l->fill(l->fill_ctx, offset, buffer, data_length) : 0;
+    memset(buffer + data_length, 0, length - data_length);
+
+    if (err != 0) {
+        l->fill_errors.fetch_add(1, std::memory_order_relaxed);
+        PLOGE.printf("failed to fill %lu bytes at offset %lu of lazy mapping, error %d", length, offset, err);
+        _mmapext_lazy_fail_page(l, page);
+        return;
+    }
+
+    // UFFDIO_COPY copies and wakes part of the range and returns EAGAIN when the mapping changes under it,
+    // and fails with EEXIST at a page that is already there. The rest is copied again, skipping existing
+    // pages, which no copy wakes.
+    uint64_t copied = 0;
+    uint64_t bytes_copied = 0;
+    bool skipped = false;
+    while (copied < length) {
+        struct uffdio_copy copy {};
+        copy.dst = uint64_t(l->base) + offset + copied;
+        copy.src = uint64_t(buffer) + copied;
+        copy.len = length - copied;
+        if (ioctl(l->uffd, UFFDIO_COPY, &copy) == 0) {
+            bytes_copied += length - copied;
+            copied = length;
+            break;
+        }
+        const int copy_errno = errno;
+        if (copy.copy > 0) {
+            bytes_copied += uint64_t(copy.copy);
+            copied += uint64_t(copy.copy);
+        }
+        if (copy_errno == EAGAIN) {
+            continue;
+        }
+        if (copy_errno == EEXIST) {
+            _mmapext_lazy_mark_filled(l, page + copied / l->page_size, page + copied / l->page_size + 1);
+            copied += l->page_size;
+            skipped = true;
+            continue;
+        }
+
+        std::array<char, 256> errno_desc_buf{};
+        PLOGE.printf("failed to copy filled pages into lazy mapping: %s",
+                     strerror_r(copy_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+        l->fill_errors.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+
+    const uint64_t copied_end = page + copied / l->page_size;
+    _mmapext_lazy_mark_filled(l, page, copied_end);
+    l->bytes_filled.fetch_add(bytes_copied, std::memory_order_relaxed);
+    if (copied_end == page) {
+        _mmapext_lazy_fail_page(l, page);
+        return;
+    }
+    if (skipped) {
+        struct uffdio_range range {};
+        range.start = uint64_t(l->base) + offset;
+        range.len = copied;
+        ioctl(l->uffd, UFFDIO_WAKE, &range);
+    }
+    l->next_sequential = copied_end;
+}
+
+static void _mmapext_lazy_handler(LazyState *l)
+{
+    std::array<uffd_msg, 64> msgs;
+    std::vector<uint8_t> buffer(uint64_t(l->max_fill_pages) * l->page_size);
+
+    for (;;) {
+        pollfd fds[2] = { { l->uffd, POLLIN, 0 }, { l->stop_fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOGE.printf("poll on userfaultfd failed, stopping lazy mapping handler");
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+
+        const ssize_t n = read(l->uffd, msgs.data(), sizeof(msgs));
+        if (n <= 0) {
+            continue;
+        }
+
+        for (ssize_t i = 0; i < n / ssize_t(sizeof(uffd_msg)); ++i) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            l->faults.fetch_add(1, std::memory_order_relaxed);
+            timed_syscall(l->internal, MMAPEXT_OP_FILL, [&] {
+                _mmapext_lazy_fault(l, buffer.data(), msgs[i].arg.pagefault.address);
+                return 0;
+            });
+        }
+    }
+}
+
+void lazy_state_delete(LazyState *l)
+{
+    if (l == nullptr) {
+        return;
+    }
+    if (l->handler.joinable()) {
+        const uint64_t one = 1;
+        if (write(l->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            PLOGE.printf("failed to signal the lazy mapping handler to stop");
+        }
+        l->handler.join();
+    }
+    if (l->uffd != -1) {
+        close(l->uffd);
+    }
+    if (l->stop_fd != -1) {
+        close(l->stop_fd);
+    }
+    delete l;
+}
+
+static ErrorResult _mmapext_start_lazy(LazyState *l)
+{
+    l->uffd = int(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+    if (l->uffd == -1) {
+        return _mmapext_lazy_error(MMAPEXT_ERR_INVALID_ARGUMENT, "userfaultfd is not available");
+    }
+
+    // Asks for poisoning first and falls back to zero filling failed pages on kernels without it.
+    struct uffdio_api api {};
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_POISON;
+    if (ioctl(l->uffd, UFFDIO_API, &api) == 0) {
+        l->can_poison = true;
+    } else {
+        // A failed UFFDIO_API handshake can't be retried on the same file descriptor.
+        close(l->uffd);
+        l->uffd = int(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+        api = uffdio_api{};
+        api.api = UFFD_API;
+        if (l->uffd == -1 || ioctl(l->uffd, UFFDIO_API, &api) != 0) {
+            return _mmapext_lazy_error(MMAPEXT_ERR_INVALID_ARGUMENT, "userfaultfd handshake failed");
+        }
+    }
+
+    struct uffdio_register reg {};
+    reg.range.start = uint64_t(l->base);
+    reg.range.len = l->num_pages * l->page_size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(l->uffd, UFFDIO_REGISTER, &reg) != 0) {
+        return _mmapext_lazy_error(MMAPEXT_ERR_INVALID_ARGUMENT,
+                                   "failed to register lazy mapping with userfaultfd");
+    }
+
+    l->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (l->stop_fd == -1) {
+        return _mmapext_lazy_error(MMAPEXT_ERR_UNKNOWN, "failed to create eventfd");
+    }
+
+    l->handler = std::thread(_mmapext_lazy_handler, l);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+struct MmapManager mmapext_open_lazy(struct MmapManagerLazyOptions opts)
+{
+    MmapManager manager{};
+    manager._fd = -1;
+
+    auto fail = [&](ErrorResult err) {
+        manager.error_code = err.error_code;
+        manager.error_message = err.error_message;
+        if (manager._fd != -1) {
+            close(manager._fd);
+            manager._fd = -1;
+        }
+        return manager;
+    };
+
+    // 0 picks the defaults, the check is against the maximum that will be used.
+    const uint32_t max_fill_pages = opts.max_fill_pages != 0 ? opts.max_fill_pages : default_max_fill_pages;
+    if ((opts.fill == nullptr && opts.backing_file == nullptr) ||
+        (opts.backing_file == nullptr && opts.file_size == 0) || opts.fill_pages > max_fill_pages) {
+        return fail(ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "lazy mapping needs a backing file or a fill function and size, "
+                             "and fill_pages at most max_fill_pages",
+        });
+    }
+
+    uint64_t size = opts.file_size;
+    if (opts.backing_file != nullptr) {
+        manager._fd = open(opts.backing_file, O_RDONLY | O_CLOEXEC);
+        if (manager._fd == -1) {
+            return fail(_mmapext_lazy_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open backing file"));
+        }
+
+        struct stat statbuf;
+        if (size == 0) {
+            if (fstat(manager._fd, &statbuf) != 0) {
+                return fail(
+                    _mmapext_lazy_error(MMAPEXT_ERR_FAILED_TO_STAT_FILE, "failed to stat backing file"));
+            }
+            size = uint64_t(statbuf.st_size);
+        }
+    }
+
+    const uint64_t chunk_size = MMAPEXT_PAGE_SIZE;
+    const uint64_t mapped_size = std::max<uint64_t>((size + chunk_size - 1) / chunk_size, 1) * chunk_size;
+
+    // Filled pages are private copies, so the mapping is read only and never written back. Faults on
+    // missing pages go to the handler thread.
+    void *addr = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return fail(_mmapext_lazy_error(MMAPEXT_ERR_FAILED_TO_MMAP, "failed to reserve lazy mapping"));
+    }
+
+    manager._internal = new MmapManagerInternal();
+    auto *l = new LazyState();
+    l->internal = manager._internal;
+    l->base = static_cast<uint8_t *>(addr);
+    l->page_size = sysconf(_SC_PAGESIZE);
+    l->num_pages = mapped_size / l->page_size;
+    l->file_size = size;
+    l->fd = manager._fd;
+    l->fill = opts.fill != nullptr ? opts.fill : _mmapext_pread_fill;
+    l->fill_ctx = opts.fill != nullptr ? opts.fill_ctx : &l->fd;
+    l->fill_pages = opts.fill_pages != 0 ? opts.fill_pages : default_fill_pages;
+    l->max_fill_pages = std::max(max_fill_pages, l->fill_pages);
+    l->filled.assign((l->num_pages + 63) / 64, 0);
+
+    auto err = _mmapext_start_lazy(l);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        lazy_state_delete(l);
+        delete manager._internal;
+        manager._internal = nullptr;
+        munmap(addr, mapped_size);
+        return fail(err);
+    }
+    manager._internal->lazy = l;
+
+    const char *path = opts.backing_file != nullptr ? opts.backing_file : "";
+    manager.filepath = static_cast<char *>(malloc(strlen(path) + 1));
+    strcpy(manager.filepath, path);
+
+    manager.address = l->base;
+    manager._chunk_size = chunk_size;
+    manager.num_chunks_reserved = mapped_size / chunk_size;
+    manager.num_chunks_mapped = manager.num_chunks_reserved;
+
+    PLOGI.printf("opened lazy mapping of %s with %lu bytes", path, size);
+    return manager;
+}
+
+void mmapext_get_lazy_stats(const struct MmapManager *man, struct MmapManagerLazyStats *out)
+{
+    *out = MmapManagerLazyStats{};
+    const LazyState *l = man->_internal != nullptr ? man->_internal->lazy : nullptr;
+    if (l == nullptr) {
+        return;
+    }
+    out->faults = l->faults.load(std::memory_order_relaxed);
+    out->bytes_filled = l->bytes_filled.load(std::memory_order_relaxed);
+    out->fill_errors = l->fill_errors.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,440 @@
+#include <fcntl.h>
+#include <mmapext/mmapext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#include <plog/Log.h>
+
+ErrorResult log_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+static ErrorResult _mmapext_pread_fd(int fd, void *dst, uint64_t length, uint64_t offset, uint64_t *calls)
+{
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    while (length > 0) {
+        const ssize_t n = pread(fd, out, length, offset);
+        ++*calls;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return log_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read log file");
+        }
+        if (n == 0) {
+            memset(out, 0, length);
+            break;
+        }
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult
+_mmapext_pwrite_fd(int fd, const void *src, uint64_t length, uint64_t offset, uint64_t *calls)
+{
+    const uint8_t *in = static_cast<const uint8_t *>(src);
+    while (length > 0) {
+        const ssize_t n = pwrite(fd, in, length, offset);
+        ++*calls;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return log_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write log file");
+        }
+        in += n;
+        offset += n;
+        length -= n;
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult log_pread_full(MmapManagerLogInternal *log, void *dst, uint64_t length, uint64_t offset)
+{
+    return _mmapext_pread_fd(log->fd, dst, length, offset, &log->stats.read_calls);
+}
+
+ErrorResult log_pwrite_full(MmapManagerLogInternal *log, const void *src, uint64_t length, uint64_t offset)
+{
+    return _mmapext_pwrite_fd(log->fd, src, length, offset, &log->stats.write_calls);
+}
+
+// A zeroed page for the header, aligned for O_DIRECT.
+static std::unique_ptr<LogHeader, AlignedFree> _mmapext_header_page()
+{
+    void *page = aligned_alloc(log_header_size, log_header_size);
+    if (page != nullptr) {
+        memset(page, 0, log_header_size);
+    }
+    return std::unique_ptr<LogHeader, AlignedFree>(static_cast<LogHeader *>(page));
+}
+
+ErrorResult log_sync_with_header(MmapManagerLogInternal *log)
+{
+    auto header = _mmapext_header_page();
+    if (header == nullptr) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+    }
+    header->end = log->end;
+    header->magic = log_magic;
+
+    if (fdatasync(log->fd) != 0) {
+        return log_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to sync log data");
+    }
+    uint64_t calls = 0;
+    auto err = _mmapext_pwrite_fd(log->fd, header.get(), log_header_size, 0, &calls);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    if (fdatasync(log->fd) != 0) {
+        return log_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to sync log header");
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Reads the end from the header, writing the header of an empty log first.
+static ErrorResult _mmapext_log_init_header(const char *path, uint64_t *end)
+{
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return log_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open log file");
+    }
+
+    auto header = _mmapext_header_page();
+    uint64_t calls = 0;
+    struct stat statbuf;
+    ErrorResult err{ .error_code = MMAPEXT_ERR_NONE };
+    if (header == nullptr) {
+        err = ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+    } else if (fstat(fd, &statbuf) != 0) {
+        err = log_error(MMAPEXT_ERR_FAILED_TO_STAT_FILE, "failed to stat log file");
+    } else if (statbuf.st_size == 0) {
+        header->end = log_header_size;
+        header->magic = log_magic;
+        err = _mmapext_pwrite_fd(fd, header.get(), log_header_size, 0, &calls);
+    } else {
+        err = _mmapext_pread_fd(fd, header.get(), log_header_size, 0, &calls);
+        if (err.error_code == MMAPEXT_ERR_NONE &&
+            (header->magic != log_magic || header->end < log_header_size ||
+             header->end > uint64_t(statbuf.st_size))) {
+            PLOGE.printf("%s is not a log file or its header is corrupt", path);
+            err = ErrorResult{
+                .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+                .error_message = "not a log file or corrupt log header",
+            };
+        }
+    }
+    close(fd);
+
+    if (err.error_code == MMAPEXT_ERR_NONE) {
+        *end = header->end;
+    }
+    return err;
+}
+
+// The mmap engine appends with mmapext_append, whose commit length is the end in the header.
+struct MmapLog : MmapManagerLogInternal {
+    MmapManager man{};
+
+    // Everything before it was flushed by a previous sync.
+    uint64_t synced_end = 0;
+};
+
+static MmapManagerLogInternal *
+_mmapext_mmap_log_open(const MmapManagerLogOptions &opts, uint64_t end, ErrorResult *err)
+{
+    // Only address space. Growing past it remaps, and appends fault in every page they touched again.
+    auto *log = new MmapLog();
+    log->man = mmapext_create_manager(MmapManagerCreateOptions{
+        .backing_file = opts.path,
+        .initial_reserved_size = uint64_t(1) << 30,
+        .reserve_existing_file_size = true,
+    });
+    if (log->man.error_code != MMAPEXT_ERR_NONE) {
+        *err = ErrorResult{ .error_code = log->man.error_code, .error_message = log->man.error_message };
+        delete log;
+        return nullptr;
+    }
+
+    auto res = mmapext_map_full_file(&log->man);
+    if (res.error.error_code != MMAPEXT_ERR_NONE) {
+        *err = res.error;
+        mmapext_delete_manager(&log->man);
+        delete log;
+        return nullptr;
+    }
+
+    log->fd = log->man._fd;
+    log->end = end;
+    log->synced_end = end;
+    return log;
+}
+
+static ErrorResult _mmapext_mmap_log_append(MmapManagerLogInternal *base, const void *src, uint64_t length)
+{
+    auto *log = static_cast<MmapLog *>(base);
+    return mmapext_append(&log->man, MMAPEXT_APPEND_COMMIT_OFFSET, src, length, &log->end);
+}
+
+static ErrorResult
+_mmapext_mmap_log_read(MmapManagerLogInternal *base, uint64_t offset, void *dst, uint64_t length)
+{
+    auto *log = static_cast<MmapLog *>(base);
+    memcpy(dst, log->man.address + offset, length);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Only the pages appended to since the last sync, and the header. The header is written back together with
+// the data, so unlike the other engines a crash can leave it covering data that didn't make it.
+static ErrorResult _mmapext_mmap_log_sync(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<MmapLog *>(base);
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t start = log->synced_end / page_size * page_size;
+
+    if (log->end > start && msync(log->man.address + start, log->end - start, MS_SYNC) != 0) {
+        return log_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to msync log data");
+    }
+    if (msync(log->man.address, log_header_size, MS_SYNC) != 0) {
+        return log_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to msync log header");
+    }
+    log->synced_end = log->end;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static void _mmapext_mmap_log_close(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<MmapLog *>(base);
+    mmapext_delete_manager(&log->man);
+    delete log;
+}
+
+const LogEngine log_engine_mmap = {
+    "mmap",
+    _mmapext_mmap_log_open,
+    _mmapext_mmap_log_append,
+    _mmapext_mmap_log_read,
+    _mmapext_mmap_log_sync,
+    _mmapext_mmap_log_close,
+};
+
+// The pwrite engine collects appends in a buffer and writes it when it is full.
+struct PwriteLog : MmapManagerLogInternal {
+    std::vector<uint8_t> buffer;
+
+    // Bytes in the buffer, the ones at [end - buffered, end) of the file.
+    uint64_t buffered = 0;
+};
+
+static MmapManagerLogInternal *
+_mmapext_pwrite_log_open(const MmapManagerLogOptions &opts, uint64_t end, ErrorResult *err)
+{
+    const int fd = open(opts.path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        *err = log_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open log file");
+        return nullptr;
+    }
+
+    auto *log = new PwriteLog();
+    log->fd = fd;
+    log->end = end;
+    log->buffer.resize(opts.buffer_size != 0 ? opts.buffer_size : default_log_buffer_size);
+    return log;
+}
+
+static ErrorResult _mmapext_pwrite_log_flush(PwriteLog *log)
+{
+    auto err = log_pwrite_full(log, log->buffer.data(), log->buffered, log->end - log->buffered);
+    if (err.error_code == MMAPEXT_ERR_NONE) {
+        log->buffered = 0;
+    }
+    return err;
+}
+
+static ErrorResult _mmapext_pwrite_log_append(MmapManagerLogInternal *base, const void *src, uint64_t length)
+{
+    auto *log = static_cast<PwriteLog *>(base);
+    if (log->buffered + length > log->buffer.size()) {
+        auto err = _mmapext_pwrite_log_flush(log);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+    }
+
+    // Appends that don't fit in the buffer skip it.
+    if (length > log->buffer.size()) {
+        auto err = log_pwrite_full(log, src, length, log->end);
+        if (err.error_code == MMAPEXT_ERR_NONE) {
+            log->end += length;
+        }
+        return err;
+    }
+
+    memcpy(log->buffer.data() + log->buffered, src, length);
+    log->buffered += length;
+    log->end += length;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult
+_mmapext_pwrite_log_read(MmapManagerLogInternal *base, uint64_t offset, void *dst, uint64_t length)
+{
+    auto *log = static_cast<PwriteLog *>(base);
+    const uint64_t buffer_start = log->end - log->buffered;
+    uint8_t *out = static_cast<uint8_t *>(dst);
+
+    if (offset < buffer_start) {
+        const uint64_t n = std::min(length, buffer_start - offset);
+        auto err = log_pread_full(log, out, n, offset);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    memcpy(out, log->buffer.data() + (offset - buffer_start), length);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult _mmapext_pwrite_log_sync(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<PwriteLog *>(base);
+    auto err = _mmapext_pwrite_log_flush(log);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    return log_sync_with_header(log);
+}
+
+static void _mmapext_pwrite_log_close(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<PwriteLog *>(base);
+    close(log->fd);
+    delete log;
+}
+
+const LogEngine log_engine_pwrite = {
+    "pwrite",
+    _mmapext_pwrite_log_open,
+    _mmapext_pwrite_log_append,
+    _mmapext_pwrite_log_read,
+    _mmapext_pwrite_log_sync,
+    _mmapext_pwrite_log_close,
+};
+
+static const LogEngine *_mmapext_log_engine(int engine)
+{
+    switch (engine) {
+    case MMAPEXT_ENGINE_MMAP:
+        return &log_engine_mmap;
+    case MMAPEXT_ENGINE_PWRITE:
+        return &log_engine_pwrite;
+    case MMAPEXT_ENGINE_DIRECT:
+        return &log_engine_direct;
+    }
+    return nullptr;
+}
+
+struct MmapManagerLog mmapext_log_open(struct MmapManagerLogOptions opts)
+{
+    auto log = MmapManagerLog{};
+    const LogEngine *engine = _mmapext_log_engine(opts.engine);
+    if (engine == nullptr || opts.path == nullptr) {
+        log.error_code = MMAPEXT_ERR_INVALID_ARGUMENT;
+        log.error_message = "unknown log engine or no path";
+        return log;
+    }
+
+    uint64_t end = 0;
+    auto err = _mmapext_log_init_header(opts.path, &end);
+    if (err.error_code == MMAPEXT_ERR_NONE) {
+        log._internal = engine->open(opts, end, &err);
+    }
+    if (log._internal == nullptr) {
+        log.error_code = err.error_code;
+        log.error_message = err.error_message;
+        return log;
+    }
+
+    log._internal->engine = engine;
+    PLOGI.printf(
+        "opened log %s with %lu bytes and the %s engine", opts.path, end - log_header_size, engine->name);
+    return log;
+}
+
+ErrorResult mmapext_log_close(struct MmapManagerLog *log)
+{
+    if (log->_internal == nullptr) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    auto err = log->_internal->engine->sync(log->_internal);
+    log->_internal->engine->close(log->_internal);
+    log->_internal = nullptr;
+    return err;
+}
+
+ErrorResult
+mmapext_log_append(struct MmapManagerLog *log, const void *src, uint64_t length, uint64_t *offset)
+{
+    MmapManagerLogInternal *l = log->_internal;
+    const uint64_t start = l->end;
+    auto err = l->engine->append(l, src, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    l->stats.appended_bytes += length;
+    if (offset != nullptr) {
+        *offset = start - log_header_size;
+    }
+    return err;
+}
+
+ErrorResult mmapext_log_read(struct MmapManagerLog *log, uint64_t offset, void *dst, uint64_t length)
+{
+    MmapManagerLogInternal *l = log->_internal;
+    const uint64_t size = l->end - log_header_size;
+    if (offset > size || length > size - offset) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to read is past the end of the log",
+        };
+    }
+
+    l->stats.read_bytes += length;
+    return l->engine->read(l, offset + log_header_size, dst, length);
+}
+
+ErrorResult mmapext_log_sync(struct MmapManagerLog *log)
+{
+    ++log->_internal->stats.syncs;
+    return log->_internal->engine->sync(log->_internal);
+}
+
+uint64_t mmapext_log_size(const struct MmapManagerLog *log) { return log->_internal->end - log_header_size; }
+
+void mmapext_log_get_stats(const struct MmapManagerLog *log, struct MmapManagerLogStats *out)
+{
+    *out = log->_internal != nullptr ? log->_internal->stats : MmapManagerLogStats{};
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// I/O engines behind MmapManagerLog. Every engine uses the same file format, a log_header_size header
+// followed by the appended bytes, so a log written with one engine can be opened with any other.
+
+#include <mmapext/mmapext.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+
+constexpr uint64_t log_magic = 0x31474f4c54584d4dull; // "MMXTLOG1"
+
+// Aligned for O_DIRECT, and a whole page so the mmap engine's appends never share a page with it.
+constexpr uint64_t log_header_size = 4096;
+
+// First bytes of the file.
+struct LogHeader {
+    // File offset one past the last durable byte, at least log_header_size. The mmap engine updates it with
+    // every append, the others when syncing.
+    uint64_t end;
+    uint64_t magic;
+};
+
+static_assert(offsetof(LogHeader, end) == MMAPEXT_APPEND_COMMIT_OFFSET,
+              "the end of a log has to be where mmapext_append keeps its commit length");
+
+// Of the pwrite and O_DIRECT engines when the options leave it at 0.
+constexpr uint64_t default_log_buffer_size = uint64_t(1) << 20;
+
+struct LogEngine;
+
+// State shared by all engines. Each engine derives its own state from it.
+struct MmapManagerLogInternal {
+    const LogEngine *engine = nullptr;
+    int fd = -1;
+
+    // File offset one past the last appended byte.
+    uint64_t end = log_header_size;
+
+    MmapManagerLogStats stats{};
+};
+
+// Functions of one MMAPEXT_ENGINE_*. Offsets are file offsets, the API adds the header size. Reads are
+// within [log_header_size, end).
+struct LogEngine {
+    const char *name;
+
+    // Returns the engine's state with the file opened, or null and sets *err. end is the end from the header.
+    MmapManagerLogInternal *(*open)(const MmapManagerLogOptions &opts, uint64_t end, ErrorResult *err);
+    ErrorResult (*append)(MmapManagerLogInternal *log, const void *src, uint64_t length);
+    ErrorResult (*read)(MmapManagerLogInternal *log, uint64_t offset, void *dst, uint64_t length);
+
+    // Makes everything appended durable, including the end in the header.
+    ErrorResult (*sync)(MmapManagerLogInternal *log);
+
+    // Frees the state and closes the file, without syncing.
+    void (*close)(MmapManagerLogInternal *log);
+};
+
+// Deleter of buffers from aligned_alloc.
+struct AlignedFree {
+    void operator()(void *p) const { free(p); }
+};
+
+extern const LogEngine log_engine_mmap;
+extern const LogEngine log_engine_pwrite;
+extern const LogEngine log_engine_direct;
+
+ErrorResult log_error(int error_code, const char *message);
+
+// pread and pwrite until done. Short reads past the end of the file fill the rest with zeros.
+ErrorResult log_pread_full(MmapManagerLogInternal *log, void *dst, uint64_t length, uint64_t offset);
+ErrorResult log_pwrite_full(MmapManagerLogInternal *log, const void *src, uint64_t length, uint64_t offset);
+
+// fdatasync, then writes the header with log->end, then fdatasync again, so the header never covers data
+// that isn't durable. The header is written from an aligned page, which O_DIRECT needs.
+ErrorResult log_sync_with_header(MmapManagerLogInternal *log);
@@ -0,0 +1,227 @@
+#include <fcntl.h>
+#include <mmapext/mmapext.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+// Offsets, lengths and buffer addresses of O_DIRECT reads and writes are multiples of it. The logical block
+// size of most devices is 512 bytes, but 4096 covers 4Kn drives as well and is the header size anyway.
+constexpr uint64_t direct_alignment = 4096;
+
+// Unit of the block cache. Reads of a few records cost one device read per block instead of one per record.
+constexpr uint64_t direct_cache_block_size = uint64_t(64) << 10;
+constexpr uint64_t default_direct_cache_size = uint64_t(16) << 20;
+
+struct DirectCacheSlot {
+    uint64_t block = UINT64_MAX;
+    uint64_t last_used = 0;
+
+    // Bytes of the block read from the file. Blocks overlapping the buffer are cached up to where it starts.
+    uint64_t valid = 0;
+    uint8_t *data = nullptr;
+};
+
+// O_DIRECT bypasses the page cache, so the engine keeps its own: a buffer for the tail of the log and a
+// block cache for reads of everything before it.
+struct DirectLog : MmapManagerLogInternal {
+    std::unique_ptr<uint8_t, AlignedFree> buffer;
+    uint64_t buffer_size = 0;
+
+    // File offset of the first byte in the buffer, aligned. Everything before it is written and never
+    // changes again, which is what lets the block cache skip invalidation.
+    uint64_t buffer_offset = 0;
+
+    std::unique_ptr<uint8_t, AlignedFree> cache_memory;
+    std::vector<DirectCacheSlot> cache;
+    std::unordered_map<uint64_t, uint32_t> cached_blocks;
+    uint64_t tick = 0;
+};
+
+static uint64_t _mmapext_align_up(uint64_t n, uint64_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+static MmapManagerLogInternal *
+_mmapext_direct_log_open(const MmapManagerLogOptions &opts, uint64_t end, ErrorResult *err)
+{
+    const int fd = open(opts.path, O_RDWR | O_DIRECT | O_CLOEXEC);
+    if (fd == -1) {
+        *err = log_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open log file with O_DIRECT");
+        return nullptr;
+    }
+
+    auto *log = new DirectLog();
+    log->fd = fd;
+    log->end = end;
+    log->buffer_size = _mmapext_align_up(opts.buffer_size != 0 ? opts.buffer_size : default_log_buffer_size,
+                                         direct_alignment);
+    log->buffer_offset = end / direct_alignment * direct_alignment;
+
+    const uint64_t cache_size = opts.cache_size != 0 ? opts.cache_size : default_direct_cache_size;
+    log->cache.resize(std::max<uint64_t>(1, cache_size / direct_cache_block_size));
+    log->buffer.reset(static_cast<uint8_t *>(aligned_alloc(direct_alignment, log->buffer_size)));
+    log->cache_memory.reset(
+        static_cast<uint8_t *>(aligned_alloc(direct_alignment, log->cache.size() * direct_cache_block_size)));
+    if (log->buffer == nullptr || log->cache_memory == nullptr) {
+        *err = ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+        close(fd);
+        delete log;
+        return nullptr;
+    }
+    for (uint64_t i = 0; i < log->cache.size(); ++i) {
+        log->cache[i].data = log->cache_memory.get() + i * direct_cache_block_size;
+    }
+
+    // The partial last block goes to the buffer, appends rewrite it.
+    if (end > log->buffer_offset) {
+        *err = log_pread_full(log, log->buffer.get(), direct_alignment, log->buffer_offset);
+        if (err->error_code != MMAPEXT_ERR_NONE) {
+            close(fd);
+            delete log;
+            return nullptr;
+        }
+    }
+    return log;
+}
+
+static ErrorResult _mmapext_direct_log_append(MmapManagerLogInternal *base, const void *src, uint64_t length)
+{
+    auto *log = static_cast<DirectLog *>(base);
+    const uint8_t *in = static_cast<const uint8_t *>(src);
+
+    while (length > 0) {
+        const uint64_t used = log->end - log->buffer_offset;
+        const uint64_t n = std::min(length, log->buffer_size - used);
+        memcpy(log->buffer.get() + used, in, n);
+        log->end += n;
+        in += n;
+        length -= n;
+
+        if (log->end - log->buffer_offset == log->buffer_size) {
+            auto err = log_pwrite_full(log, log->buffer.get(), log->buffer_size, log->buffer_offset);
+            if (err.error_code != MMAPEXT_ERR_NONE) {
+                return err;
+            }
+            log->buffer_offset += log->buffer_size;
+        }
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Returns the cache slot holding the block with at least the first needed bytes, reading it if it isn't.
+static ErrorResult
+_mmapext_direct_cached_block(DirectLog *log, uint64_t block, uint64_t needed, DirectCacheSlot **out)
+{
+    auto found = log->cached_blocks.find(block);
+    if (found != log->cached_blocks.end() && log->cache[found->second].valid >= needed) {
+        ++log->stats.cache_hits;
+        *out = &log->cache[found->second];
+        (*out)->last_used = ++log->tick;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    ++log->stats.cache_misses;
+
+    // The block is reread into its slot if it was cached before the buffer moved past more of it.
+    uint32_t victim = 0;
+    if (found != log->cached_blocks.end()) {
+        victim = found->second;
+    } else {
+        for (uint32_t i = 1; i < log->cache.size(); ++i) {
+            if (log->cache[i].last_used < log->cache[victim].last_used) {
+                victim = i;
+            }
+        }
+    }
+
+    DirectCacheSlot &slot = log->cache[victim];
+    if (slot.block != UINT64_MAX) {
+        log->cached_blocks.erase(slot.block);
+    }
+    slot.block = UINT64_MAX;
+    slot.last_used = 0;
+
+    const uint64_t start = block * direct_cache_block_size;
+    const uint64_t valid = std::min(direct_cache_block_size, log->buffer_offset - start);
+    auto err = log_pread_full(log, slot.data, valid, start);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    slot.block = block;
+    slot.valid = valid;
+    slot.last_used = ++log->tick;
+    log->cached_blocks.emplace(block, victim);
+    *out = &slot;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult
+_mmapext_direct_log_read(MmapManagerLogInternal *base, uint64_t offset, void *dst, uint64_t length)
+{
+    auto *log = static_cast<DirectLog *>(base);
+    uint8_t *out = static_cast<uint8_t *>(dst);
+
+    while (length > 0 && offset < log->buffer_offset) {
+        const uint64_t block = offset / direct_cache_block_size;
+        const uint64_t in_block = offset % direct_cache_block_size;
+        const uint64_t n =
+            std::min({ length, direct_cache_block_size - in_block, log->buffer_offset - offset });
+
+        DirectCacheSlot *slot = nullptr;
+        auto err = _mmapext_direct_cached_block(log, block, in_block + n, &slot);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+        memcpy(out, slot->data + in_block, n);
+
+        offset += n;
+        out += n;
+        length -= n;
+    }
+    memcpy(out, log->buffer.get() + (offset - log->buffer_offset), length);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Writes the buffer padded with zeros to the next aligned offset, the padding is overwritten by later
+// appends. Whole blocks leave the buffer, the partial last one stays in it.
+static ErrorResult _mmapext_direct_log_sync(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<DirectLog *>(base);
+    const uint64_t used = log->end - log->buffer_offset;
+    if (used > 0) {
+        const uint64_t padded = _mmapext_align_up(used, direct_alignment);
+        memset(log->buffer.get() + used, 0, padded - used);
+        auto err = log_pwrite_full(log, log->buffer.get(), padded, log->buffer_offset);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+
+        const uint64_t full = used / direct_alignment * direct_alignment;
+        memmove(log->buffer.get(), log->buffer.get() + full, used - full);
+        log->buffer_offset += full;
+    }
+    return log_sync_with_header(log);
+}
+
+static void _mmapext_direct_log_close(MmapManagerLogInternal *base)
+{
+    auto *log = static_cast<DirectLog *>(base);
+    close(log->fd);
+    delete log;
+}
+
+const LogEngine log_engine_direct = {
+    "direct",
+    _mmapext_direct_log_open,
+    _mmapext_direct_log_append,
+    _mmapext_direct_log_read,
+    _mmapext_direct_log_sync,
+    _mmapext_direct_log_close,
+};
@@ -0,0 +1,480 @@
+#include <mmapext/mmap_allocator.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <plog/Log.h>
+#include <string.h>
+#include <vector>
+
+namespace mmapext {
+
+namespace {
+
+constexpr uint64_t heap_magic = 0x5041454854584d4dull; // "MMXTHEAP"
+constexpr uint32_t heap_version = 1;
+
+// Offset of the allocator object inside the header chunk
+constexpr uint64_t allocator_object_offset = 1024;
+
+// Allocations start after the header chunk
+constexpr uint64_t heap_data_offset = MMAPEXT_PAGE_SIZE;
+
+constexpr uint32_t large_class = ~uint32_t(0);
+
+} // namespace
+
+// Lives at offset 0 of the heap file. Everything is stored as offsets from the start of the file.
+struct HeapHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+
+    // Address the raw pointers in the heap were made for. Set when the heap is created and left alone by
+    // opens at another address, so those keep reporting the pointers as invalid.
+    uint64_t base_address;
+
+    // Offset of the first never-allocated byte.
+    uint64_t top;
+
+    // Sum of the sizes of all blocks currently allocated.
+    uint64_t total_allocated;
+
+    // Offset of the root object's data. 0 if not set.
+    uint64_t root;
+
+    // Free lists. Each free block stores the offset of the next free block in its first 8 bytes. Free large
+    // blocks store their size in the next 8 bytes.
+    uint64_t free_lists[MmapAllocator::NUM_SIZE_CLASSES];
+    uint64_t large_free_list;
+};
+
+static_assert(sizeof(HeapHeader) <= allocator_object_offset, "");
+static_assert(allocator_object_offset + sizeof(MmapAllocator) <= heap_data_offset, "");
+
+// Stored right before the data of each allocation. There can be padding between the start of the block and
+// this header for allocations with alignment > 16.
+struct alignas(16) BlockHeader {
+    uint64_t requested_size;
+    uint32_t size_class;
+    uint32_t pad;
+};
+
+static_assert(sizeof(BlockHeader) == 16, "");
+
+struct FreeBlock {
+    uint64_t next;
+    uint64_t size;
+};
+
+template <typename T> static T align_up(T value, T divisor)
+{
+    return (value + divisor - 1) / divisor * divisor;
+}
+
+static uint32_t size_class_of(uint64_t block_size)
+{
+    uint32_t c = 0;
+    uint64_t s = MmapAllocator::MIN_CLASS_SIZE;
+    while (s < block_size) {
+        s <<= 1;
+        ++c;
+    }
+    return c;
+}
+
+static uint64_t class_block_size(uint32_t size_class) { return MmapAllocator::MIN_CLASS_SIZE << size_class; }
+
+// Worst case size of a block holding an allocation of `size` bytes aligned to `align`.
+static uint64_t needed_block_size(uint64_t size, uint64_t align)
+{
+    const uint64_t max_pad = align > sizeof(BlockHeader) ? align - sizeof(BlockHeader) : 0;
+    return max_pad + sizeof(BlockHeader) + size;
+}
+
+static uint64_t large_block_size(uint64_t pad, uint64_t requested_size)
+{
+    return align_up<uint64_t>(pad + sizeof(BlockHeader) + requested_size, MMAPEXT_PAGE_SIZE);
+}
+
+// A file is a new heap if it is empty or its header chunk is all zeros, as left by a creation that stopped
+// before writing the header. Otherwise copies its header to `existing`, whether it holds a heap or not.
+static bool is_new_heap_file(int fd, HeapHeader *existing)
+{
+    std::vector<uint8_t> chunk(MMAPEXT_PAGE_SIZE);
+    const ssize_t n = pread(fd, chunk.data(), chunk.size(), 0);
+    if (n <= 0) {
+        return true;
+    }
+    memcpy(existing, chunk.data(), std::min<uint64_t>(uint64_t(n), sizeof(*existing)));
+    return std::all_of(chunk.begin(), chunk.begin() + n, [](uint8_t b) { return b == 0; });
+}
+
+// Puts a large block, or the unused tail of one, on the large free list, or gives it back to the top of the
+// heap if it ends there.
+static void release_large_block(HeapHeader *h, uint8_t *base, uint64_t offset, uint64_t size)
+{
+    if (offset + size == h->top) {
+        h->top = offset;
+        return;
+    }
+
+    auto block = reinterpret_cast<FreeBlock *>(base + offset);
+    block->next = h->large_free_list;
+    block->size = size;
+    h->large_free_list = offset;
+}
+
+HeapHeader *MmapAllocator::header() const { return reinterpret_cast<HeapHeader *>(_man.address); }
+
+MmapAllocatorOpenResult MmapAllocator::open(const MmapAllocatorOptions &opts)
+{
+    MmapAllocatorOpenResult res{};
+
+    // Read the header first to know where the heap was mapped last time.
+    HeapHeader existing{};
+    bool is_new = true;
+    int fd = ::open(opts.backing_file, O_RDONLY);
+    if (fd != -1) {
+        is_new = is_new_heap_file(fd, &existing);
+        ::close(fd);
+    }
+
+    if (!is_new && existing.magic != heap_magic) {
+        res.error = ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "file exists but does not contain an mmap heap",
+        };
+        return res;
+    }
+
+    if (!is_new && (existing.version != heap_version || existing.chunk_size != MMAPEXT_PAGE_SIZE)) {
+        PLOGE.printf("heap file %s has version %u and chunk size %u, expected version %u and chunk size %u",
+                     opts.backing_file,
+                     existing.version,
+                     existing.chunk_size,
+                     heap_version,
+                     uint32_t(MMAPEXT_PAGE_SIZE));
+        res.error = ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "heap file was created with an incompatible version or chunk size",
+        };
+        return res;
+    }
+
+    auto create_opts = MmapManagerCreateOptions{
+        .backing_file = opts.backing_file,
+        .initial_reserved_size = opts.max_heap_size,
+        .reserve_existing_file_size = true,
+        .preferred_address = reinterpret_cast<void *>(existing.base_address),
+    };
+
+    MmapManager man = mmapext_create_manager(create_opts);
+    if (man.error_code != MMAPEXT_ERR_NONE) {
+        res.error = ErrorResult{ .error_code = man.error_code, .error_message = man.error_message };
+        return res;
+    }
+
+    MmapManagerMapNextChunkResult map_res{};
+    if (!is_new) {
+        map_res = mmapext_map_full_file(&man);
+    } else {
+        auto map_opts = MmapManagerMapNextOptions{
+            .dont_grow_if_fully_mapped = false,
+            .extra_chunks_to_reserve_on_grow = 0,
+            .chunks_to_map_next = 1,
+        };
+        map_res = mmapext_map_next_file_chunk(&man, map_opts);
+    }
+
+    if (map_res.error.error_code != MMAPEXT_ERR_NONE) {
+        mmapext_delete_manager(&man);
+        res.error = map_res.error;
+        return res;
+    }
+
+    auto h = reinterpret_cast<HeapHeader *>(man.address);
+
+    if (is_new) {
+        memset(h, 0, sizeof(*h));
+        h->magic = heap_magic;
+        h->version = heap_version;
+        h->chunk_size = MMAPEXT_PAGE_SIZE;
+        h->top = heap_data_offset;
+        h->base_address = uint64_t(man.address);
+        res.created = true;
+        res.pointers_valid = true;
+    } else {
+        res.pointers_valid = h->base_address == uint64_t(man.address);
+        if (!res.pointers_valid) {
+            PLOGW.printf("heap %s mapped at %p, previously at %p. Raw pointers in the heap are invalid",
+                         opts.backing_file,
+                         man.address,
+                         reinterpret_cast<void *>(h->base_address));
+        }
+    }
+
+    auto a = new (man.address + allocator_object_offset) MmapAllocator();
+    a->_man = man;
+    a->_chunks_per_grow = opts.chunks_per_grow == 0 ? 1 : opts.chunks_per_grow;
+    a->set_name("MmapAllocator", sizeof("MmapAllocator"));
+
+    PLOGI.printf("opened mmap heap %s at %p, top = %lu, allocated = %lu",
+                 opts.backing_file,
+                 man.address,
+                 h->top,
+                 h->total_allocated);
+
+    res.allocator = a;
+    return res;
+}
+
+ErrorResult MmapAllocator::close(MmapAllocator *a)
+{
+    // The allocator object lives inside the mapping, so take the manager out before unmapping.
+    MmapManager man = a->_man;
+    a->~MmapAllocator();
+    return mmapext_delete_manager(&man);
+}
+
+bool MmapAllocator::ensure_mapped(uint64_t end_offset)
+{
+    const uint64_t mapped_size = mmapext_mapped_size(&_man);
+    if (end_offset <= mapped_size) {
+        return true;
+    }
+
+    const uint64_t chunks_needed = align_up(end_offset - mapped_size, _man._chunk_size) / _man._chunk_size;
+    const uint64_t chunks_left = _man.num_chunks_reserved - _man.num_chunks_mapped;
+
+    if (chunks_needed > chunks_left) {
+        PLOGE.printf("mmap heap %s is out of reserved address space", _man.filepath);
+        return false;
+    }
+
+    auto opts = MmapManagerMapNextOptions{
+        .dont_grow_if_fully_mapped = false,
+        .extra_chunks_to_reserve_on_grow = 0,
+        .chunks_to_map_next = std::min(std::max(chunks_needed, _chunks_per_grow), chunks_left),
+    };
+
+    auto res = mmapext_map_next_file_chunk(&_man, opts);
+    if (res.error.error_code != MMAPEXT_ERR_NONE) {
+        PLOGE.printf("failed to extend mmap heap %s: %s", _man.filepath, res.error.error_message);
+        return false;
+    }
+    return true;
+}
+
+uint64_t MmapAllocator::take_block(uint32_t size_class, uint64_t block_size)
+{
+    HeapHeader *h = header();
+    uint8_t *base = _man.address;
+
+    if (size_class != large_class) {
+        uint64_t offset = h->free_lists[size_class];
+        if (offset != 0) {
+            h->free_lists[size_class] = reinterpret_cast<FreeBlock *>(base + offset)->next;
+            return offset;
+        }
+    } else {
+        // First fit. Splits off the tail of a larger free block.
+        uint64_t *link = &h->large_free_list;
+        while (*link != 0) {
+            auto block = reinterpret_cast<FreeBlock *>(base + *link);
+            if (block->size >= block_size) {
+                const uint64_t offset = *link;
+                if (block->size > block_size) {
+                    auto rest = reinterpret_cast<FreeBlock *>(base + offset + block_size);
+                    rest->next = block->next;
+                    rest->size = block->size - block_size;
+                    *link = offset + block_size;
+                } else {
+                    *link = block->next;
+                }
+                return offset;
+            }
+            link = &block->next;
+        }
+    }
+
+    // Large blocks are page aligned so that their tails can be split off as large blocks again.
+    uint64_t offset = align_up<uint64_t>(h->top, size_class == large_class ? MMAPEXT_PAGE_SIZE : 16);
+    if (!ensure_mapped(offset + block_size)) {
+        return 0;
+    }
+    h->top = offset + block_size;
+    return offset;
+}
+
+void *MmapAllocator::allocate_no_lock(uint64_t size, uint64_t align)
+{
+    if (size == 0) {
+        return nullptr;
+    }
+
+    if (align < alignof(BlockHeader)) {
+        align = alignof(BlockHeader);
+    }
+
+    const uint64_t needed = needed_block_size(size, align);
+
+    uint32_t size_class = large_class;
+    uint64_t block_size = 0;
+
+    if (needed <= MAX_CLASS_SIZE) {
+        size_class = size_class_of(needed);
+        block_size = class_block_size(size_class);
+    } else {
+        block_size = align_up<uint64_t>(needed, MMAPEXT_PAGE_SIZE);
+    }
+
+    const uint64_t block_offset = take_block(size_class, block_size);
+    if (block_offset == 0) {
+        return nullptr;
+    }
+
+    uint8_t *block = _man.address + block_offset;
+    auto data = reinterpret_cast<uint8_t *>(fo::memory::align_forward(block + sizeof(BlockHeader), align));
+    auto bh = reinterpret_cast<BlockHeader *>(data) - 1;
+    bh->requested_size = size;
+    bh->size_class = size_class;
+    bh->pad = uint32_t(reinterpret_cast<uint8_t *>(bh) - block);
+
+    if (size_class != large_class) {
+        header()->total_allocated += block_size;
+        return data;
+    }
+
+    // The block was sized for the worst case padding. Deallocation only knows the actual padding, so the
+    // pages past what it needs are released now.
+    const uint64_t used_size = large_block_size(bh->pad, size);
+    if (used_size < block_size) {
+        release_large_block(header(), _man.address, block_offset + used_size, block_size - used_size);
+    }
+    header()->total_allocated += used_size;
+    return data;
+}
+
+void MmapAllocator::deallocate_no_lock(void *p)
+{
+    if (p == nullptr) {
+        return;
+    }
+
+    HeapHeader *h = header();
+    uint8_t *base = _man.address;
+
+    auto bh = reinterpret_cast<BlockHeader *>(p) - 1;
+    const uint64_t block_offset = uint64_t(reinterpret_cast<uint8_t *>(bh) - base) - bh->pad;
+    auto block = reinterpret_cast<FreeBlock *>(base + block_offset);
+
+    if (bh->size_class != large_class) {
+        h->total_allocated -= class_block_size(bh->size_class);
+        block->next = h->free_lists[bh->size_class];
+        h->free_lists[bh->size_class] = block_offset;
+        return;
+    }
+
+    const uint64_t block_size = large_block_size(bh->pad, bh->requested_size);
+    h->total_allocated -= block_size;
+    release_large_block(h, base, block_offset, block_size);
+}
+
+void *MmapAllocator::allocate(fo::AddrUint size, fo::AddrUint align)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    return allocate_no_lock(size, align);
+}
+
+void MmapAllocator::deallocate(void *p)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    deallocate_no_lock(p);
+}
+
+void *MmapAllocator::reallocate(void *old_allocation,
+                                fo::AddrUint new_size,
+                                fo::AddrUint align,
+                                fo::AddrUint old_size)
+{
+    (void)old_size; // This allocator tracks size per allocation
+
+    std::lock_guard<std::mutex> lk(_mutex);
+
+    if (old_allocation == nullptr) {
+        return allocate_no_lock(new_size, align);
+    }
+
+    if (new_size == 0) {
+        deallocate_no_lock(old_allocation);
+        return nullptr;
+    }
+
+    auto bh = reinterpret_cast<BlockHeader *>(old_allocation) - 1;
+
+    // Grow or shrink in place if the block is big enough and no smaller class would do.
+    if (bh->size_class != large_class) {
+        const uint64_t needed = needed_block_size(new_size, align);
+        if (needed <= MAX_CLASS_SIZE && size_class_of(needed) == bh->size_class) {
+            bh->requested_size = new_size;
+            return old_allocation;
+        }
+    } else if (large_block_size(bh->pad, new_size) == large_block_size(bh->pad, bh->requested_size)) {
+        bh->requested_size = new_size;
+        return old_allocation;
+    }
+
+    const uint64_t copy_size = std::min<uint64_t>(bh->requested_size, new_size);
+
+    void *new_allocation = allocate_no_lock(new_size, align);
+    if (new_allocation == nullptr) {
+        return nullptr;
+    }
+    memcpy(new_allocation, old_allocation, copy_size);
+    deallocate_no_lock(old_allocation);
+    return new_allocation;
+}
+
+uint64_t MmapAllocator::allocated_size(void *p)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    return (reinterpret_cast<BlockHeader *>(p) - 1)->requested_size;
+}
+
+uint64_t MmapAllocator::total_allocated()
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    return header()->total_allocated;
+}
+
+void *MmapAllocator::root()
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    const uint64_t offset = header()->root;
+    return offset == 0 ? nullptr : _man.address + offset;
+}
+
+void MmapAllocator::set_root(void *p)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    header()->root = p == nullptr ? 0 : uint64_t(reinterpret_cast<uint8_t *>(p) - _man.address);
+}
+
+ErrorResult MmapAllocator::sync()
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (msync(_man.address, mmapext_mapped_size(&_man), MS_SYNC) != 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_UNKNOWN,
+            .error_message = "msync failed on mmap heap",
+            .saved_errno = errno,
+        };
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+} // namespace mmapext
@@ -1,10 +1,20 @@
 #include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <mmapext/mmapext.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include "mmapext_internal.h"
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <optional>
+#include <thread>
 #include <plog/Log.h>
 
 constexpr uint64_t mmapext_page_size = MMAPEXT_PAGE_SIZE;
@@ -16,7 +26,44 @@ static std::optional<uint64_t> file_size(const char *filepath);
 static ErrorResult _mmapext_map_next_chunk_dont_grow(struct MmapManager *man,
                                                      struct MmapManagerMapNextOptions opts);
 
-static ErrorResult _mmapext_grow_reserved_address_space(MmapManager *man, uint64_t grow_num_chunks);
+static ErrorResult
+_mmapext_grow_reserved_address_space(MmapManager *man, uint64_t grow_num_chunks, uint8_t **new_address);
+
+static void _mmapext_publish_moved_mapping(MmapManager *man, uint8_t *new_address, uint64_t grow_num_chunks);
+
+static uint64_t _mmapext_reclaim_retired(MmapManager *man, bool force);
+
+static ErrorResult _mmapext_apply_numa_policy(MmapManager *man, uint64_t offset, uint64_t length);
+
+static ErrorResult _mmapext_relock_ranges(MmapManager *man);
+
+static ErrorResult _mmapext_map_chunks(MmapManager *man, uint64_t first, uint64_t n);
+
+static void _mmapext_set_chunks_mapped(MmapManagerInternal *internal, uint64_t first, uint64_t n);
+
+static ErrorResult _mmapext_map_missing_chunks(MmapManager *man, uint64_t first, uint64_t end);
+
+static MmapManagerMapNextChunkResult _mmapext_regrow_on_demand(MmapManager *man,
+                                                               uint8_t *new_address,
+                                                               uint64_t grow_num_chunks,
+                                                               uint64_t wanted_mapped_chunks,
+                                                               uint64_t file_size_increment);
+
+static int64_t _mmapext_vma_delta(const MmapManager *man, uint64_t first, uint64_t end, bool map);
+
+static bool _mmapext_charge_vmas(MmapManagerInternal *internal, int64_t delta);
+
+static void _mmapext_recount_vmas(MmapManager *man);
+
+static ErrorResult _mmapext_vma_limit_error(int64_t delta);
+
+// Bytes locked by all managers, and the limit set with mmapext_set_lock_budget.
+static std::atomic<uint64_t> g_locked_bytes{ 0 };
+static std::atomic<uint64_t> g_lock_budget{ 0 };
+
+// VMAs of all managers, and the limit set with mmapext_set_vma_budget.
+static std::atomic<uint64_t> g_vmas{ 0 };
+static std::atomic<uint64_t> g_vma_budget{ 0 };
 
 template <typename T> T align_forward(T value, T divisor)
 {
@@ -58,12 +105,93 @@ ErrorResult extend_file_size(int fd, uint64_t file_size)
     return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
 }
 
+MmapManager open_structure_file(const char *backing_file, uint64_t initial_reserved_size)
+{
+    auto create_opts = MmapManagerCreateOptions{
+        .backing_file = backing_file,
+        .initial_reserved_size = initial_reserved_size,
+        .reserve_existing_file_size = true,
+    };
+
+    MmapManager man = mmapext_create_manager(create_opts);
+    if (man.error_code != MMAPEXT_ERR_NONE) {
+        return man;
+    }
+
+    auto map_res = mmapext_map_full_file(&man);
+    if (map_res.error.error_code == MMAPEXT_ERR_NONE && man.num_chunks_mapped == 0) {
+        auto map_opts = MmapManagerMapNextOptions{
+            .dont_grow_if_fully_mapped = false,
+            .extra_chunks_to_reserve_on_grow = 0,
+            .chunks_to_map_next = 1,
+        };
+        map_res = mmapext_map_next_file_chunk(&man, map_opts);
+    }
+
+    if (map_res.error.error_code != MMAPEXT_ERR_NONE) {
+        mmapext_delete_manager(&man);
+        man = MmapManager{};
+        man._fd = -1;
+        man.error_code = map_res.error.error_code;
+        man.error_message = map_res.error.error_message;
+    }
+    return man;
+}
+
+ErrorResult grow_structure_file(MmapManager *man, uint64_t end_offset, const char *name)
+{
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (end_offset <= mapped_size) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // Double the file each time so the number of remaps stays logarithmic.
+    const uint64_t chunks_needed =
+        align_forward(end_offset - mapped_size, man->_chunk_size) / man->_chunk_size;
+    const uint64_t chunks = std::max<uint64_t>(chunks_needed, man->num_chunks_mapped);
+
+    auto opts = MmapManagerMapNextOptions{
+        .dont_grow_if_fully_mapped = false,
+        .extra_chunks_to_reserve_on_grow = 2 * chunks,
+        .chunks_to_map_next = chunks,
+    };
+
+    auto res = mmapext_map_next_file_chunk(man, opts);
+    if (res.error.error_code != MMAPEXT_ERR_NONE) {
+        PLOGE.printf("failed to grow %s %s: %s", name, man->filepath, res.error.error_message);
+    }
+    return res.error;
+}
+
+ErrorResult sync_structure_file(MmapManager *man, const char *error_message)
+{
+    if (msync(man->address, mmapext_mapped_size(man), MS_SYNC) != 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_UNKNOWN,
+            .error_message = error_message,
+            .saved_errno = errno,
+        };
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
 struct MmapManager mmapext_create_manager(MmapManagerCreateOptions opts)
 {
     std::array<char, 1024> errno_desc_buf{};
 
     MmapManager manager{};
 
+    if (opts.numa_policy < MMAPEXT_NUMA_DEFAULT || opts.numa_policy > MMAPEXT_NUMA_PREFERRED ||
+        (opts.numa_policy != MMAPEXT_NUMA_DEFAULT && opts.numa_node_mask == 0)) {
+        manager._fd = -1;
+        manager.error_code = MMAPEXT_ERR_INVALID_ARGUMENT;
+        manager.error_message = "unknown numa policy or empty numa node mask";
+        return manager;
+    }
+
+    manager._numa_policy = opts.numa_policy;
+    manager._numa_node_mask = opts.numa_node_mask;
+
     if (opts.initial_reserved_size < mmapext_page_size) {
         opts.initial_reserved_size = mmapext_page_size;
     }
@@ -101,8 +229,25 @@ struct MmapManager mmapext_create_manager(MmapManagerCreateOptions opts)
         return manager;
     }
 
-    uint64_t reserved_size = opts.initial_reserved_size;
-    if (new_file_size > opts.initial_reserved_size && opts.reserve_existing_file_size) {
+    // The superblock says how much of the file is in use, so that much is mapped right away.
+    uint64_t superblock_mapped_size = 0;
+    if (opts.use_superblock) {
+        uint64_t logical_length = 0;
+        err = superblock_open(manager._fd, new_file_size, opts.superblock_features, &logical_length);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            PLOGE.printf("can't use superblock of %s: %s", opts.backing_file, err.error_message);
+            close(manager._fd);
+            manager._fd = -1;
+            manager.error_code = err.error_code;
+            manager.error_message = err.error_message;
+            return manager;
+        }
+        superblock_mapped_size = align_forward(logical_length, mmapext_page_size);
+        new_file_size = std::max(new_file_size, mmapext_page_size);
+    }
+
+    uint64_t reserved_size = std::max(opts.initial_reserved_size, superblock_mapped_size);
+    if (new_file_size > reserved_size && (opts.reserve_existing_file_size || opts.map_on_demand)) {
         reserved_size = new_file_size;
     }
 
@@ -111,8 +256,36 @@ struct MmapManager mmapext_create_manager(MmapManagerCreateOptions opts)
     manager.filepath = reinterpret_cast<char *>(malloc(strlen(opts.backing_file) + 1));
     strcpy(manager.filepath, opts.backing_file);
 
-    void *addr = mmap(nullptr, reserved_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (addr == nullptr) {
+    manager._internal = new MmapManagerInternal();
+
+    void *addr = MAP_FAILED;
+    if (opts.preferred_address != nullptr) {
+        addr = timed_syscall(manager._internal, MMAPEXT_OP_MMAP, [&] {
+            return mmap(opts.preferred_address,
+                        reserved_size,
+                        PROT_NONE,
+                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+                        -1,
+                        0);
+        });
+        // Older kernels treat MAP_FIXED_NOREPLACE as a plain hint.
+        if (addr != MAP_FAILED && addr != opts.preferred_address) {
+            munmap(addr, reserved_size);
+            addr = MAP_FAILED;
+        }
+        if (addr == MAP_FAILED) {
+            PLOGW.printf("could not reserve address space at preferred address %p", opts.preferred_address);
+        }
+    }
+
+    if (addr == MAP_FAILED) {
+        addr = timed_syscall(manager._internal, MMAPEXT_OP_MMAP, [&] {
+            return mmap(nullptr, reserved_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        });
+    }
+    if (addr == MAP_FAILED) {
+        delete manager._internal;
+        manager._internal = nullptr;
         manager.error_code = MMAPEXT_ERR_FAILED_TO_MMAP;
         manager.error_message = "failed to reserve initial address space with mmap";
         return manager;
@@ -130,6 +303,40 @@ struct MmapManager mmapext_create_manager(MmapManagerCreateOptions opts)
                  reserved_size_str.c_str(),
                  mmapext_reserved_size(&manager));
 
+    // Without mapping on demand, the superblock maps the logical length. With it, the whole file is within
+    // the mapped size and only the superblock and the initial range get mapped.
+    if (opts.map_on_demand) {
+        manager._internal->on_demand = true;
+        manager.num_chunks_mapped = new_file_size / mmapext_page_size;
+    }
+    manager._internal->has_superblock = opts.use_superblock;
+
+    if (opts.map_on_demand && !manager._internal->mapped_chunks.resize(manager.num_chunks_reserved)) {
+        err = ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+    } else {
+        // The reservation, nothing is mapped in it yet.
+        _mmapext_recount_vmas(&manager);
+    }
+
+    if (err.error_code == MMAPEXT_ERR_NONE && opts.use_superblock && opts.map_on_demand) {
+        err = mmapext_ensure_mapped(&manager, 0, mmapext_page_size);
+    } else if (err.error_code == MMAPEXT_ERR_NONE && opts.use_superblock) {
+        auto map_opts = MmapManagerMapNextOptions{
+            .chunks_to_map_next = superblock_mapped_size / mmapext_page_size,
+        };
+        err = _mmapext_map_next_chunk_dont_grow(&manager, map_opts);
+    }
+    if (err.error_code == MMAPEXT_ERR_NONE && opts.map_on_demand) {
+        err = mmapext_ensure_mapped(&manager, opts.initial_map_offset, opts.initial_map_length);
+    }
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        mmapext_delete_manager(&manager);
+        manager._fd = -1;
+        manager.error_code = err.error_code;
+        manager.error_message = err.error_message;
+        return manager;
+    }
+
     return manager;
 }
 
@@ -140,7 +347,18 @@ ErrorResult mmapext_delete_manager(struct MmapManager *man)
         return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
     }
 
-    int r = munmap(man->address, mmapext_reserved_size(man));
+    if (man->_internal != nullptr) {
+        lazy_state_delete(man->_internal->lazy);
+        man->_internal->lazy = nullptr;
+        size_watchdog_delete(man->_internal->watchdog);
+        man->_internal->watchdog = nullptr;
+        async_ring_delete(man->_internal->async);
+        man->_internal->async = nullptr;
+        _mmapext_reclaim_retired(man, true);
+    }
+
+    int r = timed_syscall(
+        man->_internal, MMAPEXT_OP_MUNMAP, [&] { return munmap(man->address, mmapext_reserved_size(man)); });
     if (r != 0) {
         PLOGE.printf("failed to unmap reserved address space");
         return ErrorResult{
@@ -166,6 +384,18 @@ ErrorResult mmapext_delete_manager(struct MmapManager *man)
     free(man->filepath);
     man->filepath = nullptr;
 
+    if (man->_internal != nullptr) {
+        // munmap dropped the locks.
+        for (const auto &range : man->_internal->locked_ranges) {
+            g_locked_bytes -= range.second - range.first;
+        }
+        g_vmas -= man->_internal->vmas.load();
+        seal_state_delete(man->_internal->seal);
+        dirty_tracker_delete(man->_internal->dirty);
+        delete man->_internal;
+        man->_internal = nullptr;
+    }
+
     return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
 }
 
@@ -209,9 +439,17 @@ struct MmapManagerMapNextChunkResult mmapext_map_next_file_chunk(struct MmapMana
 {
     std::array<char, safe_strerror_bufsize> errno_desc_buf{};
 
+    if (man->_internal != nullptr && man->_internal->lazy != nullptr) {
+        auto err = ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "lazily mapped managers are fully mapped and can't grow",
+        };
+        return MmapManagerMapNextChunkResult{ .error = err };
+    }
+
     // Unmap the current mapping and map an extended amount of file.
     struct stat statbuf;
-    if (stat(man->filepath, &statbuf) != 0) {
+    if (timed_syscall(man->_internal, MMAPEXT_OP_STAT, [&] { return fstat(man->_fd, &statbuf); }) != 0) {
         PLOGE.printf("failed to stat backing file: %s, errno = %d, error = %s",
                      man->filepath,
                      errno,
@@ -232,15 +470,16 @@ struct MmapManagerMapNextChunkResult mmapext_map_next_file_chunk(struct MmapMana
     bool need_to_grow_file = false;
     uint64_t file_size_increment = 0;
 
-    if (man->num_chunks_reserved >= wanted_mapped_chunks) {
-        if (statbuf.st_size < wanted_mapped_chunks * man->_chunk_size) {
-            // return _mmapext_map_next_chunk_dont_grow(man, opts);
-            need_to_grow_file = true;
-        }
-    } else {
+    if (man->num_chunks_reserved < wanted_mapped_chunks) {
         need_to_grow_reserved_space = true;
     }
 
+    // The file has to cover the mapping whether or not the reserved space grows, or touching the tail of
+    // the mapping raises SIGBUS.
+    if (uint64_t(statbuf.st_size) < wanted_mapped_chunks * man->_chunk_size) {
+        need_to_grow_file = true;
+    }
+
     PLOGI.printf("need to grow file and/or reserved address space: grow file? %d, grow reserved? %d",
                  need_to_grow_file,
                  need_to_grow_reserved_space);
@@ -262,7 +501,9 @@ struct MmapManagerMapNextChunkResult mmapext_map_next_file_chunk(struct MmapMana
         const uint64_t new_file_size = wanted_mapped_chunks * man->_chunk_size;
         file_size_increment = new_file_size - uint64_t(statbuf.st_size);
 
-        if (ftruncate(man->_fd, new_file_size) != 0) {
+        if (timed_syscall(man->_internal, MMAPEXT_OP_FTRUNCATE, [&] {
+                return ftruncate(man->_fd, new_file_size);
+            }) != 0) {
             PLOGE.printf("failed to extend file %s using ftruncate: %s",
                          man->filepath,
                          safe_strerror(errno_desc_buf, errno));
@@ -275,6 +516,9 @@ struct MmapManagerMapNextChunkResult mmapext_map_next_file_chunk(struct MmapMana
             return MmapManagerMapNextChunkResult{ .error = err };
         }
 
+        MMAPEXT_METRIC_ADD(man, file_extensions, 1);
+        MMAPEXT_METRIC_ADD(man, file_extension_bytes, file_size_increment);
+
         auto old_reserved_size_str = _format_memory_size(statbuf.st_size);
         auto new_reserved_size_str = _format_memory_size(new_file_size);
 
@@ -286,41 +530,79 @@ struct MmapManagerMapNextChunkResult mmapext_map_next_file_chunk(struct MmapMana
     if (need_to_grow_reserved_space) {
         const auto reserve_grow_chunks =
             std::max(opts.extra_chunks_to_reserve_on_grow, opts.chunks_to_map_next);
-        ErrorResult err = _mmapext_grow_reserved_address_space(man, reserve_grow_chunks);
+        uint8_t *new_address = nullptr;
+        ErrorResult err = _mmapext_grow_reserved_address_space(man, reserve_grow_chunks, &new_address);
         if (err.error_code != MMAPEXT_ERR_NONE) {
             PLOGE.printf("failed to grow reserved address space: %s", err.error_message);
             return MmapManagerMapNextChunkResult{ .error = err };
         }
         PLOGI.printf("grew reserved address space");
 
+        if (man->_internal != nullptr && man->_internal->on_demand) {
+            return _mmapext_regrow_on_demand(
+                man, new_address, reserve_grow_chunks, wanted_mapped_chunks, file_size_increment);
+        }
+
         // In this case we have to remap the address space. Map all the file chunks from start to desired.
-        man->num_chunks_mapped = wanted_mapped_chunks;
-        PLOGI.printf("Reallocated %zu chunks with %zu in total to be mapped (adding %zu chunks to currently "
-                     "mapped chunks)",
-                     man->num_chunks_reserved,
-                     man->num_chunks_mapped,
-                     opts.chunks_to_map_next);
-        void *same_addr = mmap(man->address,
-                               man->num_chunks_mapped * man->_chunk_size,
-                               PROT_READ | PROT_WRITE,
-                               MAP_SHARED | MAP_FIXED,
-                               man->_fd,
-                               0);
-        if (same_addr == nullptr) {
-            auto reserved_size_str = _format_memory_size(mmapext_reserved_size(man));
+        // Readers may still use the old mapping, so the new one is complete before it replaces it.
+        void *same_addr = timed_syscall(man->_internal, MMAPEXT_OP_MMAP, [&] {
+            return mmap(new_address,
+                        wanted_mapped_chunks * man->_chunk_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED,
+                        man->_fd,
+                        0);
+        });
+        if (same_addr == MAP_FAILED) {
+            const int saved_errno = errno;
+            const uint64_t new_reserved_size =
+                (man->num_chunks_reserved + reserve_grow_chunks) * man->_chunk_size;
+            auto reserved_size_str = _format_memory_size(new_reserved_size);
             PLOGE.printf("failed to remap the file after extending address space to size %s, errno: %s",
                          reserved_size_str.c_str(),
-                         safe_strerror(errno_desc_buf, errno));
+                         safe_strerror(errno_desc_buf, saved_errno));
+            munmap(new_address, new_reserved_size);
 
             auto err = ErrorResult{
                 .error_code = MMAPEXT_ERR_FAILED_TO_MMAP,
                 .error_message =
                     R"(failed to mmap extended number of chunks after extending file and address space respectively.)",
-                .saved_errno = errno,
+                .saved_errno = saved_errno,
             };
             return MmapManagerMapNextChunkResult{ .error = err };
         }
 
+        _mmapext_publish_moved_mapping(man, new_address, reserve_grow_chunks);
+        __atomic_store_n(&man->num_chunks_mapped, uint32_t(wanted_mapped_chunks), __ATOMIC_SEQ_CST);
+        PLOGI.printf("Reallocated %zu chunks with %zu in total to be mapped (adding %zu chunks to currently "
+                     "mapped chunks)",
+                     man->num_chunks_reserved,
+                     man->num_chunks_mapped,
+                     opts.chunks_to_map_next);
+
+        MMAPEXT_METRIC_ADD(man, grow_events, 1);
+        MMAPEXT_METRIC_ADD(man, moved_mapping_events, 1);
+        MMAPEXT_METRIC_ADD(man, bytes_mapped, mmapext_mapped_size(man));
+#if MMAPEXT_METRICS
+        man->_internal->metrics.last_grow_time_ns.store(clock_ns(CLOCK_REALTIME), std::memory_order_relaxed);
+#endif
+        _mmapext_recount_vmas(man);
+
+        err = _mmapext_apply_numa_policy(man, 0, mmapext_mapped_size(man));
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return MmapManagerMapNextChunkResult{ .error = err, .mapping_was_moved = true };
+        }
+
+        err = _mmapext_relock_ranges(man);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return MmapManagerMapNextChunkResult{ .error = err, .mapping_was_moved = true };
+        }
+
+        err = dirty_tracker_on_map(man, 0, mmapext_mapped_size(man));
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return MmapManagerMapNextChunkResult{ .error = err, .mapping_was_moved = true };
+        }
+
         return MmapManagerMapNextChunkResult{
             .error = ErrorResult{ .error_code = MMAPEXT_ERR_NONE },
             .mapping_was_moved = true,
@@ -344,15 +626,24 @@ ErrorResult _mmapext_map_next_chunk_dont_grow(struct MmapManager *man, struct Mm
     uint64_t cur_mapped_size = man->num_chunks_mapped * man->_chunk_size;
     uint8_t *next_mapped_chunk_addr = man->address + cur_mapped_size;
     uint64_t next_mapped_chunk_size = opts.chunks_to_map_next * man->_chunk_size;
-    
-    void *mapped_addr = mmap(next_mapped_chunk_addr,
-                             next_mapped_chunk_size,
-                             PROT_READ | PROT_WRITE,
-                             MAP_SHARED | MAP_FIXED,
-                             man->_fd,
-                             cur_mapped_size);
-
-    if (mapped_addr == nullptr) {
+
+    const int64_t vma_delta = _mmapext_vma_delta(
+        man, man->num_chunks_mapped, man->num_chunks_mapped + opts.chunks_to_map_next, true);
+    if (!_mmapext_charge_vmas(man->_internal, vma_delta)) {
+        return _mmapext_vma_limit_error(vma_delta);
+    }
+
+    void *mapped_addr = timed_syscall(man->_internal, MMAPEXT_OP_MMAP, [&] {
+        return mmap(next_mapped_chunk_addr,
+                    next_mapped_chunk_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED,
+                    man->_fd,
+                    cur_mapped_size);
+    });
+
+    if (mapped_addr == MAP_FAILED) {
+        _mmapext_charge_vmas(man->_internal, -vma_delta);
         PLOGE.printf("failed to extend mapping to existing file chunks from %d to %d chunks",
                      man->num_chunks_mapped,
                      man->num_chunks_mapped + opts.chunks_to_map_next);
@@ -365,49 +656,1153 @@ ErrorResult _mmapext_map_next_chunk_dont_grow(struct MmapManager *man, struct Mm
 
     PLOGI.printf("mapped %li chunks at tail", int64_t(opts.chunks_to_map_next));
 
+    _mmapext_set_chunks_mapped(man->_internal, man->num_chunks_mapped, opts.chunks_to_map_next);
     man->num_chunks_mapped += opts.chunks_to_map_next;
-    return ErrorResult{};
+    MMAPEXT_METRIC_ADD(man, bytes_mapped, next_mapped_chunk_size);
+
+    auto err = _mmapext_apply_numa_policy(man, cur_mapped_size, next_mapped_chunk_size);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    return dirty_tracker_on_map(man, cur_mapped_size, next_mapped_chunk_size);
 }
 
-ErrorResult _mmapext_grow_reserved_address_space(MmapManager *man, uint64_t grow_num_chunks)
+// Returns the first chunk of [first, end) that is mapped if mapped is true, or not mapped otherwise. end if
+// there is none.
+static uint64_t
+_mmapext_next_chunk(const MmapManagerInternal *internal, uint64_t first, uint64_t end, bool mapped)
 {
-    uint64_t new_reserved_size = (man->num_chunks_reserved + grow_num_chunks) * man->_chunk_size;
+    const uint64_t flip = mapped ? 0 : ~uint64_t(0);
+    for (uint64_t chunk = first; chunk < end;) {
+        const uint64_t bit = chunk % 64;
+        const uint64_t bits = __atomic_load_n(&internal->mapped_chunks.words[chunk / 64], __ATOMIC_ACQUIRE);
+        const uint64_t word = (bits ^ flip) >> bit;
+        if (word != 0) {
+            return std::min(end, chunk + __builtin_ctzll(word));
+        }
+        chunk += 64 - bit;
+    }
+    return end;
+}
 
-    // First we relinquish current reserved address space and then we map the
-    // already-mapped address-space worth of memory plus the requested chunks to
-    // map.
-    int r = munmap(man->address, mmapext_reserved_size(man));
-    if (r != 0) {
+// Calls f with the word index and mask of each bitmap word covering part of the chunks [first, first + n).
+template <typename F> static void _mmapext_for_each_chunk_word(uint64_t first, uint64_t n, F &&f)
+{
+    for (uint64_t chunk = first; chunk < first + n;) {
+        const uint64_t bit = chunk % 64;
+        const uint64_t count = std::min(64 - bit, first + n - chunk);
+        f(chunk / 64, (count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1)) << bit);
+        chunk += count;
+    }
+}
+
+// Marks the chunks [first, first + n) mapped, if the manager maps on demand. The release pairs with the
+// acquire of _mmapext_next_chunk, so threads that see the bit also see the mapping.
+void _mmapext_set_chunks_mapped(MmapManagerInternal *internal, uint64_t first, uint64_t n)
+{
+    if (internal == nullptr || !internal->on_demand) {
+        return;
+    }
+    _mmapext_for_each_chunk_word(first, n, [&](uint64_t word, uint64_t mask) {
+        __atomic_fetch_or(&internal->mapped_chunks.words[word], mask, __ATOMIC_RELEASE);
+    });
+}
+
+static void _mmapext_clear_chunks_mapped(MmapManagerInternal *internal, uint64_t first, uint64_t n)
+{
+    _mmapext_for_each_chunk_word(first, n, [&](uint64_t word, uint64_t mask) {
+        __atomic_fetch_and(&internal->mapped_chunks.words[word], ~mask, __ATOMIC_RELEASE);
+    });
+}
+
+// Calls f(run_first, run_end) for each run of chunks within [first, end) that are mapped if mapped is true,
+// or not mapped otherwise, until f returns false.
+template <typename F>
+static void _mmapext_for_each_run(const MmapManagerInternal *internal, uint64_t first, uint64_t end,
+                                  bool mapped, F &&f)
+{
+    for (uint64_t chunk = _mmapext_next_chunk(internal, first, end, mapped); chunk < end;) {
+        const uint64_t run_end = _mmapext_next_chunk(internal, chunk, end, !mapped);
+        if (!f(chunk, run_end)) {
+            return;
+        }
+        chunk = _mmapext_next_chunk(internal, run_end, end, mapped);
+    }
+}
+
+// Without a budget, managers may take half of vm.max_map_count, the other half is for libraries, malloc
+// arenas and thread stacks.
+static uint64_t _mmapext_vma_limit()
+{
+    static const uint64_t max_map_count = [] {
+        uint64_t n = 65530; // DEFAULT_MAX_MAP_COUNT of the kernel
+        if (FILE *f = fopen("/proc/sys/vm/max_map_count", "r")) {
+            if (fscanf(f, "%lu", &n) != 1) {
+                n = 65530;
+            }
+            fclose(f);
+        }
+        return n;
+    }();
+
+    const uint64_t budget = g_vma_budget.load();
+    return budget == 0 ? max_map_count / 2 : std::min(budget, max_map_count);
+}
+
+// Adds delta to the VMAs of the manager and of all managers. Fails without changing either if that goes
+// over the limit. Giving VMAs back always succeeds.
+bool _mmapext_charge_vmas(MmapManagerInternal *internal, int64_t delta)
+{
+    if (internal == nullptr || delta == 0) {
+        return true;
+    }
+    if (delta > 0) {
+        const uint64_t limit = _mmapext_vma_limit();
+        uint64_t cur = g_vmas.load();
+        do {
+            if (uint64_t(delta) > limit || cur > limit - uint64_t(delta)) {
+                return false;
+            }
+        } while (!g_vmas.compare_exchange_weak(cur, cur + uint64_t(delta)));
+    } else {
+        g_vmas -= uint64_t(-delta);
+    }
+    internal->vmas += uint64_t(delta);
+    return true;
+}
+
+ErrorResult _mmapext_vma_limit_error(int64_t delta)
+{
+    PLOGW.printf("%ld more VMAs would exceed the VMA budget of %lu", delta, _mmapext_vma_limit());
+    return ErrorResult{
+        .error_code = MMAPEXT_ERR_VMA_LIMIT,
+        .error_message = "mapping the range would exceed the VMA budget or vm.max_map_count",
+    };
+}
+
+// 1 if the chunk is mapped, 0 if it is reserved address space, -1 past the reservation.
+static int _mmapext_chunk_state(const MmapManager *man, uint64_t chunk)
+{
+    if (chunk >= man->num_chunks_reserved) {
+        return -1;
+    }
+    const MmapManagerInternal *internal = man->_internal;
+    if (internal != nullptr && internal->on_demand) {
+        return _mmapext_next_chunk(internal, chunk, chunk + 1, true) == chunk;
+    }
+    return chunk < man->num_chunks_mapped;
+}
+
+// Change of the VMA estimate from turning the chunks [first, end), all reserved address space or all
+// mapped, into the other. The kernel merges the run with neighbors that end up in the same state, and
+// splits the area it is cut out of.
+int64_t _mmapext_vma_delta(const MmapManager *man, uint64_t first, uint64_t end, bool map)
+{
+    if (first >= end) {
+        return 0;
+    }
+    const int from = map ? 0 : 1;
+    const int to = 1 - from;
+    const int left = first > 0 ? _mmapext_chunk_state(man, first - 1) : -1;
+    const int right = _mmapext_chunk_state(man, end);
+    return int64_t(left == from) + int64_t(right == from) - int64_t(left == to) - int64_t(right == to);
+}
+
+// Sets the estimate from the layout of the manager, after the mapping moved or mapping failed halfway. Not
+// checked against the limit, the layout is there already.
+void _mmapext_recount_vmas(MmapManager *man)
+{
+    MmapManagerInternal *internal = man->_internal;
+    if (internal == nullptr) {
+        return;
+    }
+
+    uint64_t vmas = 2 * internal->locked_ranges.size();
+    const uint64_t end = man->num_chunks_reserved;
+    if (!internal->on_demand) {
+        vmas += uint64_t(man->num_chunks_mapped > 0) + uint64_t(end > man->num_chunks_mapped);
+    } else {
+        bool mapped = _mmapext_chunk_state(man, 0) == 1;
+        for (uint64_t chunk = 0; chunk < end; mapped = !mapped) {
+            ++vmas;
+            chunk = _mmapext_next_chunk(internal, chunk, end, !mapped);
+        }
+    }
+
+    vmas += internal->retired_vmas.load();
+    const uint64_t old = internal->vmas.exchange(vmas);
+    g_vmas += vmas - old;
+}
+
+// Gaps of reserved address space of up to this many chunks between a range being mapped and mapped chunks
+// are mapped along with it, which merges the areas on both sides of the gap. The gap costs address space,
+// but no memory until it is touched.
+constexpr uint64_t vma_coalesce_gap_chunks = 16;
+
+// Widens [*first, *end) over small gaps to mapped chunks. Stays within the mapped size, which the file
+// covers.
+static void _mmapext_coalesce_range(const MmapManager *man, uint64_t *first, uint64_t *end)
+{
+    for (uint64_t gap = 0; gap <= vma_coalesce_gap_chunks && gap < *first; ++gap) {
+        if (_mmapext_chunk_state(man, *first - gap - 1) == 1) {
+            *first -= gap;
+            break;
+        }
+    }
+    for (uint64_t gap = 0; gap <= vma_coalesce_gap_chunks && *end + gap < man->num_chunks_mapped; ++gap) {
+        if (_mmapext_chunk_state(man, *end + gap) == 1) {
+            *end += gap;
+            break;
+        }
+    }
+}
+
+// Starts tracking mapped chunks in a manager that maps a prefix of the file, with the prefix as mapped.
+// Called with the map mutex held.
+static ErrorResult _mmapext_switch_to_on_demand(MmapManager *man)
+{
+    MmapManagerInternal *internal = man->_internal;
+    if (internal->on_demand) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    if (!internal->mapped_chunks.resize(man->num_chunks_reserved)) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+    }
+    _mmapext_for_each_chunk_word(0, man->num_chunks_mapped, [&](uint64_t word, uint64_t mask) {
+        internal->mapped_chunks.words[word] |= mask;
+    });
+    internal->on_demand.store(true, std::memory_order_release);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// mmaps the chunks [first, first + n) of the file to their place in the reservation starting at base.
+static ErrorResult _mmapext_mmap_chunks(MmapManager *man, uint8_t *base, uint64_t first, uint64_t n)
+{
+    const uint64_t offset = first * man->_chunk_size;
+    const uint64_t length = n * man->_chunk_size;
+
+    void *mapped_addr = timed_syscall(man->_internal, MMAPEXT_OP_MMAP, [&] {
+        return mmap(base + offset, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, man->_fd, offset);
+    });
+    if (mapped_addr == MAP_FAILED) {
+        PLOGE.printf("failed to map chunks %lu to %lu", first, first + n);
         return ErrorResult{
-            .error_code = MMAPEXT_ERR_FAILED_TO_UNMAP,
-            .error_message = "munmap() failed to unmap currently reserved address space",
+            .error_code = MMAPEXT_ERR_FAILED_TO_REMAP,
+            .error_message = "failed to map chunks within the reserved address space",
             .saved_errno = errno,
         };
     }
+    MMAPEXT_METRIC_ADD(man, bytes_mapped, length);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Applies the NUMA policy and the dirty tracking to the chunks [first, first + n) after mapping them.
+static ErrorResult _mmapext_setup_mapped_chunks(MmapManager *man, uint64_t first, uint64_t n)
+{
+    const uint64_t offset = first * man->_chunk_size;
+    const uint64_t length = n * man->_chunk_size;
+
+    auto err = _mmapext_apply_numa_policy(man, offset, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    return dirty_tracker_on_map(man, offset, length);
+}
+
+// Maps the chunks [first, first + n) of the file to their place in the reserved address space.
+ErrorResult _mmapext_map_chunks(MmapManager *man, uint64_t first, uint64_t n)
+{
+    auto err = _mmapext_mmap_chunks(man, man->address, first, n);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    err = _mmapext_setup_mapped_chunks(man, first, n);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    _mmapext_set_chunks_mapped(man->_internal, first, n);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// The grow path of mmapext_map_next_file_chunk for managers that map on demand. Maps again only what was
+// mapped before the mapping moved, and the chunks added to it, in the new reservation at new_address.
+static MmapManagerMapNextChunkResult _mmapext_regrow_on_demand(MmapManager *man,
+                                                               uint8_t *new_address,
+                                                               uint64_t grow_num_chunks,
+                                                               uint64_t wanted_mapped_chunks,
+                                                               uint64_t file_size_increment)
+{
+    MmapManagerInternal *internal = man->_internal;
+    std::lock_guard<std::mutex> lock(internal->map_mutex);
+
+    // Until it is published, the new reservation is only ours to unmap again.
+    const uint64_t new_reserved_size = (man->num_chunks_reserved + grow_num_chunks) * man->_chunk_size;
+    const uint64_t old_mapped_chunks = man->num_chunks_mapped;
+    if (!internal->mapped_chunks.resize(man->num_chunks_reserved + grow_num_chunks)) {
+        munmap(new_address, new_reserved_size);
+        auto err = ErrorResult{ .error_code = MMAPEXT_ERR_OUT_OF_MEMORY, .error_message = "out of memory" };
+        return MmapManagerMapNextChunkResult{ .error = err };
+    }
+    _mmapext_set_chunks_mapped(internal, old_mapped_chunks, wanted_mapped_chunks - old_mapped_chunks);
+
+    auto err = ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    _mmapext_for_each_run(internal, 0, wanted_mapped_chunks, true, [&](uint64_t first, uint64_t end) {
+        err = _mmapext_mmap_chunks(man, new_address, first, end - first);
+        return err.error_code == MMAPEXT_ERR_NONE;
+    });
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        _mmapext_clear_chunks_mapped(internal, old_mapped_chunks, wanted_mapped_chunks - old_mapped_chunks);
+        munmap(new_address, new_reserved_size);
+        return MmapManagerMapNextChunkResult{ .error = err };
+    }
+
+    _mmapext_publish_moved_mapping(man, new_address, grow_num_chunks);
+    __atomic_store_n(&man->num_chunks_mapped, uint32_t(wanted_mapped_chunks), __ATOMIC_SEQ_CST);
+    _mmapext_recount_vmas(man);
+
+    _mmapext_for_each_run(internal, 0, wanted_mapped_chunks, true, [&](uint64_t first, uint64_t end) {
+        err = _mmapext_setup_mapped_chunks(man, first, end - first);
+        return err.error_code == MMAPEXT_ERR_NONE;
+    });
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return MmapManagerMapNextChunkResult{ .error = err, .mapping_was_moved = true };
+    }
+
+    MMAPEXT_METRIC_ADD(man, grow_events, 1);
+    MMAPEXT_METRIC_ADD(man, moved_mapping_events, 1);
+#if MMAPEXT_METRICS
+    internal->metrics.last_grow_time_ns.store(clock_ns(CLOCK_REALTIME), std::memory_order_relaxed);
+#endif
+
+    err = _mmapext_relock_ranges(man);
+    return MmapManagerMapNextChunkResult{
+        .error = err,
+        .mapping_was_moved = true,
+        .file_extension_size = err.error_code == MMAPEXT_ERR_NONE ? file_size_increment : 0,
+    };
+}
+
+// Maps the chunks of [first, end) that are not mapped, and the small gaps next to it, see
+// vma_coalesce_gap_chunks. Called with the map mutex held.
+static ErrorResult _mmapext_map_missing_chunks(MmapManager *man, uint64_t first, uint64_t end)
+{
+    const MmapManagerInternal *internal = man->_internal;
+    _mmapext_coalesce_range(man, &first, &end);
+
+    // Mapped chunks separate the runs, so their changes to the estimate add up.
+    int64_t vma_delta = 0;
+    _mmapext_for_each_run(internal, first, end, false, [&](uint64_t run_first, uint64_t run_end) {
+        vma_delta += _mmapext_vma_delta(man, run_first, run_end, true);
+        return true;
+    });
+    if (!_mmapext_charge_vmas(man->_internal, vma_delta)) {
+        return _mmapext_vma_limit_error(vma_delta);
+    }
 
-    void *new_addr = mmap(nullptr, new_reserved_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (new_addr == nullptr) {
-        PLOGE.printf("failed to mmap after munmap in grow_reserved_address_space");
+    auto err = ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    _mmapext_for_each_run(internal, first, end, false, [&](uint64_t run_first, uint64_t run_end) {
+        err = _mmapext_map_chunks(man, run_first, run_end - run_first);
+        return err.error_code == MMAPEXT_ERR_NONE;
+    });
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        _mmapext_recount_vmas(man);
+    }
+    return err;
+}
 
+ErrorResult mmapext_ensure_mapped(const struct MmapManager *man, uint64_t offset, uint64_t length)
+{
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (offset > mapped_size || length > mapped_size - offset) {
         return ErrorResult{
-            .error_code = MMAPEXT_ERR_FAILED_TO_MMAP,
-            .error_message = "failed to mmap after relinquishing old mapping",
-            .saved_errno = errno,
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to map is outside of the mapped size",
         };
     }
 
-    auto old_reserved_size_str = _format_memory_size(mmapext_reserved_size(man));
-    auto new_reserved_size_str = _format_memory_size(new_reserved_size);
+    MmapManagerInternal *internal = man->_internal;
+    if (internal == nullptr || !internal->on_demand || length == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
 
-    PLOGI.printf("grew reserved address space from %s to %s",
-                 old_reserved_size_str.c_str(),
-                 new_reserved_size_str.c_str());
+    const uint64_t first = offset / man->_chunk_size;
+    const uint64_t end = (offset + length + man->_chunk_size - 1) / man->_chunk_size;
+    if (_mmapext_next_chunk(internal, first, end, false) == end) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
 
-    man->address = reinterpret_cast<uint8_t *>(new_addr);
-    man->num_chunks_reserved += grow_num_chunks;
+    // Mapping chunks changes no field of the manager, only its internal state. Another thread may have
+    // mapped some of the chunks since the check.
+    std::lock_guard<std::mutex> lock(internal->map_mutex);
+    return _mmapext_map_missing_chunks(const_cast<MmapManager *>(man), first, end);
+}
+
+ErrorResult _mmapext_apply_numa_policy(MmapManager *man, uint64_t offset, uint64_t length)
+{
+    if (man->_numa_policy == MMAPEXT_NUMA_DEFAULT || length == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    int mode = MPOL_BIND;
+    uint64_t node_mask = man->_numa_node_mask;
+
+    switch (man->_numa_policy) {
+    case MMAPEXT_NUMA_INTERLEAVE:
+        mode = MPOL_INTERLEAVE;
+        break;
+    case MMAPEXT_NUMA_PREFERRED:
+        mode = MPOL_PREFERRED;
+        node_mask &= -node_mask;
+        break;
+    }
+
+    // maxnode counts one past the highest node the kernel should read from the mask.
+    const long r = timed_syscall(man->_internal, MMAPEXT_OP_MBIND, [&] {
+        return syscall(SYS_mbind,
+                       man->address + offset,
+                       length,
+                       mode,
+                       &node_mask,
+                       sizeof(node_mask) * 8 + 1,
+                       MPOL_MF_MOVE);
+    });
+    if (r != 0) {
+        std::array<char, safe_strerror_bufsize> errno_desc_buf{};
+        PLOGE.printf("mbind failed on %lu bytes at offset %lu: %s",
+                     length,
+                     offset,
+                     safe_strerror(errno_desc_buf, errno));
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_MBIND,
+            .error_message = "failed to apply numa policy to newly mapped chunks",
+            .saved_errno = errno,
+        };
+    }
     return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
 }
 
+static uint64_t _mmapext_lock_limit()
+{
+    uint64_t limit = g_lock_budget.load();
+    if (limit == 0) {
+        limit = UINT64_MAX;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        limit = std::min<uint64_t>(limit, rl.rlim_cur);
+    }
+    return limit;
+}
+
+static bool _mmapext_charge_lock_budget(uint64_t bytes)
+{
+    const uint64_t limit = _mmapext_lock_limit();
+    uint64_t cur = g_locked_bytes.load();
+    do {
+        if (bytes > limit || cur > limit - bytes) {
+            return false;
+        }
+    } while (!g_locked_bytes.compare_exchange_weak(cur, cur + bytes));
+    return true;
+}
+
+// Returns the number of bytes of [start, end) covered by locked ranges.
+static uint64_t _mmapext_locked_overlap(const MmapManagerInternal *internal, uint64_t start, uint64_t end)
+{
+    const auto &ranges = internal->locked_ranges;
+
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin()) {
+        --it;
+    }
+
+    uint64_t overlap = 0;
+    for (; it != ranges.end() && it->first < end; ++it) {
+        const uint64_t a = std::max(it->first, start);
+        const uint64_t b = std::min(it->second, end);
+        if (a < b) {
+            overlap += b - a;
+        }
+    }
+    return overlap;
+}
+
+// Aligns [offset, offset + length) outwards to system pages. Returns false if the range is empty or not
+// mapped.
+static bool _mmapext_page_range(const MmapManager *man, uint64_t offset, uint64_t length, uint64_t *start,
+                                uint64_t *end)
+{
+    const uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    *start = offset / sys_page_size * sys_page_size;
+    *end = align_forward(offset + length, sys_page_size);
+    return length != 0 && *end <= mmapext_mapped_size(man);
+}
+
+ErrorResult mmapext_lock_range(struct MmapManager *man, uint64_t offset, uint64_t length)
+{
+    uint64_t start = 0;
+    uint64_t end = 0;
+    if (!_mmapext_page_range(man, offset, length, &start, &end)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to lock is empty or not mapped",
+        };
+    }
+
+    auto &ranges = man->_internal->locked_ranges;
+    const uint64_t new_bytes = (end - start) - _mmapext_locked_overlap(man->_internal, start, end);
+
+    if (!_mmapext_charge_lock_budget(new_bytes)) {
+        auto size_str = _format_memory_size(new_bytes);
+        PLOGW.printf("locking %s more would exceed the lock budget", size_str.c_str());
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_LOCK_BUDGET_EXCEEDED,
+            .error_message = "locking the range would exceed the lock budget or RLIMIT_MEMLOCK",
+        };
+    }
+
+    // The range splits the areas it is cut out of, up to two more. Merging with other locked ranges gives
+    // some back below.
+    if (!_mmapext_charge_vmas(man->_internal, 2)) {
+        g_locked_bytes -= new_bytes;
+        return _mmapext_vma_limit_error(2);
+    }
+
+    if (timed_syscall(man->_internal, MMAPEXT_OP_MLOCK, [&] {
+            return mlock2(man->address + start, end - start, MLOCK_ONFAULT);
+        }) != 0) {
+        const int saved_errno = errno;
+        g_locked_bytes -= new_bytes;
+        _mmapext_charge_vmas(man->_internal, -2);
+
+        std::array<char, safe_strerror_bufsize> errno_desc_buf{};
+        PLOGE.printf("mlock2 failed: %s", safe_strerror(errno_desc_buf, saved_errno));
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_MLOCK,
+            .error_message = "mlock2 failed to lock range",
+            .saved_errno = saved_errno,
+        };
+    }
+
+    // Merge with every range that overlaps or touches the new one.
+    const int64_t old_num_ranges = ranges.size();
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin() && std::prev(it)->second >= start) {
+        --it;
+    }
+    while (it != ranges.end() && it->first <= end) {
+        start = std::min(start, it->first);
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+    ranges.emplace(start, end);
+    _mmapext_charge_vmas(man->_internal, 2 * (int64_t(ranges.size()) - old_num_ranges) - 2);
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_unlock_range(struct MmapManager *man, uint64_t offset, uint64_t length)
+{
+    uint64_t start = 0;
+    uint64_t end = 0;
+    if (!_mmapext_page_range(man, offset, length, &start, &end)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to unlock is empty or not mapped",
+        };
+    }
+
+    // Unlocking the middle of a locked range splits it in two.
+    if (!_mmapext_charge_vmas(man->_internal, 2)) {
+        return _mmapext_vma_limit_error(2);
+    }
+
+    if (timed_syscall(man->_internal, MMAPEXT_OP_MLOCK, [&] {
+            return munlock(man->address + start, end - start);
+        }) != 0) {
+        _mmapext_charge_vmas(man->_internal, -2);
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_MLOCK,
+            .error_message = "munlock failed to unlock range",
+            .saved_errno = errno,
+        };
+    }
+
+    auto &ranges = man->_internal->locked_ranges;
+    g_locked_bytes -= _mmapext_locked_overlap(man->_internal, start, end);
+
+    // Cut [start, end) out of the overlapping ranges.
+    const int64_t old_num_ranges = ranges.size();
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin() && std::prev(it)->second > start) {
+        --it;
+    }
+    while (it != ranges.end() && it->first < end) {
+        const uint64_t a = it->first;
+        const uint64_t b = it->second;
+        it = ranges.erase(it);
+        if (a < start) {
+            ranges.emplace(a, start);
+        }
+        if (b > end) {
+            ranges.emplace(end, b);
+        }
+    }
+    _mmapext_charge_vmas(man->_internal, 2 * (int64_t(ranges.size()) - old_num_ranges) - 2);
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void mmapext_set_lock_budget(uint64_t bytes) { g_lock_budget = bytes; }
+
+uint64_t mmapext_locked_bytes() { return g_locked_bytes.load(); }
+
+// Locks the ranges in the new mapping after a move. _mmapext_publish_moved_mapping unlocked them in the old
+// one, and the budget was already charged for them.
+ErrorResult _mmapext_relock_ranges(MmapManager *man)
+{
+    for (const auto &range : man->_internal->locked_ranges) {
+        if (timed_syscall(man->_internal, MMAPEXT_OP_MLOCK, [&] {
+                return mlock2(man->address + range.first, range.second - range.first, MLOCK_ONFAULT);
+            }) != 0) {
+            std::array<char, safe_strerror_bufsize> errno_desc_buf{};
+            PLOGE.printf("failed to lock range [%lu, %lu) again after remap: %s",
+                         range.first,
+                         range.second,
+                         safe_strerror(errno_desc_buf, errno));
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_FAILED_TO_MLOCK,
+                .error_message = "failed to lock ranges again after the mapping moved",
+                .saved_errno = errno,
+            };
+        }
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_map_range(struct MmapManager *man, uint64_t chunk_offset, uint64_t n_chunks)
+{
+    const uint64_t end = chunk_offset + n_chunks;
+    if (man->_internal == nullptr || man->_internal->lazy != nullptr || end < chunk_offset ||
+        end > man->num_chunks_reserved) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to map is outside of the reserved address space",
+        };
+    }
+
+    std::lock_guard<std::mutex> lock(man->_internal->map_mutex);
+    auto err = _mmapext_switch_to_on_demand(man);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    // The file has to cover the range, or touching it raises SIGBUS.
+    struct stat statbuf;
+    if (timed_syscall(man->_internal, MMAPEXT_OP_STAT, [&] { return fstat(man->_fd, &statbuf); }) != 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_STAT_FILE,
+            .error_message = "failed to stat the managed backing file",
+            .saved_errno = errno,
+        };
+    }
+    const uint64_t wanted_file_size = end * man->_chunk_size;
+    if (uint64_t(statbuf.st_size) < wanted_file_size) {
+        if (timed_syscall(man->_internal, MMAPEXT_OP_FTRUNCATE, [&] {
+                return ftruncate(man->_fd, wanted_file_size);
+            }) != 0) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_FAILED_TO_FTRUNCATE,
+                .error_message = "failed to extend file to the range to map",
+                .saved_errno = errno,
+            };
+        }
+        MMAPEXT_METRIC_ADD(man, file_extensions, 1);
+        MMAPEXT_METRIC_ADD(man, file_extension_bytes, wanted_file_size - statbuf.st_size);
+    }
+
+    err = _mmapext_map_missing_chunks(man, chunk_offset, end);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+    man->num_chunks_mapped = std::max<uint64_t>(man->num_chunks_mapped, end);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_unmap_range(struct MmapManager *man, uint64_t chunk_offset, uint64_t n_chunks)
+{
+    const uint64_t end = chunk_offset + n_chunks;
+    if (man->_internal == nullptr || man->_internal->lazy != nullptr || end < chunk_offset ||
+        end > man->num_chunks_mapped) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to unmap is outside of the mapped size",
+        };
+    }
+
+    const uint64_t offset = chunk_offset * man->_chunk_size;
+    const uint64_t length = n_chunks * man->_chunk_size;
+    if (n_chunks == 0) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    if (_mmapext_locked_overlap(man->_internal, offset, offset + length) != 0) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to unmap has locked pages, unlock them first",
+        };
+    }
+
+    std::lock_guard<std::mutex> lock(man->_internal->map_mutex);
+    auto err = _mmapext_switch_to_on_demand(man);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    // Cutting a hole into a run of mapped chunks splits its area in two.
+    int64_t vma_delta = 0;
+    _mmapext_for_each_run(man->_internal, chunk_offset, end, true, [&](uint64_t run_first, uint64_t run_end) {
+        vma_delta += _mmapext_vma_delta(man, run_first, run_end, false);
+        return true;
+    });
+    if (!_mmapext_charge_vmas(man->_internal, vma_delta)) {
+        return _mmapext_vma_limit_error(vma_delta);
+    }
+
+    // Checkpoints that find dirty pages through the mapping would miss the ones written through the range.
+    if (!dirty_tracker_survives_unmap(man) &&
+        timed_syscall(man->_internal, MMAPEXT_OP_MSYNC, [&] {
+            return msync(man->address + offset, length, MS_SYNC);
+        }) != 0) {
+        _mmapext_charge_vmas(man->_internal, -vma_delta);
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_WRITE,
+            .error_message = "failed to msync range before unmapping it",
+            .saved_errno = errno,
+        };
+    }
+
+    // Back to reserved address space, which also drops the pages of the range from the page tables.
+    void *addr = timed_syscall(man->_internal, MMAPEXT_OP_MMAP, [&] {
+        return mmap(man->address + offset, length, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+    });
+    if (addr == MAP_FAILED) {
+        _mmapext_charge_vmas(man->_internal, -vma_delta);
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_MMAP,
+            .error_message = "failed to replace range with reserved address space",
+            .saved_errno = errno,
+        };
+    }
+    _mmapext_clear_chunks_mapped(man->_internal, chunk_offset, n_chunks);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+uint64_t mmapext_count_mapped_chunks(const struct MmapManager *man)
+{
+    const MmapManagerInternal *internal = man->_internal;
+    if (internal == nullptr || !internal->on_demand) {
+        return man->num_chunks_mapped;
+    }
+
+    uint64_t count = 0;
+    const uint64_t num_words = (uint64_t(man->num_chunks_mapped) + 63) / 64;
+    for (uint64_t i = 0; i < num_words; ++i) {
+        count += __builtin_popcountll(__atomic_load_n(&internal->mapped_chunks.words[i], __ATOMIC_RELAXED));
+    }
+    return count;
+}
+
+uint64_t mmapext_vma_count(const struct MmapManager *man)
+{
+    return man->_internal != nullptr ? man->_internal->vmas.load() : 0;
+}
+
+ErrorResult mmapext_count_vmas(const struct MmapManager *man, uint64_t *out)
+{
+    *out = 0;
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_OPEN_FILE,
+            .error_message = "failed to open /proc/self/maps",
+            .saved_errno = errno,
+        };
+    }
+
+    // The reservation, and the ones the mapping moved away from that are still mapped for readers.
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.emplace_back(uint64_t(man->address), uint64_t(man->address) + mmapext_reserved_size(man));
+    if (man->_internal != nullptr) {
+        std::lock_guard<std::mutex> lock(man->_internal->retired_mutex);
+        for (const RetiredMapping &r : man->_internal->retired) {
+            ranges.emplace_back(uint64_t(r.address), uint64_t(r.address) + r.size);
+        }
+    }
+
+    // One "start-end perms offset dev inode path" line per area. Paths longer than the buffer take several
+    // reads, only the first one starts a line.
+    bool line_start = true;
+    char line[512];
+    while (fgets(line, sizeof(line), maps) != nullptr) {
+        uint64_t vma_begin = 0;
+        uint64_t vma_end = 0;
+        if (line_start && sscanf(line, "%lx-%lx ", &vma_begin, &vma_end) == 2) {
+            for (const auto &range : ranges) {
+                *out += vma_begin < range.second && vma_end > range.first;
+            }
+        }
+        line_start = strchr(line, '\n') != nullptr;
+    }
+    fclose(maps);
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void mmapext_set_vma_budget(uint64_t vmas) { g_vma_budget = vmas; }
+
+uint64_t mmapext_total_vma_count() { return g_vmas.load(); }
+
+struct MmapManagerNumaResidency
+mmapext_numa_residency(const struct MmapManager *man, uint64_t offset, uint64_t length)
+{
+    MmapManagerNumaResidency res{};
+
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (offset >= mapped_size) {
+        return res;
+    }
+    length = std::min(length, mapped_size - offset);
+
+    const uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t first_page = offset / sys_page_size;
+    const uint64_t end_page = (offset + length + sys_page_size - 1) / sys_page_size;
+
+    // move_pages with a null node array only reports where each page is.
+    constexpr uint64_t batch_size = 1024;
+    std::array<void *, batch_size> pages;
+    std::array<int, batch_size> status;
+
+    for (uint64_t page = first_page; page < end_page; page += batch_size) {
+        const uint64_t n = std::min(batch_size, end_page - page);
+        for (uint64_t i = 0; i < n; ++i) {
+            pages[i] = man->address + (page + i) * sys_page_size;
+        }
+
+        const long r = syscall(SYS_move_pages, 0, n, pages.data(), nullptr, status.data(), 0);
+        if (r != 0) {
+            res.error = ErrorResult{
+                .error_code = MMAPEXT_ERR_UNKNOWN,
+                .error_message = "move_pages failed to query page placement",
+                .saved_errno = errno,
+            };
+            return res;
+        }
+
+        for (uint64_t i = 0; i < n; ++i) {
+            if (status[i] >= 0 && status[i] < MMAPEXT_MAX_NUMA_NODES) {
+                ++res.num_pages_on_node[status[i]];
+            } else {
+                ++res.num_pages_not_resident;
+            }
+        }
+        res.num_pages += n;
+    }
+
+    return res;
+}
+
+// Reserves address space for grow_num_chunks more chunks elsewhere, and leaves the current reservation to
+// readers until the file is mapped in the new one, see _mmapext_publish_moved_mapping.
+ErrorResult
+_mmapext_grow_reserved_address_space(MmapManager *man, uint64_t grow_num_chunks, uint8_t **new_address)
+{
+    uint64_t new_reserved_size = (man->num_chunks_reserved + grow_num_chunks) * man->_chunk_size;
+
+    void *new_addr = timed_syscall(man->_internal, MMAPEXT_OP_MMAP, [&] {
+        return mmap(nullptr, new_reserved_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    });
+    if (new_addr == MAP_FAILED) {
+        PLOGE.printf("failed to mmap new reservation in grow_reserved_address_space");
+
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_MMAP,
+            .error_message = "failed to reserve grown address space",
+            .saved_errno = errno,
+        };
+    }
+
+    auto old_reserved_size_str = _format_memory_size(mmapext_reserved_size(man));
+    auto new_reserved_size_str = _format_memory_size(new_reserved_size);
+
+    PLOGI.printf("grew reserved address space from %s to %s",
+                 old_reserved_size_str.c_str(),
+                 new_reserved_size_str.c_str());
+
+    *new_address = reinterpret_cast<uint8_t *>(new_addr);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Switches the manager to the new reservation, which has the file mapped already. Readers that entered a
+// critical section before may still use the old one, so it is retired with the epoch that ends now, and
+// unmapped once they have left.
+void _mmapext_publish_moved_mapping(MmapManager *man, uint8_t *new_address, uint64_t grow_num_chunks)
+{
+    MmapManagerInternal *internal = man->_internal;
+    uint8_t *old_address = man->address;
+    const uint64_t old_reserved_size = mmapext_reserved_size(man);
+
+    __atomic_store_n(&man->address, new_address, __ATOMIC_SEQ_CST);
+    man->num_chunks_reserved += grow_num_chunks;
+
+    // Readers only need the old mapping to stay mapped. Unlocked, its pages don't count against
+    // RLIMIT_MEMLOCK a second time once _mmapext_relock_ranges locks them in the new one, and its VMAs
+    // merge again.
+    for (const auto &range : internal->locked_ranges) {
+        if (timed_syscall(internal, MMAPEXT_OP_MLOCK, [&] {
+                return munlock(old_address + range.first, range.second - range.first);
+            }) != 0) {
+            std::array<char, safe_strerror_bufsize> errno_desc_buf{};
+            PLOGE.printf("failed to unlock range [%lu, %lu) of the retired mapping: %s",
+                         range.first,
+                         range.second,
+                         safe_strerror(errno_desc_buf, errno));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(internal->retired_mutex);
+        const uint64_t vmas =
+            internal->vmas.load() - internal->retired_vmas.load() - 2 * internal->locked_ranges.size();
+        internal->retired.push_back(RetiredMapping{
+            .address = old_address,
+            .size = old_reserved_size,
+            .epoch = epoch_advance(),
+            .vmas = vmas,
+        });
+        internal->retired_vmas += vmas;
+    }
+    _mmapext_reclaim_retired(man, false);
+}
+
+// Unmaps the retired reservations of the manager no reader can use anymore, or all of them if force is set.
+// Returns how many are left.
+uint64_t _mmapext_reclaim_retired(MmapManager *man, bool force)
+{
+    MmapManagerInternal *internal = man->_internal;
+    std::lock_guard<std::mutex> lock(internal->retired_mutex);
+    auto &retired = internal->retired;
+    if (retired.empty()) {
+        return 0;
+    }
+
+    const uint64_t oldest_reader = force ? UINT64_MAX : epoch_oldest_reader();
+    auto left = std::remove_if(retired.begin(), retired.end(), [&](const RetiredMapping &r) {
+        if (r.epoch >= oldest_reader) {
+            return false;
+        }
+        if (timed_syscall(internal, MMAPEXT_OP_MUNMAP, [&] { return munmap(r.address, r.size); }) != 0) {
+            std::array<char, safe_strerror_bufsize> errno_desc_buf{};
+            PLOGE.printf("failed to unmap retired reservation at %p: %s",
+                         r.address,
+                         safe_strerror(errno_desc_buf, errno));
+            return false;
+        }
+        internal->retired_vmas -= r.vmas;
+        internal->vmas -= r.vmas;
+        g_vmas -= r.vmas;
+        return true;
+    });
+    retired.erase(left, retired.end());
+    return retired.size();
+}
+
+uint64_t mmapext_reclaim_mappings(struct MmapManager *man, bool wait)
+{
+    if (man->_internal == nullptr) {
+        return 0;
+    }
+    uint64_t left = _mmapext_reclaim_retired(man, false);
+    while (wait && left > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        left = _mmapext_reclaim_retired(man, false);
+    }
+    return left;
+}
+
+ErrorResult mmapext_residency(const struct MmapManager *man,
+                              uint64_t offset,
+                              uint64_t length,
+                              struct MmapManagerResidency *out)
+{
+    *out = MmapManagerResidency{};
+
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (offset < mapped_size) {
+        length = std::min(length, mapped_size - offset);
+    } else {
+        length = 0;
+    }
+
+    const uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset / sys_page_size * sys_page_size;
+    const uint64_t end = align_forward(offset + length, sys_page_size);
+    out->range_bytes = length;
+
+    // Fixed buffer so sampling a huge mapping doesn't allocate.
+    constexpr uint64_t batch_pages = 16384;
+    std::array<unsigned char, batch_pages> vec;
+
+    for (uint64_t pos = start; pos < end; pos += batch_pages * sys_page_size) {
+        const uint64_t n = std::min(batch_pages, (end - pos) / sys_page_size);
+        if (mincore(man->address + pos, n * sys_page_size, vec.data()) != 0) {
+            return ErrorResult{
+                .error_code = MMAPEXT_ERR_UNKNOWN,
+                .error_message = "mincore failed on mapped range",
+                .saved_errno = errno,
+            };
+        }
+
+        uint64_t resident_pages = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            resident_pages += vec[i] & 1;
+        }
+        out->resident_bytes += resident_pages * sys_page_size;
+    }
+
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_FAILED_TO_OPEN_FILE,
+            .error_message = "failed to open /proc/self/smaps",
+            .saved_errno = errno,
+        };
+    }
+
+    const uint64_t reserved_begin = uint64_t(man->address);
+    const uint64_t reserved_end = reserved_begin + mmapext_reserved_size(man);
+
+    // Each mapping starts with a "start-end perms offset dev inode path" line followed by "Field: value kB"
+    // lines. Paths longer than the buffer take several reads, only the first one starts a line.
+    bool in_range = false;
+    bool line_start = true;
+    char line[512];
+    while (fgets(line, sizeof(line), smaps) != nullptr) {
+        const bool parse = line_start;
+        line_start = strchr(line, '\n') != nullptr;
+        if (!parse) {
+            continue;
+        }
+
+        uint64_t vma_begin = 0;
+        uint64_t vma_end = 0;
+        char field[64];
+        uint64_t kb = 0;
+
+        if (sscanf(line, "%lx-%lx ", &vma_begin, &vma_end) == 2) {
+            in_range = vma_begin < reserved_end && vma_end > reserved_begin;
+            continue;
+        }
+        if (!in_range || sscanf(line, "%63[^:]: %lu kB", field, &kb) != 2) {
+            continue;
+        }
+
+        const uint64_t bytes = kb << 10;
+        if (strcmp(field, "Rss") == 0) {
+            out->rss_bytes += bytes;
+        } else if (strcmp(field, "Shared_Dirty") == 0 || strcmp(field, "Private_Dirty") == 0) {
+            out->dirty_bytes += bytes;
+        } else if (strcmp(field, "Swap") == 0) {
+            out->swapped_bytes += bytes;
+        } else if (strcmp(field, "AnonHugePages") == 0 || strcmp(field, "ShmemPmdMapped") == 0 ||
+                   strcmp(field, "FilePmdMapped") == 0) {
+            out->huge_page_bytes += bytes;
+        }
+    }
+    fclose(smaps);
+
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void mmapext_get_metrics(const struct MmapManager *man, struct MmapManagerMetrics *out)
+{
+    *out = MmapManagerMetrics{};
+    if (man->_internal == nullptr) {
+        return;
+    }
+
+    const auto &m = man->_internal->metrics;
+    const auto relaxed = std::memory_order_relaxed;
+
+    out->grow_events = m.grow_events.load(relaxed);
+    out->moved_mapping_events = m.moved_mapping_events.load(relaxed);
+    out->last_grow_time_ns = m.last_grow_time_ns.load(relaxed);
+    out->file_extensions = m.file_extensions.load(relaxed);
+    out->file_extension_bytes = m.file_extension_bytes.load(relaxed);
+    out->bytes_mapped = m.bytes_mapped.load(relaxed);
+
+    for (int op = 0; op < MMAPEXT_NUM_OPS; ++op) {
+        out->latency[op].count = m.latency[op].count.load(relaxed);
+        out->latency[op].total_ns = m.latency[op].total_ns.load(relaxed);
+        out->latency[op].max_ns = m.latency[op].max_ns.load(relaxed);
+        for (int b = 0; b < MMAPEXT_HISTOGRAM_BUCKETS; ++b) {
+            out->latency[op].buckets[b] = m.latency[op].buckets[b].load(relaxed);
+        }
+    }
+}
+
+void mmapext_reset_metrics(struct MmapManager *man)
+{
+    if (man->_internal == nullptr) {
+        return;
+    }
+
+    auto &m = man->_internal->metrics;
+    m.grow_events = 0;
+    m.moved_mapping_events = 0;
+    m.last_grow_time_ns = 0;
+    m.file_extensions = 0;
+    m.file_extension_bytes = 0;
+    m.bytes_mapped = 0;
+
+    for (auto &h : m.latency) {
+        h.count = 0;
+        h.total_ns = 0;
+        h.max_ns = 0;
+        for (auto &b : h.buckets) {
+            b = 0;
+        }
+    }
+}
+
+uint64_t mmapext_histogram_bucket_upper_ns(int bucket)
+{
+    // Inverse of histogram_bucket for bucket + 1.
+    const int next = bucket + 1;
+    if (next < 4) {
+        return uint64_t(next);
+    }
+    const int e = next / 4 + 1;
+    return uint64_t(4 + next % 4) << (e - 2);
+}
+
+uint64_t mmapext_histogram_percentile_ns(const struct MmapManagerHistogram *h, double p)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    const double rank = std::min(std::max(p, 0.0), 100.0) / 100.0 * double(h->count);
+    uint64_t seen = 0;
+    for (int b = 0; b < MMAPEXT_HISTOGRAM_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (double(seen) >= rank && h->buckets[b] != 0) {
+            return std::min(mmapext_histogram_bucket_upper_ns(b), h->max_ns);
+        }
+    }
+    return h->max_ns;
+}
+
 uint64_t mmapext_chunk_size() { return mmapext_page_size; }
 
 std::string _format_memory_size(uint64_t size)
@@ -417,7 +1812,7 @@ std::string _format_memory_size(uint64_t size)
     auto divisors = std::array<uint64_t, 5>{ 0, uint64_t(1) << 30, uint64_t(1) << 20, uint64_t(1) << 10, 1 };
     auto units = std::array<std::string, 5>{ "Total", "GB", "MB", "KB", "B" };
 
-    for (auto i = 1; i < quotients.size(); i++) {
+    for (size_t i = 1; i < quotients.size(); i++) {
         rems[i] = rems[i - 1] % divisors[i];
         quotients[i] = rems[i - 1] / divisors[i];
     }
@@ -425,7 +1820,7 @@ std::string _format_memory_size(uint64_t size)
     std::string total;
     total.reserve(64);
 
-    for (auto i = 1; i < quotients.size(); i++) {
+    for (size_t i = 1; i < quotients.size(); i++) {
         if (quotients[i] != 0) {
             total += std::to_string(quotients[i]);
             total += units[i];
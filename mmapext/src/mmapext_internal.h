@@ -0,0 +1,296 @@
+#pragma once
+
+#include <mmapext/mmapext.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#if !defined(MMAPEXT_METRICS)
+#    define MMAPEXT_METRICS 1
+#endif
+
+struct AtomicHistogram {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[MMAPEXT_HISTOGRAM_BUCKETS];
+};
+
+struct AtomicMetrics {
+    std::atomic<uint64_t> grow_events;
+    std::atomic<uint64_t> moved_mapping_events;
+    std::atomic<uint64_t> last_grow_time_ns;
+    std::atomic<uint64_t> file_extensions;
+    std::atomic<uint64_t> file_extension_bytes;
+    std::atomic<uint64_t> bytes_mapped;
+    AtomicHistogram latency[MMAPEXT_NUM_OPS];
+};
+
+// Sets the size of a file with ftruncate.
+ErrorResult extend_file_size(int fd, uint64_t file_size);
+
+// Files holding one structure that starts with a header in the first chunk, like the hash index and the
+// b+tree, see mmapext.cpp.
+
+// Creates a manager for the file and maps all of it, or the first chunk of a new file, which reads as
+// zeros then. Returns a manager with the error set on failure, like mmapext_create_manager.
+MmapManager open_structure_file(const char *backing_file, uint64_t initial_reserved_size);
+
+// Maps more chunks until the first end_offset bytes are mapped. Logs failures with the name of the
+// structure.
+ErrorResult grow_structure_file(MmapManager *man, uint64_t end_offset, const char *name);
+
+// Flushes the whole mapping with msync.
+ErrorResult sync_structure_file(MmapManager *man, const char *error_message);
+
+// Companion files and block cache of a manager with sealing enabled, see seal.cpp.
+struct SealState;
+
+void seal_state_delete(SealState *seal);
+
+// Dirty page tracking of mmapext_track_dirty, see dirty.cpp.
+struct DirtyTracker;
+
+void dirty_tracker_delete(DirtyTracker *tracker);
+
+// Has the tracker watch the chunks [offset, offset + length) that were just mapped, and the whole mapping
+// after it moved.
+ErrorResult dirty_tracker_on_map(MmapManager *man, uint64_t offset, uint64_t length);
+
+// Whether the next checkpoint flushes pages written through chunks that were unmapped since. Explicit and
+// userfaultfd tracking keep the offsets of written pages, soft-dirty bits go away with the page tables, and
+// without tracking a checkpoint only flushes what is mapped.
+bool dirty_tracker_survives_unmap(const MmapManager *man);
+
+// Byte range of a run of dirty pages within the mapping.
+struct DirtyRun {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Pages taken from the tracker by a checkpoint.
+struct DirtyPages {
+    // False if the manager doesn't track dirty pages, then the whole mapping has to be flushed.
+    bool tracked = false;
+
+    // The runs may miss pages written while they were taken, which are dirty in the page cache, so flushing
+    // has to end with an fdatasync of the file even when there are no runs.
+    bool sync_file = false;
+
+    // One bit per system page, to hand them back if flushing fails.
+    std::vector<uint64_t> bits;
+    std::vector<DirtyRun> runs;
+};
+
+// Takes the pages written since the last checkpoint and resets the tracker. With userfaultfd write
+// protection the pages are protected again first.
+ErrorResult dirty_tracker_take(MmapManager *man, DirtyPages *out);
+
+// Marks taken pages dirty again, after flushing them failed.
+void dirty_tracker_restore(MmapManager *man, const DirtyPages &pages);
+
+// Fault handler of a manager opened with mmapext_open_lazy, see lazy.cpp.
+struct LazyState;
+
+// Stops the handler. Must run before the mapping is unmapped.
+void lazy_state_delete(LazyState *lazy);
+
+// Thread of mmapext_watch_file_size, see guard.cpp.
+struct SizeWatchdog;
+
+void size_watchdog_delete(SizeWatchdog *watchdog);
+
+// io_uring of mmapext_enable_async, see uring.cpp.
+struct AsyncRing;
+
+// Waits for the operations in flight. Must run before the mapping is unmapped.
+void async_ring_delete(AsyncRing *ring);
+
+// Reads and checks the superblock of a file opened with use_superblock, or writes one to a new file, see
+// superblock.cpp. Sets *logical_length to the length to map on open.
+ErrorResult superblock_open(int fd, uint64_t file_size, uint64_t features, uint64_t *logical_length);
+
+// Epochs of the read-side critical sections of mmapext_read_begin, see epoch.cpp.
+
+// Starts a new epoch and returns the one that ended. Readers that entered in it or before may still use
+// what was replaced before the call.
+uint64_t epoch_advance();
+
+// Returns the oldest epoch a reader in a critical section entered in, UINT64_MAX if there is none.
+uint64_t epoch_oldest_reader();
+
+// Reservation of a manager left behind when its mapping moved, kept mapped for readers.
+struct RetiredMapping {
+    uint8_t *address;
+    uint64_t size;
+
+    // Ended when the mapping moved. Readers that entered in a later epoch use the new mapping.
+    uint64_t epoch;
+
+    // Its part of the VMA estimate of the manager.
+    uint64_t vmas;
+};
+
+// One bit per chunk. The words live in an anonymous mapping, whose pages read as zeros until written, so
+// the bitmap of a huge file costs nothing up front. calloc would only do that until the allocator decides
+// to reuse freed memory.
+struct ChunkBitmap {
+    uint64_t *words = nullptr;
+    uint64_t num_words = 0;
+
+    ChunkBitmap() = default;
+    ChunkBitmap(const ChunkBitmap &) = delete;
+    ChunkBitmap &operator=(const ChunkBitmap &) = delete;
+    ~ChunkBitmap()
+    {
+        if (words != nullptr) {
+            munmap(words, num_words * sizeof(uint64_t));
+        }
+    }
+
+    // Grows to cover num_chunks, the new bits are clear. Returns false if out of memory.
+    bool resize(uint64_t num_chunks)
+    {
+        const uint64_t page_words = uint64_t(sysconf(_SC_PAGESIZE)) / sizeof(uint64_t);
+        const uint64_t n = ((num_chunks + 63) / 64 + page_words - 1) / page_words * page_words;
+        if (n <= num_words) {
+            return true;
+        }
+        void *grown = words == nullptr
+                          ? mmap(nullptr, n * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                          : mremap(words, num_words * sizeof(uint64_t), n * sizeof(uint64_t), MREMAP_MAYMOVE);
+        if (grown == MAP_FAILED) {
+            return false;
+        }
+        words = static_cast<uint64_t *>(grown);
+        num_words = n;
+        return true;
+    }
+};
+
+// State of a MmapManager that the C API doesn't expose. Created with the manager and freed by
+// mmapext_delete_manager.
+struct MmapManagerInternal {
+    // Disjoint ranges locked with mmapext_lock_range, as start offset -> end offset. Aligned to the system
+    // page size.
+    std::map<uint64_t, uint64_t> locked_ranges;
+
+    AtomicMetrics metrics{};
+
+    // Set by mmapext_enable_sealing.
+    SealState *seal = nullptr;
+
+    // Set by mmapext_track_dirty.
+    DirtyTracker *dirty = nullptr;
+
+    // Set by mmapext_open_lazy.
+    LazyState *lazy = nullptr;
+
+    // Size of the backing file last seen by the guarded copies or the watchdog, UINT64_MAX before the first
+    // look.
+    std::atomic<uint64_t> known_file_size{ UINT64_MAX };
+
+    // Set by mmapext_watch_file_size.
+    SizeWatchdog *watchdog = nullptr;
+
+    // Set by mmapext_enable_async.
+    AsyncRing *async = nullptr;
+
+    // Created with use_superblock, the superblock is at the start of the mapping.
+    bool has_superblock = false;
+
+    // Created with map_on_demand, or switched to it by mmapext_map_range or mmapext_unmap_range. Bit i of
+    // mapped_chunks is set while chunk i is mapped, the other chunks below the mapped size are reserved
+    // address space. The words are read with atomic loads, so mmapext_ensure_mapped checks them without
+    // taking map_mutex, which serializes the mapping.
+    std::atomic<bool> on_demand{ false };
+    ChunkBitmap mapped_chunks;
+    std::mutex map_mutex;
+
+    // VMAs the manager is estimated to take, see mmapext_vma_count. Part of the count of all managers.
+    std::atomic<uint64_t> vmas{ 0 };
+
+    // Reservations the mapping moved away from, until no reader can use them, see mmapext_read_begin.
+    // retired_vmas is their part of vmas.
+    std::vector<RetiredMapping> retired;
+    std::atomic<uint64_t> retired_vmas{ 0 };
+    std::mutex retired_mutex;
+};
+
+// The mapping of a lazily mapped manager is a read only private copy, writing through it raises SIGSEGV.
+// Functions that write to the mapping refuse such managers with this error.
+inline bool is_read_only_manager(const MmapManager *man)
+{
+    return man->_internal != nullptr && man->_internal->lazy != nullptr;
+}
+
+inline ErrorResult read_only_manager_error()
+{
+    return ErrorResult{
+        .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+        .error_message = "lazily mapped managers are read only",
+    };
+}
+
+// Maps a duration to its histogram bucket. 4 buckets per power of two, linear below 4ns.
+inline int histogram_bucket(uint64_t ns)
+{
+    if (ns < 4) {
+        return int(ns);
+    }
+    const int e = 63 - __builtin_clzll(ns);
+    const int bucket = (e - 1) * 4 + int((ns >> (e - 2)) & 3);
+    return bucket < MMAPEXT_HISTOGRAM_BUCKETS ? bucket : MMAPEXT_HISTOGRAM_BUCKETS - 1;
+}
+
+inline uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+inline void record_latency(AtomicHistogram &h, uint64_t ns)
+{
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    h.buckets[histogram_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = h.max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !h.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+// Runs `f`, a lambda making the system call `op`, and records its latency in the manager's metrics.
+template <typename F> inline auto timed_syscall(MmapManagerInternal *internal, int op, F &&f)
+{
+#if MMAPEXT_METRICS
+    if (internal != nullptr) {
+        const uint64_t start = clock_ns(CLOCK_MONOTONIC);
+        auto r = f();
+        record_latency(internal->metrics.latency[op], clock_ns(CLOCK_MONOTONIC) - start);
+        return r;
+    }
+#endif
+    return f();
+}
+
+// Adds n to one of the AtomicMetrics counters of the manager.
+#if MMAPEXT_METRICS
+#    define MMAPEXT_METRIC_ADD(man, field, n)                                                            \
+        do {                                                                                             \
+            if ((man)->_internal != nullptr) {                                                           \
+                (man)->_internal->metrics.field.fetch_add((n), std::memory_order_relaxed);               \
+            }                                                                                            \
+        } while (0)
+#else
+#    define MMAPEXT_METRIC_ADD(man, field, n)                                                            \
+        do {                                                                                             \
+        } while (0)
+#endif
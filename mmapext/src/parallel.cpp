@@ -0,0 +1,337 @@
+#include <mmapext/mmapext.h>
+
+#include "mmapext_internal.h"
+#include "scan.h"
+#include "streaming.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Ranges are split into stripes of this size, aligned to offsets in the mapping. Large enough to amortize
+// taking a stripe, small enough to balance threads that run at different speeds because of page faults.
+constexpr uint64_t stripe_size = uint64_t(2) << 20;
+
+// Checksums are computed per block of this size, so that they don't depend on how stripes are assigned.
+constexpr uint64_t checksum_block_size = uint64_t(64) << 10;
+
+constexpr int max_parallel_threads = 256;
+
+namespace {
+
+// Worker threads shared by all parallel operations. Workers are started on first use and stay around until
+// exit. One operation runs at a time; the calling thread works on stripes too.
+class StripePool {
+  public:
+    ~StripePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _work_cv.notify_all();
+        for (auto &t : _workers) {
+            t.join();
+        }
+    }
+
+    // Calls fn(stripe) for every stripe in [0, num_stripes) on num_threads threads including the caller.
+    void run(uint64_t num_stripes, int num_threads, const std::function<void(uint64_t)> &fn)
+    {
+        std::lock_guard<std::mutex> run_lock(_run_mutex);
+
+        const int helpers = int(std::min<uint64_t>(uint64_t(num_threads - 1), num_stripes - 1));
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (int(_workers.size()) < helpers) {
+                const uint64_t generation = _generation;
+                _workers.emplace_back([this, generation] { worker_loop(generation); });
+            }
+            _fn = &fn;
+            _num_stripes = num_stripes;
+            _next_stripe.store(0, std::memory_order_relaxed);
+            _helpers_wanted = helpers;
+            ++_generation;
+        }
+        _work_cv.notify_all();
+
+        drain();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _helpers_wanted = 0;
+        _done_cv.wait(lock, [this] { return _active == 0; });
+        _fn = nullptr;
+    }
+
+  private:
+    void drain()
+    {
+        for (uint64_t s = _next_stripe.fetch_add(1); s < _num_stripes; s = _next_stripe.fetch_add(1)) {
+            (*_fn)(s);
+        }
+    }
+
+    // Started during the run after seen_generation, which it joins.
+    void worker_loop(uint64_t seen_generation)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _work_cv.wait(lock, [&] {
+                return _stop || (_generation != seen_generation && _helpers_wanted > 0);
+            });
+            if (_stop) {
+                return;
+            }
+            seen_generation = _generation;
+            --_helpers_wanted;
+            ++_active;
+
+            lock.unlock();
+            drain();
+            lock.lock();
+
+            if (--_active == 0) {
+                _done_cv.notify_all();
+            }
+        }
+    }
+
+    std::mutex _run_mutex;
+
+    std::mutex _mutex;
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+    std::vector<std::thread> _workers;
+    bool _stop = false;
+    uint64_t _generation = 0;
+    int _helpers_wanted = 0;
+    int _active = 0;
+
+    const std::function<void(uint64_t)> *_fn = nullptr;
+    uint64_t _num_stripes = 0;
+    std::atomic<uint64_t> _next_stripe{ 0 };
+};
+
+StripePool g_stripe_pool;
+
+} // namespace
+
+static bool _mmapext_valid_range(const MmapManager *man, uint64_t offset, uint64_t length)
+{
+    return length != 0 && offset <= mmapext_mapped_size(man) && length <= mmapext_mapped_size(man) - offset;
+}
+
+static int _mmapext_thread_count(int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    return std::min(num_threads, max_parallel_threads);
+}
+
+// Runs fn(begin, end) for the stripes of [offset, offset + length). Stripe boundaries are multiples of
+// stripe_size, so every thread faults whole huge pages and its own page table pages.
+static void _mmapext_for_each_stripe(uint64_t offset,
+                                     uint64_t length,
+                                     int num_threads,
+                                     const std::function<void(uint64_t, uint64_t)> &fn)
+{
+    const uint64_t first = offset / stripe_size;
+    const uint64_t last = (offset + length - 1) / stripe_size;
+
+    g_stripe_pool.run(last - first + 1, _mmapext_thread_count(num_threads), [&](uint64_t s) {
+        const uint64_t begin = std::max(offset, (first + s) * stripe_size);
+        const uint64_t end = std::min(offset + length, (first + s + 1) * stripe_size);
+        fn(begin, end);
+    });
+}
+
+ErrorResult mmapext_parallel_fill(struct MmapManager *man,
+                                  uint64_t offset,
+                                  uint64_t length,
+                                  uint8_t value,
+                                  int num_threads)
+{
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+    if (!_mmapext_valid_range(man, offset, length)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to fill is empty or not mapped",
+        };
+    }
+
+    mmapext_mark_dirty(man, offset, length);
+    _mmapext_for_each_stripe(offset, length, num_threads, [&](uint64_t begin, uint64_t end) {
+        stream_fill(man->address + begin, value, end - begin);
+        stream_fence();
+    });
+
+    return ErrorResult{};
+}
+
+ErrorResult mmapext_parallel_copy_in(struct MmapManager *man,
+                                     uint64_t offset,
+                                     const void *src,
+                                     uint64_t length,
+                                     int num_threads)
+{
+    if (is_read_only_manager(man)) {
+        return read_only_manager_error();
+    }
+    if (!_mmapext_valid_range(man, offset, length)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to copy into is empty or not mapped",
+        };
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(src);
+    mmapext_mark_dirty(man, offset, length);
+    _mmapext_for_each_stripe(offset, length, num_threads, [&](uint64_t begin, uint64_t end) {
+        stream_copy(man->address + begin, bytes + (begin - offset), end - begin);
+        stream_fence();
+    });
+
+    return ErrorResult{};
+}
+
+// Same constants and round as XXH64.
+constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+
+static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t checksum_round(uint64_t acc, uint64_t word)
+{
+    return rotl(acc + word * prime2, 31) * prime1;
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+// Hash of one checksum block. Four independent lanes keep the multipliers busy.
+static uint64_t _mmapext_block_hash(const uint8_t *p, uint64_t n)
+{
+    uint64_t acc[4] = { prime1, prime2, 0, uint64_t(0) - prime1 };
+    uint64_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, p + i + lane * 8, 8);
+            acc[lane] = checksum_round(acc[lane], word);
+        }
+    }
+
+    for (int lane = 0; i < n; i += 8, lane = (lane + 1) & 3) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, std::min<uint64_t>(8, n - i));
+        acc[lane] = checksum_round(acc[lane], word);
+    }
+
+    return fmix64(rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18) + n);
+}
+
+ErrorResult mmapext_parallel_checksum(const struct MmapManager *man,
+                                      uint64_t offset,
+                                      uint64_t length,
+                                      int num_threads,
+                                      uint64_t *out)
+{
+    if (!_mmapext_valid_range(man, offset, length)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to checksum is empty or not mapped",
+        };
+    }
+
+    // Blocks are aligned to offsets in the mapping like stripes, so a stripe always holds whole blocks.
+    // Block hashes are mixed with their offset and summed, which doesn't depend on the order.
+    std::atomic<uint64_t> sum{ 0 };
+    _mmapext_for_each_stripe(offset, length, num_threads, [&](uint64_t begin, uint64_t end) {
+        uint64_t stripe_sum = 0;
+        while (begin < end) {
+            const uint64_t block_end = std::min(end, (begin / checksum_block_size + 1) * checksum_block_size);
+            const uint64_t block_hash = _mmapext_block_hash(man->address + begin, block_end - begin);
+            stripe_sum += fmix64(block_hash ^ (begin * prime1));
+            begin = block_end;
+        }
+        sum.fetch_add(stripe_sum, std::memory_order_relaxed);
+    });
+
+    *out = sum.load();
+    return ErrorResult{};
+}
+
+uint64_t mmapext_parallel_count_byte(const struct MmapManager *man,
+                                     uint64_t offset,
+                                     uint64_t length,
+                                     uint8_t byte,
+                                     int num_threads)
+{
+    if (offset >= mmapext_mapped_size(man)) {
+        return 0;
+    }
+    length = std::min(length, mmapext_mapped_size(man) - offset);
+    if (length == 0) {
+        return 0;
+    }
+
+    std::atomic<uint64_t> count{ 0 };
+    _mmapext_for_each_stripe(offset, length, num_threads, [&](uint64_t begin, uint64_t end) {
+        count.fetch_add(scan_count_byte(man->address + begin, end - begin, byte), std::memory_order_relaxed);
+    });
+    return count.load();
+}
+
+uint64_t mmapext_parallel_find_substring(const struct MmapManager *man,
+                                         uint64_t offset,
+                                         uint64_t length,
+                                         const uint8_t *needle,
+                                         uint64_t needle_length,
+                                         int num_threads)
+{
+    if (offset >= mmapext_mapped_size(man) || needle_length == 0) {
+        return mmapext_find_substring(man, offset, length, needle, needle_length);
+    }
+    length = std::min(length, mmapext_mapped_size(man) - offset);
+    if (needle_length > length) {
+        return MMAPEXT_NOT_FOUND;
+    }
+
+    // Each stripe looks for matches starting in it, which can end in the next stripe. Stripes are taken in
+    // order, so once there is a match the stripes after it are skipped.
+    const uint64_t range_end = offset + length;
+    std::atomic<uint64_t> found{ MMAPEXT_NOT_FOUND };
+
+    _mmapext_for_each_stripe(offset, length, num_threads, [&](uint64_t begin, uint64_t end) {
+        if (begin >= found.load(std::memory_order_relaxed)) {
+            return;
+        }
+        const uint64_t search_end = std::min(range_end, end + needle_length - 1);
+        const uint64_t index =
+            scan_find_substring(man->address + begin, search_end - begin, needle, needle_length);
+        if (index == search_end - begin) {
+            return;
+        }
+
+        uint64_t current = found.load(std::memory_order_relaxed);
+        while (begin + index < current && !found.compare_exchange_weak(current, begin + index)) {
+        }
+    });
+    return found.load();
+}
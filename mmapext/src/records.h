@@ -0,0 +1,61 @@
+#pragma once
+
+// Encoding of the length prefixes of MMAPEXT_RECORD_* records.
+
+#include <mmapext/mmapext.h>
+#include <string.h>
+
+// A LEB128 varint of a uint64_t takes at most 10 bytes.
+constexpr int max_record_prefix_size = 10;
+
+// Writes the length prefix of a record to out and returns its size, 0 if the format is unknown or can't
+// hold the length. The suffix of a framed record is the same as its prefix.
+inline int encode_record_length(int format, uint64_t length, uint8_t *out)
+{
+    switch (format) {
+    case MMAPEXT_RECORD_VARINT: {
+        int n = 0;
+        while (length >= 0x80) {
+            out[n++] = uint8_t(length) | 0x80;
+            length >>= 7;
+        }
+        out[n++] = uint8_t(length);
+        return n;
+    }
+    case MMAPEXT_RECORD_U32:
+    case MMAPEXT_RECORD_U32_FRAMED: {
+        if (length > UINT32_MAX) {
+            return 0;
+        }
+        // Host byte order, little endian on everything we run on, like the other file formats.
+        const uint32_t value = uint32_t(length);
+        memcpy(out, &value, sizeof(value));
+        return int(sizeof(value));
+    }
+    }
+    return 0;
+}
+
+// Decodes a length prefix from [p, end). Returns the prefix size, 0 if it is truncated or malformed.
+inline int decode_record_length(int format, const uint8_t *p, const uint8_t *end, uint64_t *length)
+{
+    if (format == MMAPEXT_RECORD_VARINT) {
+        uint64_t value = 0;
+        for (int i = 0; i < max_record_prefix_size && p + i < end; ++i) {
+            value |= uint64_t(p[i] & 0x7f) << (7 * i);
+            if ((p[i] & 0x80) == 0) {
+                *length = value;
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    if (end - p < 4) {
+        return 0;
+    }
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    *length = value;
+    return 4;
+}
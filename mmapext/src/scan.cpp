@@ -0,0 +1,523 @@
+#include <mmapext/mmapext.h>
+
+#include "scan.h"
+
+#include <algorithm>
+#include <plog/Log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#endif
+
+void byte_set_init(ByteSet *set, const uint8_t *bytes, uint32_t num_bytes)
+{
+    memset(set, 0, sizeof(*set));
+    for (uint32_t i = 0; i < num_bytes; ++i) {
+        const uint8_t b = bytes[i];
+        uint8_t *table = b < 0x80 ? set->low_table : set->high_table;
+        table[b & 15] |= uint8_t(1u << ((b >> 4) & 7));
+        set->contains[b] = true;
+    }
+}
+
+// Scalar versions, also used for the tails of the AVX2 versions.
+
+static uint64_t find_byte_scalar(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const void *found = memchr(p, byte, n);
+    return found == nullptr ? n : uint64_t(static_cast<const uint8_t *>(found) - p);
+}
+
+static uint64_t find_any_scalar(const uint8_t *p, uint64_t n, const ByteSet &set)
+{
+    for (uint64_t i = 0; i < n; ++i) {
+        if (set.contains[p[i]]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+static uint64_t find_substring_scalar(const uint8_t *p, uint64_t n, const uint8_t *needle, uint64_t m)
+{
+    const void *found = memmem(p, n, needle, m);
+    return found == nullptr ? n : uint64_t(static_cast<const uint8_t *>(found) - p);
+}
+
+static uint64_t
+byte_positions_scalar(const uint8_t *p, uint64_t n, uint8_t byte, uint64_t base, uint64_t *out, uint64_t max)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; count < max; ++i) {
+        i += find_byte_scalar(p + i, n - i, byte);
+        if (i == n) {
+            break;
+        }
+        out[count++] = base + i;
+    }
+    return count;
+}
+
+static uint64_t count_byte_scalar(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        count += p[i] == byte;
+    }
+    return count;
+}
+
+// Checks the candidates in mask, bit i meaning the first and last byte of the needle match at p + i.
+static inline bool
+first_candidate(const uint8_t *p, uint64_t mask, const uint8_t *needle, uint64_t m, uint64_t *index)
+{
+    while (mask != 0) {
+        const int bit = __builtin_ctzll(mask);
+        if (m <= 2 || memcmp(p + bit + 1, needle + 1, m - 2) == 0) {
+            *index = uint64_t(bit);
+            return true;
+        }
+        mask &= mask - 1;
+    }
+    return false;
+}
+
+#if defined(__x86_64__)
+
+// Writes base + the index of each set bit to out and returns the number of bits. Writes 4 entries at a time
+// whether or not the bits are set, so out needs room for 64. The first 4 are written unconditionally, which
+// avoids a hard to predict branch when a block has one match or none about equally often.
+__attribute__((target("bmi"))) static inline uint64_t
+flatten_bits(uint64_t bits, uint64_t base, uint64_t *out)
+{
+    const uint64_t count = __builtin_popcountll(bits);
+    uint64_t written = 0;
+    do {
+        out[written] = base + _tzcnt_u64(bits);
+        bits = _blsr_u64(bits);
+        out[written + 1] = base + _tzcnt_u64(bits);
+        bits = _blsr_u64(bits);
+        out[written + 2] = base + _tzcnt_u64(bits);
+        bits = _blsr_u64(bits);
+        out[written + 3] = base + _tzcnt_u64(bits);
+        bits = _blsr_u64(bits);
+        written += 4;
+    } while (written < count);
+    return count;
+}
+
+__attribute__((target("avx2"))) static uint64_t find_byte_avx2(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const __m256i b = _mm256_set1_epi8(char(byte));
+    uint64_t i = 0;
+
+    // Two vectors per iteration, only locating the match once either of them has one.
+    for (; i + 64 <= n; i += 64) {
+        const __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), b);
+        const __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), b);
+        if (!_mm256_testz_si256(_mm256_or_si256(eq0, eq1), _mm256_or_si256(eq0, eq1))) {
+            const uint64_t mask = uint64_t(uint32_t(_mm256_movemask_epi8(eq0))) |
+                                  (uint64_t(uint32_t(_mm256_movemask_epi8(eq1))) << 32);
+            return i + __builtin_ctzll(mask);
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        const uint32_t mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), b));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_byte_scalar(p + i, n - i, byte);
+}
+
+// Bit (i & 7) at index i, for looking up the bit of a high nibble.
+static inline __m128i nibble_bits()
+{
+    return _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, char(128), 1, 2, 4, 8, 16, 32, 64, char(128));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+not_in_set_avx2(__m256i v, __m256i low, __m256i high)
+{
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    const __m256i bits = _mm256_broadcastsi128_si256(nibble_bits());
+
+    const __m256i lo = _mm256_and_si256(v, nibble_mask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble_mask);
+
+    // Bytes with the high bit set select from the second table.
+    const __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, lo), _mm256_shuffle_epi8(high, lo), v);
+    const __m256i hit = _mm256_and_si256(row, _mm256_shuffle_epi8(bits, hi));
+    return _mm256_cmpeq_epi8(hit, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static uint64_t
+find_any_avx2(const uint8_t *p, uint64_t n, const ByteSet &set)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set.low_table));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set.high_table));
+    uint64_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        const __m256i not_in_set = not_in_set_avx2(_mm256_loadu_si256((const __m256i *)(p + i)), low, high);
+        const uint32_t mask = ~uint32_t(_mm256_movemask_epi8(not_in_set));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_any_scalar(p + i, n - i, set);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+find_substring_avx2(const uint8_t *p, uint64_t n, const uint8_t *needle, uint64_t m)
+{
+    const __m256i first = _mm256_set1_epi8(char(needle[0]));
+    const __m256i last = _mm256_set1_epi8(char(needle[m - 1]));
+    uint64_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        const __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), first);
+        const __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + m - 1)), last);
+        const uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        uint64_t index = 0;
+        if (mask != 0 && first_candidate(p + i, mask, needle, m, &index)) {
+            return i + index;
+        }
+    }
+    const uint64_t rest = find_substring_scalar(p + i, n - i, needle, m);
+    return rest == n - i ? n : i + rest;
+}
+
+__attribute__((target("avx2,bmi"))) static uint64_t
+byte_positions_avx2(const uint8_t *p, uint64_t n, uint8_t byte, uint64_t base, uint64_t *out, uint64_t max)
+{
+    const __m256i b = _mm256_set1_epi8(char(byte));
+    uint64_t count = 0;
+    uint64_t i = 0;
+
+    for (; i + 32 <= n && count + 32 <= max; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        count += flatten_bits(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b))), base + i, out + count);
+    }
+    for (; i < n && count < max; ++i) {
+        if (p[i] == byte) {
+            out[count++] = base + i;
+        }
+    }
+    return count;
+}
+
+__attribute__((target("avx2"))) static uint64_t count_byte_avx2(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const __m256i b = _mm256_set1_epi8(char(byte));
+    uint64_t count = 0;
+    uint64_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        const __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), b);
+        count += __builtin_popcount(uint32_t(_mm256_movemask_epi8(eq)));
+    }
+    return count + count_byte_scalar(p + i, n - i, byte);
+}
+
+// The AVX-512 versions handle the tail with a masked load, which doesn't fault on the masked out bytes.
+// Full blocks use plain loads, masked ones are slower even with all bits set.
+
+static inline __mmask64 tail_mask(uint64_t remaining)
+{
+    return remaining >= 64 ? ~__mmask64(0) : (__mmask64(1) << remaining) - 1;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __mmask64
+eq_mask_avx512(const uint8_t *p, uint64_t remaining, __m512i b)
+{
+    if (remaining >= 64) {
+        return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p), b);
+    }
+    const __mmask64 valid = tail_mask(remaining);
+    return _mm512_mask_cmpeq_epi8_mask(valid, _mm512_maskz_loadu_epi8(valid, p), b);
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2"))) static uint64_t
+find_byte_avx512(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const __m512i b = _mm512_set1_epi8(char(byte));
+    for (uint64_t i = 0; i < n; i += 64) {
+        const __mmask64 eq = eq_mask_avx512(p + i, n - i, b);
+        if (eq != 0) {
+            return i + __builtin_ctzll(eq);
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx512f,avx512bw,bmi,bmi2"))) static uint64_t
+byte_positions_avx512(const uint8_t *p, uint64_t n, uint8_t byte, uint64_t base, uint64_t *out, uint64_t max)
+{
+    const __m512i b = _mm512_set1_epi8(char(byte));
+    uint64_t count = 0;
+    uint64_t i = 0;
+
+    for (; i < n && count + 64 <= max; i += 64) {
+        count += flatten_bits(eq_mask_avx512(p + i, n - i, b), base + i, out + count);
+    }
+    // Close to max_positions, where flatten_bits could write past the end.
+    for (; i < n && count < max; i += 64) {
+        uint64_t eq = eq_mask_avx512(p + i, n - i, b);
+        for (; eq != 0 && count < max; eq &= eq - 1) {
+            out[count++] = base + i + __builtin_ctzll(eq);
+        }
+    }
+    return count;
+}
+
+// _mm512_broadcast_i32x4, like the zero extending casts and _mm512_reduce_add_epi64, is built on an
+// undefined vector in GCC's headers and trips -Wuninitialized. The zero masked form is the same instruction.
+__attribute__((target("avx512f"))) static inline __m512i broadcast_128_avx512(__m128i v)
+{
+    return _mm512_maskz_broadcast_i32x4(__mmask16(0xffff), v);
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2"))) static uint64_t
+find_any_avx512(const uint8_t *p, uint64_t n, const ByteSet &set)
+{
+    const __m512i low = broadcast_128_avx512(_mm_loadu_si128((const __m128i *)set.low_table));
+    const __m512i high = broadcast_128_avx512(_mm_loadu_si128((const __m128i *)set.high_table));
+    const __m512i bits = broadcast_128_avx512(nibble_bits());
+    const __m512i nibble_mask = _mm512_set1_epi8(0x0f);
+
+    for (uint64_t i = 0; i < n; i += 64) {
+        const __mmask64 valid = tail_mask(n - i);
+        const __m512i v = n - i >= 64 ? _mm512_loadu_si512(p + i) : _mm512_maskz_loadu_epi8(valid, p + i);
+        const __m512i lo = _mm512_and_si512(v, nibble_mask);
+        const __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble_mask);
+
+        const __m512i row = _mm512_mask_blend_epi8(
+            _mm512_movepi8_mask(v), _mm512_shuffle_epi8(low, lo), _mm512_shuffle_epi8(high, lo));
+        const __mmask64 hit = _mm512_mask_test_epi8_mask(valid, row, _mm512_shuffle_epi8(bits, hi));
+        if (hit != 0) {
+            return i + __builtin_ctzll(hit);
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2"))) static uint64_t
+find_substring_avx512(const uint8_t *p, uint64_t n, const uint8_t *needle, uint64_t m)
+{
+    const __m512i first = _mm512_set1_epi8(char(needle[0]));
+    const __m512i last = _mm512_set1_epi8(char(needle[m - 1]));
+    const uint64_t num_positions = n - m + 1;
+
+    for (uint64_t i = 0; i < num_positions; i += 64) {
+        const __mmask64 a = eq_mask_avx512(p + i, num_positions - i, first);
+        const __mmask64 b = a & eq_mask_avx512(p + i + m - 1, num_positions - i, last);
+        uint64_t index = 0;
+        if (b != 0 && first_candidate(p + i, b, needle, m, &index)) {
+            return i + index;
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq,bmi2"))) static uint64_t
+count_byte_avx512_vpopcnt(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const __m512i b = _mm512_set1_epi8(char(byte));
+    __m512i counts = _mm512_setzero_si512();
+
+    // Four masks per iteration collected into one vector, so the popcounts don't serialize.
+    uint64_t i = 0;
+    for (; i + 256 <= n; i += 256) {
+        const __mmask64 m0 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i), b);
+        const __mmask64 m1 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i + 64), b);
+        const __mmask64 m2 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i + 128), b);
+        const __mmask64 m3 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i + 192), b);
+        const __m512i masks =
+            _mm512_set_epi64(0, 0, 0, 0, int64_t(m3), int64_t(m2), int64_t(m1), int64_t(m0));
+        counts = _mm512_add_epi64(counts, _mm512_popcnt_epi64(masks));
+    }
+
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, counts);
+    uint64_t count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i += 64) {
+        count += __builtin_popcountll(eq_mask_avx512(p + i, n - i, b));
+    }
+    return count;
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2,popcnt"))) static uint64_t
+count_byte_avx512(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    const __m512i b = _mm512_set1_epi8(char(byte));
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; i += 64) {
+        count += __builtin_popcountll(eq_mask_avx512(p + i, n - i, b));
+    }
+    return count;
+}
+
+#endif
+
+struct ScanKernels {
+    const char *isa;
+    uint64_t (*find_byte)(const uint8_t *, uint64_t, uint8_t);
+    uint64_t (*find_any)(const uint8_t *, uint64_t, const ByteSet &);
+    uint64_t (*find_substring)(const uint8_t *, uint64_t, const uint8_t *, uint64_t);
+    uint64_t (*count_byte)(const uint8_t *, uint64_t, uint8_t);
+    uint64_t (*byte_positions)(const uint8_t *, uint64_t, uint8_t, uint64_t, uint64_t *, uint64_t);
+};
+
+static ScanKernels _mmapext_select_scan_kernels()
+{
+    // MMAPEXT_SCAN_ISA=avx2 or scalar forces a less capable version, for benchmarks.
+    const char *forced = getenv("MMAPEXT_SCAN_ISA");
+    const std::string limit = forced != nullptr ? forced : "";
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (limit != "avx2" && limit != "scalar" && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("bmi2")) {
+        const bool vpopcnt = __builtin_cpu_supports("avx512vpopcntdq");
+        return ScanKernels{ "avx512",
+                            find_byte_avx512,
+                            find_any_avx512,
+                            find_substring_avx512,
+                            vpopcnt ? count_byte_avx512_vpopcnt : count_byte_avx512,
+                            byte_positions_avx512 };
+    }
+    if (limit != "scalar" && __builtin_cpu_supports("avx2")) {
+        return ScanKernels{
+            "avx2", find_byte_avx2, find_any_avx2, find_substring_avx2, count_byte_avx2, byte_positions_avx2
+        };
+    }
+#endif
+    return ScanKernels{ "scalar",
+                        find_byte_scalar,
+                        find_any_scalar,
+                        find_substring_scalar,
+                        count_byte_scalar,
+                        byte_positions_scalar };
+}
+
+static const ScanKernels &_mmapext_scan_kernels()
+{
+    static const ScanKernels kernels = [] {
+        const ScanKernels k = _mmapext_select_scan_kernels();
+        PLOGI.printf("using %s scan kernels", k.isa);
+        return k;
+    }();
+    return kernels;
+}
+
+uint64_t scan_find_byte(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    return _mmapext_scan_kernels().find_byte(p, n, byte);
+}
+
+uint64_t scan_find_any(const uint8_t *p, uint64_t n, const ByteSet &set)
+{
+    return _mmapext_scan_kernels().find_any(p, n, set);
+}
+
+uint64_t scan_find_substring(const uint8_t *p, uint64_t n, const uint8_t *needle, uint64_t needle_length)
+{
+    if (needle_length == 0) {
+        return 0;
+    }
+    if (needle_length > n) {
+        return n;
+    }
+    if (needle_length == 1) {
+        return scan_find_byte(p, n, needle[0]);
+    }
+    return _mmapext_scan_kernels().find_substring(p, n, needle, needle_length);
+}
+
+uint64_t scan_count_byte(const uint8_t *p, uint64_t n, uint8_t byte)
+{
+    return _mmapext_scan_kernels().count_byte(p, n, byte);
+}
+
+uint64_t scan_byte_positions(const uint8_t *p,
+                             uint64_t n,
+                             uint8_t byte,
+                             uint64_t base,
+                             uint64_t *positions,
+                             uint64_t max_positions)
+{
+    return _mmapext_scan_kernels().byte_positions(p, n, byte, base, positions, max_positions);
+}
+
+const char *scan_isa() { return _mmapext_scan_kernels().isa; }
+
+// Clamps [offset, offset + length) to the mapped size and returns its length.
+static uint64_t _mmapext_scan_range(const MmapManager *man, uint64_t offset, uint64_t length)
+{
+    const uint64_t mapped = mmapext_mapped_size(man);
+    if (offset >= mapped) {
+        return 0;
+    }
+    return std::min(length, mapped - offset);
+}
+
+static uint64_t _mmapext_found(uint64_t offset, uint64_t index, uint64_t n)
+{
+    return index == n ? MMAPEXT_NOT_FOUND : offset + index;
+}
+
+uint64_t mmapext_find_byte(const struct MmapManager *man, uint64_t offset, uint64_t length, uint8_t byte)
+{
+    const uint64_t n = _mmapext_scan_range(man, offset, length);
+    return _mmapext_found(offset, scan_find_byte(man->address + offset, n, byte), n);
+}
+
+uint64_t mmapext_find_any_byte(const struct MmapManager *man,
+                               uint64_t offset,
+                               uint64_t length,
+                               const uint8_t *bytes,
+                               uint32_t num_bytes)
+{
+    ByteSet set;
+    byte_set_init(&set, bytes, num_bytes);
+
+    const uint64_t n = _mmapext_scan_range(man, offset, length);
+    return _mmapext_found(offset, scan_find_any(man->address + offset, n, set), n);
+}
+
+uint64_t mmapext_find_substring(const struct MmapManager *man,
+                                uint64_t offset,
+                                uint64_t length,
+                                const uint8_t *needle,
+                                uint64_t needle_length)
+{
+    const uint64_t n = _mmapext_scan_range(man, offset, length);
+    if (needle_length == 0 || needle_length > n) {
+        return needle_length == 0 && n != 0 ? offset : MMAPEXT_NOT_FOUND;
+    }
+    return _mmapext_found(offset, scan_find_substring(man->address + offset, n, needle, needle_length), n);
+}
+
+uint64_t mmapext_count_byte(const struct MmapManager *man, uint64_t offset, uint64_t length, uint8_t byte)
+{
+    const uint64_t n = _mmapext_scan_range(man, offset, length);
+    return scan_count_byte(man->address + offset, n, byte);
+}
+
+uint64_t mmapext_find_all_bytes(const struct MmapManager *man,
+                                uint64_t offset,
+                                uint64_t length,
+                                uint8_t byte,
+                                uint64_t *positions,
+                                uint64_t max_positions)
+{
+    const uint64_t n = _mmapext_scan_range(man, offset, length);
+    return scan_byte_positions(man->address + offset, n, byte, offset, positions, max_positions);
+}
+
+const char *mmapext_scan_isa() { return scan_isa(); }
@@ -0,0 +1,38 @@
+#pragma once
+
+// Byte scanning kernels. The AVX2 and AVX-512 versions are picked at run time by what the CPU supports.
+// None of them reads outside [p, p + n), so they are safe at the end of a mapping. They return the index of
+// the first match, or n if there is none.
+
+#include <inttypes.h>
+
+// Set of bytes in the form used by the SIMD kernels. A byte b is in the set if
+// low_nibble_table[b & 15] has bit (b >> 4) & 7 set, where the table for bytes below 0x80 is used for those
+// and the one for bytes from 0x80 up for the rest.
+struct ByteSet {
+    uint8_t low_table[16];
+    uint8_t high_table[16];
+    bool contains[256];
+};
+
+void byte_set_init(ByteSet *set, const uint8_t *bytes, uint32_t num_bytes);
+
+uint64_t scan_find_byte(const uint8_t *p, uint64_t n, uint8_t byte);
+
+uint64_t scan_find_any(const uint8_t *p, uint64_t n, const ByteSet &set);
+
+// Index of the first occurrence of needle. Matches have to fit in [p, p + n).
+uint64_t scan_find_substring(const uint8_t *p, uint64_t n, const uint8_t *needle, uint64_t needle_length);
+
+uint64_t scan_count_byte(const uint8_t *p, uint64_t n, uint8_t byte);
+
+// Writes base + index for up to max_positions occurrences of byte to positions and returns how many.
+uint64_t scan_byte_positions(const uint8_t *p,
+                             uint64_t n,
+                             uint8_t byte,
+                             uint64_t base,
+                             uint64_t *positions,
+                             uint64_t max_positions);
+
+// "avx512", "avx2" or "scalar".
+const char *scan_isa();
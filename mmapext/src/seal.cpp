@@ -0,0 +1,537 @@
+#include <fcntl.h>
+#include <lz4block.h>
+#include <mmapext/mmapext.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <plog/Log.h>
+
+constexpr uint64_t seal_magic = 0x4c41455354584d4dull; // "MMXTSEAL"
+constexpr uint32_t seal_version = 1;
+constexpr uint64_t default_seal_block_size = uint64_t(64) << 10;
+constexpr uint32_t default_seal_cache_blocks = 64;
+
+// lz4block works on int sizes.
+constexpr uint64_t max_seal_block_size = uint64_t(1) << 30;
+
+// Start of the index file.
+struct SealIndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t _unused;
+    uint64_t block_size;
+
+    // Blocks whose entries and data are durable. Updated last by mmapext_seal.
+    uint64_t num_blocks;
+};
+
+// Entry i of the index, right after the header, describes block i, the bytes [i * block_size, (i + 1) *
+// block_size) of the backing file.
+struct SealIndexEntry {
+    // Where the block is in the data file.
+    uint64_t offset;
+
+    // block_size if the block is stored uncompressed.
+    uint32_t compressed_length;
+
+    // Of the stored bytes, see _mmapext_seal_checksum. The LZ4 format has none, and corrupt input often
+    // still decompresses.
+    uint32_t checksum;
+};
+
+struct SealCacheSlot {
+    uint64_t block = UINT64_MAX;
+    uint64_t last_used = 0;
+    std::vector<uint8_t> data;
+};
+
+struct SealState {
+    int data_fd = -1;
+    int index_fd = -1;
+    uint64_t block_size = 0;
+    bool keep_backing_data = false;
+
+    // End of the blocks in the data file. Only used by mmapext_seal.
+    uint64_t data_size = 0;
+
+    // Readers use it to decide what to read from the mapping. Stored after the new blocks are in the index
+    // and before they are punched out of the backing file.
+    std::atomic<uint64_t> sealed_bytes{ 0 };
+
+    // Guards the index and the cache.
+    std::mutex mutex;
+    std::vector<SealIndexEntry> index;
+    std::vector<SealCacheSlot> cache;
+    std::unordered_map<uint64_t, uint32_t> cached_blocks;
+    uint64_t tick = 0;
+    std::vector<uint8_t> read_buffer;
+
+    std::atomic<uint64_t> compressed_bytes{ 0 };
+    std::atomic<uint64_t> cache_hits{ 0 };
+    std::atomic<uint64_t> cache_misses{ 0 };
+    std::atomic<uint64_t> cache_evictions{ 0 };
+};
+
+void seal_state_delete(SealState *seal)
+{
+    if (seal == nullptr) {
+        return;
+    }
+    if (seal->data_fd != -1) {
+        close(seal->data_fd);
+    }
+    if (seal->index_fd != -1) {
+        close(seal->index_fd);
+    }
+    delete seal;
+}
+
+// FNV-1a over 8 byte words, folded to 32 bits. Only guards against corruption, and costs little next to the
+// compression.
+static uint32_t _mmapext_seal_checksum(const uint8_t *p, uint64_t n)
+{
+    constexpr uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * prime;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ p[i]) * prime;
+    }
+    return uint32_t(h ^ (h >> 32));
+}
+
+static bool _mmapext_pwrite_all(int fd, const void *buf, uint64_t length, uint64_t offset)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(buf);
+    while (length != 0) {
+        const ssize_t n = pwrite(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool _mmapext_pread_all(int fd, void *buf, uint64_t length, uint64_t offset)
+{
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    while (length != 0) {
+        const ssize_t n = pread(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static ErrorResult _mmapext_seal_io_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+// Reads the header and entries of an existing index file, or writes the header of a new one.
+static ErrorResult _mmapext_load_seal_index(SealState *seal)
+{
+    struct stat statbuf;
+    if (fstat(seal->index_fd, &statbuf) != 0) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_STAT_FILE, "failed to stat seal index file");
+    }
+
+    SealIndexHeader header{};
+    if (statbuf.st_size == 0) {
+        header.magic = seal_magic;
+        header.version = seal_version;
+        header.block_size = seal->block_size;
+        if (!_mmapext_pwrite_all(seal->index_fd, &header, sizeof(header), 0) ||
+            fdatasync(seal->index_fd) != 0) {
+            return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write seal index header");
+        }
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    if (!_mmapext_pread_all(seal->index_fd, &header, sizeof(header), 0)) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read seal index header");
+    }
+    if (header.magic != seal_magic || header.version != seal_version) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "file is not a seal index or was created by an incompatible version",
+        };
+    }
+    if (header.block_size != seal->block_size) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "seal block size differs from the one of the existing companion file",
+        };
+    }
+
+    seal->index.resize(header.num_blocks);
+    if (!_mmapext_pread_all(seal->index_fd,
+                            seal->index.data(),
+                            header.num_blocks * sizeof(SealIndexEntry),
+                            sizeof(SealIndexHeader))) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read seal index entries");
+    }
+
+    // Blocks are appended in order, anything after the last one is left over from an interrupted seal.
+    for (const auto &entry : seal->index) {
+        seal->compressed_bytes += entry.compressed_length;
+    }
+    if (!seal->index.empty()) {
+        seal->data_size = seal->index.back().offset + seal->index.back().compressed_length;
+    }
+    seal->sealed_bytes = header.num_blocks * seal->block_size;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_enable_sealing(struct MmapManager *man, struct MmapManagerSealOptions opts)
+{
+    if (man->_internal == nullptr || man->_internal->seal != nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "manager is not alive or sealing is already enabled",
+        };
+    }
+
+    const uint64_t block_size = opts.block_size != 0 ? opts.block_size : default_seal_block_size;
+    if (block_size % man->_chunk_size != 0 || block_size > max_seal_block_size) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "seal block size is not a multiple of the chunk size or larger than 1GB",
+        };
+    }
+
+    auto seal = new SealState();
+    seal->block_size = block_size;
+    seal->keep_backing_data = opts.keep_backing_data;
+
+    const std::string data_path = std::string(man->filepath) + ".sealed";
+    const std::string index_path = data_path + ".idx";
+    seal->data_fd = open(data_path.c_str(), O_RDWR | O_CREAT, 0644);
+    seal->index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (seal->data_fd == -1 || seal->index_fd == -1) {
+        auto err =
+            _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_OPEN_FILE, "failed to open seal companion file");
+        seal_state_delete(seal);
+        return err;
+    }
+
+    auto err = _mmapext_load_seal_index(seal);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        seal_state_delete(seal);
+        return err;
+    }
+
+    const uint32_t cache_blocks = opts.cache_blocks != 0 ? opts.cache_blocks : default_seal_cache_blocks;
+    seal->cache.resize(cache_blocks);
+    seal->cached_blocks.reserve(cache_blocks);
+
+    PLOGI.printf("enabled sealing of %s with %lu sealed blocks of %lu bytes",
+                 man->filepath,
+                 seal->index.size(),
+                 block_size);
+
+    man->_internal->seal = seal;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_seal(struct MmapManager *man, uint64_t watermark)
+{
+    SealState *seal = man->_internal != nullptr ? man->_internal->seal : nullptr;
+    if (seal == nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "sealing is not enabled",
+        };
+    }
+
+    const uint64_t block_size = seal->block_size;
+    const uint64_t first_block = seal->sealed_bytes.load() / block_size;
+    const uint64_t end_block = std::min(watermark, mmapext_mapped_size(man)) / block_size;
+    if (end_block <= first_block) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    const uint64_t sealed_length = (end_block - first_block) * block_size;
+    auto map_err = mmapext_ensure_mapped(man, first_block * block_size, sealed_length);
+    if (map_err.error_code != MMAPEXT_ERR_NONE) {
+        return map_err;
+    }
+
+    std::vector<uint8_t> compressed(lz4block_compress_bound(int(block_size)));
+    std::vector<SealIndexEntry> entries;
+    entries.reserve(end_block - first_block);
+    uint64_t data_size = seal->data_size;
+
+    for (uint64_t block = first_block; block < end_block; ++block) {
+        const uint8_t *src = man->address + block * block_size;
+        const int n = lz4block_compress(src, int(block_size), compressed.data(), int(compressed.size()));
+
+        auto entry = SealIndexEntry{ .offset = data_size, .compressed_length = uint32_t(block_size) };
+        const uint8_t *stored = src;
+        if (n > 0 && uint64_t(n) < block_size) {
+            entry.compressed_length = uint32_t(n);
+            stored = compressed.data();
+        }
+        entry.checksum = _mmapext_seal_checksum(stored, entry.compressed_length);
+
+        if (!_mmapext_pwrite_all(seal->data_fd, stored, entry.compressed_length, entry.offset)) {
+            return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write sealed block");
+        }
+        data_size += entry.compressed_length;
+        entries.push_back(entry);
+    }
+
+    // The data has to be durable before the index points to it, and the entries before the header counts
+    // them.
+    if (fdatasync(seal->data_fd) != 0) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to sync seal data file");
+    }
+    if (!_mmapext_pwrite_all(seal->index_fd,
+                             entries.data(),
+                             entries.size() * sizeof(SealIndexEntry),
+                             sizeof(SealIndexHeader) + first_block * sizeof(SealIndexEntry)) ||
+        fdatasync(seal->index_fd) != 0) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write seal index entries");
+    }
+    const uint64_t num_blocks = end_block;
+    if (!_mmapext_pwrite_all(seal->index_fd,
+                             &num_blocks,
+                             sizeof(num_blocks),
+                             offsetof(SealIndexHeader, num_blocks)) ||
+        fdatasync(seal->index_fd) != 0) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write seal index header");
+    }
+
+    uint64_t compressed_bytes = 0;
+    for (const auto &entry : entries) {
+        compressed_bytes += entry.compressed_length;
+    }
+    seal->data_size = data_size;
+    seal->compressed_bytes += compressed_bytes;
+
+    {
+        std::lock_guard<std::mutex> lock(seal->mutex);
+        seal->index.insert(seal->index.end(), entries.begin(), entries.end());
+        seal->sealed_bytes.store(end_block * block_size, std::memory_order_release);
+    }
+
+    uint64_t begin = first_block * block_size;
+    const uint64_t end = end_block * block_size;
+    PLOGI.printf("sealed %lu bytes at offset %lu into %lu bytes", end - begin, begin, compressed_bytes);
+    if (seal->keep_backing_data) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // The superblock has to tell openers that the range is gone before it is.
+    if (man->_internal->has_superblock) {
+        mmapext_add_features(man, MMAPEXT_FEATURE_SEALED);
+        mmapext_set_reclaim_watermark(man, end);
+        auto err = mmapext_sync_superblock(man);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+    }
+
+    // The first chunk is never punched. It holds the superblock or the commit length of appends at
+    // MMAPEXT_APPEND_COMMIT_OFFSET, which later appends still update.
+    begin = std::max<uint64_t>(begin, MMAPEXT_PAGE_SIZE);
+
+    if (begin < end &&
+        fallocate(man->_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin) != 0) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_WRITE,
+                                      "failed to punch sealed range out of the backing file");
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+uint64_t mmapext_sealed_size(const struct MmapManager *man)
+{
+    if (man->_internal == nullptr || man->_internal->seal == nullptr) {
+        return 0;
+    }
+    return man->_internal->seal->sealed_bytes.load(std::memory_order_acquire);
+}
+
+// Returns the cache slot holding the decompressed block, reading it if it isn't cached. Called with the
+// mutex held.
+static ErrorResult _mmapext_cached_block(SealState *seal, uint64_t block, SealCacheSlot **out)
+{
+    auto found = seal->cached_blocks.find(block);
+    if (found != seal->cached_blocks.end()) {
+        seal->cache_hits.fetch_add(1, std::memory_order_relaxed);
+        *out = &seal->cache[found->second];
+        (*out)->last_used = ++seal->tick;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+    seal->cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+    // Least recently used slot. The cache is small and a miss costs a read and decompression anyway.
+    uint32_t victim = 0;
+    for (uint32_t i = 1; i < seal->cache.size(); ++i) {
+        if (seal->cache[i].last_used < seal->cache[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    SealCacheSlot &slot = seal->cache[victim];
+    if (slot.block != UINT64_MAX) {
+        seal->cached_blocks.erase(slot.block);
+        seal->cache_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot.block = UINT64_MAX;
+    slot.last_used = 0;
+    slot.data.resize(seal->block_size);
+
+    const SealIndexEntry &entry = seal->index[block];
+    const bool stored_raw = entry.compressed_length == seal->block_size;
+    auto &buffer = stored_raw ? slot.data : seal->read_buffer;
+    buffer.resize(entry.compressed_length);
+    if (!_mmapext_pread_all(seal->data_fd, buffer.data(), entry.compressed_length, entry.offset)) {
+        return _mmapext_seal_io_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read sealed block");
+    }
+
+    if (_mmapext_seal_checksum(buffer.data(), entry.compressed_length) != entry.checksum ||
+        (!stored_raw && lz4block_decompress(buffer.data(),
+                                            int(entry.compressed_length),
+                                            slot.data.data(),
+                                            int(seal->block_size)) != int(seal->block_size))) {
+        PLOGE.printf("sealed block %lu at offset %lu of the data file is corrupt", block, entry.offset);
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT,
+            .error_message = "sealed block is corrupt",
+        };
+    }
+
+    slot.block = block;
+    slot.last_used = ++seal->tick;
+    seal->cached_blocks.emplace(block, victim);
+    *out = &slot;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static ErrorResult _mmapext_read_sealed(SealState *seal, uint64_t offset, uint8_t *dst, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(seal->mutex);
+
+    while (length != 0) {
+        const uint64_t block = offset / seal->block_size;
+        const uint64_t in_block = offset % seal->block_size;
+        const uint64_t n = std::min(length, seal->block_size - in_block);
+
+        SealCacheSlot *slot = nullptr;
+        auto err = _mmapext_cached_block(seal, block, &slot);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+        memcpy(dst, slot->data.data() + in_block, n);
+
+        offset += n;
+        dst += n;
+        length -= n;
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_read(const struct MmapManager *man, uint64_t offset, void *dst, uint64_t length)
+{
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    if (offset > mapped_size || length > mapped_size - offset) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "range to read is not mapped",
+        };
+    }
+    auto err = mmapext_ensure_mapped(man, offset, length);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    SealState *seal = man->_internal != nullptr ? man->_internal->seal : nullptr;
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    if (seal == nullptr) {
+        memcpy(out, man->address + offset, length);
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    const uint64_t end = offset + length;
+    uint64_t pos = offset;
+
+    // The first chunk stays in the backing file and may have changed since it was sealed.
+    if (pos < MMAPEXT_PAGE_SIZE) {
+        const uint64_t stop = std::min<uint64_t>(end, MMAPEXT_PAGE_SIZE);
+        memcpy(out, man->address + pos, stop - pos);
+        pos = stop;
+    }
+    while (pos < end) {
+        const uint64_t sealed = seal->sealed_bytes.load(std::memory_order_acquire);
+        if (pos < sealed) {
+            const uint64_t stop = std::min(end, sealed);
+            err = _mmapext_read_sealed(seal, pos, out + (pos - offset), stop - pos);
+            if (err.error_code != MMAPEXT_ERR_NONE) {
+                return err;
+            }
+            pos = stop;
+            continue;
+        }
+
+        memcpy(out + (pos - offset), man->address + pos, end - pos);
+
+        // A concurrent mmapext_seal stores the sealed size before punching the range, so if the range just
+        // copied could have been punched, the sealed size has grown over it. Like a seqlock reader.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seal->sealed_bytes.load(std::memory_order_relaxed) <= pos) {
+            break;
+        }
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+void mmapext_get_seal_stats(const struct MmapManager *man, struct MmapManagerSealStats *out)
+{
+    *out = MmapManagerSealStats{};
+    SealState *seal = man->_internal != nullptr ? man->_internal->seal : nullptr;
+    if (seal == nullptr) {
+        return;
+    }
+
+    const auto relaxed = std::memory_order_relaxed;
+    out->sealed_bytes = seal->sealed_bytes.load(relaxed);
+    out->compressed_bytes = seal->compressed_bytes.load(relaxed);
+    out->cache_hits = seal->cache_hits.load(relaxed);
+    out->cache_misses = seal->cache_misses.load(relaxed);
+    out->cache_evictions = seal->cache_evictions.load(relaxed);
+}
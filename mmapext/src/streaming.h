@@ -0,0 +1,91 @@
+#pragma once
+
+// Fill and copy kernels with non-temporal stores. The stores bypass the cache and are weakly ordered, so
+// call stream_fence before anything that publishes the written data to other threads.
+
+#include <inttypes.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#endif
+
+// Bytes from p to the next 64 byte boundary, at most n.
+static inline uint64_t stream_head_bytes(const uint8_t *p, uint64_t n)
+{
+    const uint64_t misalignment = uint64_t(uintptr_t(p) & 63);
+    const uint64_t head = misalignment == 0 ? 0 : 64 - misalignment;
+    return head < n ? head : n;
+}
+
+inline void stream_fill(uint8_t *dst, uint8_t value, uint64_t n)
+{
+#if defined(__x86_64__)
+    const uint64_t head = stream_head_bytes(dst, n);
+    memset(dst, value, head);
+    dst += head;
+    n -= head;
+
+#    if defined(__AVX512F__)
+    const __m512i v = _mm512_set1_epi8(char(value));
+    for (; n >= 64; n -= 64, dst += 64) {
+        _mm512_stream_si512((__m512i *)dst, v);
+    }
+#    elif defined(__AVX2__)
+    const __m256i v = _mm256_set1_epi8(char(value));
+    for (; n >= 64; n -= 64, dst += 64) {
+        _mm256_stream_si256((__m256i *)dst, v);
+        _mm256_stream_si256((__m256i *)(dst + 32), v);
+    }
+#    else
+    const __m128i v = _mm_set1_epi8(char(value));
+    for (; n >= 64; n -= 64, dst += 64) {
+        _mm_stream_si128((__m128i *)dst, v);
+        _mm_stream_si128((__m128i *)(dst + 16), v);
+        _mm_stream_si128((__m128i *)(dst + 32), v);
+        _mm_stream_si128((__m128i *)(dst + 48), v);
+    }
+#    endif
+#endif
+
+    memset(dst, value, n);
+}
+
+inline void stream_copy(uint8_t *dst, const uint8_t *src, uint64_t n)
+{
+#if defined(__x86_64__)
+    const uint64_t head = stream_head_bytes(dst, n);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+#    if defined(__AVX512F__)
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        _mm512_stream_si512((__m512i *)dst, _mm512_loadu_si512(src));
+    }
+#    elif defined(__AVX2__)
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        _mm256_stream_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+        _mm256_stream_si256((__m256i *)(dst + 32), _mm256_loadu_si256((const __m256i *)(src + 32)));
+    }
+#    else
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        for (int i = 0; i < 64; i += 16) {
+            _mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+        }
+    }
+#    endif
+#endif
+
+    memcpy(dst, src, n);
+}
+
+inline void stream_fence()
+{
+#if defined(__x86_64__)
+    _mm_sfence();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
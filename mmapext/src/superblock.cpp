@@ -0,0 +1,205 @@
+#include <mmapext/mmapext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#include <plog/Log.h>
+
+constexpr uint64_t superblock_magic = 0x5250555354584d4dull; // "MMXTSUPR"
+
+// First bytes of a file created with use_superblock, and of its mapping.
+struct Superblock {
+    uint64_t magic;
+    uint32_t version;
+
+    // Of the fields from chunk_size to reclaim_watermark, see _mmapext_superblock_checksum.
+    uint32_t checksum;
+
+    uint64_t chunk_size;
+    uint64_t features;
+    uint64_t reclaim_watermark;
+
+    // Not checksummed, every append stores it. Checked against the file size instead.
+    uint64_t logical_length;
+};
+
+static_assert(offsetof(Superblock, logical_length) == MMAPEXT_SUPERBLOCK_COMMIT_OFFSET,
+              "MMAPEXT_SUPERBLOCK_COMMIT_OFFSET has to point at the logical length");
+static_assert(sizeof(Superblock) <= MMAPEXT_PAGE_SIZE, "superblock has to fit the first chunk");
+
+// FNV-1a over the checksummed words, folded to 32 bits like the checksums of sealing.
+static uint32_t _mmapext_superblock_checksum(const Superblock &sb)
+{
+    const uint64_t words[] = { sb.version, sb.chunk_size, sb.features, sb.reclaim_watermark };
+    constexpr uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint64_t word : words) {
+        h = (h ^ word) * prime;
+    }
+    return uint32_t(h ^ (h >> 32));
+}
+
+static ErrorResult _mmapext_superblock_io_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+static ErrorResult _mmapext_bad_superblock(const char *message)
+{
+    return ErrorResult{ .error_code = MMAPEXT_ERR_BAD_FILE_FORMAT, .error_message = message };
+}
+
+ErrorResult superblock_open(int fd, uint64_t file_size, uint64_t features, uint64_t *logical_length)
+{
+    // An empty file is new, and so is a first chunk of zeros, left by a creation that stopped before the
+    // superblock was written. A file with anything else in it is not ours to overwrite.
+    bool is_new = file_size == 0;
+    Superblock sb{};
+    if (file_size == MMAPEXT_PAGE_SIZE) {
+        std::vector<uint8_t> chunk(MMAPEXT_PAGE_SIZE);
+        if (pread(fd, chunk.data(), chunk.size(), 0) != ssize_t(chunk.size())) {
+            return _mmapext_superblock_io_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read superblock");
+        }
+        is_new = std::all_of(chunk.begin(), chunk.end(), [](uint8_t b) { return b == 0; });
+        memcpy(&sb, chunk.data(), sizeof(sb));
+    } else if (file_size >= sizeof(sb) && pread(fd, &sb, sizeof(sb), 0) != ssize_t(sizeof(sb))) {
+        return _mmapext_superblock_io_error(MMAPEXT_ERR_FAILED_TO_READ, "failed to read superblock");
+    }
+
+    if (is_new) {
+        sb.magic = superblock_magic;
+        sb.version = MMAPEXT_SUPERBLOCK_VERSION;
+        sb.chunk_size = MMAPEXT_PAGE_SIZE;
+        sb.features = features;
+        sb.reclaim_watermark = 0;
+        sb.logical_length = MMAPEXT_PAGE_SIZE;
+        sb.checksum = _mmapext_superblock_checksum(sb);
+
+        if (ftruncate(fd, MMAPEXT_PAGE_SIZE) != 0) {
+            return _mmapext_superblock_io_error(MMAPEXT_ERR_FAILED_TO_FTRUNCATE,
+                                                "failed to extend file for the superblock");
+        }
+        if (pwrite(fd, &sb, sizeof(sb), 0) != ssize_t(sizeof(sb)) || fdatasync(fd) != 0) {
+            return _mmapext_superblock_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to write superblock");
+        }
+        *logical_length = sb.logical_length;
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    if (sb.magic != superblock_magic) {
+        return _mmapext_bad_superblock("file has no superblock");
+    }
+    if (sb.version != MMAPEXT_SUPERBLOCK_VERSION) {
+        return _mmapext_bad_superblock("superblock was written by an incompatible version");
+    }
+    if (sb.checksum != _mmapext_superblock_checksum(sb)) {
+        return _mmapext_bad_superblock("superblock checksum mismatch");
+    }
+    if (sb.chunk_size != MMAPEXT_PAGE_SIZE) {
+        return _mmapext_bad_superblock("file was written with another chunk size");
+    }
+    if ((sb.features & ~features) != 0) {
+        PLOGE.printf("file has features %#lx, the opener understands %#lx", sb.features, features);
+        return _mmapext_bad_superblock("file has features the opener doesn't understand");
+    }
+    if (sb.logical_length < MMAPEXT_PAGE_SIZE || sb.logical_length > file_size) {
+        PLOGE.printf("logical length %lu is outside of the file of %lu bytes", sb.logical_length, file_size);
+        return _mmapext_bad_superblock("logical length in superblock is outside of the file");
+    }
+
+    *logical_length = sb.logical_length;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static Superblock *_mmapext_superblock(const MmapManager *man)
+{
+    if (man->_internal == nullptr || !man->_internal->has_superblock) {
+        return nullptr;
+    }
+    return reinterpret_cast<Superblock *>(man->address);
+}
+
+static ErrorResult _mmapext_no_superblock()
+{
+    return ErrorResult{
+        .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+        .error_message = "manager has no superblock",
+    };
+}
+
+// Rewrites the checksum after changing a checksummed field. Single writer, like appends.
+static void _mmapext_superblock_changed(MmapManager *man, Superblock *sb)
+{
+    sb->checksum = _mmapext_superblock_checksum(*sb);
+    mmapext_mark_dirty(man, 0, sizeof(Superblock));
+}
+
+ErrorResult mmapext_get_superblock(const struct MmapManager *man, struct MmapManagerSuperblock *out)
+{
+    *out = MmapManagerSuperblock{};
+    const Superblock *sb = _mmapext_superblock(man);
+    if (sb == nullptr) {
+        return _mmapext_no_superblock();
+    }
+
+    out->version = sb->version;
+    out->chunk_size = sb->chunk_size;
+    out->logical_length = __atomic_load_n(&sb->logical_length, __ATOMIC_ACQUIRE);
+    out->reclaim_watermark = sb->reclaim_watermark;
+    out->features = sb->features;
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_set_reclaim_watermark(struct MmapManager *man, uint64_t watermark)
+{
+    Superblock *sb = _mmapext_superblock(man);
+    if (sb == nullptr) {
+        return _mmapext_no_superblock();
+    }
+    sb->reclaim_watermark = watermark;
+    _mmapext_superblock_changed(man, sb);
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_add_features(struct MmapManager *man, uint64_t features)
+{
+    Superblock *sb = _mmapext_superblock(man);
+    if (sb == nullptr) {
+        return _mmapext_no_superblock();
+    }
+    if ((sb->features | features) != sb->features) {
+        sb->features |= features;
+        _mmapext_superblock_changed(man, sb);
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+ErrorResult mmapext_sync_superblock(struct MmapManager *man)
+{
+    if (_mmapext_superblock(man) == nullptr) {
+        return _mmapext_no_superblock();
+    }
+
+    const uint64_t sys_page_size = sysconf(_SC_PAGESIZE);
+    if (timed_syscall(man->_internal, MMAPEXT_OP_MSYNC, [&] {
+            return msync(man->address, sys_page_size, MS_SYNC);
+        }) != 0) {
+        return _mmapext_superblock_io_error(MMAPEXT_ERR_FAILED_TO_WRITE, "failed to msync superblock");
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
@@ -0,0 +1,543 @@
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mmapext/mmapext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mmapext_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+
+#include <plog/Log.h>
+
+constexpr uint32_t default_async_queue_depth = 64;
+
+// sync_file_range and madvise take a 32 bit length in the submission entry. Checkpoints split longer runs.
+constexpr uint64_t max_async_range = uint64_t(1) << 30;
+
+// The operations of one mmapext_async_checkpoint. Only the final fdatasync is reported, the writeback
+// operations before it leave their first error here.
+struct AsyncCheckpoint {
+    int first_error = 0;
+    DirtyPages pages;
+};
+
+// An operation in flight, keyed by the user_data of its submission entry.
+struct AsyncPending {
+    uint64_t user_data = 0;
+    int op = 0;
+    std::shared_ptr<AsyncCheckpoint> checkpoint;
+
+    // False for the writeback operations of a checkpoint.
+    bool report = true;
+};
+
+struct AsyncRing {
+    // Guards everything below. Not held while waiting for completions.
+    std::mutex mutex;
+
+    // -1 if io_uring isn't available, operations run synchronously then.
+    int fd = -1;
+
+    void *ring = MAP_FAILED;
+    uint64_t ring_size = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    uint64_t sqes_size = 0;
+
+    uint32_t *sq_head = nullptr;
+    uint32_t *sq_tail = nullptr;
+    uint32_t *sq_array = nullptr;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+
+    uint32_t *cq_head = nullptr;
+    uint32_t *cq_tail = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    uint32_t cq_mask = 0;
+
+    uint64_t next_id = 0;
+    std::unordered_map<uint64_t, AsyncPending> pending;
+
+    // Operations submitted and not reaped, the writeback operations of checkpoints not counted.
+    uint32_t in_flight = 0;
+    std::deque<MmapManagerAsyncCompletion> ready;
+};
+
+static ErrorResult _mmapext_async_error(int error_code, const char *message)
+{
+    const int saved_errno = errno;
+    std::array<char, 256> errno_desc_buf{};
+    PLOGE.printf("%s: %s", message, strerror_r(saved_errno, errno_desc_buf.data(), errno_desc_buf.size()));
+    return ErrorResult{
+        .error_code = error_code,
+        .error_message = message,
+        .saved_errno = saved_errno,
+    };
+}
+
+static int _mmapext_io_uring_setup(uint32_t entries, io_uring_params *params)
+{
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int _mmapext_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+// Maps the rings of a new io_uring. Returns false, leaving the ring synchronous, if the kernel doesn't
+// have io_uring or doesn't allow it.
+static bool _mmapext_async_setup_ring(AsyncRing *r, uint32_t queue_depth)
+{
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CLAMP;
+    const int fd = _mmapext_io_uring_setup(queue_depth, &params);
+    if (fd < 0) {
+        PLOGW.printf("io_uring is not available, asynchronous operations run synchronously: %s",
+                     strerror(errno));
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        PLOGW.printf("io_uring of the kernel is too old, asynchronous operations run synchronously");
+        close(fd);
+        return false;
+    }
+
+    r->ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    r->ring = mmap(nullptr, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQ_RING);
+    r->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    r->sqes = static_cast<io_uring_sqe *>(mmap(
+        nullptr, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        PLOGW.printf("failed to map io_uring, asynchronous operations run synchronously: %s",
+                     strerror(errno));
+        if (r->ring != MAP_FAILED) {
+            munmap(r->ring, r->ring_size);
+        }
+        if (r->sqes != MAP_FAILED) {
+            munmap(r->sqes, r->sqes_size);
+        }
+        r->ring = MAP_FAILED;
+        r->sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+        close(fd);
+        return false;
+    }
+
+    uint8_t *ring = static_cast<uint8_t *>(r->ring);
+    r->sq_head = reinterpret_cast<uint32_t *>(ring + params.sq_off.head);
+    r->sq_tail = reinterpret_cast<uint32_t *>(ring + params.sq_off.tail);
+    r->sq_array = reinterpret_cast<uint32_t *>(ring + params.sq_off.array);
+    r->sq_mask = *reinterpret_cast<uint32_t *>(ring + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->cq_head = reinterpret_cast<uint32_t *>(ring + params.cq_off.head);
+    r->cq_tail = reinterpret_cast<uint32_t *>(ring + params.cq_off.tail);
+    r->cqes = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+    r->cq_mask = *reinterpret_cast<uint32_t *>(ring + params.cq_off.ring_mask);
+    r->fd = fd;
+    return true;
+}
+
+// Runs an operation on the calling thread, for rings without io_uring. Returns 0 or a negative errno.
+static int _mmapext_async_run_sync(MmapManager *man, const MmapManagerAsyncOp &op)
+{
+    int r = 0;
+    switch (op.op) {
+    case MMAPEXT_ASYNC_FALLOCATE:
+        r = fallocate(man->_fd, op.flags, op.offset, op.length);
+        break;
+    case MMAPEXT_ASYNC_FSYNC:
+        r = fsync(man->_fd);
+        break;
+    case MMAPEXT_ASYNC_FDATASYNC:
+        r = fdatasync(man->_fd);
+        break;
+    case MMAPEXT_ASYNC_SYNC_FILE_RANGE:
+        r = sync_file_range(man->_fd, op.offset, op.length, SYNC_FILE_RANGE_WRITE);
+        break;
+    case MMAPEXT_ASYNC_MADVISE:
+        r = madvise(man->address + op.offset, op.length, op.flags);
+        break;
+    }
+    return r == 0 ? 0 : -errno;
+}
+
+static void
+_mmapext_async_prep(MmapManager *man, io_uring_sqe *sqe, const MmapManagerAsyncOp &op, uint64_t id)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = man->_fd;
+    sqe->user_data = id;
+    switch (op.op) {
+    case MMAPEXT_ASYNC_FALLOCATE:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = op.offset;
+        sqe->addr = op.length;
+        sqe->len = uint32_t(op.flags);
+        break;
+    case MMAPEXT_ASYNC_FSYNC:
+    case MMAPEXT_ASYNC_FDATASYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op.op == MMAPEXT_ASYNC_FDATASYNC ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    case MMAPEXT_ASYNC_SYNC_FILE_RANGE:
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->off = op.offset;
+        sqe->len = uint32_t(op.length);
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+        break;
+    case MMAPEXT_ASYNC_MADVISE:
+        sqe->opcode = IORING_OP_MADVISE;
+        sqe->fd = -1;
+        sqe->addr = uint64_t(man->address + op.offset);
+        sqe->len = uint32_t(op.length);
+        sqe->fadvise_advice = uint32_t(op.flags);
+        break;
+    }
+    if (op.link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+static ErrorResult _mmapext_async_check_op(const MmapManager *man, const MmapManagerAsyncOp &op)
+{
+    const bool short_range = op.op == MMAPEXT_ASYNC_SYNC_FILE_RANGE || op.op == MMAPEXT_ASYNC_MADVISE;
+    const uint64_t mapped_size = mmapext_mapped_size(man);
+    const bool mapped = op.offset <= mapped_size && op.length <= mapped_size - op.offset;
+    if (op.op < MMAPEXT_ASYNC_FALLOCATE || op.op > MMAPEXT_ASYNC_MADVISE ||
+        (short_range && op.length > UINT32_MAX) || (op.op == MMAPEXT_ASYNC_MADVISE && !mapped)) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "unknown asynchronous operation or range too long or not mapped",
+        };
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+// Queues the operations in the submission ring and submits them. Called with the mutex held, count is at
+// most sq_entries. wait_for_previous drains the ring before the last operation.
+static ErrorResult _mmapext_async_enqueue(MmapManager *man,
+                                          AsyncRing *r,
+                                          const MmapManagerAsyncOp *ops,
+                                          const AsyncPending *pending,
+                                          uint32_t count,
+                                          bool wait_for_previous)
+{
+    // Entries are only left in the ring by a submission that failed, and those are taken back below, but
+    // the ring is shared with the kernel and mustn't be overwritten before it read the entries.
+    const uint32_t first = *r->sq_tail;
+    if (first - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + count > r->sq_entries) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "io_uring submission queue is full",
+        };
+    }
+
+    uint32_t tail = first;
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint64_t id = r->next_id++;
+        const uint32_t index = tail & r->sq_mask;
+        _mmapext_async_prep(man, &r->sqes[index], ops[i], id);
+        if (wait_for_previous && i + 1 == count) {
+            r->sqes[index].flags |= IOSQE_IO_DRAIN;
+        }
+        r->sq_array[index] = index;
+        r->pending.emplace(id, pending[i]);
+        r->in_flight += pending[i].report ? 1 : 0;
+        ++tail;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    do {
+        submitted = _mmapext_io_uring_enter(r->fd, count, 0, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted >= 0 && uint32_t(submitted) == count) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // The entries the kernel didn't take will never complete. Without polling it only reads the ring in
+    // io_uring_enter, and the mutex is held, so they are taken back out of the ring.
+    auto err = _mmapext_async_error(MMAPEXT_ERR_UNKNOWN, "failed to submit to io_uring");
+    const uint32_t taken = submitted > 0 ? uint32_t(submitted) : 0;
+    for (uint32_t i = taken; i < count; ++i) {
+        r->pending.erase(r->sqes[(first + i) & r->sq_mask].user_data);
+        r->in_flight -= pending[i].report ? 1 : 0;
+    }
+    __atomic_store_n(r->sq_tail, first + taken, __ATOMIC_RELEASE);
+    return err;
+}
+
+// Moves the completions in the ring to the ready queue. Called with the mutex held.
+static void _mmapext_async_collect(MmapManager *man, AsyncRing *r)
+{
+    uint32_t head = *r->cq_head;
+    const uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = r->cqes[head & r->cq_mask];
+        auto found = r->pending.find(cqe.user_data);
+        if (found == r->pending.end()) {
+            continue;
+        }
+        AsyncPending p = std::move(found->second);
+        r->pending.erase(found);
+
+        int result = cqe.res;
+        if (p.checkpoint != nullptr) {
+            if (result < 0 && p.checkpoint->first_error == 0) {
+                p.checkpoint->first_error = result;
+            }
+            if (!p.report) {
+                continue;
+            }
+            result = p.checkpoint->first_error != 0 ? p.checkpoint->first_error : result;
+            if (result < 0) {
+                dirty_tracker_restore(man, p.checkpoint->pages);
+            }
+        }
+        --r->in_flight;
+        r->ready.push_back(
+            MmapManagerAsyncCompletion{ .user_data = p.user_data, .op = p.op, .result = result });
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void async_ring_delete(AsyncRing *r)
+{
+    if (r == nullptr) {
+        return;
+    }
+
+    // Operations in flight may still use the mapping and the file.
+    if (r->fd != -1) {
+        while (!r->pending.empty()) {
+            if (_mmapext_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                PLOGE.printf("failed to wait for asynchronous operations: %s", strerror(errno));
+                break;
+            }
+            uint32_t head = *r->cq_head;
+            const uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                r->pending.erase(r->cqes[head & r->cq_mask].user_data);
+            }
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+        munmap(r->sqes, r->sqes_size);
+        munmap(r->ring, r->ring_size);
+        close(r->fd);
+    }
+    delete r;
+}
+
+ErrorResult mmapext_enable_async(struct MmapManager *man, uint32_t queue_depth)
+{
+    if (man->_internal == nullptr || man->_internal->lazy != nullptr) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "manager is not alive or lazily mapped",
+        };
+    }
+    if (man->_internal->async != nullptr) {
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    // The same limit per submission applies without io_uring, so callers don't depend on which one runs.
+    auto *r = new AsyncRing();
+    r->sq_entries = queue_depth != 0 ? queue_depth : default_async_queue_depth;
+    _mmapext_async_setup_ring(r, r->sq_entries);
+    man->_internal->async = r;
+    PLOGI.printf("enabled asynchronous operations on %s, %s",
+                 man->filepath,
+                 r->fd != -1 ? "with io_uring" : "running synchronously");
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
+
+static AsyncRing *_mmapext_async_ring(const MmapManager *man)
+{
+    return man->_internal != nullptr ? man->_internal->async : nullptr;
+}
+
+static ErrorResult _mmapext_async_not_enabled()
+{
+    return ErrorResult{
+        .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+        .error_message = "asynchronous operations are not enabled",
+    };
+}
+
+ErrorResult
+mmapext_async_submit(struct MmapManager *man, const struct MmapManagerAsyncOp *ops, uint32_t count)
+{
+    AsyncRing *r = _mmapext_async_ring(man);
+    if (r == nullptr) {
+        return _mmapext_async_not_enabled();
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        auto err = _mmapext_async_check_op(man, ops[i]);
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            return err;
+        }
+    }
+
+    // Links only hold within one submission to the kernel, so all operations have to fit in the ring.
+    if (count > r->sq_entries) {
+        return ErrorResult{
+            .error_code = MMAPEXT_ERR_INVALID_ARGUMENT,
+            .error_message = "more operations than the queue depth",
+        };
+    }
+
+    std::lock_guard<std::mutex> lock(r->mutex);
+    if (r->fd == -1) {
+        // In order, which is all a link promises.
+        for (uint32_t i = 0; i < count; ++i) {
+            r->ready.push_back(MmapManagerAsyncCompletion{
+                .user_data = ops[i].user_data,
+                .op = ops[i].op,
+                .result = _mmapext_async_run_sync(man, ops[i]),
+            });
+        }
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    std::vector<AsyncPending> pending(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        pending[i].user_data = ops[i].user_data;
+        pending[i].op = ops[i].op;
+    }
+    return _mmapext_async_enqueue(man, r, ops, pending.data(), count, false);
+}
+
+uint32_t mmapext_async_reap(struct MmapManager *man,
+                            struct MmapManagerAsyncCompletion *out,
+                            uint32_t max,
+                            uint32_t min_complete)
+{
+    AsyncRing *r = _mmapext_async_ring(man);
+    if (r == nullptr) {
+        return 0;
+    }
+    min_complete = std::min(min_complete, max);
+
+    std::unique_lock<std::mutex> lock(r->mutex);
+    bool entered = false;
+    while (r->fd != -1) {
+        _mmapext_async_collect(man, r);
+        const bool enough = r->ready.size() >= min_complete;
+        if (r->in_flight == 0 || (enough && (entered || !r->ready.empty()))) {
+            break;
+        }
+
+        // The kernel posts the completions of operations that ran on its workers only when the submitting
+        // thread enters it, which a writer that doesn't make system calls never does. So even without
+        // waiting the kernel is entered once. Another thread may collect the completion this one waits for,
+        // the loop checks again.
+        entered = true;
+        lock.unlock();
+        const int ret = _mmapext_io_uring_enter(r->fd, 0, enough ? 0 : 1, IORING_ENTER_GETEVENTS);
+        const int saved_errno = errno;
+        lock.lock();
+        if (ret < 0 && saved_errno != EINTR) {
+            PLOGE.printf("failed to wait for asynchronous operations: %s", strerror(saved_errno));
+            break;
+        }
+    }
+
+    uint32_t n = 0;
+    for (; n < max && !r->ready.empty(); ++n) {
+        out[n] = r->ready.front();
+        r->ready.pop_front();
+    }
+    return n;
+}
+
+uint32_t mmapext_async_pending(const struct MmapManager *man)
+{
+    AsyncRing *r = _mmapext_async_ring(man);
+    if (r == nullptr) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(r->mutex);
+    return r->in_flight + uint32_t(r->ready.size());
+}
+
+ErrorResult mmapext_async_preallocate(struct MmapManager *man, uint64_t num_chunks, uint64_t user_data)
+{
+    const auto op = MmapManagerAsyncOp{
+        .op = MMAPEXT_ASYNC_FALLOCATE,
+        .offset = mmapext_mapped_size(man),
+        .length = num_chunks * man->_chunk_size,
+        .user_data = user_data,
+    };
+    return mmapext_async_submit(man, &op, 1);
+}
+
+ErrorResult mmapext_async_checkpoint(struct MmapManager *man, uint64_t user_data)
+{
+    AsyncRing *r = _mmapext_async_ring(man);
+    if (r == nullptr) {
+        return _mmapext_async_not_enabled();
+    }
+
+    if (r->fd == -1) {
+        auto res = mmapext_checkpoint(man);
+        const int result = res.error.error_code == MMAPEXT_ERR_NONE ? 0
+                           : res.error.saved_errno != 0           ? -res.error.saved_errno
+                                                                  : -EIO;
+        std::lock_guard<std::mutex> lock(r->mutex);
+        r->ready.push_back(MmapManagerAsyncCompletion{
+            .user_data = user_data,
+            .op = MMAPEXT_ASYNC_FDATASYNC,
+            .result = result,
+        });
+        return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+    }
+
+    auto checkpoint = std::make_shared<AsyncCheckpoint>();
+    auto err = dirty_tracker_take(man, &checkpoint->pages);
+    if (err.error_code != MMAPEXT_ERR_NONE) {
+        return err;
+    }
+
+    std::vector<MmapManagerAsyncOp> ops;
+    for (const DirtyRun &run : checkpoint->pages.runs) {
+        for (uint64_t offset = run.offset; offset < run.offset + run.length; offset += max_async_range) {
+            ops.push_back(MmapManagerAsyncOp{
+                .op = MMAPEXT_ASYNC_SYNC_FILE_RANGE,
+                .offset = offset,
+                .length = std::min(max_async_range, run.offset + run.length - offset),
+            });
+        }
+    }
+    // Without tracking the fdatasync alone writes every dirty page, the mapping is the file.
+    ops.push_back(MmapManagerAsyncOp{ .op = MMAPEXT_ASYNC_FDATASYNC, .user_data = user_data });
+
+    std::vector<AsyncPending> pending(ops.size());
+    for (uint64_t i = 0; i < ops.size(); ++i) {
+        pending[i].user_data = ops[i].user_data;
+        pending[i].op = ops[i].op;
+        pending[i].checkpoint = checkpoint;
+        pending[i].report = i + 1 == ops.size();
+    }
+
+    // The writeback operations run in parallel, the fdatasync drains the ring so it starts after them. There
+    // can be more of them than fit in the ring, earlier batches are submitted on their own.
+    std::lock_guard<std::mutex> lock(r->mutex);
+    for (uint64_t i = 0; i < ops.size(); i += r->sq_entries) {
+        const uint32_t n = uint32_t(std::min<uint64_t>(r->sq_entries, ops.size() - i));
+        err = _mmapext_async_enqueue(man, r, &ops[i], &pending[i], n, i + n == ops.size());
+        if (err.error_code != MMAPEXT_ERR_NONE) {
+            dirty_tracker_restore(man, checkpoint->pages);
+            return err;
+        }
+    }
+    return ErrorResult{ .error_code = MMAPEXT_ERR_NONE };
+}
@@ -51,6 +51,25 @@ package mmapexp
 #define MMAPEXT_ERR_FAILED_TO_CLOSE_FILE 8
 #define MMAPEXT_ERR_FULLY_MAPPED 9
 #define MMAPEXT_ERR_PAGE_SIZE_NON_MULTIPLE 10
+#define MMAPEXT_ERR_BAD_FILE_FORMAT 11
+#define MMAPEXT_ERR_OUT_OF_MEMORY 12
+#define MMAPEXT_ERR_INVALID_ARGUMENT 13
+#define MMAPEXT_ERR_FAILED_TO_MBIND 14
+#define MMAPEXT_ERR_FAILED_TO_MLOCK 15
+#define MMAPEXT_ERR_LOCK_BUDGET_EXCEEDED 16
+#define MMAPEXT_ERR_FAILED_TO_WRITE 17
+#define MMAPEXT_ERR_FAILED_TO_READ 18
+#define MMAPEXT_ERR_BUS_ERROR 19
+#define MMAPEXT_ERR_VMA_LIMIT 20
+
+// NUMA memory policies, see MmapManagerCreateOptions.numa_policy.
+
+#define MMAPEXT_NUMA_DEFAULT 0
+#define MMAPEXT_NUMA_BIND 1
+#define MMAPEXT_NUMA_INTERLEAVE 2
+#define MMAPEXT_NUMA_PREFERRED 3
+
+#define MMAPEXT_MAX_NUMA_NODES 64
 
 // The page size is fixed for now. 8KB is a good "max" estimate.
 #if !defined(MMAPEXT_PAGE_SIZE)
@@ -68,8 +87,50 @@ struct MMAPEXT_API MmapManagerCreateOptions {
     // initial_reserved_size, ignore initial_reserved_size and reserve file size
     // amount of address space instead.
     _Bool reserve_existing_file_size;
+
+    // If not null, try to reserve the address space starting at this address.
+    // If that range is already taken, the reservation falls back to any
+    // address the kernel picks. Useful for data structures stored in the file
+    // that contain raw pointers into the mapping.
+    void *preferred_address;
+
+    // One of the MMAPEXT_NUMA_* policies, applied with mbind to every chunk
+    // as it gets mapped. MMAPEXT_NUMA_DEFAULT leaves placement to the
+    // kernel, which puts a page on the node of the thread that first faults
+    // it. Pages already resident when a chunk is mapped are migrated if
+    // possible. Note that the kernel only honors the policy when allocating
+    // the pages of tmpfs/shm files. Pages of regular files are placed by the
+    // policy of the faulting thread.
+    int numa_policy;
+
+    // Bit i set means node i can be used by the policy. MMAPEXT_NUMA_PREFERRED
+    // uses the lowest set node.
+    uint64_t numa_node_mask;
+
+    // Keep a superblock with the state of the manager in the first chunk of
+    // the file, see mmapext_get_superblock. An empty file, or one with only
+    // zeros in its first chunk, gets one. Any other file must have one, or
+    // creating the manager fails with MMAPEXT_ERR_BAD_FILE_FORMAT.
+    _Bool use_superblock;
+
+    // MMAPEXT_FEATURE_* flags this opener understands. A new file starts
+    // with them, and an existing file with flags not set here is refused.
+    uint64_t superblock_features;
+
+    // Reserve address space for the whole file, whatever
+    // reserve_existing_file_size says, but map only the chunks of
+    // [initial_map_offset, initial_map_offset + initial_map_length) and the
+    // superblock. The mapped size covers the whole file, the rest of it is
+    // mapped by mmapext_ensure_mapped. Opening then costs the same for any
+    // file size.
+    _Bool map_on_demand;
+    uint64_t initial_map_offset;
+    uint64_t initial_map_length;
 };
 
+// Manager state that is not part of the C API.
+struct MmapManagerInternal;
+
 struct MMAPEXT_API MmapManager {
     uint8_t *address;
     uint32_t num_chunks_reserved;
@@ -80,6 +141,11 @@ struct MMAPEXT_API MmapManager {
     int _fd;
     int error_code;
     const char *error_message;
+
+    int _numa_policy;
+    uint64_t _numa_node_mask;
+
+    struct MmapManagerInternal *_internal;
 };
 
 struct MMAPEXT_API ErrorResult {
@@ -154,6 +220,835 @@ mmapext_map_next_file_chunk(struct MmapManager *man, struct MmapManagerMapNextOp
 // already reserved. Call it right after
 MMAPEXT_API struct MmapManagerMapNextChunkResult mmapext_map_full_file(struct MmapManager *man);
 
+struct MMAPEXT_API MmapManagerNumaResidency {
+    struct ErrorResult error;
+
+    // Number of system pages in the queried range.
+    uint64_t num_pages;
+
+    // Pages not present in this process' page tables. A page can be in the
+    // page cache and still count here if it was not touched through this
+    // mapping.
+    uint64_t num_pages_not_resident;
+
+    uint64_t num_pages_on_node[MMAPEXT_MAX_NUMA_NODES];
+};
+
+// Reports on which NUMA node each resident page of the mapped range
+// [offset, offset + length) lives. The range is clamped to the mapped size.
+MMAPEXT_API struct MmapManagerNumaResidency
+mmapext_numa_residency(const struct MmapManager *man, uint64_t offset, uint64_t length);
+
+struct MMAPEXT_API MmapManagerResidency {
+    // Bytes of the queried range after clamping it to the mapped size.
+    uint64_t range_bytes;
+
+    // Bytes of the queried range that are in the page cache, from mincore.
+    uint64_t resident_bytes;
+
+    // The following come from /proc/self/smaps and cover the whole reserved
+    // range of the manager, not just the queried range, since smaps only
+    // reports per mapping.
+    uint64_t rss_bytes;
+    uint64_t dirty_bytes;
+    uint64_t swapped_bytes;
+    uint64_t huge_page_bytes;
+};
+
+// Samples how much of the manager's mapping is in memory. mincore costs one
+// byte of output per page of the range and reading smaps is proportional
+// to the number of mappings in the process, so this is fine to call every
+// few seconds on mappings of many GB.
+MMAPEXT_API struct ErrorResult mmapext_residency(const struct MmapManager *man,
+                                                 uint64_t offset,
+                                                 uint64_t length,
+                                                 struct MmapManagerResidency *out);
+
+// System calls timed by the manager metrics.
+
+#define MMAPEXT_OP_MMAP 0
+#define MMAPEXT_OP_MUNMAP 1
+#define MMAPEXT_OP_FTRUNCATE 2
+#define MMAPEXT_OP_STAT 3
+#define MMAPEXT_OP_MBIND 4
+#define MMAPEXT_OP_MLOCK 5
+#define MMAPEXT_OP_MSYNC 6
+// Not a system call, the fills of lazily mapped managers.
+#define MMAPEXT_OP_FILL 7
+#define MMAPEXT_NUM_OPS 8
+
+// Latency histograms have 4 buckets per power of two nanoseconds, so a
+// bucket is at most 25% wide. The last bucket also counts everything above
+// ~4s.
+#define MMAPEXT_HISTOGRAM_BUCKETS 128
+
+struct MMAPEXT_API MmapManagerHistogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[MMAPEXT_HISTOGRAM_BUCKETS];
+};
+
+struct MMAPEXT_API MmapManagerMetrics {
+    // Times the reserved address space grew, which always moves the mapping.
+    uint64_t grow_events;
+    uint64_t moved_mapping_events;
+
+    // CLOCK_REALTIME of the last grow event in nanoseconds, 0 if none.
+    uint64_t last_grow_time_ns;
+
+    // Times the file was extended and by how many bytes in total.
+    uint64_t file_extensions;
+    uint64_t file_extension_bytes;
+
+    // Bytes added to the mapping by map next calls, including remaps.
+    uint64_t bytes_mapped;
+
+    // Indexed by MMAPEXT_OP_*. The count of a histogram is the number of calls.
+    struct MmapManagerHistogram latency[MMAPEXT_NUM_OPS];
+};
+
+// Copies the manager's metrics. The counters are updated with relaxed atomics,
+// so this can run concurrently with the manager's operations. All zeros if
+// the library was built with MMAPEXT_ENABLE_METRICS off.
+MMAPEXT_API void mmapext_get_metrics(const struct MmapManager *man, struct MmapManagerMetrics *out);
+
+MMAPEXT_API void mmapext_reset_metrics(struct MmapManager *man);
+
+// Smallest duration counted in the next bucket.
+MMAPEXT_API uint64_t mmapext_histogram_bucket_upper_ns(int bucket);
+
+// Estimates the p-th percentile, p in [0, 100], as the upper bound of the
+// bucket containing it.
+MMAPEXT_API uint64_t mmapext_histogram_percentile_ns(const struct MmapManagerHistogram *h, double p);
+
+// Locks the pages of the mapped range [offset, offset + length) in RAM with
+// mlock2(MLOCK_ONFAULT). The pages are locked as they are faulted, so this
+// doesn't read the range. Locked ranges stay locked when the mapping moves.
+//
+// The bytes locked by all managers are charged against a process-wide
+// budget, see mmapext_set_lock_budget. Locking an already locked page
+// doesn't charge it twice.
+MMAPEXT_API struct ErrorResult
+mmapext_lock_range(struct MmapManager *man, uint64_t offset, uint64_t length);
+
+// Unlocks the pages of the range and returns them to the budget.
+MMAPEXT_API struct ErrorResult
+mmapext_unlock_range(struct MmapManager *man, uint64_t offset, uint64_t length);
+
+// Sets the process-wide limit of bytes locked with mmapext_lock_range. 0,
+// the default, means only RLIMIT_MEMLOCK applies. RLIMIT_MEMLOCK is
+// always checked, even when the budget is larger.
+MMAPEXT_API void mmapext_set_lock_budget(uint64_t bytes);
+
+// Returns the number of bytes currently locked by all managers.
+MMAPEXT_API uint64_t mmapext_locked_bytes();
+
+// Bulk operations over the mapped range [offset, offset + length). The range
+// is split into 2MB stripes that num_threads threads, including the caller,
+// work on. 0 threads means one per CPU. The threads come from a pool that is
+// started on first use and shared by all managers. Fill and copy use
+// non-temporal stores, so the written data doesn't evict the caches, and are
+// fenced before returning.
+MMAPEXT_API struct ErrorResult mmapext_parallel_fill(struct MmapManager *man,
+                                                     uint64_t offset,
+                                                     uint64_t length,
+                                                     uint8_t value,
+                                                     int num_threads);
+
+// Copies length bytes from src to the range.
+MMAPEXT_API struct ErrorResult mmapext_parallel_copy_in(struct MmapManager *man,
+                                                        uint64_t offset,
+                                                        const void *src,
+                                                        uint64_t length,
+                                                        int num_threads);
+
+// 64-bit checksum of the range for verification passes, not a cryptographic
+// hash. The result only depends on the data and the range, not on the number
+// of threads.
+MMAPEXT_API struct ErrorResult mmapext_parallel_checksum(const struct MmapManager *man,
+                                                         uint64_t offset,
+                                                         uint64_t length,
+                                                         int num_threads,
+                                                         uint64_t *out);
+
+// Copies length bytes from src to the mapped range [offset, offset +
+// length). Copies of at least the streaming threshold use non-temporal
+// stores that don't pull the written lines into the cache, and are fenced
+// before returning.
+MMAPEXT_API struct ErrorResult
+mmapext_write(struct MmapManager *man, uint64_t offset, const void *src, uint64_t length);
+
+// Appends length bytes from src to a log in the mapping whose length is the
+// uint64_t at commit_offset. The data is written at the current commit
+// length, mapping more chunks if needed, and the new commit length is then
+// published with a release store. Readers that load the commit length with
+// acquire ordering see all data below it. One thread may append at a time.
+// Writes use non-temporal stores above the streaming threshold like
+// mmapext_write. new_commit_length can be null.
+MMAPEXT_API struct ErrorResult mmapext_append(struct MmapManager *man,
+                                              uint64_t commit_offset,
+                                              const void *src,
+                                              uint64_t length,
+                                              uint64_t *new_commit_length);
+
+// Where files written with mmapext_append keep their commit length, unless
+// they have a superblock, see MMAPEXT_SUPERBLOCK_COMMIT_OFFSET: the first
+// uint64_t of the file, in host byte order. It counts bytes from the start
+// of the file, so it includes the header it is in, and a new file starts
+// it at the size of that header, at least 8. While it is 0 appends would
+// overwrite it and fail.
+#define MMAPEXT_APPEND_COMMIT_OFFSET 0
+
+// Sets the size from which mmapext_write and mmapext_append use
+// non-temporal stores, 256KB by default. UINT64_MAX disables them.
+MMAPEXT_API void mmapext_set_streaming_threshold(uint64_t bytes);
+
+MMAPEXT_API uint64_t mmapext_streaming_threshold();
+
+// Scans of the mapped range [offset, offset + length), clamped to the
+// mapped size. The AVX-512 or AVX2 versions are used if the CPU supports
+// them, and nothing outside the range is read. The find functions return
+// the offset of the first match or MMAPEXT_NOT_FOUND.
+#define MMAPEXT_NOT_FOUND UINT64_MAX
+
+MMAPEXT_API uint64_t
+mmapext_find_byte(const struct MmapManager *man, uint64_t offset, uint64_t length, uint8_t byte);
+
+// Finds the first byte that is one of bytes[0, num_bytes). Takes the same
+// time for any number of bytes.
+MMAPEXT_API uint64_t mmapext_find_any_byte(const struct MmapManager *man,
+                                           uint64_t offset,
+                                           uint64_t length,
+                                           const uint8_t *bytes,
+                                           uint32_t num_bytes);
+
+// Finds the first occurrence of needle that lies entirely in the range.
+MMAPEXT_API uint64_t mmapext_find_substring(const struct MmapManager *man,
+                                            uint64_t offset,
+                                            uint64_t length,
+                                            const uint8_t *needle,
+                                            uint64_t needle_length);
+
+// Writes the offsets of the first max_positions occurrences of byte to
+// positions and returns how many there were. Much cheaper than calling
+// mmapext_find_byte per record when records are short. If the result is
+// max_positions, continue from the offset after the last one.
+MMAPEXT_API uint64_t mmapext_find_all_bytes(const struct MmapManager *man,
+                                            uint64_t offset,
+                                            uint64_t length,
+                                            uint8_t byte,
+                                            uint64_t *positions,
+                                            uint64_t max_positions);
+
+// Counts occurrences of byte, e.g. lines with '\n'.
+MMAPEXT_API uint64_t
+mmapext_count_byte(const struct MmapManager *man, uint64_t offset, uint64_t length, uint8_t byte);
+
+// Versions of the above that split the range into stripes like
+// mmapext_parallel_fill.
+MMAPEXT_API uint64_t mmapext_parallel_count_byte(const struct MmapManager *man,
+                                                 uint64_t offset,
+                                                 uint64_t length,
+                                                 uint8_t byte,
+                                                 int num_threads);
+
+MMAPEXT_API uint64_t mmapext_parallel_find_substring(const struct MmapManager *man,
+                                                     uint64_t offset,
+                                                     uint64_t length,
+                                                     const uint8_t *needle,
+                                                     uint64_t needle_length,
+                                                     int num_threads);
+
+// Instruction set of the scan functions: "avx512", "avx2" or "scalar". The
+// MMAPEXT_SCAN_ISA environment variable can lower it to avx2 or scalar.
+MMAPEXT_API const char *mmapext_scan_isa();
+
+// Length prefixed records, see mmapext_append_record and
+// mmapext_record_iterator. Lengths are in host byte order.
+
+// LEB128 varint length, then the payload.
+#define MMAPEXT_RECORD_VARINT 0
+// 4 byte length, then the payload.
+#define MMAPEXT_RECORD_U32 1
+// 4 byte length, the payload and the length again, so the records can also
+// be read backward.
+#define MMAPEXT_RECORD_U32_FRAMED 2
+
+// Appends a record in the given format like mmapext_append, prefix, payload
+// and suffix all at once.
+MMAPEXT_API struct ErrorResult mmapext_append_record(struct MmapManager *man,
+                                                     uint64_t commit_offset,
+                                                     int format,
+                                                     const void *src,
+                                                     uint64_t length,
+                                                     uint64_t *new_commit_length);
+
+struct MMAPEXT_API MmapManagerRecordIteratorOptions {
+    // One of MMAPEXT_RECORD_*.
+    int format;
+
+    // Range of the records, usually from where the log starts to the commit
+    // length of mmapext_append loaded with acquire ordering. end is clamped
+    // to the mapped size.
+    uint64_t begin;
+    uint64_t end;
+
+    // Iterate from end to begin. Only for MMAPEXT_RECORD_U32_FRAMED.
+    _Bool backward;
+
+    // Bytes ahead of the current record to prefetch into the cache, 0 for
+    // the default of 4KB.
+    uint64_t prefetch_distance;
+
+    // If not 0, madvise(MADV_WILLNEED) the next willneed_distance bytes
+    // whenever the iterator gets within that distance of the end of the
+    // previous advice. Useful for files that are not in the page cache, a
+    // few MB is a good start.
+    uint64_t willneed_distance;
+};
+
+struct MMAPEXT_API MmapManagerRecordIterator {
+    // Set if the options were bad or a record was malformed, in which case
+    // iteration stops.
+    int error_code;
+    const char *error_message;
+
+    const struct MmapManager *_man;
+    int _format;
+    _Bool _backward;
+    uint64_t _begin;
+    uint64_t _end;
+    uint64_t _pos;
+    uint64_t _prefetch_distance;
+    uint64_t _prefetched_to;
+    uint64_t _willneed_distance;
+    uint64_t _advised_to;
+};
+
+struct MMAPEXT_API MmapManagerRecord {
+    // Offset of the payload in the mapping.
+    uint64_t offset;
+    uint64_t length;
+
+    // Pointer to the payload. Invalid once the mapping moves.
+    const uint8_t *data;
+};
+
+MMAPEXT_API struct MmapManagerRecordIterator
+mmapext_record_iterator(const struct MmapManager *man, struct MmapManagerRecordIteratorOptions opts);
+
+// Reads the next record. Returns false at the end of the range or on error.
+MMAPEXT_API _Bool mmapext_record_next(struct MmapManagerRecordIterator *it, struct MmapManagerRecord *out);
+
+// Reads up to max_records records and returns how many it read, fewer only
+// at the end of the range or on error.
+MMAPEXT_API uint64_t mmapext_record_next_batch(struct MmapManagerRecordIterator *it,
+                                               struct MmapManagerRecord *out,
+                                               uint64_t max_records);
+
+// Offset of the next record, or the end of the previous one when iterating
+// backward. Where to resume once more records were committed.
+MMAPEXT_API uint64_t mmapext_record_position(const struct MmapManagerRecordIterator *it);
+
+// Sealing moves cold data out of the backing file. Blocks below a
+// watermark are compressed into a companion file, <backing_file>.sealed,
+// with an index in <backing_file>.sealed.idx, and their range of the
+// backing file is then punched out to free the disk space. The mapping of
+// a sealed range reads as zeros afterwards, so sealed data has to be read
+// with mmapext_read, which decompresses it into a small cache of blocks.
+// Data above the sealed size is read from the mapping directly, without
+// copying. Sealed data is immutable, only seal ranges nothing writes to
+// anymore. The first chunk, where the commit length of appends and the
+// superblock are, is never punched and always read from the mapping.
+
+struct MMAPEXT_API MmapManagerSealOptions {
+    // Bytes compressed together, a multiple of the chunk size. 0 for 64KB.
+    // Has to match the block size of an existing companion file.
+    uint64_t block_size;
+
+    // Decompressed blocks kept in memory by mmapext_read, 0 for 64.
+    uint32_t cache_blocks;
+
+    // Don't punch the sealed blocks out of the backing file, for keeping a
+    // compressed copy only.
+    _Bool keep_backing_data;
+};
+
+// Opens or creates the companion files. Picks up the sealed size of an
+// existing companion file, so call it right after creating the manager.
+MMAPEXT_API struct ErrorResult mmapext_enable_sealing(struct MmapManager *man,
+                                                      struct MmapManagerSealOptions opts);
+
+// Seals the blocks between the current sealed size and watermark, which is
+// rounded down to the block size. Blocks that don't compress are stored as
+// they are. The companion files are synced before the backing file is
+// punched, so a crash loses at most the blocks of this call, which are
+// still in the backing file then.
+MMAPEXT_API struct ErrorResult mmapext_seal(struct MmapManager *man, uint64_t watermark);
+
+// Bytes from the start of the file that are sealed, 0 without sealing.
+MMAPEXT_API uint64_t mmapext_sealed_size(const struct MmapManager *man);
+
+// Copies the mapped range [offset, offset + length) to dst, decompressing
+// the sealed part of it. Safe to call from several threads.
+MMAPEXT_API struct ErrorResult
+mmapext_read(const struct MmapManager *man, uint64_t offset, void *dst, uint64_t length);
+
+struct MMAPEXT_API MmapManagerSealStats {
+    uint64_t sealed_bytes;
+
+    // Size of the sealed blocks in the companion file.
+    uint64_t compressed_bytes;
+
+    // Block lookups of mmapext_read.
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+};
+
+MMAPEXT_API void mmapext_get_seal_stats(const struct MmapManager *man, struct MmapManagerSealStats *out);
+
+// Dirty range tracking, so a checkpoint only flushes what changed since the
+// previous one.
+
+// No tracking, a checkpoint flushes the whole mapping.
+#define MMAPEXT_DIRTY_NONE 0
+// Writes are reported with mmapext_mark_dirty. mmapext_write, the appends
+// and the parallel fill and copy report theirs, so this is exact for
+// managers only written through them.
+#define MMAPEXT_DIRTY_EXPLICIT 1
+// The kernel's soft-dirty page bits, read from /proc/self/pagemap. Catches
+// every write, but clearing the bits is process-wide, so only one manager
+// can use it, and a write that races with the clearing at the end of a
+// checkpoint isn't reported. Checkpoints in this mode always end with an
+// fdatasync, which still makes such a write durable. Needs a kernel built
+// with CONFIG_MEM_SOFT_DIRTY.
+#define MMAPEXT_DIRTY_SOFT_DIRTY 2
+// userfaultfd write protection. The first write to each page after a
+// checkpoint faults to a handler thread of the manager, which records it.
+// Exact, but the kernel supports it only for files on tmpfs or hugetlbfs.
+#define MMAPEXT_DIRTY_UFFD_WP 3
+
+// Switches the manager to one of the MMAPEXT_DIRTY_* modes. Changes made
+// before tracking started are unknown, so the next checkpoint flushes the
+// whole mapping. Must not run concurrently with writes to the mapping.
+MMAPEXT_API struct ErrorResult mmapext_track_dirty(struct MmapManager *man, int mode);
+
+// Reports a write to the mapped range [offset, offset + length). Only
+// needed with MMAPEXT_DIRTY_EXPLICIT, does nothing otherwise. Safe to call
+// from several threads.
+MMAPEXT_API void mmapext_mark_dirty(struct MmapManager *man, uint64_t offset, uint64_t length);
+
+struct MMAPEXT_API MmapManagerCheckpoint {
+    struct ErrorResult error;
+
+    // Runs of adjacent dirty pages flushed, 1 for the whole mapping without
+    // tracking.
+    uint64_t ranges;
+    uint64_t flushed_bytes;
+    uint64_t duration_ns;
+};
+
+// Flushes the pages written since the previous checkpoint to the file and
+// waits until they are durable. Without tracking that is an msync(MS_SYNC)
+// of the whole mapping, with it writeback of each dirty run is started
+// with sync_file_range and one fdatasync waits for them. Pages written while
+// the checkpoint runs are flushed by this one or the next. Both count as
+// MMAPEXT_OP_MSYNC in the metrics.
+MMAPEXT_API struct MmapManagerCheckpoint mmapext_checkpoint(struct MmapManager *man);
+
+// Lazily mapped files. The whole file is reserved at open without reading
+// anything, and the first access to each page faults to a handler thread of
+// the manager, which fills it through userfaultfd. Useful for files that
+// are stored compressed or remotely, where the fill function decompresses
+// or fetches the data, and to apply our own read ahead instead of the
+// kernel's.
+//
+// The mapping is read only, private, and can't grow. Filled pages are not
+// written back and stay in memory, counted as anonymous memory of the
+// process, until the manager is deleted. The functions that write to the
+// mapping, mmapext_write, the appends, the parallel fill and copy and
+// mmapext_safe_write, return MMAPEXT_ERR_INVALID_ARGUMENT for it.
+
+// Reads length bytes of data at offset to dst. Returns 0 on success, an
+// errno value otherwise. Runs on the handler thread, so it must not touch
+// the lazy mapping.
+typedef int (*mmapext_fill_fn)(void *ctx, uint64_t offset, void *dst, uint64_t length);
+
+struct MMAPEXT_API MmapManagerLazyOptions {
+    // File read with pread when fill is null. Opened read only.
+    const char *backing_file;
+
+    // Bytes of data. 0 means the size of backing_file. Past it the mapping
+    // reads zeros up to the next chunk boundary.
+    uint64_t file_size;
+
+    // Fills the pages of a fault. Null reads them from backing_file.
+    mmapext_fill_fn fill;
+    void *fill_ctx;
+
+    // Number of system pages filled by a fault. A fault on the page right
+    // after the previous fill doubles it, up to max_fill_pages, and any other
+    // fault starts over. 0 means 16 and 256.
+    uint32_t fill_pages;
+    uint32_t max_fill_pages;
+};
+
+// Opens a lazily mapped manager. If a fill fails, the faulting thread gets
+// SIGBUS, the same as when reading a mapped file fails. Kernels before 6.6
+// can't do that, and the failed page reads as zeros instead.
+MMAPEXT_API struct MmapManager mmapext_open_lazy(struct MmapManagerLazyOptions opts);
+
+struct MMAPEXT_API MmapManagerLazyStats {
+    // Faults handled. Faults of a page already filled by the read ahead of
+    // a concurrent fault count too.
+    uint64_t faults;
+    uint64_t bytes_filled;
+    uint64_t fill_errors;
+};
+
+// All zeros for managers that are not lazily mapped. The latency of each
+// fault, from reading it to waking the faulting thread, is in the
+// MMAPEXT_OP_FILL histogram of the metrics.
+MMAPEXT_API void mmapext_get_lazy_stats(const struct MmapManager *man, struct MmapManagerLazyStats *out);
+
+// Guarded copies for files that other processes may truncate. Touching a
+// page of a shared mapping past the end of its file raises SIGBUS, which
+// kills the process. These copies catch it and return
+// MMAPEXT_ERR_BUS_ERROR instead. The first call installs a SIGBUS handler
+// that passes signals not raised by a guarded copy on to the handler it
+// replaced, so install other SIGBUS handlers before. A failed write may
+// have written part of the range.
+//
+// Without a fault the guard costs a few nanoseconds per call. A range past
+// the file size last seen by the manager costs an fstat, so a truncated
+// file doesn't fault on every call.
+MMAPEXT_API struct ErrorResult
+mmapext_safe_read(const struct MmapManager *man, uint64_t offset, void *dst, uint64_t length);
+
+MMAPEXT_API struct ErrorResult
+mmapext_safe_write(struct MmapManager *man, uint64_t offset, const void *src, uint64_t length);
+
+// Starts a thread that fstats the backing file every interval_ms and
+// updates the size seen by the guarded copies and mmapext_valid_size. 0
+// stops it. Either way the size is updated once right away.
+MMAPEXT_API struct ErrorResult mmapext_watch_file_size(struct MmapManager *man, uint32_t interval_ms);
+
+// Mapped size clamped to the file size last seen by the manager. Bytes
+// below it were valid at that time. Just the mapped size if the file size
+// was never looked at.
+MMAPEXT_API uint64_t mmapext_valid_size(const struct MmapManager *man);
+
+// Append-only logs behind a choice of I/O engine, to compare mmap with
+// plain and direct I/O on the same workload without changing its code. The
+// file starts with a 4096 byte header holding the durable size, followed by
+// the appended bytes, and is the same for every engine, so a log written
+// with one engine can be reopened with any other. Offsets are relative to
+// the first appended byte. A log is not thread safe.
+
+// Appends go through a manager with mmapext_append, reads are copies from
+// the mapping. Syncing msyncs the pages appended to since the last sync.
+// The durable size in the header is written back along with the data, so
+// after a crash it may cover bytes that didn't make it to the file.
+#define MMAPEXT_ENGINE_MMAP 0
+// Appends are collected in a buffer and written with pwrite when it is
+// full, reads use pread and the page cache.
+#define MMAPEXT_ENGINE_PWRITE 1
+// O_DIRECT, bypassing the page cache. Appends are collected in an aligned
+// buffer, reads go through a block cache of the log's own. The RSS is just
+// the two, no matter how much of the file is read. Needs a file system
+// with O_DIRECT support.
+#define MMAPEXT_ENGINE_DIRECT 2
+
+struct MMAPEXT_API MmapManagerLogOptions {
+    // Created if it doesn't exist.
+    const char *path;
+
+    // One of the MMAPEXT_ENGINE_*.
+    int engine;
+
+    // Bytes of appends collected before they are written, for the pwrite
+    // and direct engines. 0 means 1MB.
+    uint64_t buffer_size;
+
+    // Bytes of the block cache of the direct engine. 0 means 16MB.
+    uint64_t cache_size;
+};
+
+struct MMAPEXT_API MmapManagerLog {
+    int error_code;
+    const char *error_message;
+
+    struct MmapManagerLogInternal *_internal;
+};
+
+MMAPEXT_API struct MmapManagerLog mmapext_log_open(struct MmapManagerLogOptions opts);
+
+// Syncs the log and closes it. The log is closed even if syncing fails.
+MMAPEXT_API struct ErrorResult mmapext_log_close(struct MmapManagerLog *log);
+
+// Appends length bytes and sets *offset, if not null, to where they start.
+// They are readable right away and durable after the next sync.
+MMAPEXT_API struct ErrorResult
+mmapext_log_append(struct MmapManagerLog *log, const void *src, uint64_t length, uint64_t *offset);
+
+MMAPEXT_API struct ErrorResult
+mmapext_log_read(struct MmapManagerLog *log, uint64_t offset, void *dst, uint64_t length);
+
+// Makes everything appended so far durable, including the size in the
+// header.
+MMAPEXT_API struct ErrorResult mmapext_log_sync(struct MmapManagerLog *log);
+
+// Bytes appended, durable or not.
+MMAPEXT_API uint64_t mmapext_log_size(const struct MmapManagerLog *log);
+
+struct MMAPEXT_API MmapManagerLogStats {
+    uint64_t appended_bytes;
+    uint64_t read_bytes;
+
+    // pread and pwrite calls, not counting the ones for the header. Always
+    // 0 for the mmap engine.
+    uint64_t write_calls;
+    uint64_t read_calls;
+    uint64_t syncs;
+
+    // Reads of the block cache of the direct engine, in blocks.
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+MMAPEXT_API void mmapext_log_get_stats(const struct MmapManagerLog *log, struct MmapManagerLogStats *out);
+
+// Asynchronous growth, preallocation and flushing through io_uring. The
+// system calls around a mapping that block on the file system are
+// submitted to a ring of the manager and run by the kernel, so writers can
+// allocate ahead and make data durable without waiting for it. Results
+// come back on a completion queue with the user_data of each operation.
+// An operation linked to the next one completes before the next one
+// starts, which turns "preallocate, then map" or "flush, then publish" into
+// pipelines. Without io_uring, when the kernel is too old or it is
+// disabled, operations run synchronously in mmapext_async_submit and
+// complete right away.
+
+// fallocate of [offset, offset + length) of the backing file with the
+// flags as mode, growing the file if it ends before.
+#define MMAPEXT_ASYNC_FALLOCATE 0
+// fsync or fdatasync of the backing file, offset and length are ignored.
+#define MMAPEXT_ASYNC_FSYNC 1
+#define MMAPEXT_ASYNC_FDATASYNC 2
+// Starts writeback of [offset, offset + length) of the backing file with
+// sync_file_range(SYNC_FILE_RANGE_WRITE), without waiting for it.
+#define MMAPEXT_ASYNC_SYNC_FILE_RANGE 3
+// madvise of [offset, offset + length) of the mapping with the flags as
+// advice. The address is taken at submission, so the manager must not grow
+// while one is in flight.
+#define MMAPEXT_ASYNC_MADVISE 4
+
+struct MMAPEXT_API MmapManagerAsyncOp {
+    // One of the MMAPEXT_ASYNC_*.
+    int op;
+    uint64_t offset;
+
+    // At most 4GB - 1 for sync_file_range and madvise.
+    uint64_t length;
+    int flags;
+
+    // The next operation of the same submission starts only after this one
+    // completed. The kernel doesn't cancel it when this one fails, none of
+    // these operations break a link, so check the result of each.
+    _Bool link;
+    uint64_t user_data;
+};
+
+struct MMAPEXT_API MmapManagerAsyncCompletion {
+    uint64_t user_data;
+    int op;
+
+    // 0 on success, a negative errno otherwise.
+    int result;
+};
+
+// Sets up the ring of the manager with room for queue_depth operations per
+// submission, 0 means 64. Does nothing if it is already set up.
+MMAPEXT_API struct ErrorResult mmapext_enable_async(struct MmapManager *man, uint32_t queue_depth);
+
+// Submits count operations and returns without waiting for them. Safe to
+// call from several threads. Fails with MMAPEXT_ERR_INVALID_ARGUMENT if the
+// ring has no room for them. If the kernel refuses some of them, those are
+// dropped and it fails, the ones it took still complete.
+MMAPEXT_API struct ErrorResult
+mmapext_async_submit(struct MmapManager *man, const struct MmapManagerAsyncOp *ops, uint32_t count);
+
+// Copies up to max completions to out, first waiting until at least
+// min_complete of them are there or nothing is left in flight. Returns the
+// number copied.
+MMAPEXT_API uint32_t mmapext_async_reap(struct MmapManager *man,
+                                        struct MmapManagerAsyncCompletion *out,
+                                        uint32_t max,
+                                        uint32_t min_complete);
+
+// Operations submitted and not reaped yet.
+MMAPEXT_API uint32_t mmapext_async_pending(const struct MmapManager *man);
+
+// Allocates the num_chunks chunks after the mapped ones with fallocate.
+// Once it completed, mmapext_map_next_file_chunk maps them without growing
+// the file, and writes to them can't fail for lack of space.
+MMAPEXT_API struct ErrorResult
+mmapext_async_preallocate(struct MmapManager *man, uint64_t num_chunks, uint64_t user_data);
+
+// mmapext_checkpoint without waiting: submits writeback of each dirty run
+// and an fdatasync that starts after all of them, or just the fdatasync
+// without dirty tracking. Completes once as MMAPEXT_ASYNC_FDATASYNC with
+// user_data when everything it flushed is durable, or with the first
+// error, in which case the pages are dirty again for the next checkpoint.
+MMAPEXT_API struct ErrorResult mmapext_async_checkpoint(struct MmapManager *man, uint64_t user_data);
+
+// Superblock of managers created with use_superblock. It takes the first
+// chunk of the file and the mapping, and holds what a reopen needs to
+// know without looking at the data: the chunk size the file was written
+// with, the logical length, the reclaim watermark and feature flags. The
+// logical length is the commit length of mmapext_append at
+// MMAPEXT_SUPERBLOCK_COMMIT_OFFSET, so appends through it persist the
+// appender state as they go. Reopening maps [0, logical length) right
+// away, without mmapext_map_full_file, and refuses files written with
+// another chunk size, superblock version or with unknown feature flags
+// with MMAPEXT_ERR_BAD_FILE_FORMAT. The other fields are checksummed. The
+// superblock is written back with the rest of the mapping, call
+// mmapext_sync_superblock to make it durable right away.
+
+#define MMAPEXT_SUPERBLOCK_VERSION 1
+
+// Offset of the logical length in the mapping. It starts at the chunk
+// size, the first byte after the superblock.
+#define MMAPEXT_SUPERBLOCK_COMMIT_OFFSET 40
+
+// Set by mmapext_seal. The data below the reclaim watermark is in the
+// companion files of sealing and reads as zeros from the mapping.
+#define MMAPEXT_FEATURE_SEALED (1ull << 0)
+// Bits 32 to 63 are left to applications.
+#define MMAPEXT_FEATURE_APP_SHIFT 32
+
+struct MMAPEXT_API MmapManagerSuperblock {
+    uint32_t version;
+    uint64_t chunk_size;
+    uint64_t logical_length;
+
+    // Bytes from the start of the file whose data was moved out or dropped.
+    uint64_t reclaim_watermark;
+    uint64_t features;
+};
+
+// Copies the superblock to out. Fails with MMAPEXT_ERR_INVALID_ARGUMENT if
+// the manager has none.
+MMAPEXT_API struct ErrorResult mmapext_get_superblock(const struct MmapManager *man,
+                                                      struct MmapManagerSuperblock *out);
+
+// Sets the reclaim watermark, mmapext_seal does it for sealed data.
+MMAPEXT_API struct ErrorResult mmapext_set_reclaim_watermark(struct MmapManager *man, uint64_t watermark);
+
+// Adds the flags to the features of the file. Openers that don't set all
+// of them in superblock_features are refused from then on.
+MMAPEXT_API struct ErrorResult mmapext_add_features(struct MmapManager *man, uint64_t features);
+
+// msyncs the superblock.
+MMAPEXT_API struct ErrorResult mmapext_sync_superblock(struct MmapManager *man);
+
+// Maps the chunks of [offset, offset + length) that are not mapped yet, in
+// managers that map on demand. The range must be within the mapped
+// size. Touching a chunk of such a manager before it is mapped raises
+// SIGSEGV. mmapext_write, mmapext_append, mmapext_read, mmapext_seal and
+// the guarded copies map what they touch, the other functions taking a
+// range need it mapped first. Checking a mapped range costs a few loads,
+// so call it before every access if in doubt. Safe to call from several
+// threads, but not while the manager grows. Does nothing for other
+// managers, all of whose mapped size is mapped.
+MMAPEXT_API struct ErrorResult
+mmapext_ensure_mapped(const struct MmapManager *man, uint64_t offset, uint64_t length);
+
+// Maps the chunks [chunk_offset, chunk_offset + n_chunks) of the file to
+// their place in the reserved address space, growing the file if it ends
+// before, and the mapped size to cover them. Chunks already mapped stay as
+// they are. From then on the manager maps on demand, see map_on_demand, so
+// ranges of a huge reservation can be mapped as islands. Fails with
+// MMAPEXT_ERR_INVALID_ARGUMENT past the reserved size. Like
+// mmapext_ensure_mapped, this also maps gaps of up to 16 chunks between the
+// range and mapped chunks within the mapped size, which saves the VMAs the
+// gaps would split off.
+MMAPEXT_API struct ErrorResult
+mmapext_map_range(struct MmapManager *man, uint64_t chunk_offset, uint64_t n_chunks);
+
+// Turns the chunks [chunk_offset, chunk_offset + n_chunks) back into
+// reserved address space, dropping their pages from the process. The data
+// stays in the file, mmapext_map_range or mmapext_ensure_mapped map it
+// again, and nothing may touch the range in between. Without explicit or
+// userfaultfd dirty tracking, checkpoints find written pages through the
+// mapping, so the range is msynced first. Ranges with locked pages are
+// refused. The manager maps on demand from then on.
+MMAPEXT_API struct ErrorResult
+mmapext_unmap_range(struct MmapManager *man, uint64_t chunk_offset, uint64_t n_chunks);
+
+// Chunks that are mapped, num_chunks_mapped without the holes of a manager
+// that maps on demand.
+MMAPEXT_API uint64_t mmapext_count_mapped_chunks(const struct MmapManager *man);
+
+// Number of VMAs, the kernel's memory areas, the reservation of the
+// manager is estimated to take: one per run of mapped chunks, one per run
+// of reserved address space between them, and two per locked range. The
+// kernel merges neighboring chunks of the file into one area, so a manager
+// mapping a prefix of the file takes at most two plus its locks. NUMA
+// policies, madvise and userfaultfd may split areas further, which only
+// mmapext_count_vmas sees. Reservations kept for readers after the mapping
+// moved count until they are unmapped, see mmapext_read_begin.
+MMAPEXT_API uint64_t mmapext_vma_count(const struct MmapManager *man);
+
+// Counts the VMAs within the reservation of the manager in
+// /proc/self/maps, and within the reservations kept for readers. Costs a
+// read of the whole file, for checking the estimate of mmapext_vma_count.
+MMAPEXT_API struct ErrorResult mmapext_count_vmas(const struct MmapManager *man, uint64_t *out);
+
+// Sets the process-wide limit of the VMAs of all managers, as estimated by
+// mmapext_vma_count. Mapping, unmapping and locking that would go over it
+// fail with MMAPEXT_ERR_VMA_LIMIT, leaving the manager as it was, instead
+// of running into vm.max_map_count, the kernel's limit for the whole
+// process, where mmap fails with ENOMEM. 0, the default, means half of
+// vm.max_map_count, leaving the rest to libraries, malloc and thread
+// stacks. The budget is never more than vm.max_map_count, which is read
+// once.
+MMAPEXT_API void mmapext_set_vma_budget(uint64_t vmas);
+
+// Returns the number of VMAs all managers are estimated to take.
+MMAPEXT_API uint64_t mmapext_total_vma_count();
+
+// Address and mapped size of a manager as seen when entering a read-side
+// critical section.
+struct MMAPEXT_API MmapManagerReadSection {
+    uint8_t *address;
+    uint64_t mapped_size;
+};
+
+// Enters a read-side critical section of the calling thread. Until the
+// matching mmapext_read_end, the returned mapping stays valid even if
+// another thread grows the manager and the mapping moves: the reservation
+// it moved away from stays mapped to the file until no thread can use it
+// anymore, see mmapext_reclaim_mappings. Entering costs a store to a
+// thread-local record and a fence, readers share no lock. Sections nest,
+// the outermost one counts, and cover all managers. Managers that map on
+// demand keep the chunks mapped when the mapping moved, chunks mapped later
+// only appear in the new mapping.
+MMAPEXT_API struct MmapManagerReadSection mmapext_read_begin(const struct MmapManager *man);
+
+// Leaves the read-side critical section entered with mmapext_read_begin.
+MMAPEXT_API void mmapext_read_end();
+
+// Unmaps the reservations the mapping of the manager moved away from that
+// no reader can use anymore, and returns how many are left. Growing does
+// this as well. With wait set, waits until none is left, which never
+// returns within a critical section of the calling thread.
+// mmapext_delete_manager unmaps them all without waiting, so no thread may
+// use the manager anymore by then.
+MMAPEXT_API uint64_t mmapext_reclaim_mappings(struct MmapManager *man, _Bool wait);
+
 uint64_t mmapext_chunk_size();
 */
 import "C"
@@ -161,6 +1056,7 @@ import "C"
 import (
 	"errors"
 	"fmt"
+	"runtime"
 	"unsafe"
 )
 
@@ -175,6 +1071,17 @@ const (
 	MmapextErrFailedToUnmap     = 7
 	MmapextErrFailedToCloseFile = 8
 	MmapextErrFullyMapped       = 9
+	MmapextErrPageSizeNonMult   = 10
+	MmapextErrBadFileFormat     = 11
+	MmapextErrOutOfMemory       = 12
+	MmapextErrInvalidArgument   = 13
+	MmapextErrFailedToMbind     = 14
+	MmapextErrFailedToMlock     = 15
+	MmapextErrLockBudget        = 16
+	MmapextErrFailedToWrite     = 17
+	MmapextErrFailedToRead      = 18
+	MmapextErrBusError          = 19
+	MmapextErrVmaLimit          = 20
 )
 
 const MmapextChunkSize = 8192
@@ -190,6 +1097,16 @@ var (
 	ErrMmapextErrFailedToCloseFile   = errors.New("failed to close file")
 	ErrMmapextErrFullyMapped         = errors.New("file fully mapped")
 	ErrMmapextErrPageSizeNonMultiple = errors.New("not multiple of page size")
+	ErrMmapextErrBadFileFormat       = errors.New("bad file format")
+	ErrMmapextErrOutOfMemory         = errors.New("out of memory")
+	ErrMmapextErrInvalidArgument     = errors.New("invalid argument")
+	ErrMmapextErrFailedToMbind       = errors.New("failed to mbind")
+	ErrMmapextErrFailedToMlock       = errors.New("failed to mlock")
+	ErrMmapextErrLockBudget          = errors.New("lock budget exceeded")
+	ErrMmapextErrFailedToWrite       = errors.New("failed to write")
+	ErrMmapextErrFailedToRead        = errors.New("failed to read")
+	ErrMmapextErrBusError            = errors.New("bus error accessing the mapping")
+	ErrMmapextErrVmaLimit            = errors.New("vma budget exceeded")
 )
 
 var cErrorToGoError = map[int]error{
@@ -203,6 +1120,17 @@ var cErrorToGoError = map[int]error{
 	MmapextErrFailedToUnmap:     ErrMmapextErrFailedToUnmap,
 	MmapextErrFailedToCloseFile: ErrMmapextErrFailedToCloseFile,
 	MmapextErrFullyMapped:       ErrMmapextErrFullyMapped,
+	MmapextErrPageSizeNonMult:   ErrMmapextErrPageSizeNonMultiple,
+	MmapextErrBadFileFormat:     ErrMmapextErrBadFileFormat,
+	MmapextErrOutOfMemory:       ErrMmapextErrOutOfMemory,
+	MmapextErrInvalidArgument:   ErrMmapextErrInvalidArgument,
+	MmapextErrFailedToMbind:     ErrMmapextErrFailedToMbind,
+	MmapextErrFailedToMlock:     ErrMmapextErrFailedToMlock,
+	MmapextErrLockBudget:        ErrMmapextErrLockBudget,
+	MmapextErrFailedToWrite:     ErrMmapextErrFailedToWrite,
+	MmapextErrFailedToRead:      ErrMmapextErrFailedToRead,
+	MmapextErrBusError:          ErrMmapextErrBusError,
+	MmapextErrVmaLimit:          ErrMmapextErrVmaLimit,
 }
 
 type (
@@ -217,10 +1145,27 @@ type Manager struct {
 	backingFile string
 }
 
+// NUMA policies for CreateOptions.NumaPolicy.
+const (
+	NumaDefault    = 0
+	NumaBind       = 1
+	NumaInterleave = 2
+	NumaPreferred  = 3
+)
+
+const MaxNumaNodes = 64
+
 type CreateOptions struct {
 	BackingFile             string
 	InitialReservedSize     uint64
 	ReserveExistingFileSize bool
+	NumaPolicy              int
+	NumaNodeMask            uint64
+	UseSuperblock           bool
+	SuperblockFeatures      uint64
+	MapOnDemand             bool
+	InitialMapOffset        uint64
+	InitialMapLength        uint64
 }
 
 func NewManager(opts CreateOptions) (Manager, error) {
@@ -229,6 +1174,13 @@ func NewManager(opts CreateOptions) (Manager, error) {
 	cOpts.backing_file = backingFileCstr
 	cOpts.initial_reserved_size = C.ulong(opts.InitialReservedSize)
 	cOpts.reserve_existing_file_size = C.bool(opts.ReserveExistingFileSize)
+	cOpts.numa_policy = C.int(opts.NumaPolicy)
+	cOpts.numa_node_mask = C.ulong(opts.NumaNodeMask)
+	cOpts.use_superblock = C.bool(opts.UseSuperblock)
+	cOpts.superblock_features = C.ulong(opts.SuperblockFeatures)
+	cOpts.map_on_demand = C.bool(opts.MapOnDemand)
+	cOpts.initial_map_offset = C.ulong(opts.InitialMapOffset)
+	cOpts.initial_map_length = C.ulong(opts.InitialMapLength)
 
 	defer C.free(unsafe.Pointer(backingFileCstr))
 
@@ -299,3 +1251,773 @@ func (man *Manager) IsAlive() bool {
 func (man *Manager) IsFullyMapped() bool {
 	return bool(C.mmapext_full(&man.man))
 }
+
+type NumaResidency struct {
+	NumPages            uint64
+	NumPagesNotResident uint64
+	NumPagesOnNode      [MaxNumaNodes]uint64
+}
+
+func (man *Manager) NumaResidency(offset, length uint64) (NumaResidency, error) {
+	result := C.mmapext_numa_residency(&man.man, C.ulong(offset), C.ulong(length))
+	if result.error.error_code != MmapextErrNone {
+		return NumaResidency{}, cErrorToGoError[int(result.error.error_code)]
+	}
+
+	residency := NumaResidency{
+		NumPages:            uint64(result.num_pages),
+		NumPagesNotResident: uint64(result.num_pages_not_resident),
+	}
+	for i := range residency.NumPagesOnNode {
+		residency.NumPagesOnNode[i] = uint64(result.num_pages_on_node[i])
+	}
+	return residency, nil
+}
+
+func (man *Manager) LockRange(offset, length uint64) error {
+	result := C.mmapext_lock_range(&man.man, C.ulong(offset), C.ulong(length))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) UnlockRange(offset, length uint64) error {
+	result := C.mmapext_unlock_range(&man.man, C.ulong(offset), C.ulong(length))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func SetLockBudget(bytes uint64) {
+	C.mmapext_set_lock_budget(C.ulong(bytes))
+}
+
+func LockedBytes() uint64 {
+	return uint64(C.mmapext_locked_bytes())
+}
+
+type Residency struct {
+	RangeBytes    uint64
+	ResidentBytes uint64
+	RssBytes      uint64
+	DirtyBytes    uint64
+	SwappedBytes  uint64
+	HugePageBytes uint64
+}
+
+func (man *Manager) Residency(offset, length uint64) (Residency, error) {
+	var out C.struct_MmapManagerResidency
+	result := C.mmapext_residency(&man.man, C.ulong(offset), C.ulong(length), &out)
+	if result.error_code != MmapextErrNone {
+		return Residency{}, cErrorToGoError[int(result.error_code)]
+	}
+
+	return Residency{
+		RangeBytes:    uint64(out.range_bytes),
+		ResidentBytes: uint64(out.resident_bytes),
+		RssBytes:      uint64(out.rss_bytes),
+		DirtyBytes:    uint64(out.dirty_bytes),
+		SwappedBytes:  uint64(out.swapped_bytes),
+		HugePageBytes: uint64(out.huge_page_bytes),
+	}, nil
+}
+
+// System calls timed by the manager metrics, indexes of Metrics.Latency.
+const (
+	OpMmap      = 0
+	OpMunmap    = 1
+	OpFtruncate = 2
+	OpStat      = 3
+	OpMbind     = 4
+	OpMlock     = 5
+	OpMsync     = 6
+	OpFill      = 7
+	NumOps      = 8
+)
+
+const HistogramBuckets = 128
+
+type Histogram struct {
+	Count   uint64
+	TotalNs uint64
+	MaxNs   uint64
+	Buckets [HistogramBuckets]uint64
+}
+
+type Metrics struct {
+	GrowEvents         uint64
+	MovedMappingEvents uint64
+	LastGrowTimeNs     uint64
+	FileExtensions     uint64
+	FileExtensionBytes uint64
+	BytesMapped        uint64
+	Latency            [NumOps]Histogram
+}
+
+func (man *Manager) Metrics() Metrics {
+	var out C.struct_MmapManagerMetrics
+	C.mmapext_get_metrics(&man.man, &out)
+
+	metrics := Metrics{
+		GrowEvents:         uint64(out.grow_events),
+		MovedMappingEvents: uint64(out.moved_mapping_events),
+		LastGrowTimeNs:     uint64(out.last_grow_time_ns),
+		FileExtensions:     uint64(out.file_extensions),
+		FileExtensionBytes: uint64(out.file_extension_bytes),
+		BytesMapped:        uint64(out.bytes_mapped),
+	}
+	for op := range metrics.Latency {
+		h := &out.latency[op]
+		metrics.Latency[op].Count = uint64(h.count)
+		metrics.Latency[op].TotalNs = uint64(h.total_ns)
+		metrics.Latency[op].MaxNs = uint64(h.max_ns)
+		for b := range metrics.Latency[op].Buckets {
+			metrics.Latency[op].Buckets[b] = uint64(h.buckets[b])
+		}
+	}
+	return metrics
+}
+
+func (man *Manager) ResetMetrics() {
+	C.mmapext_reset_metrics(&man.man)
+}
+
+// Percentile estimates the p-th percentile, p in [0, 100], as the upper bound of the bucket containing it.
+func (h *Histogram) Percentile(p float64) uint64 {
+	if h.Count == 0 {
+		return 0
+	}
+	rank := p / 100 * float64(h.Count)
+	seen := uint64(0)
+	for b, n := range h.Buckets {
+		seen += n
+		if float64(seen) >= rank && n != 0 {
+			upper := uint64(C.mmapext_histogram_bucket_upper_ns(C.int(b)))
+			if upper > h.MaxNs {
+				return h.MaxNs
+			}
+			return upper
+		}
+	}
+	return h.MaxNs
+}
+
+// ParallelFill sets the mapped range to value using threads threads, 0 for one per CPU.
+func (man *Manager) ParallelFill(offset, length uint64, value byte, threads int) error {
+	result := C.mmapext_parallel_fill(&man.man, C.ulong(offset), C.ulong(length), C.uint8_t(value), C.int(threads))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// ParallelCopyIn copies data to the mapping at offset using threads threads, 0 for one per CPU.
+func (man *Manager) ParallelCopyIn(offset uint64, data []byte, threads int) error {
+	if len(data) == 0 {
+		return ErrMmapextErrInvalidArgument
+	}
+	result := C.mmapext_parallel_copy_in(
+		&man.man, C.ulong(offset), unsafe.Pointer(&data[0]), C.ulong(len(data)), C.int(threads))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// ParallelChecksum returns a checksum of the mapped range that doesn't depend on the number of threads.
+func (man *Manager) ParallelChecksum(offset, length uint64, threads int) (uint64, error) {
+	var out C.uint64_t
+	result := C.mmapext_parallel_checksum(&man.man, C.ulong(offset), C.ulong(length), C.int(threads), &out)
+	if result.error_code != MmapextErrNone {
+		return 0, cErrorToGoError[int(result.error_code)]
+	}
+	return uint64(out), nil
+}
+
+// Write copies data to the mapping at offset.
+func (man *Manager) Write(offset uint64, data []byte) error {
+	if len(data) == 0 {
+		return nil
+	}
+	result := C.mmapext_write(&man.man, C.ulong(offset), unsafe.Pointer(&data[0]), C.ulong(len(data)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// Append appends data to the log whose length is stored at commitOffset and returns the new length.
+func (man *Manager) Append(commitOffset uint64, data []byte) (uint64, error) {
+	var src unsafe.Pointer
+	if len(data) != 0 {
+		src = unsafe.Pointer(&data[0])
+	}
+	var newLength C.uint64_t
+	result := C.mmapext_append(&man.man, C.ulong(commitOffset), src, C.ulong(len(data)), &newLength)
+	if result.error_code != MmapextErrNone {
+		return 0, cErrorToGoError[int(result.error_code)]
+	}
+	return uint64(newLength), nil
+}
+
+func SetStreamingThreshold(bytes uint64) {
+	C.mmapext_set_streaming_threshold(C.ulong(bytes))
+}
+
+func StreamingThreshold() uint64 {
+	return uint64(C.mmapext_streaming_threshold())
+}
+
+// NotFound is returned by the Find functions when there is no match.
+const NotFound = ^uint64(0)
+
+func bytesPointer(b []byte) *C.uint8_t {
+	if len(b) == 0 {
+		return nil
+	}
+	return (*C.uint8_t)(unsafe.Pointer(&b[0]))
+}
+
+func (man *Manager) FindByte(offset, length uint64, b byte) uint64 {
+	return uint64(C.mmapext_find_byte(&man.man, C.ulong(offset), C.ulong(length), C.uint8_t(b)))
+}
+
+func (man *Manager) FindAnyByte(offset, length uint64, set []byte) uint64 {
+	return uint64(C.mmapext_find_any_byte(
+		&man.man, C.ulong(offset), C.ulong(length), bytesPointer(set), C.uint32_t(len(set))))
+}
+
+func (man *Manager) FindSubstring(offset, length uint64, needle []byte) uint64 {
+	return uint64(C.mmapext_find_substring(
+		&man.man, C.ulong(offset), C.ulong(length), bytesPointer(needle), C.ulong(len(needle))))
+}
+
+// FindAllBytes fills positions with the offsets of the first len(positions) occurrences of b and returns
+// how many it found.
+func (man *Manager) FindAllBytes(offset, length uint64, b byte, positions []uint64) int {
+	if len(positions) == 0 {
+		return 0
+	}
+	n := C.mmapext_find_all_bytes(&man.man, C.ulong(offset), C.ulong(length), C.uint8_t(b),
+		(*C.uint64_t)(unsafe.Pointer(&positions[0])), C.ulong(len(positions)))
+	return int(n)
+}
+
+func (man *Manager) CountByte(offset, length uint64, b byte) uint64 {
+	return uint64(C.mmapext_count_byte(&man.man, C.ulong(offset), C.ulong(length), C.uint8_t(b)))
+}
+
+func (man *Manager) ParallelCountByte(offset, length uint64, b byte, threads int) uint64 {
+	return uint64(C.mmapext_parallel_count_byte(
+		&man.man, C.ulong(offset), C.ulong(length), C.uint8_t(b), C.int(threads)))
+}
+
+func (man *Manager) ParallelFindSubstring(offset, length uint64, needle []byte, threads int) uint64 {
+	return uint64(C.mmapext_parallel_find_substring(&man.man, C.ulong(offset), C.ulong(length),
+		bytesPointer(needle), C.ulong(len(needle)), C.int(threads)))
+}
+
+func ScanISA() string {
+	return C.GoString(C.mmapext_scan_isa())
+}
+
+// Record formats for AppendRecord and RecordIteratorOptions.Format.
+const (
+	RecordVarint    = 0
+	RecordU32       = 1
+	RecordU32Framed = 2
+)
+
+func (man *Manager) AppendRecord(commitOffset uint64, format int, data []byte) (uint64, error) {
+	var newLength C.uint64_t
+	result := C.mmapext_append_record(&man.man, C.ulong(commitOffset), C.int(format),
+		unsafe.Pointer(bytesPointer(data)), C.ulong(len(data)), &newLength)
+	if result.error_code != MmapextErrNone {
+		return 0, cErrorToGoError[int(result.error_code)]
+	}
+	return uint64(newLength), nil
+}
+
+type RecordIteratorOptions struct {
+	Format           int
+	Begin            uint64
+	End              uint64
+	Backward         bool
+	PrefetchDistance uint64
+	WillneedDistance uint64
+}
+
+type Record struct {
+	Offset uint64
+	// Aliases the mapping, invalid once it moves.
+	Data []byte
+}
+
+// RecordIterator lives in C memory since it points to the manager, cgo doesn't allow passing Go memory
+// holding Go pointers. Close frees it.
+type RecordIterator struct {
+	it *C.struct_MmapManagerRecordIterator
+}
+
+func (man *Manager) RecordIterator(opts RecordIteratorOptions) (*RecordIterator, error) {
+	it := C.mmapext_record_iterator(&man.man, C.struct_MmapManagerRecordIteratorOptions{
+		format:            C.int(opts.Format),
+		begin:             C.ulong(opts.Begin),
+		end:               C.ulong(opts.End),
+		backward:          C._Bool(opts.Backward),
+		prefetch_distance: C.ulong(opts.PrefetchDistance),
+		willneed_distance: C.ulong(opts.WillneedDistance),
+	})
+	if it.error_code != MmapextErrNone {
+		return nil, cErrorToGoError[int(it.error_code)]
+	}
+	cit := (*C.struct_MmapManagerRecordIterator)(C.malloc(C.sizeof_struct_MmapManagerRecordIterator))
+	*cit = it
+	return &RecordIterator{it: cit}, nil
+}
+
+func (it *RecordIterator) Close() {
+	C.free(unsafe.Pointer(it.it))
+	it.it = nil
+}
+
+func recordFromC(r *C.struct_MmapManagerRecord) Record {
+	return Record{Offset: uint64(r.offset), Data: unsafe.Slice((*byte)(r.data), int(r.length))}
+}
+
+// Next returns the next record, false at the end of the range or on error, see Err.
+func (it *RecordIterator) Next() (Record, bool) {
+	var r C.struct_MmapManagerRecord
+	if !bool(C.mmapext_record_next(it.it, &r)) {
+		return Record{}, false
+	}
+	return recordFromC(&r), true
+}
+
+// NextBatch fills records and returns how many it read.
+func (it *RecordIterator) NextBatch(records []Record) int {
+	if len(records) == 0 {
+		return 0
+	}
+	batch := make([]C.struct_MmapManagerRecord, len(records))
+	n := int(C.mmapext_record_next_batch(it.it, &batch[0], C.ulong(len(batch))))
+	for i := 0; i < n; i++ {
+		records[i] = recordFromC(&batch[i])
+	}
+	return n
+}
+
+func (it *RecordIterator) Position() uint64 {
+	return uint64(C.mmapext_record_position(it.it))
+}
+
+// Err returns the error that stopped the iteration, nil if it reached the end.
+func (it *RecordIterator) Err() error {
+	if it.it.error_code == MmapextErrNone {
+		return nil
+	}
+	return cErrorToGoError[int(it.it.error_code)]
+}
+
+type SealOptions struct {
+	BlockSize       uint64
+	CacheBlocks     uint32
+	KeepBackingData bool
+}
+
+func (man *Manager) EnableSealing(opts SealOptions) error {
+	result := C.mmapext_enable_sealing(&man.man, C.struct_MmapManagerSealOptions{
+		block_size:        C.ulong(opts.BlockSize),
+		cache_blocks:      C.uint32_t(opts.CacheBlocks),
+		keep_backing_data: C._Bool(opts.KeepBackingData),
+	})
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) Seal(watermark uint64) error {
+	result := C.mmapext_seal(&man.man, C.ulong(watermark))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) SealedSize() uint64 {
+	return uint64(C.mmapext_sealed_size(&man.man))
+}
+
+// Read copies len(dst) bytes at offset to dst, decompressing sealed data.
+func (man *Manager) Read(offset uint64, dst []byte) error {
+	result := C.mmapext_read(&man.man, C.ulong(offset), unsafe.Pointer(bytesPointer(dst)), C.ulong(len(dst)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+type SealStats struct {
+	SealedBytes     uint64
+	CompressedBytes uint64
+	CacheHits       uint64
+	CacheMisses     uint64
+	CacheEvictions  uint64
+}
+
+func (man *Manager) SealStats() SealStats {
+	var out C.struct_MmapManagerSealStats
+	C.mmapext_get_seal_stats(&man.man, &out)
+	return SealStats{
+		SealedBytes:     uint64(out.sealed_bytes),
+		CompressedBytes: uint64(out.compressed_bytes),
+		CacheHits:       uint64(out.cache_hits),
+		CacheMisses:     uint64(out.cache_misses),
+		CacheEvictions:  uint64(out.cache_evictions),
+	}
+}
+
+const (
+	DirtyNone      = 0
+	DirtyExplicit  = 1
+	DirtySoftDirty = 2
+	DirtyUffdWP    = 3
+)
+
+func (man *Manager) TrackDirty(mode int) error {
+	result := C.mmapext_track_dirty(&man.man, C.int(mode))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) MarkDirty(offset uint64, length uint64) {
+	C.mmapext_mark_dirty(&man.man, C.ulong(offset), C.ulong(length))
+}
+
+type Checkpoint struct {
+	Ranges       uint64
+	FlushedBytes uint64
+	DurationNs   uint64
+}
+
+// Checkpoint flushes the pages written since the previous checkpoint.
+func (man *Manager) Checkpoint() (Checkpoint, error) {
+	result := C.mmapext_checkpoint(&man.man)
+	out := Checkpoint{
+		Ranges:       uint64(result.ranges),
+		FlushedBytes: uint64(result.flushed_bytes),
+		DurationNs:   uint64(result.duration_ns),
+	}
+	return out, cErrorToGoError[int(result.error.error_code)]
+}
+
+// LazyOptions opens the backing file lazily with the default pread fill. Custom fill functions are only
+// available from C.
+type LazyOptions struct {
+	BackingFile  string
+	FileSize     uint64
+	FillPages    uint32
+	MaxFillPages uint32
+}
+
+func OpenLazy(opts LazyOptions) (Manager, error) {
+	backingFileCstr := C.CString(opts.BackingFile)
+	defer C.free(unsafe.Pointer(backingFileCstr))
+
+	man := C.mmapext_open_lazy(C.struct_MmapManagerLazyOptions{
+		backing_file:   backingFileCstr,
+		file_size:      C.ulong(opts.FileSize),
+		fill_pages:     C.uint32_t(opts.FillPages),
+		max_fill_pages: C.uint32_t(opts.MaxFillPages),
+	})
+	if man.error_code != MmapextErrNone {
+		return Manager{}, fmt.Errorf("failed to open lazy mapping: %s", C.GoString(man.error_message))
+	}
+	return Manager{man: man, backingFile: opts.BackingFile}, nil
+}
+
+type LazyStats struct {
+	Faults      uint64
+	BytesFilled uint64
+	FillErrors  uint64
+}
+
+func (man *Manager) LazyStats() LazyStats {
+	var out C.struct_MmapManagerLazyStats
+	C.mmapext_get_lazy_stats(&man.man, &out)
+	return LazyStats{
+		Faults:      uint64(out.faults),
+		BytesFilled: uint64(out.bytes_filled),
+		FillErrors:  uint64(out.fill_errors),
+	}
+}
+
+// SafeRead is Read for files that other processes may truncate, it returns ErrMmapextErrBusError instead of
+// crashing.
+func (man *Manager) SafeRead(offset uint64, dst []byte) error {
+	result := C.mmapext_safe_read(&man.man, C.ulong(offset), unsafe.Pointer(bytesPointer(dst)), C.ulong(len(dst)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) SafeWrite(offset uint64, data []byte) error {
+	result := C.mmapext_safe_write(&man.man, C.ulong(offset), unsafe.Pointer(bytesPointer(data)), C.ulong(len(data)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) WatchFileSize(intervalMs uint32) error {
+	result := C.mmapext_watch_file_size(&man.man, C.uint32_t(intervalMs))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) ValidSize() uint64 {
+	return uint64(C.mmapext_valid_size(&man.man))
+}
+
+const (
+	EngineMmap   = 0
+	EnginePwrite = 1
+	EngineDirect = 2
+)
+
+type LogOptions struct {
+	Path       string
+	Engine     int
+	BufferSize uint64
+	CacheSize  uint64
+}
+
+// Log is an append-only log written and read through one of the Engine* I/O engines. Not safe for
+// concurrent use.
+type Log struct {
+	log C.struct_MmapManagerLog
+}
+
+func OpenLog(opts LogOptions) (*Log, error) {
+	pathCstr := C.CString(opts.Path)
+	defer C.free(unsafe.Pointer(pathCstr))
+
+	log := C.mmapext_log_open(C.struct_MmapManagerLogOptions{
+		path:        pathCstr,
+		engine:      C.int(opts.Engine),
+		buffer_size: C.ulong(opts.BufferSize),
+		cache_size:  C.ulong(opts.CacheSize),
+	})
+	if log.error_code != MmapextErrNone {
+		return nil, fmt.Errorf("failed to open log: %s", C.GoString(log.error_message))
+	}
+	return &Log{log: log}, nil
+}
+
+// Append returns the offset the data was appended at.
+func (log *Log) Append(data []byte) (uint64, error) {
+	var offset C.uint64_t
+	result := C.mmapext_log_append(&log.log, unsafe.Pointer(bytesPointer(data)), C.ulong(len(data)), &offset)
+	return uint64(offset), cErrorToGoError[int(result.error_code)]
+}
+
+func (log *Log) Read(offset uint64, dst []byte) error {
+	result := C.mmapext_log_read(&log.log, C.ulong(offset), unsafe.Pointer(bytesPointer(dst)), C.ulong(len(dst)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (log *Log) Sync() error {
+	result := C.mmapext_log_sync(&log.log)
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (log *Log) Size() uint64 {
+	return uint64(C.mmapext_log_size(&log.log))
+}
+
+type LogStats struct {
+	AppendedBytes uint64
+	ReadBytes     uint64
+	WriteCalls    uint64
+	ReadCalls     uint64
+	Syncs         uint64
+	CacheHits     uint64
+	CacheMisses   uint64
+}
+
+func (log *Log) Stats() LogStats {
+	var out C.struct_MmapManagerLogStats
+	C.mmapext_log_get_stats(&log.log, &out)
+	return LogStats{
+		AppendedBytes: uint64(out.appended_bytes),
+		ReadBytes:     uint64(out.read_bytes),
+		WriteCalls:    uint64(out.write_calls),
+		ReadCalls:     uint64(out.read_calls),
+		Syncs:         uint64(out.syncs),
+		CacheHits:     uint64(out.cache_hits),
+		CacheMisses:   uint64(out.cache_misses),
+	}
+}
+
+// Close syncs and closes the log.
+func (log *Log) Close() error {
+	result := C.mmapext_log_close(&log.log)
+	return cErrorToGoError[int(result.error_code)]
+}
+
+const (
+	AsyncFallocate     = 0
+	AsyncFsync         = 1
+	AsyncFdatasync     = 2
+	AsyncSyncFileRange = 3
+	AsyncMadvise       = 4
+)
+
+type AsyncOp struct {
+	Op       int
+	Offset   uint64
+	Length   uint64
+	Flags    int
+	Link     bool
+	UserData uint64
+}
+
+type AsyncCompletion struct {
+	UserData uint64
+	Op       int
+	// 0 on success, a negative errno otherwise.
+	Result int
+}
+
+func (man *Manager) EnableAsync(queueDepth uint32) error {
+	result := C.mmapext_enable_async(&man.man, C.uint32_t(queueDepth))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) AsyncSubmit(ops []AsyncOp) error {
+	if len(ops) == 0 {
+		return nil
+	}
+	cOps := make([]C.struct_MmapManagerAsyncOp, len(ops))
+	for i, op := range ops {
+		cOps[i] = C.struct_MmapManagerAsyncOp{
+			op:        C.int(op.Op),
+			offset:    C.ulong(op.Offset),
+			length:    C.ulong(op.Length),
+			flags:     C.int(op.Flags),
+			link:      C.bool(op.Link),
+			user_data: C.ulong(op.UserData),
+		}
+	}
+	result := C.mmapext_async_submit(&man.man, &cOps[0], C.uint32_t(len(cOps)))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// AsyncReap returns up to max completions, waiting for at least minComplete of them unless nothing is left in
+// flight.
+func (man *Manager) AsyncReap(max int, minComplete int) []AsyncCompletion {
+	if max == 0 {
+		return nil
+	}
+	cOut := make([]C.struct_MmapManagerAsyncCompletion, max)
+	n := C.mmapext_async_reap(&man.man, &cOut[0], C.uint32_t(max), C.uint32_t(minComplete))
+	out := make([]AsyncCompletion, int(n))
+	for i := range out {
+		out[i] = AsyncCompletion{
+			UserData: uint64(cOut[i].user_data),
+			Op:       int(cOut[i].op),
+			Result:   int(cOut[i].result),
+		}
+	}
+	return out
+}
+
+func (man *Manager) AsyncPending() uint32 {
+	return uint32(C.mmapext_async_pending(&man.man))
+}
+
+func (man *Manager) AsyncPreallocate(numChunks uint64, userData uint64) error {
+	result := C.mmapext_async_preallocate(&man.man, C.ulong(numChunks), C.ulong(userData))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) AsyncCheckpoint(userData uint64) error {
+	result := C.mmapext_async_checkpoint(&man.man, C.ulong(userData))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+const (
+	SuperblockVersion      = 1
+	SuperblockCommitOffset = 40
+	FeatureSealed          = 1 << 0
+	FeatureAppShift        = 32
+)
+
+type Superblock struct {
+	Version          uint32
+	ChunkSize        uint64
+	LogicalLength    uint64
+	ReclaimWatermark uint64
+	Features         uint64
+}
+
+func (man *Manager) Superblock() (Superblock, error) {
+	var out C.struct_MmapManagerSuperblock
+	result := C.mmapext_get_superblock(&man.man, &out)
+	return Superblock{
+		Version:          uint32(out.version),
+		ChunkSize:        uint64(out.chunk_size),
+		LogicalLength:    uint64(out.logical_length),
+		ReclaimWatermark: uint64(out.reclaim_watermark),
+		Features:         uint64(out.features),
+	}, cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) SetReclaimWatermark(watermark uint64) error {
+	result := C.mmapext_set_reclaim_watermark(&man.man, C.ulong(watermark))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) AddFeatures(features uint64) error {
+	result := C.mmapext_add_features(&man.man, C.ulong(features))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) SyncSuperblock() error {
+	result := C.mmapext_sync_superblock(&man.man)
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// EnsureMapped maps the chunks of [offset, offset + length) that are not mapped yet, in managers created with
+// MapOnDemand.
+func (man *Manager) EnsureMapped(offset uint64, length uint64) error {
+	result := C.mmapext_ensure_mapped(&man.man, C.ulong(offset), C.ulong(length))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// MapRange maps the chunks [chunkOffset, chunkOffset + nChunks) of the file, growing it if needed.
+func (man *Manager) MapRange(chunkOffset uint64, nChunks uint64) error {
+	result := C.mmapext_map_range(&man.man, C.ulong(chunkOffset), C.ulong(nChunks))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+// UnmapRange turns the chunks [chunkOffset, chunkOffset + nChunks) back into reserved address space.
+func (man *Manager) UnmapRange(chunkOffset uint64, nChunks uint64) error {
+	result := C.mmapext_unmap_range(&man.man, C.ulong(chunkOffset), C.ulong(nChunks))
+	return cErrorToGoError[int(result.error_code)]
+}
+
+func (man *Manager) CountMappedChunks() uint64 {
+	return uint64(C.mmapext_count_mapped_chunks(&man.man))
+}
+
+func (man *Manager) VmaCount() uint64 {
+	return uint64(C.mmapext_vma_count(&man.man))
+}
+
+func (man *Manager) CountVmas() (uint64, error) {
+	var count C.uint64_t
+	result := C.mmapext_count_vmas(&man.man, &count)
+	return uint64(count), cErrorToGoError[int(result.error_code)]
+}
+
+func SetVmaBudget(vmas uint64) {
+	C.mmapext_set_vma_budget(C.ulong(vmas))
+}
+
+func TotalVmaCount() uint64 {
+	return uint64(C.mmapext_total_vma_count())
+}
+
+// ReadBegin enters a read-side critical section and returns the mapping as of now, which stays valid until
+// ReadEnd even if the mapping moves. Sections belong to the OS thread, so the goroutine is locked to its
+// thread until ReadEnd.
+func (man *Manager) ReadBegin() []byte {
+	runtime.LockOSThread()
+	section := C.mmapext_read_begin(&man.man)
+	if section.address == nil {
+		return nil
+	}
+	return unsafe.Slice((*byte)(section.address), section.mapped_size)
+}
+
+func (man *Manager) ReadEnd() {
+	C.mmapext_read_end()
+	runtime.UnlockOSThread()
+}
+
+func (man *Manager) ReclaimMappings(wait bool) uint64 {
+	return uint64(C.mmapext_reclaim_mappings(&man.man, C.bool(wait)))
+}